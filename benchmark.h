@@ -0,0 +1,376 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <arpa/inet.h>
+
+// Benchmark mode shared by the RDMA and TCP binaries.
+//
+// The client drives every run: before each size it sends a BenchRequest that
+// tells the server which test follows, the message size and how many messages
+// to expect, once for the warmup and once for the measured iterations. The
+// server then either echoes every message (lat, bibw) or counts them and
+// answers the last one with a one-byte ack (bw, rate), so the client's clock
+// always stops on something the server has sent.
+
+enum BenchTest {
+    BENCH_NONE,
+    BENCH_LATENCY,      // ping-pong, one message in flight
+    BENCH_BW,           // client to server streaming
+    BENCH_BIBW,         // streaming in both directions, server echoes
+    BENCH_RATE          // like bw, with window messages posted per call
+};
+
+enum BenchFormat {
+    BENCH_HUMAN,
+    BENCH_CSV,
+    BENCH_JSON
+};
+
+struct BenchConfig {
+    BenchTest test;
+    size_t min_size;
+    size_t max_size;
+    int iters;
+    int warmup;
+    int window;         // messages in flight for bw, bibw and rate
+    int queue_depth;    // send queue entries and receive slots (RDMA only)
+    BenchFormat format;
+    std::string tuning;   // transport settings worth recording with the results
+
+    BenchConfig() : test(BENCH_NONE), min_size(1), max_size(8 << 20),
+                    iters(1000), warmup(100), window(16), queue_depth(16),
+                    format(BENCH_HUMAN) {}
+};
+
+static inline const char *benchTestName(BenchTest test) {
+    switch (test) {
+        case BENCH_LATENCY: return "lat";
+        case BENCH_BW: return "bw";
+        case BENCH_BIBW: return "bibw";
+        case BENCH_RATE: return "rate";
+        default: return "none";
+    }
+}
+
+static inline int parseBenchTest(const char *name, BenchTest *test) {
+    if (strcmp(name, "lat") == 0) {
+        *test = BENCH_LATENCY;
+    } else if (strcmp(name, "bw") == 0) {
+        *test = BENCH_BW;
+    } else if (strcmp(name, "bibw") == 0) {
+        *test = BENCH_BIBW;
+    } else if (strcmp(name, "rate") == 0) {
+        *test = BENCH_RATE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static inline int parseBenchFormat(const char *name, BenchFormat *format) {
+    if (strcmp(name, "human") == 0) {
+        *format = BENCH_HUMAN;
+    } else if (strcmp(name, "csv") == 0) {
+        *format = BENCH_CSV;
+    } else if (strcmp(name, "json") == 0) {
+        *format = BENCH_JSON;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Byte count with an optional K, M or G suffix (powers of 1024)
+static inline int parseSize(const char *text, size_t *size) {
+    char *end = nullptr;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    // strtoull accepts a sign and wraps negative numbers around
+    if (end == text || errno == ERANGE || strchr(text, '-')) {
+        return -1;
+    }
+    int shift;
+    switch (*end) {
+        case '\0': shift = 0; break;
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+        default: return -1;
+    }
+    if (*end != '\0' || value == 0 || value > (unsigned long long)(SIZE_MAX >> shift)) {
+        return -1;
+    }
+    value <<= shift;
+    *size = (size_t)value;
+    return 0;
+}
+
+// Powers of two from min_size up to and including max_size
+static inline std::vector<size_t> benchSizes(const BenchConfig& config) {
+    std::vector<size_t> sizes;
+    for (size_t size = config.min_size; size <= config.max_size; size *= 2) {
+        sizes.push_back(size);
+    }
+    return sizes;
+}
+
+// Announces a run to the server; all fields in network byte order on the wire
+struct BenchRequest {
+    uint32_t magic;
+    uint32_t test;
+    uint32_t size;
+    uint32_t count;
+    uint32_t window;
+};
+
+static const uint32_t BENCH_MAGIC = 0x52424e43;     // "RBNC"
+
+static inline void packBenchRequest(BenchTest test, size_t size, int count, int window, char *wire) {
+    BenchRequest request;
+    request.magic = htonl(BENCH_MAGIC);
+    request.test = htonl((uint32_t)test);
+    request.size = htonl((uint32_t)size);
+    request.count = htonl((uint32_t)count);
+    request.window = htonl((uint32_t)window);
+    memcpy(wire, &request, sizeof(request));
+}
+
+static inline int unpackBenchRequest(const char *data, size_t len, BenchRequest *request) {
+    if (len != sizeof(BenchRequest)) {
+        return -1;
+    }
+    memcpy(request, data, sizeof(*request));
+    request->magic = ntohl(request->magic);
+    request->test = ntohl(request->test);
+    request->size = ntohl(request->size);
+    request->count = ntohl(request->count);
+    request->window = ntohl(request->window);
+    return request->magic == BENCH_MAGIC ? 0 : -1;
+}
+
+// Server side of one connection's run
+struct BenchSession {
+    uint32_t test;
+    uint32_t size;
+    uint32_t remaining;
+
+    BenchSession() : test(BENCH_NONE), size(0), remaining(0) {}
+};
+
+enum BenchReply {
+    BENCH_REPLY_NONE,
+    BENCH_REPLY_ECHO,       // send the message back
+    BENCH_REPLY_ACK         // last message of a one-way run, send the ack
+};
+
+// Feed one received message to the session. Between runs every message must
+// be a BenchRequest; during a run every message is payload.
+static inline BenchReply benchServerStep(BenchSession *session, const char *data, size_t len) {
+    if (session->remaining == 0) {
+        BenchRequest request;
+        if (unpackBenchRequest(data, len, &request)) {
+            std::cerr << "Unexpected message of " << len << " bytes outside a benchmark run\n";
+            return BENCH_REPLY_NONE;
+        }
+        session->test = request.test;
+        session->size = request.size;
+        session->remaining = request.count;
+        return BENCH_REPLY_NONE;
+    }
+
+    session->remaining--;
+    if (session->test == BENCH_LATENCY || session->test == BENCH_BIBW) {
+        return BENCH_REPLY_ECHO;
+    }
+    return session->remaining == 0 ? BENCH_REPLY_ACK : BENCH_REPLY_NONE;
+}
+
+static inline uint64_t benchNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Per-iteration latency samples; percentiles are read after sorting
+class LatencyRecorder {
+public:
+    void reset(size_t expected) {
+        samples.clear();
+        samples.reserve(expected);
+    }
+
+    void record(uint64_t ns) {
+        samples.push_back(ns);
+    }
+
+    bool empty() const {
+        return samples.empty();
+    }
+
+    void finish() {
+        std::sort(samples.begin(), samples.end());
+    }
+
+    // Nearest-rank percentile in microseconds; finish() must have been called
+    double percentileUs(double pct) const {
+        if (samples.empty()) {
+            return 0;
+        }
+        size_t rank = (size_t)std::ceil(pct / 100.0 * samples.size());
+        rank = std::min(std::max(rank, (size_t)1), samples.size());
+        return samples[rank - 1] / 1000.0;
+    }
+
+private:
+    std::vector<uint64_t> samples;
+};
+
+struct BenchResult {
+    BenchTest test;
+    size_t size;
+    int iters;
+    bool has_latency;
+    double p50_us;
+    double p99_us;
+    double p999_us;
+    double max_us;
+    double gbps;
+    double mmsgs;
+};
+
+// Fill the throughput fields from a run of result->iters messages that took
+// elapsed_ns; echoed messages count as traffic too
+static inline void benchThroughput(BenchResult *result, uint64_t elapsed_ns) {
+    uint64_t msgs = result->iters;
+    if (result->test == BENCH_LATENCY || result->test == BENCH_BIBW) {
+        msgs *= 2;
+    }
+    double seconds = elapsed_ns ? elapsed_ns / 1e9 : 1e-9;
+    result->gbps = msgs * result->size * 8 / seconds / 1e9;
+    result->mmsgs = msgs / seconds / 1e6;
+}
+
+static inline void benchLatency(BenchResult *result, LatencyRecorder& recorder) {
+    recorder.finish();
+    result->has_latency = !recorder.empty();
+    result->p50_us = recorder.percentileUs(50);
+    result->p99_us = recorder.percentileUs(99);
+    result->p999_us = recorder.percentileUs(99.9);
+    result->max_us = recorder.percentileUs(100);
+}
+
+// Prints one row per size: human and CSV rows as they come in, JSON as a
+// single array once the sweep is done
+class BenchReporter {
+public:
+    BenchReporter(const std::string& transport_name, const BenchConfig& bench_config)
+        : transport(transport_name), config(bench_config), rows(0) {}
+
+    void add(const BenchResult& result) {
+        if (config.format == BENCH_JSON) {
+            results.push_back(result);
+            return;
+        }
+        if (rows++ == 0) {
+            printHeader();
+        }
+        if (config.format == BENCH_CSV) {
+            std::cout << transport << "," << benchTestName(result.test) << ","
+                      << result.size << "," << result.iters << ","
+                      << latencyField(result, result.p50_us) << ","
+                      << latencyField(result, result.p99_us) << ","
+                      << latencyField(result, result.p999_us) << ","
+                      << latencyField(result, result.max_us) << ","
+                      << std::fixed << std::setprecision(3) << result.gbps << ","
+                      << result.mmsgs << "," << config.tuning << std::endl;
+            return;
+        }
+        std::cout << std::left << std::setw(6) << benchTestName(result.test) << std::right
+                  << std::setw(10) << result.size
+                  << std::setw(9) << result.iters
+                  << std::setw(11) << latencyField(result, result.p50_us)
+                  << std::setw(11) << latencyField(result, result.p99_us)
+                  << std::setw(11) << latencyField(result, result.p999_us)
+                  << std::setw(11) << latencyField(result, result.max_us)
+                  << std::fixed << std::setprecision(3)
+                  << std::setw(11) << result.gbps
+                  << std::setw(11) << result.mmsgs << std::endl;
+    }
+
+    void finish() {
+        if (config.format != BENCH_JSON) {
+            return;
+        }
+        std::cout << "[";
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchResult& result = results[i];
+            std::cout << (i ? ",\n " : "\n ")
+                      << "{\"transport\": \"" << transport << "\""
+                      << ", \"test\": \"" << benchTestName(result.test) << "\""
+                      << ", \"size\": " << result.size
+                      << ", \"iters\": " << result.iters
+                      << ", \"window\": " << config.window
+                      << ", \"p50_us\": " << jsonLatency(result, result.p50_us)
+                      << ", \"p99_us\": " << jsonLatency(result, result.p99_us)
+                      << ", \"p999_us\": " << jsonLatency(result, result.p999_us)
+                      << ", \"max_us\": " << jsonLatency(result, result.max_us)
+                      << std::fixed << std::setprecision(3)
+                      << ", \"gbps\": " << result.gbps
+                      << ", \"mmsgs\": " << result.mmsgs
+                      << ", \"tuning\": \"" << config.tuning << "\"}";
+        }
+        std::cout << "\n]" << std::endl;
+    }
+
+private:
+    std::string transport;
+    BenchConfig config;
+    size_t rows;
+    std::vector<BenchResult> results;
+
+    void printHeader() {
+        if (config.format == BENCH_CSV) {
+            std::cout << "transport,test,size,iters,p50_us,p99_us,p999_us,max_us,gbps,mmsgs,tuning\n";
+            return;
+        }
+        std::cout << "# " << transport << " " << benchTestName(config.test)
+                  << ", window " << config.window << ", warmup " << config.warmup
+                  << (config.tuning.empty() ? "" : ", tuning " + config.tuning)
+                  << " (latency is round trip)\n"
+                  << std::left << std::setw(6) << "test" << std::right
+                  << std::setw(10) << "bytes"
+                  << std::setw(9) << "iters"
+                  << std::setw(11) << "p50(us)"
+                  << std::setw(11) << "p99(us)"
+                  << std::setw(11) << "p99.9(us)"
+                  << std::setw(11) << "max(us)"
+                  << std::setw(11) << "Gb/s"
+                  << std::setw(11) << "Mmsg/s" << "\n";
+    }
+
+    static std::string latencyField(const BenchResult& result, double us) {
+        if (!result.has_latency) {
+            return "-";
+        }
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(2) << us;
+        return out.str();
+    }
+
+    static std::string jsonLatency(const BenchResult& result, double us) {
+        return result.has_latency ? latencyField(result, us) : "null";
+    }
+};
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <csignal>
+#include <pthread.h>
+#include <unistd.h>
+
+// Leveled logging that keeps formatting off the console path.
+//
+// LOG_TRACE and LOG_DEBUG compile to nothing unless DEBUG is defined (or
+// LOG_COMPILE_LEVEL says otherwise); their arguments are still type-checked
+// but never evaluated. The remaining levels are filtered at run time and
+// formatted with vsnprintf straight into a slot of a lock-free ring buffer.
+// A background thread drains the ring to stderr in batches, so the calling
+// thread never takes a stream lock, flushes or makes a system call. When the
+// ring is full, records are dropped and counted instead of blocking.
+
+enum LogLevel {
+    LOG_LEVEL_TRACE = 0,
+    LOG_LEVEL_DEBUG = 1,
+    LOG_LEVEL_INFO = 2,
+    LOG_LEVEL_WARN = 3,
+    LOG_LEVEL_ERROR = 4
+};
+
+// Lowest level that is compiled in; must be a plain number for #if
+#ifndef LOG_COMPILE_LEVEL
+#ifdef DEBUG
+#define LOG_COMPILE_LEVEL 0
+#else
+#define LOG_COMPILE_LEVEL 2
+#endif
+#endif
+
+static inline int parseLogLevel(const char *name, LogLevel *level) {
+    static const char *const names[] = {"trace", "debug", "info", "warn", "error"};
+    for (int i = LOG_LEVEL_TRACE; i <= LOG_LEVEL_ERROR; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *level = (LogLevel)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+class AsyncLogger {
+public:
+    static const size_t CAPACITY = 1024;        // records, a power of two
+    static const size_t TEXT_SIZE = 240;        // longer messages are truncated
+
+    static AsyncLogger& instance() {
+        static AsyncLogger logger;
+        return logger;
+    }
+
+    void setLevel(LogLevel level) {
+        min_level.store(level, std::memory_order_relaxed);
+    }
+
+    bool enabled(LogLevel level) const {
+        return level >= min_level.load(std::memory_order_relaxed);
+    }
+
+    void log(LogLevel level, const char *format, ...) __attribute__((format(printf, 3, 4))) {
+        if (!enabled(level)) {
+            return;
+        }
+
+        // Claim a slot (bounded MPMC queue): a slot is free for position pos
+        // once its sequence number has come round to pos
+        Record *record;
+        uint64_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            record = &ring[pos & (CAPACITY - 1)];
+            int64_t diff = (int64_t)record->seq.load(std::memory_order_acquire) - (int64_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        record->time_ns = nowNs();
+        record->level = level;
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(record->text, TEXT_SIZE, format, args);
+        va_end(args);
+        record->len = len < 0 ? 0 : std::min((size_t)len, TEXT_SIZE - 1);
+        record->seq.store(pos + 1, std::memory_order_release);
+    }
+
+    // Block until everything logged so far has been written
+    void flush() {
+        uint64_t target = enqueue_pos.load(std::memory_order_acquire);
+        while (written.load(std::memory_order_acquire) < target) {
+            idleSleep();
+        }
+    }
+
+private:
+    struct Record {
+        std::atomic<uint64_t> seq;
+        uint64_t time_ns;
+        int level;
+        uint32_t len;
+        char text[TEXT_SIZE];
+    };
+
+    Record ring[CAPACITY];
+    std::atomic<uint64_t> enqueue_pos;
+    std::atomic<uint64_t> written;
+    std::atomic<uint64_t> dropped;
+    std::atomic<int> min_level;
+    std::atomic<bool> stopping;
+    uint64_t start_ns;
+    std::thread writer;
+
+    AsyncLogger() : enqueue_pos(0), written(0), dropped(0), min_level(LOG_COMPILE_LEVEL),
+                    stopping(false), start_ns(nowNs()) {
+        for (size_t i = 0; i < CAPACITY; i++) {
+            ring[i].seq.store(i, std::memory_order_relaxed);
+        }
+        writer = std::thread(&AsyncLogger::run, this);
+    }
+
+    ~AsyncLogger() {
+        stopping = true;
+        writer.join();
+    }
+
+    static void idleSleep() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    static uint64_t nowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Single consumer: drains every ready record into one write(2)
+    void run() {
+        // Signals are for the application's threads, e.g. SIGUSR1 for stats
+        sigset_t all;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+        static const char *const level_names[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
+        char out[16 * 1024];
+        uint64_t pos = 0;
+        uint64_t dropped_reported = 0;
+
+        for (;;) {
+            size_t used = 0;
+            while (used + TEXT_SIZE + 64 < sizeof(out)) {
+                Record *record = &ring[pos & (CAPACITY - 1)];
+                if (record->seq.load(std::memory_order_acquire) != pos + 1) {
+                    break;
+                }
+                uint64_t since = record->time_ns - start_ns;
+                used += snprintf(out + used, sizeof(out) - used, "[%llu.%06llu] %s %.*s\n",
+                                 (unsigned long long)(since / 1000000000),
+                                 (unsigned long long)(since % 1000000000 / 1000),
+                                 level_names[record->level], (int)record->len, record->text);
+                record->seq.store(pos + CAPACITY, std::memory_order_release);
+                pos++;
+            }
+
+            uint64_t lost = dropped.load(std::memory_order_relaxed);
+            if (lost != dropped_reported && used + 64 < sizeof(out)) {
+                used += snprintf(out + used, sizeof(out) - used, "%llu log records dropped\n",
+                                 (unsigned long long)(lost - dropped_reported));
+                dropped_reported = lost;
+            }
+
+            if (used > 0) {
+                size_t off = 0;
+                while (off < used) {
+                    ssize_t n = write(STDERR_FILENO, out + off, used - off);
+                    if (n <= 0) {
+                        break;
+                    }
+                    off += n;
+                }
+                written.store(pos, std::memory_order_release);
+                continue;
+            }
+
+            if (stopping) {
+                return;
+            }
+            idleSleep();
+        }
+    }
+};
+
+#define LOG_AT(level, ...) AsyncLogger::instance().log(level, __VA_ARGS__)
+
+// Compiled-out statements keep their arguments type-checked and "used"
+#define LOG_DISCARD(...) do { if (0) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__); } while (0)
+
+#if LOG_COMPILE_LEVEL <= 0
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+
+#if LOG_COMPILE_LEVEL <= 1
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef RDMA_ATOMIC_H
+#define RDMA_ATOMIC_H
+
+#include <thread>
+#include <chrono>
+
+#include "rdma_client.h"
+
+// Counters and locks in a server's atomic table (rdma_server --atomics),
+// operated on by clients with RDMA atomics alone: the server's HCA
+// executes every fetch-and-add and compare-and-swap, and the server CPU
+// never sees them.
+//
+// The table is an array of 64-bit words, addressed by byte offset. Clients
+// agree on where each object lives:
+//   RemoteCounter      one word, the next value to hand out
+//   RemoteSpinLock     one word, 0 when free, otherwise the holder's id
+//   RemoteLease        one word, 0 when free, otherwise the holder's id in
+//                      the high half and a renewal count in the low half
+//   RemoteTicketLock   two words, the next ticket and the ticket served
+// Objects contended independently are best kept ATOMIC_LINE bytes apart.
+// Each object uses one RDMAClient, from the thread that drives it; one
+// client can serve any number of objects.
+
+static const size_t ATOMIC_LINE = 64;
+
+// Exponential backoff between attempts at a contended word, so waiters do
+// not flood the server's HCA with atomics
+class AtomicBackoff {
+public:
+    static const unsigned int MIN_DELAY_US = 1;
+    static const unsigned int MAX_DELAY_US = 1000;
+
+    AtomicBackoff() : delay_us(MIN_DELAY_US) {}
+
+    void pause() {
+        std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+        delay_us = std::min(delay_us * 2, (unsigned int)MAX_DELAY_US);
+    }
+
+private:
+    unsigned int delay_us;
+};
+
+// Distributed sequence numbers: each next() is one fetch-and-add
+class RemoteCounter {
+public:
+    RemoteCounter(RDMAClient& rdma_client, uint64_t offset)
+        : client(rdma_client), word(offset) {}
+
+    // Take count consecutive values; *first receives the first of them
+    int next(uint64_t *first, uint64_t count = 1) {
+        return client.fetchAdd(word, count, first);
+    }
+
+    int add(int64_t delta) {
+        return client.fetchAdd(word, (uint64_t)delta);
+    }
+
+    int get(uint64_t *value) {
+        return client.readAtomic(word, value);
+    }
+
+private:
+    RDMAClient& client;
+    uint64_t word;
+};
+
+// Test-and-set lock: compare-and-swap from 0 to the owner id. Owner ids
+// must be non-zero and unique among the clients sharing the lock.
+class RemoteSpinLock {
+public:
+    RemoteSpinLock(RDMAClient& rdma_client, uint64_t offset, uint64_t owner_id)
+        : client(rdma_client), word(offset), owner(owner_id) {}
+
+    // 0 if acquired, 1 if held by someone else (*holder says who when
+    // non-null), -1 on error
+    int tryLock(uint64_t *holder = nullptr) {
+        uint64_t old;
+        if (client.compareSwap(word, 0, owner, &old)) {
+            return -1;
+        }
+        if (holder) {
+            *holder = old;
+        }
+        return old == 0 ? 0 : 1;
+    }
+
+    // 0 once acquired, 1 if timeout_ms (< 0: no limit) passed first
+    int lock(int timeout_ms = -1) {
+        AtomicBackoff backoff;
+        uint64_t deadline = statsNowNs() + (uint64_t)timeout_ms * 1000000;
+        for (;;) {
+            int ret = tryLock();
+            if (ret <= 0) {
+                return ret;
+            }
+            if (timeout_ms >= 0 && statsNowNs() >= deadline) {
+                return 1;
+            }
+            backoff.pause();
+        }
+    }
+
+    // 0 if released, 1 if the lock was not ours
+    int unlock() {
+        uint64_t old;
+        if (client.compareSwap(word, owner, 0, &old)) {
+            return -1;
+        }
+        if (old != owner) {
+            std::cerr << "Unlock of remote lock at " << word << " held by " << old << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+private:
+    RDMAClient& client;
+    uint64_t word;
+    uint64_t owner;
+};
+
+// Lock whose holder must keep renewing it, so a holder that dies blocks the
+// others for one lease period only. The holder renews by bumping the
+// renewal count; a waiter that sees the same word for a full period, by its
+// own clock, takes the lease over with compare-and-swap. Hosts therefore
+// need no common time, but holders must renew well within the period and
+// stop relying on the lease once renew() reports it lost.
+class RemoteLease {
+public:
+    RemoteLease(RDMAClient& rdma_client, uint64_t offset, uint32_t owner_id, uint64_t period_us)
+        : client(rdma_client), word(offset), owner(owner_id), period_ns(period_us * 1000),
+          value(0) {}
+
+    // 0 once acquired, 1 if timeout_ms (< 0: no limit) passed first
+    int acquire(int timeout_ms = -1) {
+        AtomicBackoff backoff;
+        uint64_t now = statsNowNs();
+        uint64_t deadline = now + (uint64_t)timeout_ms * 1000000;
+        uint64_t expected = 0;
+        uint64_t seen = 0;
+        uint64_t seen_at = now;
+        for (;;) {
+            uint64_t mine = ((uint64_t)owner << 32) | (uint32_t)(expected + 1);
+            uint64_t old;
+            if (client.compareSwap(word, expected, mine, &old)) {
+                return -1;
+            }
+            if (old == expected) {
+                value = mine;
+                return 0;
+            }
+
+            // A free word is tried again at once, and so is one that
+            // stayed unchanged for a whole period: its holder stopped
+            // renewing. Otherwise the next attempt expects a free word and
+            // only serves to watch the holder's.
+            now = statsNowNs();
+            if (old != seen) {
+                seen = old;
+                seen_at = now;
+            }
+            if (old == 0 || now - seen_at >= period_ns) {
+                if (old) {
+                    LOG_WARN("Taking over the lease at %llu from owner %llu",
+                             (unsigned long long)word, (unsigned long long)(old >> 32));
+                }
+                expected = old;
+                continue;
+            }
+            expected = 0;
+            if (timeout_ms >= 0 && now >= deadline) {
+                return 1;
+            }
+            backoff.pause();
+        }
+    }
+
+    // 0 if renewed, 1 if the lease was lost to another client
+    int renew() {
+        uint64_t next = (value & 0xffffffff00000000ull) | (uint32_t)(value + 1);
+        return exchange(next);
+    }
+
+    // 0 if released, 1 if the lease had already been lost
+    int release() {
+        return exchange(0);
+    }
+
+    bool held() const {
+        return value != 0;
+    }
+
+private:
+    RDMAClient& client;
+    uint64_t word;
+    uint32_t owner;
+    uint64_t period_ns;
+    uint64_t value;     // our word while we hold the lease, else 0
+
+    int exchange(uint64_t next) {
+        if (!value) {
+            return 1;
+        }
+        uint64_t old;
+        if (client.compareSwap(word, value, next, &old)) {
+            return -1;
+        }
+        if (old != value) {
+            value = 0;
+            return 1;
+        }
+        value = next;
+        return 0;
+    }
+};
+
+// Fair lock: a fetch-and-add draws a ticket, the holder of the ticket being
+// served owns the lock, and unlock serves the next one. Waiters poll the
+// served ticket with RDMA READ and back off in proportion to their place in
+// line, so only the next in line polls closely.
+class RemoteTicketLock {
+public:
+    // Uses the words at offset (next ticket) and offset + 8 (served)
+    RemoteTicketLock(RDMAClient& rdma_client, uint64_t offset)
+        : client(rdma_client), next_word(offset), served_word(offset + sizeof(uint64_t)) {}
+
+    int lock() {
+        uint64_t ticket;
+        if (client.fetchAdd(next_word, 1, &ticket)) {
+            return -1;
+        }
+        for (;;) {
+            uint64_t served;
+            if (client.readAtomic(served_word, &served)) {
+                return -1;
+            }
+            if (served == ticket) {
+                return 0;
+            }
+            uint64_t ahead = ticket - served;
+            std::this_thread::sleep_for(std::chrono::microseconds(
+                std::min(ahead, (uint64_t)AtomicBackoff::MAX_DELAY_US)));
+        }
+    }
+
+    // Only the holder may unlock
+    int unlock() {
+        return client.fetchAdd(served_word, 1);
+    }
+
+private:
+    RDMAClient& client;
+    uint64_t next_word;
+    uint64_t served_word;
+};
+
+#endif
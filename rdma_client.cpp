@@ -1,283 +1,584 @@
-#include <rdma/rdma_cma.h>
-#include <rdma/rdma_verbs.h>
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <vector>
+#include <getopt.h>
 #include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-
-class RDMAClient {
-private:
-    struct rdma_cm_id *conn_id;
-    struct rdma_event_channel *ec;
-    struct ibv_pd *pd;
-    struct ibv_comp_channel *comp_chan;
-    struct ibv_cq *cq;
-    struct ibv_mr *mr;
-    char *buffer;
-    static const size_t BUFFER_SIZE = 4096;
-    static const int MAX_WR = 16;
-
-public:
-    RDMAClient() : conn_id(nullptr), ec(nullptr), pd(nullptr), 
-                   comp_chan(nullptr), cq(nullptr), mr(nullptr), 
-                   buffer(nullptr) {
-        buffer = new char[BUFFER_SIZE];
-        memset(buffer, 0, BUFFER_SIZE);
-    }
-
-    ~RDMAClient() {
-        cleanup();
-        delete[] buffer;
-    }
-
-    int initialize() {
-        int ret;
-
-        ec = rdma_create_event_channel();
-        if (!ec) {
-            std::cerr << "Failed to create event channel\n";
-            return -1;
-        }
-
-        ret = rdma_create_id(ec, &conn_id, nullptr, RDMA_PS_TCP);
-        if (ret) {
-            std::cerr << "Failed to create connection ID\n";
-            return ret;
-        }
 
-        return 0;
+#include "rdma_client.h"
+#include "rdma_conn_pool.h"
+#include "rdma_multirail.h"
+#include "rdma_rpc.h"
+#include "rdma_ud.h"
+#include "rdma_atomic.h"
+#include "benchmark.h"
+
+// Announce a run of count messages to the server and drive it. Latency
+// samples and the elapsed time are only collected for measured runs.
+static int runBenchPass(RDMAClient& client, BenchTest test, const char *data, size_t size,
+                        int count, int window, LatencyRecorder *recorder, uint64_t *elapsed_ns) {
+    char request[sizeof(BenchRequest)];
+    packBenchRequest(test, size, count, window, request);
+    if (client.sendData(request, sizeof(request))) {
+        return -1;
     }
 
-    int connectToServer(const std::string& server_ip, const std::string& port) {
-        struct sockaddr_in src_addr, dst_addr;
-        int ret;
-
-        memset(&src_addr, 0, sizeof(src_addr));
-        src_addr.sin_family = AF_INET;
-        inet_pton(AF_INET, "172.26.47.38", &src_addr.sin_addr);
-
-        memset(&dst_addr, 0, sizeof(dst_addr));
-        dst_addr.sin_family = AF_INET;
-        dst_addr.sin_port = htons(std::stoi(port));
-        inet_pton(AF_INET, server_ip.c_str(), &dst_addr.sin_addr);
+    std::vector<std::string> batch;
+    if (test == BENCH_RATE) {
+        batch.assign(window, std::string(data, size));
+    }
 
-        ret = rdma_resolve_addr(conn_id, (struct sockaddr*)&src_addr, (struct sockaddr*)&dst_addr, 2000);
-        if (ret) {
-            std::cerr << "Failed to resolve address, error: " << strerror(errno) << " (errno=" << errno << ")\n";
-            return ret;
-        }
+    uint64_t start = benchNowNs();
+    switch (test) {
+        case BENCH_LATENCY:
+            for (int i = 0; i < count; i++) {
+                uint64_t sent_at = benchNowNs();
+                if (client.sendData(data, size) || client.receiveMessage()) {
+                    return -1;
+                }
+                if (recorder) {
+                    recorder->record(benchNowNs() - sent_at);
+                }
+            }
+            break;
 
-        ret = handleConnectionEvents();
-        if (ret) {
-            return ret;
+        case BENCH_BW:
+            for (int i = 0; i < count; i++) {
+                if (client.sendData(data, size)) {
+                    return -1;
+                }
+            }
+            if (client.receiveMessage()) {
+                return -1;
+            }
+            break;
+
+        case BENCH_RATE:
+            // Each call chains a whole window of sends into as few posts as
+            // the send queue allows
+            for (int sent = 0; sent < count; sent += window) {
+                if (count - sent < window) {
+                    batch.resize(count - sent);
+                }
+                if (client.sendMessages(batch)) {
+                    return -1;
+                }
+            }
+            if (client.receiveMessage()) {
+                return -1;
+            }
+            break;
+
+        case BENCH_BIBW: {
+            int sent = 0;
+            int received = 0;
+            while (received < count) {
+                if (sent < count && sent - received < window) {
+                    if (client.sendData(data, size)) {
+                        return -1;
+                    }
+                    sent++;
+                } else {
+                    if (client.receiveMessage()) {
+                        return -1;
+                    }
+                    received++;
+                }
+            }
+            break;
         }
 
-        std::cout << "Connected to RDMA server at " << server_ip << ":" << port << std::endl;
-        return 0;
+        default:
+            return -1;
     }
 
-    int sendMessage(const std::string& message) {
-        if (!conn_id || !mr) {
-            std::cerr << "Connection or memory region not ready\n";
+    if (elapsed_ns) {
+        *elapsed_ns = benchNowNs() - start;
+    }
+    return 0;
+}
+
+// Echoes in flight must fit in half our receive ring, which leaves room for
+// the credits still on their way back to the server; otherwise both sides
+// could end up waiting for each other's credits. A rendezvous message only
+// takes its RTS frame.
+static int benchWindow(const RDMAClient& client, const BenchConfig& config, size_t size) {
+    if (config.test != BENCH_BIBW) {
+        return std::max(1, config.window);
+    }
+    int frames = 1;
+    if (size < client.rendezvousThreshold()) {
+        frames = (int)((size + client.segmentSize() - 1) / client.segmentSize());
+    }
+    int fit = std::max(1, client.queueDepth() / 2 / frames);
+    return std::max(1, std::min(config.window, fit));
+}
+
+// Sweep the configured sizes: a warmup run followed by a measured run each
+static int runBenchmark(RDMAClient& client, const BenchConfig& config) {
+    BenchReporter reporter("rdma", config);
+    std::vector<char> payload(config.max_size, 'x');
+    std::vector<size_t> sizes = benchSizes(config);
+    LatencyRecorder recorder;
+
+    for (size_t i = 0; i < sizes.size(); i++) {
+        size_t size = sizes[i];
+        int window = benchWindow(client, config, size);
+
+        if (config.warmup > 0 &&
+            runBenchPass(client, config.test, payload.data(), size, config.warmup, window,
+                         nullptr, nullptr)) {
+            std::cerr << "Benchmark warmup failed at " << size << " bytes\n";
             return -1;
         }
 
-        strncpy(buffer, message.c_str(), BUFFER_SIZE - 1);
-        buffer[BUFFER_SIZE - 1] = '\0';
-
-        struct ibv_sge sge;
-        struct ibv_send_wr send_wr, *bad_wr;
+        uint64_t elapsed_ns = 0;
+        recorder.reset(config.test == BENCH_LATENCY ? config.iters : 0);
+        if (runBenchPass(client, config.test, payload.data(), size, config.iters, window,
+                         config.test == BENCH_LATENCY ? &recorder : nullptr, &elapsed_ns)) {
+            std::cerr << "Benchmark failed at " << size << " bytes\n";
+            return -1;
+        }
 
-        memset(&sge, 0, sizeof(sge));
-        sge.addr = (uintptr_t)buffer;
-        sge.length = strlen(buffer) + 1;
-        sge.lkey = mr->lkey;
+        BenchResult result;
+        memset(&result, 0, sizeof(result));
+        result.test = config.test;
+        result.size = size;
+        result.iters = config.iters;
+        benchLatency(&result, recorder);
+        benchThroughput(&result, elapsed_ns);
+        reporter.add(result);
+    }
 
-        memset(&send_wr, 0, sizeof(send_wr));
-        send_wr.wr_id = 1;
-        send_wr.sg_list = &sge;
-        send_wr.num_sge = 1;
-        send_wr.opcode = IBV_WR_SEND;
-        send_wr.send_flags = IBV_SEND_SIGNALED;
+    reporter.finish();
+    return 0;
+}
+
+// Open count pooled connections to the server in parallel, time the setup
+// and exchange one message on each
+static int runPooled(const std::string& host, const std::string& port, int count,
+                     int queue_depth) {
+    RDMAConnectionPool pool(std::max(count, (int)RDMAConnectionPool::CONNECTIONS_PER_DEVICE),
+                            queue_depth);
+    if (pool.initialize()) {
+        return 1;
+    }
 
-        int ret = ibv_post_send(conn_id->qp, &send_wr, &bad_wr);
-        if (ret) {
-            std::cerr << "Failed to post send\n";
-            return ret;
+    std::vector<RDMAConnectionPool::Peer> peers(count);
+    for (int i = 0; i < count; i++) {
+        peers[i].host = host;
+        peers[i].port = port;
+    }
+    uint64_t start = benchNowNs();
+    int failed = pool.connectAll(peers);
+    uint64_t elapsed = benchNowNs() - start;
+    std::cout << "Connected " << (count - failed) << "/" << count << " in "
+              << elapsed / 1000 << " us\n";
+
+    // acquire() hands out the idle connections before it opens new ones
+    std::vector<RDMAClient *> clients;
+    for (int i = 0; i < count - failed; i++) {
+        RDMAClient *client = pool.acquire(host, port);
+        if (!client) {
+            break;
         }
-
-        struct ibv_wc wc;
-        while (ibv_poll_cq(cq, 1, &wc) == 0);
-
-        if (wc.status != IBV_WC_SUCCESS) {
-            std::cerr << "Send work completion failed\n";
-            return -1;
+        clients.push_back(client);
+    }
+    int replies = 0;
+    for (size_t i = 0; i < clients.size(); i++) {
+        if (clients[i]->sendMessage("Hello from pooled RDMA client!") == 0 &&
+            clients[i]->receiveMessage() == 0) {
+            replies++;
         }
-
-        std::cout << "Message sent: " << message << std::endl;
-        return 0;
+        pool.release(clients[i]);
     }
-
-    int receiveMessage() {
-        if (!conn_id || !cq) {
-            std::cerr << "Connection or completion queue not ready\n";
-            return -1;
+    std::cout << "Replies: " << replies << "/" << clients.size() << "\n";
+    return failed || replies != (int)clients.size() ? 1 : 0;
+}
+
+// Write size bytes striped over the rails, read them back and report the
+// throughput of both. rails is a comma-separated list of SOURCE[@SERVER].
+static int runMultiRail(const std::string& host, const std::string& port,
+                        const std::string& rails, size_t size) {
+    RDMAMultiRail multirail;
+    size_t start = 0;
+    while (start <= rails.size()) {
+        size_t end = rails.find(',', start);
+        std::string rail = rails.substr(start, end == std::string::npos ? end : end - start);
+        size_t at = rail.find('@');
+        multirail.addRail(rail.substr(0, at), at == std::string::npos ? "" : rail.substr(at + 1));
+        if (end == std::string::npos) {
+            break;
         }
+        start = end + 1;
+    }
+    if (multirail.connect(host, port)) {
+        return 1;
+    }
 
-        // Wait for completion of previously posted receive
-        struct ibv_wc wc;
-        do {
-            while (ibv_poll_cq(cq, 1, &wc) == 0) {
-                // Keep polling
-            }
-        } while (wc.wr_id != 2); // Wait for receive completion (wr_id = 2)
+    size = size ? std::min(size, multirail.capacity()) : multirail.capacity();
+    std::vector<char> out(size), in(size);
+    for (size_t i = 0; i < size; i++) {
+        out[i] = (char)(i * 7);
+    }
+    // The first pass registers the buffers on every rail
+    if (multirail.write(0, out.data(), size) || multirail.read(0, in.data(), size)) {
+        return 1;
+    }
 
-        if (wc.status != IBV_WC_SUCCESS) {
-            std::cerr << "Receive work completion failed\n";
-            return -1;
+    static const int ITERS = 100;
+    uint64_t write_ns = 0, read_ns = 0;
+    for (int i = 0; i < ITERS; i++) {
+        uint64_t t0 = benchNowNs();
+        if (multirail.write(0, out.data(), size)) {
+            return 1;
         }
-
-        std::cout << "Message received: " << buffer << std::endl;
-        return 0;
+        uint64_t t1 = benchNowNs();
+        if (multirail.read(0, in.data(), size)) {
+            return 1;
+        }
+        write_ns += t1 - t0;
+        read_ns += benchNowNs() - t1;
     }
+    bool match = memcmp(out.data(), in.data(), size) == 0;
+    std::cout << multirail.railCount() << " rails, " << size << " bytes: write "
+              << (double)size * ITERS / write_ns << " GB/s, read "
+              << (double)size * ITERS / read_ns << " GB/s, data "
+              << (match ? "verified" : "MISMATCH") << "\n";
+    return match ? 0 : 1;
+}
+
+// Against rdma_server --rpc: iters echo calls of size bytes with up to window
+// in flight, then a checksum call on large_size bytes if given
+static int runRpc(RDMAClient& client, const BenchConfig& bench, size_t large_size) {
+    RpcClient rpc(client);
+    rpc.setMaxOutstanding(bench.window);
+
+    std::vector<char> args(bench.min_size);
+    for (size_t i = 0; i < args.size(); i++) {
+        args[i] = (char)i;
+    }
+    int errors = 0;
+    RpcClient::Callback check = [&](int status, const char *data, size_t len) {
+        if (status != RPC_OK || len != args.size() ||
+            (len && memcmp(data, args.data(), len) != 0)) {
+            errors++;
+        }
+    };
 
-private:
-    int handleConnectionEvents() {
-        struct rdma_cm_event *event;
-        int ret;
-
-        while (rdma_get_cm_event(ec, &event) == 0) {
-            switch (event->event) {
-                case RDMA_CM_EVENT_ADDR_RESOLVED:
-                    ret = rdma_resolve_route(conn_id, 2000);
-                    if (ret) {
-                        std::cerr << "Failed to resolve route, error: " << strerror(errno) << " (errno=" << errno << ")\n";
-                        rdma_ack_cm_event(event);
-                        return ret;
-                    }
-                    break;
-
-                case RDMA_CM_EVENT_ROUTE_RESOLVED:
-                    ret = setupQueuePair();
-                    if (ret) {
-                        rdma_ack_cm_event(event);
-                        return ret;
-                    }
-                    ret = rdma_connect(conn_id, nullptr);
-                    if (ret) {
-                        std::cerr << "Failed to connect\n";
-                        rdma_ack_cm_event(event);
-                        return ret;
-                    }
-                    break;
-
-                case RDMA_CM_EVENT_ESTABLISHED:
-                    // Post initial receive work request for server response
-                    {
-                        struct ibv_sge sge;
-                        struct ibv_recv_wr recv_wr, *bad_wr;
-
-                        memset(&sge, 0, sizeof(sge));
-                        sge.addr = (uintptr_t)buffer;
-                        sge.length = BUFFER_SIZE;
-                        sge.lkey = mr->lkey;
-
-                        memset(&recv_wr, 0, sizeof(recv_wr));
-                        recv_wr.wr_id = 2;
-                        recv_wr.sg_list = &sge;
-                        recv_wr.num_sge = 1;
-
-                        ret = ibv_post_recv(conn_id->qp, &recv_wr, &bad_wr);
-                        if (ret) {
-                            std::cerr << "Failed to post initial receive\n";
-                            rdma_ack_cm_event(event);
-                            return ret;
-                        }
-                    }
-                    rdma_ack_cm_event(event);
-                    return 0;
-
-                case RDMA_CM_EVENT_CONNECT_ERROR:
-                case RDMA_CM_EVENT_UNREACHABLE:
-                case RDMA_CM_EVENT_REJECTED:
-                    std::cerr << "Connection failed\n";
-                    rdma_ack_cm_event(event);
-                    return -1;
-
-                default:
-                    break;
-            }
-            rdma_ack_cm_event(event);
+    uint64_t start = benchNowNs();
+    for (int i = 0; i < bench.iters; i++) {
+        if (rpc.call(RPC_METHOD_ECHO, args.data(), args.size(), check)) {
+            return 1;
         }
-        return 0;
     }
-
-    int setupQueuePair() {
-        int ret;
-
-        pd = ibv_alloc_pd(conn_id->verbs);
-        if (!pd) {
-            std::cerr << "Failed to allocate protection domain\n";
-            return -1;
+    if (rpc.waitAll()) {
+        return 1;
+    }
+    uint64_t elapsed = benchNowNs() - start;
+    std::cout << bench.iters << " echo calls of " << args.size() << " bytes, window "
+              << bench.window << ": " << (double)bench.iters * 1e9 / elapsed << " calls/s, "
+              << (double)elapsed / bench.iters / 1000 << " us per call, " << errors << " errors\n";
+
+    if (large_size > 0) {
+        std::vector<char> payload(large_size);
+        uint64_t expected = 0;
+        for (size_t i = 0; i < large_size; i++) {
+            payload[i] = (char)(i * 13);
+            expected += (unsigned char)payload[i];
         }
-
-        comp_chan = ibv_create_comp_channel(conn_id->verbs);
-        if (!comp_chan) {
-            std::cerr << "Failed to create completion channel\n";
-            return -1;
+        std::string result;
+        int status = rpc.callSync(RPC_METHOD_CHECKSUM, payload.data(), payload.size(), &result);
+        uint64_t sum = 0;
+        if (status == RPC_OK && result.size() == sizeof(sum)) {
+            memcpy(&sum, result.data(), sizeof(sum));
+            sum = be64toh(sum);
+        }
+        std::cout << "Checksum call on " << large_size << " bytes: "
+                  << (status == RPC_OK && sum == expected ? "verified" : "FAILED") << "\n";
+        if (status != RPC_OK || sum != expected) {
+            errors++;
         }
+    }
+    return errors ? 1 : 0;
+}
+
+// Against rdma_server --ud: iters reliable datagrams of min_size bytes over
+// one UD QP, counting the (unreliable) echoes that come back
+static int runUd(const std::string& host, const std::string& port, const std::string& source,
+                 const BenchConfig& bench) {
+    UDEndpoint endpoint;
+    int echoes = 0;
+    endpoint.setHandler([&echoes](UDEndpoint&, uint32_t, const char *, size_t) {
+        echoes++;
+    });
+    uint32_t server;
+    if (endpoint.open(source, "") || endpoint.resolve(host, port, &server)) {
+        return 1;
+    }
 
-        cq = ibv_create_cq(conn_id->verbs, MAX_WR, nullptr, comp_chan, 0);
-        if (!cq) {
-            std::cerr << "Failed to create completion queue\n";
-            return -1;
+    std::vector<char> message(std::min(bench.min_size, endpoint.maxMessageSize()));
+    uint64_t start = benchNowNs();
+    for (int i = 0; i < bench.iters; i++) {
+        if (endpoint.send(server, message.data(), message.size(), true)) {
+            return 1;
         }
+        endpoint.poll();
+    }
+    if (endpoint.flush()) {
+        return 1;
+    }
+    uint64_t elapsed = benchNowNs() - start;
 
-        mr = ibv_reg_mr(pd, buffer, BUFFER_SIZE, 
-                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ);
-        if (!mr) {
-            std::cerr << "Failed to register memory region\n";
-            return -1;
+    // Echoes still on their way
+    uint64_t deadline = benchNowNs() + 100000000;
+    while (echoes < bench.iters && benchNowNs() < deadline) {
+        if (endpoint.poll(10) < 0) {
+            return 1;
         }
+    }
+    std::cout << bench.iters << " reliable datagrams of " << message.size() << " bytes: "
+              << (double)bench.iters * 1e9 / elapsed << " msgs/s, " << echoes << " echoes\n";
+    return 0;
+}
+
+// Against rdma_server --atomics: iters sequence numbers from a counter,
+// iters rounds of a ticket lock and one lease, each object in its own line
+// of the atomic table
+static int runAtomics(RDMAClient& client, const BenchConfig& bench) {
+    if (client.atomicTable().length < 3 * ATOMIC_LINE) {
+        std::cerr << "Server has no atomic table of " << 3 * ATOMIC_LINE / sizeof(uint64_t)
+                  << " slots; start it with --atomics\n";
+        return 1;
+    }
 
-        struct ibv_qp_init_attr qp_attr;
-        memset(&qp_attr, 0, sizeof(qp_attr));
-        qp_attr.send_cq = cq;
-        qp_attr.recv_cq = cq;
-        qp_attr.qp_type = IBV_QPT_RC;
-        qp_attr.cap.max_send_wr = MAX_WR;
-        qp_attr.cap.max_recv_wr = MAX_WR;
-        qp_attr.cap.max_send_sge = 1;
-        qp_attr.cap.max_recv_sge = 1;
-
-        ret = rdma_create_qp(conn_id, pd, &qp_attr);
-        if (ret) {
-            std::cerr << "Failed to create queue pair\n";
-            return ret;
+    RemoteCounter counter(client, 0);
+    uint64_t first = 0;
+    uint64_t last = 0;
+    bool ordered = true;
+    uint64_t start = benchNowNs();
+    for (int i = 0; i < bench.iters; i++) {
+        uint64_t value;
+        if (counter.next(&value)) {
+            return 1;
+        }
+        if (i == 0) {
+            first = value;
+        } else if (value <= last) {
+            ordered = false;
+        }
+        last = value;
+    }
+    uint64_t elapsed = benchNowNs() - start;
+    std::cout << bench.iters << " sequence numbers " << first << ".." << last << ": "
+              << (double)bench.iters * 1e9 / elapsed << " ops/s, "
+              << (double)elapsed / bench.iters / 1000 << " us each"
+              << (ordered ? "" : ", OUT OF ORDER") << "\n";
+
+    RemoteTicketLock ticket_lock(client, ATOMIC_LINE);
+    start = benchNowNs();
+    for (int i = 0; i < bench.iters; i++) {
+        if (ticket_lock.lock() || ticket_lock.unlock()) {
+            return 1;
         }
+    }
+    elapsed = benchNowNs() - start;
+    std::cout << bench.iters << " ticket lock rounds: "
+              << (double)elapsed / bench.iters / 1000 << " us per lock and unlock\n";
+
+    RemoteLease lease(client, 2 * ATOMIC_LINE, (uint32_t)getpid(), 1000000);
+    int ret = lease.acquire(5000);
+    if (ret == 0) {
+        ret = lease.renew();
+    }
+    if (ret == 0) {
+        ret = lease.release();
+    }
+    std::cout << "Lease acquire, renew and release: " << (ret == 0 ? "ok" : "FAILED") << "\n";
+    return ordered && ret == 0 ? 0 : 1;
+}
+
+static void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [--cq-mode poll|event|adaptive] [--spin-us N] "
+              << "[--rendezvous BYTES] [--large-size BYTES] [--queue-depth N]\n"
+              << "       [--bench lat|bw|bibw|rate] [--min-size BYTES] [--max-size BYTES] "
+              << "[--iters N] [--warmup N] [--window N] [--format human|csv|json]\n"
+              << "       [--stats text|json] [--stats-interval SECONDS] [--connections N] "
+              << "[--src SOURCE] [--numa]\n"
+              << "       [--rails SOURCE[@SERVER],...] [--rpc] [--ud] [--atomics] <server_ip> <port>\n"
+              << "       " << prog << " --list-devices\n"
+              << "SOURCE: IPv4 address, interface, or RDMA device[:port[:gid_index]]\n";
+}
 
-        return 0;
+int main(int argc, char *argv[]) {
+    CompletionMode completion_mode = COMPLETION_ADAPTIVE;
+    int spin_us = 50;
+    size_t rendezvous = 64 * 1024;
+    size_t large_size = 0;
+    BenchConfig bench;
+    bool stats_at_exit = false;
+    StatsFormat stats_format = STATS_TEXT;
+    int stats_interval = 0;
+    int connections = 0;
+    std::string source;
+    std::string rails;
+    bool numa = false;
+    bool rpc = false;
+    bool ud = false;
+    bool atomics = false;
+
+    static const struct option long_options[] = {
+        {"cq-mode", required_argument, nullptr, 'm'},
+        {"spin-us", required_argument, nullptr, 's'},
+        {"rendezvous", required_argument, nullptr, 'r'},
+        {"large-size", required_argument, nullptr, 'l'},
+        {"queue-depth", required_argument, nullptr, 'q'},
+        {"bench", required_argument, nullptr, 'b'},
+        {"min-size", required_argument, nullptr, 'n'},
+        {"max-size", required_argument, nullptr, 'x'},
+        {"iters", required_argument, nullptr, 'i'},
+        {"warmup", required_argument, nullptr, 'W'},
+        {"window", required_argument, nullptr, 'w'},
+        {"format", required_argument, nullptr, 'f'},
+        {"stats", required_argument, nullptr, 'S'},
+        {"stats-interval", required_argument, nullptr, 'I'},
+        {"connections", required_argument, nullptr, 'c'},
+        {"src", required_argument, nullptr, 'a'},
+        {"rails", required_argument, nullptr, 'R'},
+        {"numa", no_argument, nullptr, 'N'},
+        {"list-devices", no_argument, nullptr, 'L'},
+        {"rpc", no_argument, nullptr, 'P'},
+        {"ud", no_argument, nullptr, 'U'},
+        {"atomics", no_argument, nullptr, 'A'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:s:r:l:q:b:n:x:i:W:w:f:S:I:c:a:R:NLPUA", long_options,
+                              nullptr)) != -1) {
+        switch (opt) {
+            case 'm':
+                if (parseCompletionMode(optarg, &completion_mode)) {
+                    std::cerr << "Unknown completion mode: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case 's':
+                spin_us = std::stoi(optarg);
+                break;
+            case 'r':
+                rendezvous = std::stoul(optarg);
+                break;
+            case 'l':
+                large_size = std::stoul(optarg);
+                break;
+            case 'q':
+                bench.queue_depth = std::stoi(optarg);
+                break;
+            case 'b':
+                if (parseBenchTest(optarg, &bench.test)) {
+                    std::cerr << "Unknown benchmark: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case 'n':
+            case 'x':
+                if (parseSize(optarg, opt == 'n' ? &bench.min_size : &bench.max_size)) {
+                    std::cerr << "Invalid size: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case 'i':
+                bench.iters = std::max(1, std::stoi(optarg));
+                break;
+            case 'W':
+                bench.warmup = std::max(0, std::stoi(optarg));
+                break;
+            case 'w':
+                bench.window = std::max(1, std::stoi(optarg));
+                break;
+            case 'f':
+                if (parseBenchFormat(optarg, &bench.format)) {
+                    std::cerr << "Unknown output format: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case 'S':
+                if (parseStatsFormat(optarg, &stats_format)) {
+                    std::cerr << "Unknown stats format: " << optarg << "\n";
+                    return 1;
+                }
+                stats_at_exit = true;
+                break;
+            case 'I':
+                stats_interval = std::stoi(optarg);
+                break;
+            case 'c':
+                connections = std::max(1, std::stoi(optarg));
+                break;
+            case 'a':
+                source = optarg;
+                break;
+            case 'R':
+                rails = optarg;
+                break;
+            case 'N':
+                numa = true;
+                break;
+            case 'L':
+                printDevices(std::cout);
+                return 0;
+            case 'P':
+                rpc = true;
+                break;
+            case 'U':
+                ud = true;
+                break;
+            case 'A':
+                atomics = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
     }
 
-    void cleanup() {
-        if (mr) ibv_dereg_mr(mr);
-        if (cq) ibv_destroy_cq(cq);
-        if (comp_chan) ibv_destroy_comp_channel(comp_chan);
-        if (pd) ibv_dealloc_pd(pd);
-        if (conn_id) rdma_destroy_id(conn_id);
-        if (ec) rdma_destroy_event_channel(ec);
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
     }
-};
 
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " <server_ip> <port>\n";
+    // Started before anything else so that SIGUSR1 reaches the reporter
+    StatsReporter reporter;
+    if (reporter.start(stats_interval, stats_format)) {
         return 1;
     }
 
+    if (ud) {
+        return runUd(argv[optind], argv[optind + 1], source, bench);
+    }
+
+    if (!rails.empty()) {
+        return runMultiRail(argv[optind], argv[optind + 1], rails, large_size);
+    }
+
+    if (connections > 0) {
+        return runPooled(argv[optind], argv[optind + 1], connections, bench.queue_depth);
+    }
+
     RDMAClient client;
+    client.setCompletionMode(completion_mode, spin_us);
+    client.setRendezvousThreshold(rendezvous);
+    client.setQueueDepth(bench.queue_depth);
+    client.setSource(source);
+    if (numa) {
+        client.setNumaPlacement(NUMA_PIN);
+    }
+
+    // Benchmarks keep the console to their results
+    if (bench.test != BENCH_NONE) {
+        AsyncLogger::instance().setLevel(LOG_LEVEL_WARN);
+    }
     
     int ret = client.initialize();
     if (ret) {
@@ -285,18 +586,77 @@ int main(int argc, char *argv[]) {
         return ret;
     }
 
-    ret = client.connectToServer(argv[1], argv[2]);
+    ret = client.connectToServer(argv[optind], argv[optind + 1]);
     if (ret) {
         std::cerr << "Failed to connect to server\n";
         return ret;
     }
 
+    // RPC runs need a server started with --rpc
+    if (rpc) {
+        ret = runRpc(client, bench, large_size);
+        if (stats_at_exit) {
+            reporter.dump();
+        }
+        return ret;
+    }
+
+    if (atomics) {
+        ret = runAtomics(client, bench);
+        if (stats_at_exit) {
+            reporter.dump();
+        }
+        return ret;
+    }
+
+    // Benchmark runs need a server started with --bench
+    if (bench.test != BENCH_NONE) {
+        ret = runBenchmark(client, bench);
+        if (stats_at_exit) {
+            reporter.dump();
+        }
+        return ret ? 1 : 0;
+    }
+
     // Client initiates: send first, then receive response
     std::cout << "Sending message to server...\n";
     client.sendMessage("Hello from RDMA client!");
     
     std::cout << "Waiting for server response...\n";
-    client.receiveMessage();
+    std::string reply;
+    if (client.receiveMessage(&reply) == 0) {
+        std::cout << "Server replied: " << previewPayload(reply.data(), reply.size()) << std::endl;
+    }
 
+    // Binary payload beyond one receive slot: segmented, or pulled by the
+    // server with RDMA READ from the rendezvous threshold on
+    if (large_size > 0) {
+        std::vector<char> payload(large_size);
+        for (size_t i = 0; i < large_size; i++) {
+            payload[i] = (char)i;
+        }
+        if (client.sendData(payload.data(), payload.size()) == 0) {
+            std::cout << "Large message sent: " << large_size << " bytes\n";
+            client.receiveMessage();
+        }
+    }
+
+    // One-sided exchange: write into the server's buffer, read it back and
+    // notify the server with an immediate value
+    if (client.remoteBuffer().rkey) {
+        static const char text[] = "Hello via RDMA WRITE!";
+        char *local = client.localBuffer();
+
+        memcpy(local, text, sizeof(text));
+        if (client.write(0, local, sizeof(text)) == 0 &&
+            client.read(0, local + sizeof(text), sizeof(text)) == 0) {
+            std::cout << "Read back: " << (local + sizeof(text)) << std::endl;
+        }
+        client.writeWithImm(0, local, sizeof(text), 1);
+    }
+
+    if (stats_at_exit) {
+        reporter.dump();
+    }
     return 0;
 }
\ No newline at end of file
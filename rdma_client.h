@@ -0,0 +1,1390 @@
+#ifndef RDMA_CLIENT_H
+#define RDMA_CLIENT_H
+
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "rdma_common.h"
+#include "rdma_conn.h"
+#include "rdma_mempool.h"
+#include "rdma_device.h"
+#include "stats.h"
+#include "log.h"
+
+// Verbs resources that pooled clients on one device share: the protection
+// domain with its registered pool and MR cache, and one completion queue with
+// its channel. The CQ is sized for `capacity` connections; each client finds
+// its completions by QP number, and completions polled on behalf of another
+// client wait for it in a per-QP queue. One thread drives all clients that
+// share a device.
+class RDMASharedDevice {
+public:
+    struct ibv_context *verbs;
+    struct ibv_pd *pd;
+    struct ibv_comp_channel *comp_chan;
+    struct ibv_cq *cq;
+    RegisteredPool *pool;
+    MRCache *mr_cache;
+    CQNotifier cq_events;   // one notification request covers every client
+
+    RDMASharedDevice() : verbs(nullptr), pd(nullptr), comp_chan(nullptr), cq(nullptr),
+                         pool(nullptr), mr_cache(nullptr), capacity(0) {}
+
+    // Clients are detached first
+    ~RDMASharedDevice() {
+        delete mr_cache;
+        delete pool;
+        cq_events.release(cq);
+        if (cq) ibv_destroy_cq(cq);
+        if (comp_chan) ibv_destroy_comp_channel(comp_chan);
+        if (pd) ibv_dealloc_pd(pd);
+    }
+
+    int open(struct ibv_context *device, int connections, int queue_depth) {
+        verbs = device;
+        capacity = connections;
+        pd = ibv_alloc_pd(verbs);
+        if (!pd) {
+            std::cerr << "Failed to allocate protection domain\n";
+            return -1;
+        }
+        comp_chan = ibv_create_comp_channel(verbs);
+        if (!comp_chan) {
+            std::cerr << "Failed to create completion channel\n";
+            return -1;
+        }
+        // Every client may have its whole send and receive queues completing
+        cq = ibv_create_cq(verbs, 2 * queue_depth * connections, nullptr, comp_chan, 0);
+        if (!cq) {
+            std::cerr << "Failed to create shared completion queue\n";
+            return -1;
+        }
+        pool = new RegisteredPool(pd, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+        mr_cache = new MRCache(pd, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+        return 0;
+    }
+
+    int attach(uint32_t qp_num) {
+        if ((int)stashed.size() >= capacity) {
+            std::cerr << "Shared completion queue is full (" << capacity << " connections)\n";
+            return -1;
+        }
+        stashed[qp_num];
+        return 0;
+    }
+
+    void detach(uint32_t qp_num) {
+        stashed.erase(qp_num);
+    }
+
+    // Up to max completions of qp_num: queued ones first, then whatever the
+    // CQ holds, parking completions of other clients
+    int poll(uint32_t qp_num, struct ibv_wc *wc, int max) {
+        std::deque<struct ibv_wc>& own = stashed[qp_num];
+        int n = 0;
+        while (n < max && !own.empty()) {
+            wc[n++] = own.front();
+            own.pop_front();
+        }
+        if (n > 0) {
+            return n;
+        }
+
+        struct ibv_wc batch[PollStats::MAX_BATCH];
+        int polled = ibv_poll_cq(cq, std::min(max, (int)PollStats::MAX_BATCH), batch);
+        if (polled < 0) {
+            return polled;
+        }
+        for (int i = 0; i < polled; i++) {
+            if (batch[i].qp_num == qp_num) {
+                wc[n++] = batch[i];
+                continue;
+            }
+            std::unordered_map<uint32_t, std::deque<struct ibv_wc> >::iterator it =
+                stashed.find(batch[i].qp_num);
+            if (it != stashed.end()) {
+                it->second.push_back(batch[i]);
+            } else {
+                LOG_DEBUG("Dropping completion of closed QP %u", batch[i].qp_num);
+            }
+        }
+        return n;
+    }
+
+    // Completion events are acked in bulk when the CQ goes away
+private:
+    int capacity;
+    std::unordered_map<uint32_t, std::deque<struct ibv_wc> > stashed;
+};
+
+// Shared devices by verbs context, opened on first use
+class RDMADeviceSet {
+public:
+    RDMADeviceSet(int connections_per_device, int queue_depth)
+        : per_device(connections_per_device), depth(queue_depth) {}
+
+    ~RDMADeviceSet() {
+        for (size_t i = 0; i < devices.size(); i++) {
+            delete devices[i];
+        }
+    }
+
+    RDMASharedDevice *get(struct ibv_context *verbs) {
+        for (size_t i = 0; i < devices.size(); i++) {
+            if (devices[i]->verbs == verbs) {
+                return devices[i];
+            }
+        }
+        RDMASharedDevice *device = new RDMASharedDevice();
+        if (device->open(verbs, per_device, depth)) {
+            delete device;
+            return nullptr;
+        }
+        devices.push_back(device);
+        return device;
+    }
+
+    int queueDepth() const {
+        return depth;
+    }
+
+private:
+    int per_device;
+    int depth;
+    std::vector<RDMASharedDevice *> devices;
+};
+
+class RDMAClient : private FramedChannel {
+private:
+    struct rdma_cm_id *conn_id;
+    struct rdma_event_channel *ec;
+    RDMADeviceSet *device_set;      // set for pooled clients
+    RDMASharedDevice *shared;       // their device, once the route is known
+    struct ibv_pd *pd;
+    struct ibv_comp_channel *comp_chan;
+    struct ibv_cq *cq;
+    struct ibv_mr *mr;
+    char *buffer;
+    struct ibv_mr *rdma_mr;
+    char *rdma_buffer;
+    RegisteredPool *pool;
+    MRCache *mr_cache;
+    RemoteBuffer remote;
+    RemoteBuffer atomics;
+    enum ibv_atomic_cap atomic_cap;
+    uint64_t *atomic_word;
+    struct ibv_mr *credit_mr;
+    uint8_t initiator_depth;
+    uint8_t responder_resources;
+    std::vector<uint32_t> recv_repost;
+    std::deque<struct ibv_wc> recv_pending;
+    std::deque<std::pair<uint64_t, void *>> loaned_sends;
+    bool reassembly_leased;
+    CompletionMode completion_mode;
+    int spin_budget_us;
+    CQNotifier cq_events;
+    PollStats poll_stats;
+    std::vector<Segment> send_segments;
+    std::string source;
+    NumaPlacement numa_placement;
+
+    // The registered region is carved into BUFFER_SIZE slots: queue_depth send
+    // staging slots (one per send queue entry) followed by queue_depth receive
+    // slots that are kept posted on the QP.
+    static const int QUEUE_DEPTH = 16;
+    static const int MAX_QUEUE_DEPTH = 256;
+    static const int RECV_REPOST_BATCH = 4;
+    static const int SIGNAL_INTERVAL = 4;
+    static const uint32_t MAX_INLINE_DATA = 256;
+    static const int SPIN_BUDGET_US = 50;
+    static const int CQ_POLL_BATCH = PollStats::MAX_BATCH;
+
+    // Message size from which the server pulls the payload with RDMA READ
+    // instead of receiving it in segments
+    static const size_t RENDEZVOUS_THRESHOLD = 64 * 1024;
+
+    // Window exposed to the server for one-sided access; it is also the local
+    // source/destination of our own RDMA READs and WRITEs
+    static const size_t RDMA_REGION_SIZE = 1 << 20;
+    static const uint8_t MAX_RD_ATOMIC = 16;
+
+public:
+    // A received message handed out in place by receiveLease()
+    struct MessageLease {
+        const char *data;
+        size_t len;
+        uint32_t slot;      // receive slot held until release, or NO_SLOT
+    };
+
+    static const uint32_t NO_SLOT = UINT32_MAX;
+
+    RDMAClient() : conn_id(nullptr), ec(nullptr), device_set(nullptr), shared(nullptr), pd(nullptr), 
+                   comp_chan(nullptr), cq(nullptr), mr(nullptr), 
+                   buffer(nullptr), rdma_mr(nullptr), rdma_buffer(nullptr),
+                   pool(nullptr), mr_cache(nullptr), atomic_cap(IBV_ATOMIC_NONE),
+                   atomic_word(nullptr), credit_mr(nullptr),
+                   initiator_depth(0), responder_resources(0),
+                   reassembly_leased(false),
+                   completion_mode(COMPLETION_ADAPTIVE),
+                   spin_budget_us(SPIN_BUDGET_US),
+                   numa_placement(NUMA_NONE) {
+        memset(&remote, 0, sizeof(remote));
+        memset(&atomics, 0, sizeof(atomics));
+        queue_depth = QUEUE_DEPTH;
+        signal_interval = SIGNAL_INTERVAL;
+        rendezvous_threshold = RENDEZVOUS_THRESHOLD;
+        credit_box = new CreditBox();
+        memset(&poll_stats, 0, sizeof(poll_stats));
+    }
+
+    ~RDMAClient() {
+        cleanup();
+        delete[] buffer;
+        delete[] rdma_buffer;
+        delete credit_box;
+    }
+
+    int initialize() {
+        int ret;
+
+        ec = rdma_create_event_channel();
+        if (!ec) {
+            std::cerr << "Failed to create event channel\n";
+            return -1;
+        }
+
+        ret = rdma_create_id(ec, &conn_id, nullptr, RDMA_PS_TCP);
+        if (ret) {
+            std::cerr << "Failed to create connection ID\n";
+            return ret;
+        }
+
+        return 0;
+    }
+
+    int connectToServer(const std::string& server_ip, const std::string& port) {
+        int ret = resolveServer(server_ip, port);
+        if (ret) {
+            return ret;
+        }
+
+        ret = handleConnectionEvents();
+        if (ret) {
+            return ret;
+        }
+
+        LOG_INFO("Connected to RDMA server at %s:%s", server_ip.c_str(), port.c_str());
+        return 0;
+    }
+
+    // Local source of the connection, by address, interface or RDMA device
+    // (see rdma_device.h); by default the routing table picks it. Call
+    // before connecting.
+    void setSource(const std::string& spec) {
+        source = spec;
+    }
+
+    // Where the connection's buffers (and with NUMA_PIN the calling thread)
+    // go once the device is known; call before connecting
+    void setNumaPlacement(NumaPlacement placement) {
+        numa_placement = placement;
+    }
+
+    // Device the connection runs on, once connected
+    struct ibv_context *device() const {
+        return conn_id ? conn_id->verbs : nullptr;
+    }
+
+    // Pooled clients: take the PD, CQ and registrations from the device set
+    // instead of allocating them per connection, and connect asynchronously
+    // on the caller's event channel. Call startConnect() instead of
+    // initialize() and connectToServer(), then feed every CM event whose
+    // id->context is this client to handleConnectionEvent().
+    void useSharedDevices(RDMADeviceSet *devices) {
+        device_set = devices;
+        queue_depth = devices->queueDepth();
+    }
+
+    int startConnect(struct rdma_event_channel *channel, const std::string& server_ip,
+                     const std::string& port) {
+        if (rdma_create_id(channel, &conn_id, this, RDMA_PS_TCP)) {
+            std::cerr << "Failed to create connection ID\n";
+            return -1;
+        }
+        return resolveServer(server_ip, port);
+    }
+
+    // Advance the connection by one CM event, which is acked here: 1 while
+    // it is still being set up, 0 once established, -1 if it failed
+    int handleConnectionEvent(struct rdma_cm_event *event) {
+        int ret;
+
+        switch (event->event) {
+            case RDMA_CM_EVENT_ADDR_RESOLVED:
+                ret = rdma_resolve_route(conn_id, 2000);
+                rdma_ack_cm_event(event);
+                if (ret) {
+                    std::cerr << "Failed to resolve route, error: " << strerror(errno) << " (errno=" << errno << ")\n";
+                    return -1;
+                }
+                return 1;
+
+            case RDMA_CM_EVENT_ROUTE_RESOLVED:
+                rdma_ack_cm_event(event);
+                ret = setupQueuePair();
+                if (ret) {
+                    return -1;
+                }
+                // Fill the receive ring before connecting so the server's
+                // response always finds a posted buffer
+                ret = postReceiveRing();
+                if (ret) {
+                    std::cerr << "Failed to post initial receives\n";
+                    return -1;
+                }
+                {
+                    ConnectionInfo local;
+                    struct rdma_conn_param conn_param;
+
+                    packConnectionInfo(rdma_mr, credit_box, credit_mr->rkey, recv_posted, nullptr,
+                                       &local);
+                    memset(&conn_param, 0, sizeof(conn_param));
+                    conn_param.private_data = &local;
+                    conn_param.private_data_len = sizeof(local);
+                    conn_param.initiator_depth = initiator_depth;
+                    conn_param.responder_resources = responder_resources;
+                    conn_param.retry_count = 7;
+                    conn_param.rnr_retry_count = 7;
+                    ret = rdma_connect(conn_id, &conn_param);
+                }
+                if (ret) {
+                    std::cerr << "Failed to connect\n";
+                    return -1;
+                }
+                return 1;
+
+            case RDMA_CM_EVENT_ESTABLISHED: {
+                // The server advertises its buffer, its credit mailbox and
+                // our initial send credits in the accept private data
+                ConnectionInfo info;
+                ret = unpackConnectionInfo(event->param.conn.private_data,
+                                           event->param.conn.private_data_len, &info);
+                rdma_ack_cm_event(event);
+                if (ret) {
+                    std::cerr << "Server did not send connection info\n";
+                    return -1;
+                }
+
+                remote = info.window;
+                atomics = info.atomics;
+                credit_remote = info.mailbox;
+                peer_credits = info.credits;
+                LOG_INFO("Remote buffer: %u bytes, rkey %u, send credits %u",
+                         remote.length, remote.rkey, peer_credits);
+                return 0;
+            }
+
+            case RDMA_CM_EVENT_ADDR_ERROR:
+            case RDMA_CM_EVENT_ROUTE_ERROR:
+            case RDMA_CM_EVENT_CONNECT_ERROR:
+            case RDMA_CM_EVENT_UNREACHABLE:
+            case RDMA_CM_EVENT_REJECTED:
+                std::cerr << "Connection failed: " << rdma_event_str(event->event) << "\n";
+                rdma_ack_cm_event(event);
+                return -1;
+
+            default:
+                rdma_ack_cm_event(event);
+                return 1;
+        }
+    }
+
+    int sendMessage(const std::string& message) {
+        int ret = sendData(message.data(), message.size());
+        if (ret) {
+            return ret;
+        }
+
+        LOG_DEBUG("Message sent: %s", previewPayload(message.data(), message.size()).c_str());
+        return 0;
+    }
+
+    // Send one binary message. Payloads larger than a receive slot are split
+    // into segments and payloads of rendezvousThreshold() bytes or more are
+    // pulled by the server with a single RDMA READ. The buffer may be reused
+    // as soon as the call returns, so a rendezvous message waits for its
+    // DONE; sendBuffer() does not.
+    int sendData(const void *data, size_t len) {
+        send_segments.clear();
+        int ret = queueMessage((const char *)data, len);
+        if (ret == 0) {
+            ret = postSegments(send_segments.data(), send_segments.size());
+        }
+        return ret ? ret : waitRendezvous();
+    }
+
+    // Zero-copy send of a buffer from allocBuffer(). The client takes the
+    // buffer over: every segment is gathered by the HCA straight from it and
+    // it goes back to the pool once its sends have completed, or once the
+    // server has pulled it at rendezvous sizes. The call waits for neither
+    // and the caller must not touch the buffer again.
+    int sendBuffer(void *buf, size_t len) {
+        struct ibv_mr *buf_mr = pool ? pool->findMR(buf, len) : nullptr;
+        if (!buf_mr) {
+            std::cerr << "sendBuffer needs a buffer from allocBuffer\n";
+            return -1;
+        }
+
+        send_segments.clear();
+        if (len >= rendezvous_threshold) {
+            // Released by the server's DONE
+            return queueMessage((const char *)buf, len, buf_mr->lkey, buf);
+        }
+        uint64_t posted_before = sends_posted;
+        int ret = queueMessage((const char *)buf, len, buf_mr->lkey);
+        if (ret == 0) {
+            ret = postSegments(send_segments.data(), send_segments.size(), false, false);
+        }
+        // Once any WR is posted the HCA may still gather from buf, even if a
+        // later chain failed, so it is released by the retire path
+        if (ret && sends_posted == posted_before) {
+            pool->deallocate(buf);
+            return ret;
+        }
+        loaned_sends.push_back(std::make_pair(sends_posted, buf));
+        return ret;
+    }
+
+    // Send a batch of messages; segments of consecutive non-rendezvous
+    // messages are posted together as chained work requests
+    int sendMessages(const std::vector<std::string>& messages) {
+        send_segments.clear();
+        for (size_t i = 0; i < messages.size(); i++) {
+            int ret = queueMessage(messages[i].data(), messages[i].size());
+            if (ret) {
+                return ret;
+            }
+        }
+        int ret = postSegments(send_segments.data(), send_segments.size());
+        return ret ? ret : waitRendezvous();
+    }
+
+    size_t rendezvousThreshold() const {
+        return rendezvous_threshold;
+    }
+
+    void setRendezvousThreshold(size_t bytes) {
+        rendezvous_threshold = std::max((size_t)1, bytes);
+    }
+
+    // Registered window usable as the local side of write()/read(); it is
+    // allocated on connecting
+    char *localBuffer() {
+        return rdma_buffer;
+    }
+
+    size_t localBufferSize() const {
+        return RDMA_REGION_SIZE;
+    }
+
+    // Registered buffer from the pool; usable as the local side of write(),
+    // read() and their post* variants without further registration
+    void *allocBuffer(size_t size) {
+        return pool ? pool->allocate(size) : nullptr;
+    }
+
+    void freeBuffer(void *ptr) {
+        if (pool) {
+            pool->deallocate(ptr);
+        }
+    }
+
+    // Drop cached registrations of a caller-owned buffer before freeing it
+    void releaseUserBuffer(const void *addr, size_t len) {
+        if (mr_cache) {
+            mr_cache->invalidate(addr, len);
+        }
+    }
+
+    // Server buffer advertised in the accept private data
+    const RemoteBuffer& remoteBuffer() const {
+        return remote;
+    }
+
+    // One-sided operations on the server's buffer. local_buf may be any
+    // memory: localBuffer() and allocBuffer() memory is already registered,
+    // other buffers are registered on first use and cached. The post*
+    // variants only block when the send queue is full; write(), read() and
+    // writeWithImm() also wait for completion.
+    int postWrite(uint64_t remote_off, const void *local_buf, size_t len) {
+        return postRdma(IBV_WR_RDMA_WRITE, remote, remote_off, (void *)local_buf, len, 0);
+    }
+
+    int postRead(uint64_t remote_off, void *local_buf, size_t len) {
+        return postRdma(IBV_WR_RDMA_READ, remote, remote_off, local_buf, len, 0);
+    }
+
+    // The immediate value is delivered to the server with the receive
+    // completion that the write consumes
+    int postWriteWithImm(uint64_t remote_off, const void *local_buf, size_t len, uint32_t imm) {
+        return postRdma(IBV_WR_RDMA_WRITE_WITH_IMM, remote, remote_off, (void *)local_buf, len, imm);
+    }
+
+    int write(uint64_t remote_off, const void *local_buf, size_t len) {
+        int ret = postWrite(remote_off, local_buf, len);
+        return ret ? ret : flushSends();
+    }
+
+    int read(uint64_t remote_off, void *local_buf, size_t len) {
+        int ret = postRead(remote_off, local_buf, len);
+        return ret ? ret : flushSends();
+    }
+
+    int writeWithImm(uint64_t remote_off, const void *local_buf, size_t len, uint32_t imm) {
+        int ret = postWriteWithImm(remote_off, local_buf, len, imm);
+        return ret ? ret : flushSends();
+    }
+
+    // Table of 64-bit words for atomic operations, advertised by a server
+    // started with --atomics; empty otherwise
+    const RemoteBuffer& atomicTable() const {
+        return atomics;
+    }
+
+    // Atomic operations on the word at remote_off in the atomic table,
+    // carried out by the server's HCA without involving its CPU. remote_off
+    // must be 8-byte aligned. The word's previous value lands in *result,
+    // which must be 8-byte aligned local memory (registered on first use
+    // like the local side of postRead); fetchAdd() and compareSwap() wait
+    // for it and return it in *old when non-null.
+    int postFetchAdd(uint64_t remote_off, uint64_t add, uint64_t *result) {
+        return postAtomic(IBV_WR_ATOMIC_FETCH_AND_ADD, remote_off, add, 0, result);
+    }
+
+    // The word becomes swap if it equals compare; it changed if and only if
+    // the returned value equals compare
+    int postCompareSwap(uint64_t remote_off, uint64_t compare, uint64_t swap, uint64_t *result) {
+        return postAtomic(IBV_WR_ATOMIC_CMP_AND_SWP, remote_off, compare, swap, result);
+    }
+
+    int fetchAdd(uint64_t remote_off, uint64_t add, uint64_t *old = nullptr) {
+        uint64_t *word = atomicWord();
+        int ret = word ? postFetchAdd(remote_off, add, word) : -1;
+        return finishAtomic(ret, word, old);
+    }
+
+    int compareSwap(uint64_t remote_off, uint64_t compare, uint64_t swap, uint64_t *old = nullptr) {
+        uint64_t *word = atomicWord();
+        int ret = word ? postCompareSwap(remote_off, compare, swap, word) : -1;
+        return finishAtomic(ret, word, old);
+    }
+
+    // Current value of an atomic table word, by RDMA READ
+    int readAtomic(uint64_t remote_off, uint64_t *value) {
+        if (remote_off % sizeof(uint64_t)) {
+            std::cerr << "Atomic table offset " << remote_off << " is not 8-byte aligned\n";
+            return -1;
+        }
+        uint64_t *word = atomicWord();
+        int ret = word ? postRdma(IBV_WR_RDMA_READ, atomics, remote_off, word, sizeof(*word), 0) : -1;
+        return finishAtomic(ret, word, value);
+    }
+
+    // Wait until every posted send has completed
+    using FramedChannel::flushSends;
+
+    // Largest frame (header plus payload) sent with IBV_SEND_INLINE
+    uint32_t inlineThreshold() const {
+        return max_inline;
+    }
+
+    const PollStats& pollStats() const {
+        return poll_stats;
+    }
+
+    void printPollStats() const {
+        std::cout << "CQ polls: " << poll_stats.polls
+                  << " (empty " << poll_stats.empty_polls << ")"
+                  << ", completions: " << poll_stats.completions
+                  << ", errors: " << poll_stats.errors
+                  << ", max batch: " << poll_stats.max_batch
+                  << ", credit stalls: " << poll_stats.credit_stalls << "\n";
+        for (int i = 1; i <= PollStats::MAX_BATCH; i++) {
+            if (poll_stats.batch_hist[i]) {
+                std::cout << "  batch " << i << ": " << poll_stats.batch_hist[i] << "\n";
+            }
+        }
+    }
+
+    void setCompletionMode(CompletionMode mode, int spin_us) {
+        completion_mode = mode;
+        spin_budget_us = std::max(0, spin_us);
+    }
+
+    void setSignalInterval(int interval) {
+        signal_interval = std::max(1, std::min(interval, queue_depth));
+    }
+
+    // Send queue entries and receive slots; must be called before connecting
+    void setQueueDepth(int depth) {
+        queue_depth = std::max(2, std::min(depth, (int)MAX_QUEUE_DEPTH));
+        signal_interval = std::min(signal_interval, queue_depth);
+    }
+
+    int queueDepth() const {
+        return queue_depth;
+    }
+
+    // Payload carried by one SEND frame
+    size_t segmentSize() const {
+        return SEGMENT_SIZE;
+    }
+
+    // Wait for the next complete message. Segmented messages are reassembled
+    // and rendezvous messages are pulled with RDMA READ before returning; the
+    // payload is stored in *payload when it is non-null.
+    int receiveMessage(std::string *payload = nullptr) {
+        MessageLease lease;
+        int ret = receiveLease(&lease);
+        if (ret) {
+            return ret;
+        }
+        if (payload && lease.data) {
+            payload->assign(lease.data, lease.len);
+        }
+        return releaseLease(&lease);
+    }
+
+    // Drain the CQ without blocking: 1 if a received frame is waiting, so
+    // that receiveLease() returns without sleeping (unless the frame begins
+    // a segmented or rendezvous message), 0 if none is, -1 on error
+    int pollReceive() {
+        if (!conn_id || !cq) {
+            std::cerr << "Connection or completion queue not ready\n";
+            return -1;
+        }
+        if (recv_pending.empty() && pollCompletions(false)) {
+            return -1;
+        }
+        return recv_pending.empty() ? 0 : 1;
+    }
+
+    // Zero-copy receive of the next message. Single-segment messages are
+    // handed out in their registered receive slot, which is only re-posted
+    // when the lease is released; held slots are not credited to the server,
+    // so holding many leases throttles it. Reassembled and rendezvous
+    // messages are handed out in the reassembly buffer, and that lease must
+    // be released before the next receive. RDMA writes with immediate data
+    // yield an empty lease.
+    int receiveLease(MessageLease *lease) {
+        if (!conn_id || !cq) {
+            std::cerr << "Connection or completion queue not ready\n";
+            return -1;
+        }
+        if (reassembly_leased) {
+            std::cerr << "Release the previous message lease first\n";
+            return -1;
+        }
+
+        lease->data = nullptr;
+        lease->len = 0;
+        lease->slot = NO_SLOT;
+
+        for (;;) {
+            // Wait for completion of one of the posted receive slots
+            while (recv_pending.empty()) {
+                int ret = pollCompletions();
+                if (ret) {
+                    return ret;
+                }
+            }
+            struct ibv_wc wc = recv_pending.front();
+            recv_pending.pop_front();
+
+            uint32_t slot = wrIdValue(wc.wr_id);
+            if (wc.status != IBV_WC_SUCCESS) {
+                // Already reported by the completion dispatcher
+                return -1;
+            }
+
+            if (wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+                LOG_DEBUG("RDMA write received: %u bytes, imm %u", wc.byte_len, ntohl(wc.imm_data));
+                return releaseRecvSlot(slot);
+            }
+
+            MessageHeader header;
+            const char *frame = recvSlot(slot);
+            const char *data = nullptr;
+            size_t len = 0;
+            int ret = unpackHeader(frame, wc.byte_len, &header);
+            if (ret) {
+                std::cerr << "Malformed frame of " << wc.byte_len << " bytes\n";
+            } else {
+                ret = consumeFrame(header, frame + sizeof(header), wc.byte_len - sizeof(header),
+                                   &data, &len);
+            }
+
+            // Single-segment messages are read in place and keep their slot
+            if (ret == 0 && data == frame + sizeof(header)) {
+                lease->slot = slot;
+            } else {
+                int repost_ret = releaseRecvSlot(slot);
+                if (ret || repost_ret) {
+                    return ret ? ret : repost_ret;
+                }
+                if (!data) {
+                    continue;
+                }
+                reassembly_leased = true;
+            }
+
+            ThreadStats *stats = threadStats();
+            stats->count(STAT_MSGS_RECEIVED);
+            stats->count(STAT_BYTES_RECEIVED, len);
+            LOG_DEBUG("Message received: %s", previewPayload(data, len).c_str());
+            lease->data = data;
+            lease->len = len;
+            return 0;
+        }
+    }
+
+    // Hand a leased message back; its receive slot is re-posted
+    int releaseLease(MessageLease *lease) {
+        int ret = 0;
+        if (lease->slot != NO_SLOT) {
+            ret = releaseRecvSlot(lease->slot);
+        } else if (lease->data) {
+            reassembly_leased = false;
+        }
+        lease->data = nullptr;
+        lease->len = 0;
+        lease->slot = NO_SLOT;
+        return ret;
+    }
+
+private:
+    // Resolve the server's address; the CM continues with route resolution
+    // once it is done
+    int resolveServer(const std::string& server_ip, const std::string& port) {
+        struct sockaddr_in src_addr, dst_addr;
+
+        int bound = resolveSource(source, &src_addr);
+        if (bound < 0) {
+            return -1;
+        }
+
+        memset(&dst_addr, 0, sizeof(dst_addr));
+        dst_addr.sin_family = AF_INET;
+        dst_addr.sin_port = htons(std::stoi(port));
+        inet_pton(AF_INET, server_ip.c_str(), &dst_addr.sin_addr);
+
+        int ret = rdma_resolve_addr(conn_id, bound == 0 ? (struct sockaddr*)&src_addr : nullptr,
+                                    (struct sockaddr*)&dst_addr, 2000);
+        if (ret) {
+            std::cerr << "Failed to resolve address, error: " << strerror(errno) << " (errno=" << errno << ")\n";
+        }
+        return ret;
+    }
+
+    int handleConnectionEvents() {
+        struct rdma_cm_event *event;
+        int ret = 1;
+
+        while (ret == 1) {
+            if (rdma_get_cm_event(ec, &event)) {
+                std::cerr << "Failed to get CM event\n";
+                return -1;
+            }
+            ret = handleConnectionEvent(event);
+        }
+        return ret;
+    }
+
+    int setupQueuePair() {
+        int ret;
+
+        if (device_set) {
+            // Pooled: everything but the QP and its rings already exists
+            shared = device_set->get(conn_id->verbs);
+            if (!shared) {
+                return -1;
+            }
+            pd = shared->pd;
+            comp_chan = shared->comp_chan;
+            cq = shared->cq;
+            pool = shared->pool;
+            mr_cache = shared->mr_cache;
+        } else {
+            pd = ibv_alloc_pd(conn_id->verbs);
+            if (!pd) {
+                std::cerr << "Failed to allocate protection domain\n";
+                return -1;
+            }
+
+            comp_chan = ibv_create_comp_channel(conn_id->verbs);
+            if (!comp_chan) {
+                std::cerr << "Failed to create completion channel\n";
+                return -1;
+            }
+
+            cq = ibv_create_cq(conn_id->verbs, 2 * queue_depth, nullptr, comp_chan, 0);
+            if (!cq) {
+                std::cerr << "Failed to create completion queue\n";
+                return -1;
+            }
+        }
+
+        // Pages land on the node of the CPU that first touches them, so the
+        // buffers are cleared from a CPU near the device
+        cpu_set_t saved;
+        bool restore = false;
+        if (numa_placement != NUMA_NONE) {
+            restore = numa_placement == NUMA_MEMORY &&
+                      pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) == 0;
+            if (pinToDevice(conn_id->verbs) == 0) {
+                LOG_INFO("Placing buffers on NUMA node %d", deviceNumaNode(conn_id->verbs));
+            } else {
+                restore = false;
+            }
+        }
+
+        size_t region_size = BUFFER_SIZE * 2 * queue_depth;
+        buffer = new char[region_size];
+        memset(buffer, 0, region_size);
+        rdma_buffer = new char[RDMA_REGION_SIZE];
+        memset(rdma_buffer, 0, RDMA_REGION_SIZE);
+
+        if (restore) {
+            pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+        }
+        recv_repost.reserve(queue_depth);
+        post_times.resize(queue_depth);
+
+        mr = ibv_reg_mr(pd, buffer, region_size, IBV_ACCESS_LOCAL_WRITE);
+        if (!mr) {
+            std::cerr << "Failed to register memory region\n";
+            return -1;
+        }
+        send_slots = buffer;
+        send_lkey = mr->lkey;
+
+        rdma_mr = ibv_reg_mr(pd, rdma_buffer, RDMA_REGION_SIZE,
+                             IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ);
+        if (!rdma_mr) {
+            std::cerr << "Failed to register RDMA buffer\n";
+            return -1;
+        }
+
+        credit_mr = ibv_reg_mr(pd, credit_box, sizeof(*credit_box),
+                               IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+        if (!credit_mr) {
+            std::cerr << "Failed to register credit mailbox\n";
+            return -1;
+        }
+        credit_lkey = credit_mr->lkey;
+
+        // Pool and cached user buffers are local sources and READ targets,
+        // and the sources the server pulls rendezvous messages from
+        if (!shared) {
+            pool = new RegisteredPool(pd, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+            mr_cache = new MRCache(pd, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+        }
+
+        // RDMA READs need outstanding read credits on both sides
+        struct ibv_device_attr dev_attr;
+        if (ibv_query_device(conn_id->verbs, &dev_attr)) {
+            std::cerr << "Failed to query device\n";
+            return -1;
+        }
+        initiator_depth = std::min((int)MAX_RD_ATOMIC, dev_attr.max_qp_init_rd_atom);
+        responder_resources = std::min((int)MAX_RD_ATOMIC, dev_attr.max_qp_rd_atom);
+        atomic_cap = dev_attr.atomic_cap;
+
+        struct ibv_qp_init_attr qp_attr;
+        memset(&qp_attr, 0, sizeof(qp_attr));
+        qp_attr.send_cq = cq;
+        qp_attr.recv_cq = cq;
+        qp_attr.qp_type = IBV_QPT_RC;
+        qp_attr.cap.max_send_wr = queue_depth;
+        qp_attr.cap.max_recv_wr = queue_depth;
+        qp_attr.cap.max_send_sge = 2;
+        qp_attr.cap.max_recv_sge = 1;
+        qp_attr.cap.max_inline_data = MAX_INLINE_DATA;
+
+        ret = createQueuePair(conn_id, pd, &qp_attr);
+        if (ret) {
+            std::cerr << "Failed to create queue pair\n";
+            return ret;
+        }
+        if (shared && shared->attach(conn_id->qp->qp_num)) {
+            return -1;
+        }
+
+        qp = conn_id->qp;
+        max_inline = qp_attr.cap.max_inline_data;
+        LOG_INFO("Inline send threshold: %u bytes", max_inline);
+
+        return 0;
+    }
+
+    // Registration covering a local buffer that is already registered: the
+    // window or the pool
+    struct ibv_mr *findRegisteredMR(const void *local_buf, size_t len) {
+        const char *local = (const char *)local_buf;
+        if (local >= rdma_buffer && len <= RDMA_REGION_SIZE &&
+            local - rdma_buffer <= (ptrdiff_t)(RDMA_REGION_SIZE - len)) {
+            return rdma_mr;
+        }
+        return pool ? pool->findMR(local_buf, len) : nullptr;
+    }
+
+    // Registration covering any local buffer: the window, the pool, or the MR
+    // cache (which registers the buffer on its first use)
+    struct ibv_mr *findLocalMR(const void *local_buf, size_t len) {
+        struct ibv_mr *local_mr = findRegisteredMR(local_buf, len);
+        if (!local_mr) {
+            local_mr = mr_cache->lookup(local_buf, len);
+        }
+        return local_mr;
+    }
+
+    // Append the frames of one message to send_segments
+    int queueMessage(const char *data, size_t len, uint32_t lkey = 0, void *owner = nullptr) {
+        ThreadStats *stats = threadStats();
+        stats->count(STAT_MSGS_SENT);
+        stats->count(STAT_BYTES_SENT, len);
+        return queueFrames(&send_segments, data, len, lkey, owner);
+    }
+
+    // Hooks of the framing engine
+    int progress(bool wait) {
+        return pollCompletions(wait);
+    }
+
+    int repostReceives() {
+        return flushRecvSlots(true);
+    }
+
+    struct ibv_mr *registeredMR(const void *buf, size_t len) {
+        return findRegisteredMR(buf, len);
+    }
+
+    struct ibv_mr *localMR(const void *buf, size_t len) {
+        return findLocalMR(buf, len);
+    }
+
+    void releaseMR(const void *buf, size_t len) {
+        mr_cache->invalidate(buf, len);
+    }
+
+    // Rendezvous owners are sendBuffer() buffers from the pool
+    void releaseRendezvous(const char *, size_t, void *owner) {
+        pool->deallocate(owner);
+    }
+
+    void countCreditStall() {
+        poll_stats.credit_stalls++;
+        threadStats()->count(STAT_CREDIT_STALLS);
+    }
+
+    int postRdma(enum ibv_wr_opcode opcode, const RemoteBuffer& target, uint64_t remote_off,
+                 void *local_buf, size_t len, uint32_t imm) {
+        if (!conn_id || !rdma_mr || !target.rkey) {
+            std::cerr << "Connection or remote buffer not ready\n";
+            return -1;
+        }
+
+        if (remote_off > target.length || len > target.length - remote_off) {
+            std::cerr << "RDMA access outside the remote buffer\n";
+            return -1;
+        }
+
+        bool use_inline = opcode != IBV_WR_RDMA_READ && len <= max_inline;
+        uint32_t lkey = 0;
+        if (!use_inline) {
+            struct ibv_mr *local_mr = findLocalMR(local_buf, len);
+            if (!local_mr) {
+                return -1;
+            }
+            lkey = local_mr->lkey;
+        }
+
+        // The immediate value consumes one of the server's receives
+        bool consumes_recv = opcode == IBV_WR_RDMA_WRITE_WITH_IMM;
+        if (consumes_recv) {
+            int ret = waitForSendCredits(CONTROL_CREDITS + 1);
+            if (ret) {
+                return ret;
+            }
+        }
+
+        struct ibv_sge sge;
+        struct ibv_send_wr send_wr;
+
+        memset(&sge, 0, sizeof(sge));
+        sge.addr = (uintptr_t)local_buf;
+        sge.length = len;
+        sge.lkey = lkey;
+
+        memset(&send_wr, 0, sizeof(send_wr));
+        send_wr.sg_list = &sge;
+        send_wr.num_sge = len ? 1 : 0;
+        send_wr.opcode = opcode;
+        send_wr.wr.rdma.remote_addr = target.addr + remote_off;
+        send_wr.wr.rdma.rkey = target.rkey;
+        if (opcode == IBV_WR_RDMA_WRITE_WITH_IMM) {
+            send_wr.imm_data = htonl(imm);
+        }
+
+        send_wr.send_flags = use_inline ? IBV_SEND_INLINE : 0;
+
+        // One-sided operations are always signaled so callers can wait for
+        // them
+        int ret = postSignaled(&send_wr, opcode == IBV_WR_RDMA_READ ? WR_KIND_READ : WR_KIND_WRITE);
+        if (ret == 0 && consumes_recv) {
+            frames_sent++;
+        }
+        return ret;
+    }
+
+    // Atomics share the send queue and its READ credits with postRdma, and
+    // are always signaled so their result can be waited for
+    int postAtomic(enum ibv_wr_opcode opcode, uint64_t remote_off, uint64_t compare_add,
+                   uint64_t swap, uint64_t *result) {
+        if (!conn_id || !atomics.rkey) {
+            std::cerr << "Server has no atomic table\n";
+            return -1;
+        }
+        if (atomic_cap == IBV_ATOMIC_NONE) {
+            std::cerr << "Device does not support atomic operations\n";
+            return -1;
+        }
+        if (remote_off % sizeof(uint64_t) || (uintptr_t)result % sizeof(uint64_t)) {
+            std::cerr << "Atomic operations need 8-byte aligned addresses\n";
+            return -1;
+        }
+        if (atomics.length < sizeof(uint64_t) || remote_off > atomics.length - sizeof(uint64_t)) {
+            std::cerr << "Atomic access outside the atomic table\n";
+            return -1;
+        }
+
+        struct ibv_mr *local_mr = findLocalMR(result, sizeof(*result));
+        if (!local_mr) {
+            return -1;
+        }
+
+        struct ibv_sge sge;
+        struct ibv_send_wr send_wr;
+
+        memset(&sge, 0, sizeof(sge));
+        sge.addr = (uintptr_t)result;
+        sge.length = sizeof(*result);
+        sge.lkey = local_mr->lkey;
+
+        memset(&send_wr, 0, sizeof(send_wr));
+        send_wr.sg_list = &sge;
+        send_wr.num_sge = 1;
+        send_wr.opcode = opcode;
+        send_wr.wr.atomic.remote_addr = atomics.addr + remote_off;
+        send_wr.wr.atomic.compare_add = compare_add;
+        send_wr.wr.atomic.swap = swap;
+        send_wr.wr.atomic.rkey = atomics.rkey;
+        return postSignaled(&send_wr, WR_KIND_ATOMIC);
+    }
+
+    // Registered word the blocking atomics return their result through
+    uint64_t *atomicWord() {
+        if (!atomic_word) {
+            atomic_word = (uint64_t *)allocBuffer(sizeof(uint64_t));
+            if (!atomic_word) {
+                std::cerr << "No buffer for atomic results\n";
+            }
+        }
+        return atomic_word;
+    }
+
+    int finishAtomic(int ret, const uint64_t *word, uint64_t *out) {
+        if (ret == 0) {
+            ret = flushSends();
+        }
+        if (ret == 0 && out) {
+            *out = *word;
+        }
+        return ret;
+    }
+
+    char *recvSlot(uint32_t slot) {
+        return buffer + BUFFER_SIZE * (queue_depth + slot);
+    }
+
+    // Poll up to max completions, waiting according to completion_mode until
+    // at least one is available
+    int waitForCompletions(struct ibv_wc *wc, int max) {
+        int n = pollCQ(wc, max);
+        if (n != 0) {
+            return n;
+        }
+
+        if (completion_mode != COMPLETION_EVENT) {
+            std::chrono::steady_clock::time_point deadline =
+                std::chrono::steady_clock::now() + std::chrono::microseconds(spin_budget_us);
+            do {
+                n = pollCQ(wc, max);
+                if (n != 0) {
+                    return n;
+                }
+            } while (completion_mode == COMPLETION_BUSY_POLL ||
+                     std::chrono::steady_clock::now() < deadline);
+        }
+
+        // A shared CQ has one notification request for all of its clients
+        CQNotifier& events = shared ? shared->cq_events : cq_events;
+        for (;;) {
+            if (events.arm(cq)) {
+                return -1;
+            }
+            n = pollCQ(wc, max);
+            if (n != 0) {
+                return n;
+            }
+
+            if (events.consume(comp_chan, cq)) {
+                std::cerr << "Failed to get completion event\n";
+                return -1;
+            }
+            n = pollCQ(wc, max);
+            if (n != 0) {
+                return n;
+            }
+        }
+    }
+
+    int pollCQ(struct ibv_wc *wc, int max) {
+        int n = shared ? shared->poll(conn_id->qp->qp_num, wc, max) : ibv_poll_cq(cq, max, wc);
+        if (n < 0) {
+            std::cerr << "Failed to poll completion queue\n";
+            return n;
+        }
+
+        ThreadStats *stats = threadStats();
+        stats->count(STAT_CQ_POLLS);
+        poll_stats.polls++;
+        poll_stats.batch_hist[n]++;
+        if (n == 0) {
+            stats->count(STAT_EMPTY_POLLS);
+            poll_stats.empty_polls++;
+        } else {
+            stats->count(STAT_COMPLETIONS, n);
+            poll_stats.completions += n;
+            poll_stats.max_batch = std::max(poll_stats.max_batch, n);
+        }
+        return n;
+    }
+
+    // Drain a batch of completions and route each one to the handler for its
+    // work request kind. Every failed completion is reported; -1 is returned
+    // if any of them failed. Without wait, returns at once if the CQ is empty.
+    int pollCompletions(bool wait = true) {
+        struct ibv_wc wc[CQ_POLL_BATCH];
+        int ret = 0;
+
+        int n = wait ? waitForCompletions(wc, CQ_POLL_BATCH) : pollCQ(wc, CQ_POLL_BATCH);
+        if (n < 0) {
+            return -1;
+        }
+
+        uint64_t now = n > 0 ? statsNowNs() : 0;
+        for (int i = 0; i < n; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                reportCompletionError(wc[i]);
+                ret = -1;
+            }
+
+            switch (wrIdKind(wc[i].wr_id)) {
+                case WR_KIND_SEND:
+                case WR_KIND_READ:
+                case WR_KIND_WRITE:
+                case WR_KIND_ATOMIC:
+                    // Send-queue completions return the credits of every WR
+                    // they retire
+                    if (retireSends(wc[i], threadStats(), now)) {
+                        ret = -1;
+                    }
+                    break;
+                case WR_KIND_RECV:
+                    if (handleRecvCompletion(wc[i])) {
+                        ret = -1;
+                    }
+                    break;
+                default:
+                    std::cerr << "Completion with unknown wr_id " << wc[i].wr_id << "\n";
+                    ret = -1;
+                    break;
+            }
+        }
+
+        if (!loaned_sends.empty()) {
+            releaseSentBuffers();
+        }
+        return ret;
+    }
+
+    // Send-queue work requests complete in order, so every buffer handed to
+    // sendBuffer() whose last WR is no longer outstanding can be reused
+    void releaseSentBuffers() {
+        uint64_t retired = sends_posted - send_outstanding;
+        while (!loaned_sends.empty() && loaned_sends.front().first <= retired) {
+            pool->deallocate(loaned_sends.front().second);
+            loaned_sends.pop_front();
+        }
+    }
+
+    void reportCompletionError(const struct ibv_wc& wc) {
+        ThreadStats *stats = threadStats();
+        stats->count(STAT_ERRORS);
+        if (wc.status == IBV_WC_RNR_RETRY_EXC_ERR) {
+            stats->count(STAT_RNR_ERRORS);
+        }
+        poll_stats.errors++;
+        std::cerr << "Work completion failed: " << wrKindName(wrIdKind(wc.wr_id))
+                  << " wr_id=" << wc.wr_id << " qp=" << wc.qp_num
+                  << " status=" << ibv_wc_status_str(wc.status)
+                  << " vendor_err=" << wc.vendor_err << "\n";
+    }
+
+    // Receive completions are queued for receiveMessage, except DONE frames:
+    // those are consumed here so that rendezvous sources are released while
+    // the caller waits in a send, and
+    // their slot is re-posted and credited at once so the server's reserved
+    // credit comes straight back. Credits carried by any frame apply now.
+    int handleRecvCompletion(const struct ibv_wc& wc) {
+        uint32_t slot = wrIdValue(wc.wr_id);
+        MessageHeader header;
+
+        if (wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV &&
+            unpackHeader(recvSlot(slot), wc.byte_len, &header) == 0) {
+            if (applyFrameHeader(header) == FRAME_DONE) {
+                recv_repost.push_back(slot);
+                return flushRecvSlots(true);
+            }
+        }
+
+        recv_pending.push_back(wc);
+        return 0;
+    }
+
+    // Hand a slot back to the ring; re-post in batches to save doorbells
+    int releaseRecvSlot(uint32_t slot) {
+        recv_repost.push_back(slot);
+        if (recv_repost.size() >= RECV_REPOST_BATCH) {
+            return flushRecvSlots(false);
+        }
+        return 0;
+    }
+
+    // Re-post every released slot and return the credits they represent,
+    // immediately with force or otherwise once half the ring piled up
+    int flushRecvSlots(bool force) {
+        if (!recv_repost.empty()) {
+            int ret = postReceives(recv_repost.data(), recv_repost.size());
+            if (ret) {
+                return ret;
+            }
+            recv_posted += recv_repost.size();
+            recv_repost.clear();
+        }
+        return returnCredits(force);
+    }
+
+    // Post the given receive slots as chained ibv_recv_wr lists of up to
+    // POST_BATCH entries
+    int postReceives(const uint32_t *slots, size_t count) {
+        struct ibv_sge sge[POST_BATCH];
+        struct ibv_recv_wr recv_wr[POST_BATCH], *bad_wr;
+
+        for (size_t base = 0; base < count; base += POST_BATCH) {
+            size_t n = std::min(count - base, (size_t)POST_BATCH);
+            for (size_t i = 0; i < n; i++) {
+                memset(&sge[i], 0, sizeof(sge[i]));
+                sge[i].addr = (uintptr_t)recvSlot(slots[base + i]);
+                sge[i].length = BUFFER_SIZE;
+                sge[i].lkey = mr->lkey;
+
+                memset(&recv_wr[i], 0, sizeof(recv_wr[i]));
+                recv_wr[i].wr_id = makeWrId(WR_KIND_RECV, slots[base + i]);
+                recv_wr[i].sg_list = &sge[i];
+                recv_wr[i].num_sge = 1;
+                recv_wr[i].next = (i + 1 < n) ? &recv_wr[i + 1] : nullptr;
+            }
+
+            int ret = ibv_post_recv(conn_id->qp, recv_wr, &bad_wr);
+            if (ret) {
+                std::cerr << "Failed to post receive\n";
+                return ret;
+            }
+        }
+        return 0;
+    }
+
+    // Pre-post every receive slot so the peer never hits an empty receive
+    // queue; the whole ring is the server's initial credit
+    int postReceiveRing() {
+        std::vector<uint32_t> slots(queue_depth);
+        for (int i = 0; i < queue_depth; i++) {
+            slots[i] = i;
+        }
+        recv_repost.clear();
+        recv_granted = queue_depth;
+        recv_posted = queue_depth;
+        recv_advertised = queue_depth;
+        return postReceives(slots.data(), slots.size());
+    }
+
+    void cleanup() {
+        if (shared) {
+            // Loaned buffers belong to the shared pool
+            while (!loaned_sends.empty()) {
+                pool->deallocate(loaned_sends.front().second);
+                loaned_sends.pop_front();
+            }
+            if (conn_id && conn_id->qp) shared->detach(conn_id->qp->qp_num);
+        }
+        // Buffers still on loan go away with the pool
+        loaned_sends.clear();
+        if (atomic_word && pool) {
+            pool->deallocate(atomic_word);
+            atomic_word = nullptr;
+        }
+        if (conn_id && conn_id->qp) rdma_destroy_qp(conn_id);
+        // The server can no longer read the rendezvous sources
+        dropRendezvous();
+        if (!shared) {
+            delete mr_cache;
+            delete pool;
+        }
+        if (credit_mr) ibv_dereg_mr(credit_mr);
+        if (rdma_mr) ibv_dereg_mr(rdma_mr);
+        if (mr) ibv_dereg_mr(mr);
+        if (!shared) {
+            cq_events.release(cq);
+            if (cq) ibv_destroy_cq(cq);
+            if (comp_chan) ibv_destroy_comp_channel(comp_chan);
+            if (pd) ibv_dealloc_pd(pd);
+        }
+        if (conn_id) rdma_destroy_id(conn_id);
+        if (ec) rdma_destroy_event_channel(ec);
+    }
+};
+
+#endif
@@ -0,0 +1,244 @@
+#ifndef RDMA_COMMON_H
+#define RDMA_COMMON_H
+
+#include <rdma/rdma_cma.h>
+#include <string>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <endian.h>
+#include <arpa/inet.h>
+
+#include "stats.h"
+
+// Wire formats and work request bookkeeping shared by the RDMA client and
+// server: the connection handshake, frame headers and credit mailboxes, and
+// the wr_id encoding used on both sides of a QP.
+
+// How callers wait for work completions on the CQ
+enum CompletionMode {
+    COMPLETION_BUSY_POLL,   // spin on ibv_poll_cq; lowest latency, one core per CQ
+    COMPLETION_EVENT,       // arm the CQ and sleep on the completion channel
+    COMPLETION_ADAPTIVE     // spin for spin_budget_us, then sleep on the channel
+};
+
+static inline int parseCompletionMode(const char *name, CompletionMode *mode) {
+    if (strcmp(name, "poll") == 0) {
+        *mode = COMPLETION_BUSY_POLL;
+    } else if (strcmp(name, "event") == 0) {
+        *mode = COMPLETION_EVENT;
+    } else if (strcmp(name, "adaptive") == 0) {
+        *mode = COMPLETION_ADAPTIVE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// wr_id layout: bits 63-56 hold the work request kind, bits 31-0 hold the
+// receive slot index or, for signaled send-queue WRs, the number of WRs
+// that the completion retires
+enum WorkRequestKind {
+    WR_KIND_SEND = 1,
+    WR_KIND_RECV = 2,
+    WR_KIND_READ = 3,
+    WR_KIND_WRITE = 4,
+    WR_KIND_ATOMIC = 5
+};
+
+static inline uint64_t makeWrId(WorkRequestKind kind, uint32_t value) {
+    return ((uint64_t)kind << 56) | value;
+}
+
+static inline WorkRequestKind wrIdKind(uint64_t wr_id) {
+    return (WorkRequestKind)(wr_id >> 56);
+}
+
+static inline uint32_t wrIdValue(uint64_t wr_id) {
+    return (uint32_t)wr_id;
+}
+
+static inline const char *wrKindName(WorkRequestKind kind) {
+    switch (kind) {
+        case WR_KIND_SEND:  return "send";
+        case WR_KIND_RECV:  return "recv";
+        case WR_KIND_READ:  return "read";
+        case WR_KIND_WRITE: return "write";
+        case WR_KIND_ATOMIC: return "atomic";
+    }
+    return "unknown";
+}
+
+// Histogram that times a send-queue WR kind from post to completion
+static inline int wrKindLatency(WorkRequestKind kind) {
+    switch (kind) {
+        case WR_KIND_SEND:  return STAT_LAT_SEND;
+        case WR_KIND_READ:  return STAT_LAT_READ;
+        case WR_KIND_WRITE: return STAT_LAT_WRITE;
+        case WR_KIND_ATOMIC: return STAT_LAT_ATOMIC;
+        default:            return -1;
+    }
+}
+
+// Batch-size statistics gathered by the completion dispatcher
+struct PollStats {
+    static const int MAX_BATCH = 16;
+    uint64_t polls;
+    uint64_t empty_polls;
+    uint64_t completions;
+    uint64_t errors;
+    uint64_t credit_stalls;
+    int max_batch;
+    uint64_t batch_hist[MAX_BATCH + 1];
+};
+
+// Descriptor of a remotely accessible buffer, exchanged in the CM private
+// data of rdma_connect/rdma_accept. Fields travel in network byte order.
+struct RemoteBuffer {
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t length;
+};
+
+static inline void packRemoteRange(const void *addr, uint32_t rkey, uint32_t length,
+                            RemoteBuffer *wire) {
+    wire->addr = htobe64((uintptr_t)addr);
+    wire->rkey = htonl(rkey);
+    wire->length = htonl(length);
+}
+
+static inline void packRemoteBuffer(const struct ibv_mr *mr, RemoteBuffer *wire) {
+    packRemoteRange(mr->addr, mr->rkey, (uint32_t)mr->length, wire);
+}
+
+static inline int unpackRemoteBuffer(const void *private_data, size_t len, RemoteBuffer *remote) {
+    RemoteBuffer wire;
+
+    if (!private_data || len < sizeof(wire)) {
+        return -1;
+    }
+
+    memcpy(&wire, private_data, sizeof(wire));
+    remote->addr = be64toh(wire.addr);
+    remote->rkey = ntohl(wire.rkey);
+    remote->length = ntohl(wire.length);
+    return 0;
+}
+
+// Every SEND starts with a MessageHeader (network byte order). Messages that
+// do not fit one receive slot are split into FRAME_DATA segments tagged with
+// their offset; messages at or above the rendezvous threshold are announced
+// by a FRAME_RTS whose payload is a RemoteBuffer the receiver pulls with one
+// RDMA READ and acknowledges with a FRAME_DONE.
+enum FrameType {
+    FRAME_DATA = 1,
+    FRAME_RTS = 2,
+    FRAME_DONE = 3
+};
+
+struct MessageHeader {
+    uint32_t msg_len;   // length of the whole message
+    uint32_t offset;    // offset of this segment within the message
+    uint32_t msg_id;
+    uint32_t credits;   // receives the sender has posted for us so far
+    uint16_t type;
+    uint16_t reserved;
+};
+
+static inline void packHeader(FrameType type, uint32_t msg_id, uint32_t msg_len,
+                              uint32_t offset, MessageHeader *wire) {
+    wire->msg_len = htonl(msg_len);
+    wire->offset = htonl(offset);
+    wire->msg_id = htonl(msg_id);
+    wire->credits = 0;
+    wire->type = htons((uint16_t)type);
+    wire->reserved = 0;
+}
+
+static inline int unpackHeader(const char *frame, size_t len, MessageHeader *header) {
+    if (len < sizeof(*header)) {
+        return -1;
+    }
+
+    memcpy(header, frame, sizeof(*header));
+    header->msg_len = ntohl(header->msg_len);
+    header->offset = ntohl(header->offset);
+    header->msg_id = ntohl(header->msg_id);
+    header->credits = ntohl(header->credits);
+    header->type = ntohs(header->type);
+    return 0;
+}
+
+// Credit-based flow control. Each side counts the receives it has posted for
+// its peer since the connection was set up and advertises the running total:
+// in the credits field of every frame it sends, and by RDMA WRITE into the
+// peer's CreditBox mailbox when no frame is going out. A sender may have at
+// most (advertised total - frames sent) frames in flight, so a SEND never
+// finds the peer without a posted receive. Totals wrap modulo 2^32.
+struct CreditBox {
+    uint32_t mailbox;   // written by the peer
+    uint32_t shadow;    // source of our own credit writes
+    char pad[56];
+};
+
+static inline bool creditsNewer(uint32_t total, uint32_t current) {
+    return (int32_t)(total - current) > 0;
+}
+
+// CM private data of rdma_connect/rdma_accept: the buffer open for one-sided
+// access, the CreditBox mailbox for returned credits, the number of
+// receives initially posted for the peer and the table open for atomic
+// operations (empty unless the server has one). Fields travel in network
+// byte order. At 56 bytes this is all the private data an InfiniBand
+// connect request can carry; peers that send no atomic table are accepted.
+struct ConnectionInfo {
+    RemoteBuffer window;
+    RemoteBuffer mailbox;
+    uint32_t credits;
+    uint32_t reserved;
+    RemoteBuffer atomics;
+};
+
+static inline void packConnectionInfo(const struct ibv_mr *window_mr, const CreditBox *box,
+                               uint32_t mailbox_rkey, uint32_t credits,
+                               const struct ibv_mr *atomic_mr, ConnectionInfo *wire) {
+    packRemoteBuffer(window_mr, &wire->window);
+    packRemoteRange(&box->mailbox, mailbox_rkey, sizeof(box->mailbox), &wire->mailbox);
+    wire->credits = htonl(credits);
+    wire->reserved = 0;
+    if (atomic_mr) {
+        packRemoteBuffer(atomic_mr, &wire->atomics);
+    } else {
+        memset(&wire->atomics, 0, sizeof(wire->atomics));
+    }
+}
+
+static inline int unpackConnectionInfo(const void *private_data, size_t len, ConnectionInfo *info) {
+    const char *data = (const char *)private_data;
+
+    if (!private_data || len < offsetof(ConnectionInfo, atomics) ||
+        unpackRemoteBuffer(data, sizeof(RemoteBuffer), &info->window) ||
+        unpackRemoteBuffer(data + sizeof(RemoteBuffer), sizeof(RemoteBuffer), &info->mailbox)) {
+        return -1;
+    }
+
+    memcpy(&info->credits, data + offsetof(ConnectionInfo, credits), sizeof(info->credits));
+    info->credits = ntohl(info->credits);
+    info->reserved = 0;
+    if (unpackRemoteBuffer(data + offsetof(ConnectionInfo, atomics),
+                           len - offsetof(ConnectionInfo, atomics), &info->atomics)) {
+        memset(&info->atomics, 0, sizeof(info->atomics));
+    }
+    return 0;
+}
+
+// Printable form of a message payload for console output
+static inline std::string previewPayload(const char *data, size_t len) {
+    static const size_t PREVIEW_LIMIT = 64;
+    if (len <= PREVIEW_LIMIT) {
+        return std::string(data, len);
+    }
+    return std::string(data, PREVIEW_LIMIT) + "... (" + std::to_string(len) + " bytes)";
+}
+
+#endif
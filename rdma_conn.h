@@ -0,0 +1,692 @@
+#ifndef RDMA_CONN_H
+#define RDMA_CONN_H
+
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+#include <iostream>
+#include <cstring>
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include "rdma_common.h"
+#include "stats.h"
+
+// Create the QP of id, asking for attr->cap.max_inline_data first. Not every
+// device supports inline data, so on failure it falls back to DMA sends.
+// rdma_create_qp reports the capabilities the device actually granted in
+// attr->cap, the inline size included.
+static inline int createQueuePair(struct rdma_cm_id *id, struct ibv_pd *pd,
+                                  struct ibv_qp_init_attr *attr) {
+    int ret = rdma_create_qp(id, pd, attr);
+    if (ret && attr->cap.max_inline_data) {
+        attr->cap.max_inline_data = 0;
+        ret = rdma_create_qp(id, pd, attr);
+    }
+    return ret;
+}
+
+// Event state of a CQ that reports through a completion channel. An armed
+// CQ raises an event only for completions that arrive after arming, so
+// callers arm(), poll the CQ once more and only then wait on the channel.
+// Acking takes a mutex in libibverbs, so events are acked in batches;
+// release() acks the rest before the CQ is destroyed.
+struct CQNotifier {
+    static const unsigned int ACK_BATCH = 16;
+
+    bool armed;
+    unsigned int unacked;
+
+    CQNotifier() : armed(false), unacked(0) {}
+
+    int arm(struct ibv_cq *cq) {
+        if (!armed) {
+            if (ibv_req_notify_cq(cq, 0)) {
+                std::cerr << "Failed to arm completion queue\n";
+                return -1;
+            }
+            armed = true;
+        }
+        return 0;
+    }
+
+    // Take the next event off the channel; -1 with errno set if there is
+    // none (EAGAIN on a non-blocking channel)
+    int consume(struct ibv_comp_channel *chan, struct ibv_cq *cq) {
+        struct ibv_cq *ev_cq;
+        void *ev_ctx;
+        if (ibv_get_cq_event(chan, &ev_cq, &ev_ctx)) {
+            return -1;
+        }
+        armed = false;
+        if (++unacked >= ACK_BATCH) {
+            ibv_ack_cq_events(cq, unacked);
+            unacked = 0;
+        }
+        return 0;
+    }
+
+    void release(struct ibv_cq *cq) {
+        if (cq && unacked) {
+            ibv_ack_cq_events(cq, unacked);
+        }
+        armed = false;
+        unacked = 0;
+    }
+};
+
+// One SEND on the wire: a frame header followed by up to one segment of
+// payload. A non-zero lkey means the payload is registered and can be
+// gathered by the HCA instead of being copied next to the header.
+struct Segment {
+    MessageHeader header;
+    const char *payload;
+    uint32_t len;
+    uint32_t lkey;
+};
+
+// The framed SEND protocol of one RC queue pair, as spoken by both ends:
+// segmentation, send credits and their return through the peer's mailbox,
+// selective signaling, reassembly and the READ rendezvous for large
+// messages. RDMAClient and the server's RDMAConnection build on it and
+// supply the parts that differ between them: how completions are polled,
+// how receives are re-posted and where local registrations come from.
+//
+// Every call that waits goes through progress(). Once progress() fails the
+// channel may already have been destroyed, so callers return at once
+// without touching it again.
+class FramedChannel {
+public:
+    static const size_t BUFFER_SIZE = 4096;
+
+    // Payload carried by one segment. At most POST_BATCH work requests are
+    // chained into one post. The last credit towards the peer is kept for
+    // DONE frames, which release the peer's rendezvous buffers even while it
+    // has no other credits left.
+    static const size_t SEGMENT_SIZE = BUFFER_SIZE - sizeof(MessageHeader);
+    static const int POST_BATCH = 16;
+    static const uint32_t CONTROL_CREDITS = 1;
+
+    // Send side: queue_depth staging slots of BUFFER_SIZE at send_slots, one
+    // per send queue entry
+    struct ibv_qp *qp;
+    char *send_slots;
+    uint32_t send_lkey;
+    int queue_depth;
+    int signal_interval;
+    uint32_t max_inline;
+    uint64_t send_head;
+    int send_outstanding;
+    int send_unsignaled;
+    uint64_t sends_posted;
+    PostTimes post_times;
+
+    // Credits: frames the peer has posted receives for (peer_credits, from
+    // frame headers and our mailbox) and receives we have posted for it,
+    // returned by frame headers or by a WRITE into credit_remote. Updates
+    // are batched to half of the recv_granted receives promised to the peer.
+    CreditBox *credit_box;
+    uint32_t credit_lkey;
+    RemoteBuffer credit_remote;
+    uint32_t peer_credits;
+    uint32_t frames_sent;
+    uint32_t recv_granted;
+    uint32_t recv_posted;
+    uint32_t recv_advertised;
+    bool credit_update_pending;
+
+    // A rendezvous message whose RTS is out and whose DONE has not arrived,
+    // so the peer may still be reading data. buffer goes back through
+    // releaseRendezvous() then; it is nullptr when the caller kept the memory
+    // and waits for the DONE itself.
+    struct PendingRendezvous {
+        uint32_t msg_id;
+        const char *data;
+        size_t len;
+        void *buffer;
+    };
+
+    // Messages
+    size_t rendezvous_threshold;
+    uint32_t next_msg_id;
+    std::deque<PendingRendezvous> rendezvous_pending;
+    uint32_t rendezvous_borrowed;
+    uint64_t reads_completed;
+    std::vector<char> reassembly;
+    uint32_t reassembled;
+
+    FramedChannel() : qp(nullptr), send_slots(nullptr), send_lkey(0), queue_depth(0),
+                      signal_interval(1), max_inline(0), send_head(0), send_outstanding(0),
+                      send_unsignaled(0), sends_posted(0), credit_box(nullptr), credit_lkey(0),
+                      peer_credits(0), frames_sent(0), recv_granted(0), recv_posted(0),
+                      recv_advertised(0), credit_update_pending(false),
+                      rendezvous_threshold(SIZE_MAX), next_msg_id(1), rendezvous_borrowed(0),
+                      reads_completed(0), reassembled(0) {
+        memset(&credit_remote, 0, sizeof(credit_remote));
+    }
+
+    virtual ~FramedChannel() {}
+
+    // Append the frames of one message to *segments. A rendezvous message
+    // first flushes the segments queued before it, so messages stay in order
+    // on the wire, and is then advertised without waiting for the peer to
+    // pull it. A non-null owner is the buffer holding data; the channel takes
+    // it over for a rendezvous and hands it to releaseRendezvous() once the
+    // peer is done with it or the channel is torn down.
+    int queueFrames(std::vector<Segment> *segments, const char *data, size_t len,
+                    uint32_t lkey = 0, void *owner = nullptr) {
+        if (len > UINT32_MAX) {
+            std::cerr << "Message of " << len << " bytes is too large\n";
+            if (owner) {
+                releaseRendezvous(data, len, owner);
+            }
+            return -1;
+        }
+
+        if (len >= rendezvous_threshold) {
+            // Recorded before anything is posted: a failed post may tear the
+            // channel down, and teardown releases what is still pending
+            uint32_t msg_id = holdRendezvous(data, len, owner);
+            int ret = postSegments(segments->data(), segments->size());
+            segments->clear();
+            return ret ? ret : sendRendezvous(msg_id, data, len);
+        }
+
+        // Multi-segment payloads that are already registered are gathered
+        // straight from the caller's memory
+        if (lkey == 0 && len > SEGMENT_SIZE) {
+            struct ibv_mr *payload_mr = registeredMR(data, len);
+            if (payload_mr) {
+                lkey = payload_mr->lkey;
+            }
+        }
+
+        uint32_t msg_id = next_msg_id++;
+        size_t offset = 0;
+        do {
+            size_t chunk = len - offset;
+            Segment seg;
+            seg.len = (uint32_t)(chunk < SEGMENT_SIZE ? chunk : SEGMENT_SIZE);
+            seg.payload = data + offset;
+            seg.lkey = lkey;
+            packHeader(FRAME_DATA, msg_id, (uint32_t)len, (uint32_t)offset, &seg.header);
+            segments->push_back(seg);
+            offset += seg.len;
+        } while (offset < len);
+        return 0;
+    }
+
+    // Post segments as chained SENDs. Only every signal_interval-th WR and the
+    // last WR of each post are signaled, and the call only blocks when the
+    // send queue has no free entries left, or, with wait_gathered, until
+    // gathered payloads have been sent so the caller may reuse them.
+    int postSegments(Segment *segs, size_t count_total, bool control = false,
+                     bool wait_gathered = true) {
+        if (!qp || !send_slots) {
+            std::cerr << "Connection or memory region not ready\n";
+            return -1;
+        }
+
+        uint32_t reserve = control ? 0 : CONTROL_CREDITS;
+
+        struct ibv_sge sge[POST_BATCH][2];
+        struct ibv_send_wr send_wr[POST_BATCH], *bad_wr;
+        bool gathered = false;
+        size_t next = 0;
+
+        while (next < count_total) {
+            while (send_outstanding >= queue_depth) {
+                if (progress(true)) {
+                    return -1;
+                }
+            }
+
+            if (waitForSendCredits(reserve + 1)) {
+                return -1;
+            }
+
+            size_t count = std::min(count_total - next,
+                                    (size_t)std::min(queue_depth - send_outstanding, (int)POST_BATCH));
+            count = std::min(count, (size_t)(sendCredits() - reserve));
+            int signaled = 0;
+            for (size_t i = 0; i < count; i++) {
+                Segment& seg = segs[next + i];
+
+                // Every frame carries our receive credits to the peer
+                seg.header.credits = htonl(recv_posted);
+
+                memset(sge[i], 0, sizeof(sge[i]));
+                memset(&send_wr[i], 0, sizeof(send_wr[i]));
+
+                if (sizeof(seg.header) + seg.len <= max_inline) {
+                    // Small frames are copied into the WQE by the CPU, so
+                    // neither a staging copy nor a DMA read is needed
+                    sge[i][0].addr = (uintptr_t)&seg.header;
+                    sge[i][0].length = sizeof(seg.header);
+                    sge[i][1].addr = (uintptr_t)seg.payload;
+                    sge[i][1].length = seg.len;
+                    send_wr[i].num_sge = seg.len ? 2 : 1;
+                    send_wr[i].send_flags = IBV_SEND_INLINE;
+                } else {
+                    char *slot = send_slots + BUFFER_SIZE * (send_head++ % queue_depth);
+
+                    memcpy(slot, &seg.header, sizeof(seg.header));
+                    sge[i][0].addr = (uintptr_t)slot;
+                    sge[i][0].length = sizeof(seg.header);
+                    sge[i][0].lkey = send_lkey;
+
+                    if (seg.lkey) {
+                        sge[i][1].addr = (uintptr_t)seg.payload;
+                        sge[i][1].length = seg.len;
+                        sge[i][1].lkey = seg.lkey;
+                        send_wr[i].num_sge = 2;
+                        gathered = true;
+                    } else {
+                        memcpy(slot + sizeof(seg.header), seg.payload, seg.len);
+                        sge[i][0].length += seg.len;
+                        send_wr[i].num_sge = 1;
+                    }
+                }
+
+                send_wr[i].wr_id = makeWrId(WR_KIND_SEND, 0);
+                send_wr[i].sg_list = sge[i];
+                send_wr[i].opcode = IBV_WR_SEND;
+                send_wr[i].next = (i + 1 < count) ? &send_wr[i + 1] : nullptr;
+
+                // A signaled WR carries the number of WRs its completion retires
+                if (++send_unsignaled >= signal_interval || i + 1 == count) {
+                    send_wr[i].wr_id |= (uint32_t)send_unsignaled;
+                    send_wr[i].send_flags |= IBV_SEND_SIGNALED;
+                    send_unsignaled = 0;
+                    signaled++;
+                }
+            }
+
+            uint64_t posted_at = statsNowNs();
+            bad_wr = nullptr;
+            int ret = ibv_post_send(qp, send_wr, &bad_wr);
+            if (ret) {
+                std::cerr << "Failed to post send (qp " << qp->qp_num << ")\n";
+                // The WRs ahead of bad_wr were accepted and may still gather
+                // from their buffers, so they count as posted
+                size_t accepted = 0;
+                while (accepted < count && &send_wr[accepted] != bad_wr) {
+                    accepted++;
+                }
+                send_outstanding += accepted;
+                sends_posted += accepted;
+                return ret;
+            }
+            for (int i = 0; i < signaled; i++) {
+                post_times.push(posted_at);
+            }
+
+            send_outstanding += count;
+            sends_posted += count;
+            frames_sent += count;
+            recv_advertised = recv_posted;
+            next += count;
+        }
+
+        return gathered && wait_gathered ? flushSends() : 0;
+    }
+
+    // Wait until every posted send has completed
+    int flushSends() {
+        while (send_outstanding > 0) {
+            if (progress(true)) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    int sendControl(FrameType type, uint32_t msg_id, const void *payload, uint32_t len) {
+        Segment seg;
+        packHeader(type, msg_id, len, 0, &seg.header);
+        seg.payload = (const char *)payload;
+        seg.len = len;
+        seg.lkey = 0;
+        return postSegments(&seg, 1, type == FRAME_DONE);
+    }
+
+    // Frames the peer can take right now; picks up credits it returned
+    // through our mailbox
+    uint32_t sendCredits() {
+        uint32_t returned = *(volatile uint32_t *)&credit_box->mailbox;
+        if (creditsNewer(returned, peer_credits)) {
+            peer_credits = returned;
+        }
+        return peer_credits - frames_sent;
+    }
+
+    // Spin until the peer has posted receives for `needed` more frames.
+    // Credits written to the mailbox raise no completion, so this polls
+    // without sleeping whatever the completion mode. Our own released
+    // receives are re-posted first in case the peer is waiting for them.
+    int waitForSendCredits(uint32_t needed) {
+        if (sendCredits() >= needed) {
+            return 0;
+        }
+
+        countCreditStall();
+        if (repostReceives()) {
+            return -1;
+        }
+        while (sendCredits() < needed) {
+            if (progress(false)) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // Tell the peer how many receives we have posted for it by writing the
+    // running total into its mailbox; unlike a SEND this consumes none of
+    // its receives. Deferred to the next send completion when the send
+    // queue is full.
+    int returnCredits(bool force) {
+        uint32_t unadvertised = recv_posted - recv_advertised;
+        if (unadvertised == 0 || (!force && unadvertised < std::max(1u, recv_granted / 2))) {
+            return 0;
+        }
+        if (send_outstanding >= queue_depth) {
+            credit_update_pending = true;
+            return 0;
+        }
+
+        credit_box->shadow = recv_posted;
+
+        struct ibv_sge sge;
+        struct ibv_send_wr send_wr;
+
+        memset(&sge, 0, sizeof(sge));
+        sge.addr = (uintptr_t)&credit_box->shadow;
+        sge.length = sizeof(credit_box->shadow);
+        sge.lkey = credit_lkey;
+
+        memset(&send_wr, 0, sizeof(send_wr));
+        send_wr.sg_list = &sge;
+        send_wr.num_sge = 1;
+        send_wr.opcode = IBV_WR_RDMA_WRITE;
+        send_wr.send_flags = sge.length <= max_inline ? IBV_SEND_INLINE : 0;
+        send_wr.wr.rdma.remote_addr = credit_remote.addr;
+        send_wr.wr.rdma.rkey = credit_remote.rkey;
+
+        int ret = postSignaled(&send_wr, WR_KIND_WRITE);
+        if (ret) {
+            return ret;
+        }
+        recv_advertised = recv_posted;
+        credit_update_pending = false;
+        return 0;
+    }
+
+    // Record a rendezvous message in rendezvous_pending, where it stays
+    // until the peer has pulled it and answered with DONE
+    uint32_t holdRendezvous(const char *data, size_t len, void *owner) {
+        PendingRendezvous pending;
+        pending.msg_id = next_msg_id++;
+        pending.data = data;
+        pending.len = len;
+        pending.buffer = owner;
+        rendezvous_pending.push_back(pending);
+        if (!owner) {
+            rendezvous_borrowed++;
+        }
+        return pending.msg_id;
+    }
+
+    // Advertise a held message with an RTS and return without waiting for
+    // its DONE, so neither side waits for the other and RTS frames may cross
+    int sendRendezvous(uint32_t msg_id, const char *data, size_t len) {
+        struct ibv_mr *src_mr = localMR(data, len);
+        if (!src_mr) {
+            completeRendezvous(msg_id);
+            return -1;
+        }
+
+        RemoteBuffer source;
+        packRemoteRange(data, src_mr->rkey, (uint32_t)len, &source);
+        return sendControl(FRAME_RTS, msg_id, &source, sizeof(source));
+    }
+
+    // Wait until the peer has pulled every rendezvous message sent from
+    // memory the caller kept, so that it may be reused. Incoming frames keep
+    // being handled meanwhile.
+    int waitRendezvous() {
+        while (rendezvous_borrowed > 0) {
+            if (progress(true)) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // DONE for msg_id: the peer has its copy, so the source can go
+    void completeRendezvous(uint32_t msg_id) {
+        for (size_t i = 0; i < rendezvous_pending.size(); i++) {
+            PendingRendezvous pending = rendezvous_pending[i];
+            if (pending.msg_id != msg_id) {
+                continue;
+            }
+            rendezvous_pending.erase(rendezvous_pending.begin() + i);
+            if (pending.buffer) {
+                releaseRendezvous(pending.data, pending.len, pending.buffer);
+            } else {
+                rendezvous_borrowed--;
+            }
+            return;
+        }
+    }
+
+    // Hand back the buffers of rendezvous messages whose DONE never came.
+    // Only call this once the QP is destroyed: until then the peer may still
+    // read them.
+    void dropRendezvous() {
+        for (size_t i = 0; i < rendezvous_pending.size(); i++) {
+            const PendingRendezvous& pending = rendezvous_pending[i];
+            if (pending.buffer) {
+                releaseRendezvous(pending.data, pending.len, pending.buffer);
+            }
+        }
+        rendezvous_pending.clear();
+        rendezvous_borrowed = 0;
+    }
+
+    // Post one signaled one-sided work request once the send queue has a
+    // free entry. Its completion also retires the unsignaled sends before it.
+    int postSignaled(struct ibv_send_wr *send_wr, WorkRequestKind kind) {
+        while (send_outstanding >= queue_depth) {
+            if (progress(true)) {
+                return -1;
+            }
+        }
+
+        struct ibv_send_wr *bad_wr;
+        send_wr->wr_id = makeWrId(kind, (uint32_t)(send_unsignaled + 1));
+        send_wr->send_flags |= IBV_SEND_SIGNALED;
+        send_unsignaled = 0;
+
+        uint64_t posted_at = statsNowNs();
+        int ret = ibv_post_send(qp, send_wr, &bad_wr);
+        if (ret) {
+            std::cerr << "Failed to post " << wrKindName(kind) << " (qp " << qp->qp_num << ")\n";
+            return ret;
+        }
+        post_times.push(posted_at);
+
+        send_outstanding++;
+        sends_posted++;
+        return 0;
+    }
+
+    // RDMA READ of a peer buffer into local registered memory
+    int postRead(const RemoteBuffer& source, char *dst, uint32_t lkey) {
+        struct ibv_sge sge;
+        struct ibv_send_wr send_wr;
+
+        memset(&sge, 0, sizeof(sge));
+        sge.addr = (uintptr_t)dst;
+        sge.length = source.length;
+        sge.lkey = lkey;
+
+        memset(&send_wr, 0, sizeof(send_wr));
+        send_wr.sg_list = &sge;
+        send_wr.num_sge = 1;
+        send_wr.opcode = IBV_WR_RDMA_READ;
+        send_wr.wr.rdma.remote_addr = source.addr;
+        send_wr.wr.rdma.rkey = source.rkey;
+        return postSignaled(&send_wr, WR_KIND_READ);
+    }
+
+    // Retire the send-queue WRs covered by a completion. A send queue
+    // completes in order, so the completion belongs to the oldest signaled
+    // WR in flight, whose latency is recorded in stats.
+    int retireSends(const struct ibv_wc& wc, ThreadStats *stats, uint64_t now) {
+        WorkRequestKind kind = wrIdKind(wc.wr_id);
+        uint64_t posted_at = post_times.pop();
+        if (posted_at && wc.status == IBV_WC_SUCCESS) {
+            stats->latency[wrKindLatency(kind)].record(now - posted_at);
+        }
+
+        send_outstanding -= wrIdValue(wc.wr_id);
+        if (kind == WR_KIND_READ) {
+            reads_completed++;
+        }
+        return credit_update_pending ? returnCredits(true) : 0;
+    }
+
+    // Apply what a frame tells the sending side as soon as it arrives: the
+    // credits it carries and, for DONE, the end of one of our rendezvous
+    // messages. Returns the frame type.
+    int applyFrameHeader(const MessageHeader& header) {
+        if (creditsNewer(header.credits, peer_credits)) {
+            peer_credits = header.credits;
+        }
+        if (header.type == FRAME_DONE) {
+            completeRendezvous(header.msg_id);
+        }
+        return header.type;
+    }
+
+    // Apply one received frame. *data is set once a whole message is
+    // available: in place for single-segment messages, otherwise in the
+    // reassembly buffer.
+    int consumeFrame(const MessageHeader& header, const char *body, size_t body_len,
+                     const char **data, size_t *len) {
+        switch (header.type) {
+            case FRAME_DATA:
+                if (header.offset == 0 && body_len == header.msg_len) {
+                    *data = body;
+                    *len = body_len;
+                    return 0;
+                }
+
+                if (header.offset == 0) {
+                    reserveReassembly(header.msg_len);
+                    reassembled = 0;
+                }
+                if (header.msg_len != reassembly.size() || header.offset > header.msg_len ||
+                    body_len > header.msg_len - header.offset) {
+                    std::cerr << "Segment outside of message " << header.msg_id
+                              << " (qp " << qp->qp_num << ")\n";
+                    return -1;
+                }
+
+                memcpy(reassembly.data() + header.offset, body, body_len);
+                reassembled += body_len;
+                if (reassembled == header.msg_len) {
+                    *data = reassembly.data();
+                    *len = header.msg_len;
+                }
+                return 0;
+
+            case FRAME_RTS: {
+                RemoteBuffer source;
+                if (unpackRemoteBuffer(body, body_len, &source) ||
+                    source.length != header.msg_len) {
+                    std::cerr << "Malformed rendezvous request " << header.msg_id
+                              << " (qp " << qp->qp_num << ")\n";
+                    return -1;
+                }
+
+                int ret = pullRendezvous(header.msg_id, source);
+                if (ret) {
+                    return ret;
+                }
+                *data = reassembly.data();
+                *len = source.length;
+                return 0;
+            }
+
+            case FRAME_DONE:
+                // Already applied by applyFrameHeader on arrival
+                return 0;
+
+            default:
+                std::cerr << "Unexpected frame type " << header.type
+                          << " (qp " << qp->qp_num << ")\n";
+                return -1;
+        }
+    }
+
+    // Size the reassembly buffer. It doubles as an RDMA READ target that is
+    // registered through the MR cache, so its registration is dropped before
+    // the vector moves to new memory.
+    char *reserveReassembly(size_t len) {
+        if (len > reassembly.capacity() && reassembly.capacity() > 0) {
+            releaseMR(reassembly.data(), reassembly.capacity());
+        }
+        reassembly.resize(len);
+        return reassembly.data();
+    }
+
+    // Fetch a rendezvous message into the reassembly buffer and release the
+    // sender's buffer with DONE
+    int pullRendezvous(uint32_t msg_id, const RemoteBuffer& source) {
+        char *dst = reserveReassembly(source.length);
+        struct ibv_mr *dst_mr = localMR(dst, source.length);
+        if (!dst_mr) {
+            return -1;
+        }
+
+        uint64_t target = reads_completed + 1;
+        int ret = postRead(source, dst, dst_mr->lkey);
+        if (ret) {
+            return ret;
+        }
+        while (reads_completed < target) {
+            if (progress(true)) {
+                return -1;
+            }
+        }
+        return sendControl(FRAME_DONE, msg_id, nullptr, 0);
+    }
+
+protected:
+    // Poll completions once, sleeping first if wait is set and none are
+    // ready. Non-zero if polling failed or the channel went away meanwhile.
+    virtual int progress(bool wait) = 0;
+
+    // Re-post released receive buffers at once and return their credits
+    virtual int repostReceives() = 0;
+
+    // Registration covering memory that is already registered, or nullptr
+    virtual struct ibv_mr *registeredMR(const void *buf, size_t len) = 0;
+
+    // Registration covering any local memory, registering it if need be
+    virtual struct ibv_mr *localMR(const void *buf, size_t len) = 0;
+
+    // Drop a registration made by localMR before the memory goes away
+    virtual void releaseMR(const void *buf, size_t len) = 0;
+
+    // Take back the owner buffer of a rendezvous message the peer no longer
+    // reads; data and len are the message it held
+    virtual void releaseRendezvous(const char *data, size_t len, void *owner) = 0;
+
+    virtual void countCreditStall() = 0;
+};
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef RDMA_CONN_POOL_H
+#define RDMA_CONN_POOL_H
+
+#include "rdma_client.h"
+#include <map>
+#include <set>
+#include <poll.h>
+#include <fcntl.h>
+#include <chrono>
+
+// Connection pool for RDMAClient.
+//
+// Setting up an RC connection costs several CM round trips plus the PD, CQ
+// and memory registrations behind it. Pooled clients share those per device
+// (see RDMASharedDevice), are connected in parallel on one event channel,
+// and go back to the pool after use so the next acquire() of the same peer
+// reuses the established QP. The pool and its clients are driven from one
+// thread.
+class RDMAConnectionPool {
+public:
+    struct Peer {
+        std::string host;
+        std::string port;
+    };
+
+    static const int CONNECTIONS_PER_DEVICE = 64;
+    static const int CONNECT_TIMEOUT_MS = 5000;
+
+    RDMAConnectionPool(int connections_per_device = CONNECTIONS_PER_DEVICE,
+                       int queue_depth = 16)
+        : ec(nullptr), devices(connections_per_device, queue_depth) {}
+
+    // Clients go before the devices they share
+    ~RDMAConnectionPool() {
+        for (std::set<RDMAClient *>::iterator it = clients.begin(); it != clients.end(); ++it) {
+            delete *it;
+        }
+        clients.clear();
+        if (ec) rdma_destroy_event_channel(ec);
+    }
+
+    int initialize() {
+        ec = rdma_create_event_channel();
+        if (!ec) {
+            std::cerr << "Failed to create event channel\n";
+            return -1;
+        }
+        // connectAll() waits on the channel with a timeout
+        int flags = fcntl(ec->fd, F_GETFL);
+        if (flags < 0 || fcntl(ec->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            std::cerr << "Failed to make event channel non-blocking\n";
+            return -1;
+        }
+        return 0;
+    }
+
+    // Open one connection to every peer, all at once: address and route
+    // resolution and the connect handshakes of all peers overlap, so the
+    // setup costs about one connection's round trips instead of one per
+    // peer. Established connections are left idle in the pool; returns the
+    // number that failed.
+    int connectAll(const std::vector<Peer>& peers, int timeout_ms = CONNECT_TIMEOUT_MS) {
+        std::map<RDMAClient *, std::string> pending;
+        int failed = 0;
+
+        for (size_t i = 0; i < peers.size(); i++) {
+            RDMAClient *client = newClient();
+            if (client->startConnect(ec, peers[i].host, peers[i].port)) {
+                discard(client);
+                failed++;
+                continue;
+            }
+            pending[client] = key(peers[i].host, peers[i].port);
+        }
+
+        std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        while (!pending.empty()) {
+            int left = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            if (left <= 0) {
+                std::cerr << "Timed out with " << pending.size() << " connections pending\n";
+                break;
+            }
+            struct pollfd pfd;
+            pfd.fd = ec->fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, left) < 0 && errno != EINTR) {
+                std::cerr << "Failed to wait for CM events: " << strerror(errno) << "\n";
+                break;
+            }
+
+            // Drain everything that arrived; events name their client
+            // through the id context
+            struct rdma_cm_event *event;
+            while (rdma_get_cm_event(ec, &event) == 0) {
+                RDMAClient *client = (RDMAClient *)event->id->context;
+                std::map<RDMAClient *, std::string>::iterator it = pending.find(client);
+                if (it == pending.end()) {
+                    // Late events of connections already given up on, or a
+                    // disconnect of an idle one
+                    rdma_ack_cm_event(event);
+                    continue;
+                }
+                int ret = client->handleConnectionEvent(event);
+                if (ret == 0) {
+                    idle.insert(std::make_pair(it->second, client));
+                    pending.erase(it);
+                } else if (ret < 0) {
+                    pending.erase(it);
+                    discard(client);
+                    failed++;
+                }
+            }
+        }
+
+        for (std::map<RDMAClient *, std::string>::iterator it = pending.begin();
+             it != pending.end(); ++it) {
+            discard(it->first);
+            failed++;
+        }
+        return failed;
+    }
+
+    // An established connection to host:port, reused from the pool when one
+    // is idle; nullptr if connecting failed. Give it back with release().
+    RDMAClient *acquire(const std::string& host, const std::string& port) {
+        std::string peer = key(host, port);
+        std::multimap<std::string, RDMAClient *>::iterator it = idle.find(peer);
+        if (it == idle.end()) {
+            std::vector<Peer> one(1);
+            one[0].host = host;
+            one[0].port = port;
+            if (connectAll(one) != 0) {
+                return nullptr;
+            }
+            it = idle.find(peer);
+        }
+        RDMAClient *client = it->second;
+        idle.erase(it);
+        busy[client] = peer;
+        return client;
+    }
+
+    void release(RDMAClient *client) {
+        std::map<RDMAClient *, std::string>::iterator it = busy.find(client);
+        if (it == busy.end()) {
+            return;
+        }
+        idle.insert(std::make_pair(it->second, client));
+        busy.erase(it);
+    }
+
+    // Close a connection instead of returning it, e.g. after an error
+    void discard(RDMAClient *client) {
+        busy.erase(client);
+        for (std::multimap<std::string, RDMAClient *>::iterator it = idle.begin();
+             it != idle.end(); ++it) {
+            if (it->second == client) {
+                idle.erase(it);
+                break;
+            }
+        }
+        if (clients.erase(client)) {
+            delete client;
+        }
+    }
+
+    size_t idleCount() const {
+        return idle.size();
+    }
+
+    size_t busyCount() const {
+        return busy.size();
+    }
+
+private:
+    struct rdma_event_channel *ec;
+    RDMADeviceSet devices;
+    std::set<RDMAClient *> clients;
+    std::multimap<std::string, RDMAClient *> idle;
+    std::map<RDMAClient *, std::string> busy;
+
+    static std::string key(const std::string& host, const std::string& port) {
+        return host + ":" + port;
+    }
+
+    RDMAClient *newClient() {
+        RDMAClient *client = new RDMAClient();
+        client->useSharedDevices(&devices);
+        clients.insert(client);
+        return client;
+    }
+};
+
+#endif
@@ -0,0 +1,337 @@
+#ifndef RDMA_DEVICE_H
+#define RDMA_DEVICE_H
+
+#include <rdma/rdma_cma.h>
+#include <infiniband/verbs.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <ifaddrs.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Local device selection and placement.
+//
+// The RDMA CM picks the device, port and GID from the source address a
+// connection is bound to, so selecting a device means finding the address
+// that leads to it. A source is written as one of
+//   a.b.c.d               an IPv4 address of the host
+//   eth2                  a network interface, by its IPv4 address
+//   mlx5_0[:port[:gid]]   an RDMA device, by the IPv4 address behind one of
+//                         its GIDs (the first RoCE v2 one unless gid is
+//                         given; IPoIB address on InfiniBand ports)
+// and an empty source leaves the choice to the routing table.
+//
+// Devices also have a NUMA node. Memory the HCA reads and writes and the
+// threads that poll its CQs are best kept on that node; sysfs tells which
+// CPUs are local to it.
+
+// Where a client puts the memory and thread that serve its device
+enum NumaPlacement {
+    NUMA_NONE,      // wherever the calling thread runs
+    NUMA_MEMORY,    // buffers on the device's node; the thread stays where it is
+    NUMA_PIN        // pin the calling thread to the device's CPUs, then allocate
+};
+
+static const char *const RDMA_SYSFS = "/sys/class/infiniband/";
+
+static inline bool readSysfsLine(const std::string& path, std::string *line) {
+    std::ifstream in(path.c_str());
+    return (bool)std::getline(in, *line);
+}
+
+static inline std::vector<std::string> listDirectory(const std::string& path) {
+    std::vector<std::string> names;
+    DIR *dir = opendir(path.c_str());
+    if (!dir) {
+        return names;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_name[0] != '.') {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    return names;
+}
+
+// IPv4 address of a network interface
+static inline int netdevAddress(const std::string& netdev, struct in_addr *addr) {
+    struct ifaddrs *list;
+    if (getifaddrs(&list)) {
+        return -1;
+    }
+    int ret = -1;
+    for (struct ifaddrs *ifa = list; ifa; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET && netdev == ifa->ifa_name) {
+            *addr = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+            ret = 0;
+            break;
+        }
+    }
+    freeifaddrs(list);
+    return ret;
+}
+
+// Network interfaces of an RDMA device port: the RoCE GID table names them,
+// otherwise the PCI function's interfaces whose dev_port matches
+static inline std::vector<std::string> deviceNetdevs(const std::string& device, int port) {
+    std::string ports = std::string(RDMA_SYSFS) + device + "/ports/" + std::to_string(port);
+    std::vector<std::string> netdevs;
+    std::string name;
+    std::vector<std::string> gids = listDirectory(ports + "/gid_attrs/ndevs");
+    for (size_t i = 0; i < gids.size(); i++) {
+        if (readSysfsLine(ports + "/gid_attrs/ndevs/" + gids[i], &name) &&
+            std::find(netdevs.begin(), netdevs.end(), name) == netdevs.end()) {
+            netdevs.push_back(name);
+        }
+    }
+    if (!netdevs.empty()) {
+        return netdevs;
+    }
+
+    std::string net = std::string(RDMA_SYSFS) + device + "/device/net/";
+    std::vector<std::string> candidates = listDirectory(net);
+    for (size_t i = 0; i < candidates.size(); i++) {
+        std::string dev_port;
+        if (!readSysfsLine(net + candidates[i] + "/dev_port", &dev_port) ||
+            atoi(dev_port.c_str()) == port - 1) {
+            netdevs.push_back(candidates[i]);
+        }
+    }
+    return netdevs;
+}
+
+// RoCE GIDs of IPv4 addresses are IPv4-mapped IPv6 addresses
+static inline bool gidToIPv4(const union ibv_gid& gid, struct in_addr *addr) {
+    static const uint8_t prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    if (memcmp(gid.raw, prefix, sizeof(prefix)) != 0) {
+        return false;
+    }
+    memcpy(&addr->s_addr, gid.raw + 12, 4);
+    return true;
+}
+
+static inline struct ibv_context *openDevice(const std::string& name) {
+    int count = 0;
+    struct ibv_device **list = ibv_get_device_list(&count);
+    if (!list) {
+        return nullptr;
+    }
+    struct ibv_context *context = nullptr;
+    for (int i = 0; i < count; i++) {
+        if (name == ibv_get_device_name(list[i])) {
+            context = ibv_open_device(list[i]);
+            break;
+        }
+    }
+    ibv_free_device_list(list);
+    return context;
+}
+
+// IPv4 address of GID gid_index on a device port; gid_index < 0 takes the
+// first IPv4 GID, preferring RoCE v2, which is routable
+static inline int deviceAddress(const std::string& device, int port, int gid_index,
+                                struct in_addr *addr) {
+    struct ibv_context *context = openDevice(device);
+    if (!context) {
+        std::cerr << "No RDMA device " << device << "\n";
+        return -1;
+    }
+
+    struct ibv_port_attr port_attr;
+    if (ibv_query_port(context, port, &port_attr)) {
+        std::cerr << "Failed to query " << device << " port " << port << "\n";
+        ibv_close_device(context);
+        return -1;
+    }
+
+    int ret = -1;
+    if (port_attr.link_layer == IBV_LINK_LAYER_ETHERNET) {
+        std::string types = std::string(RDMA_SYSFS) + device + "/ports/" +
+                            std::to_string(port) + "/gid_attrs/types/";
+        int first = gid_index >= 0 ? gid_index : 0;
+        int last = gid_index >= 0 ? gid_index + 1 : port_attr.gid_tbl_len;
+        bool found_v2 = false;
+        for (int i = first; i < last && !found_v2; i++) {
+            union ibv_gid gid;
+            struct in_addr candidate;
+            if (ibv_query_gid(context, port, i, &gid) || !gidToIPv4(gid, &candidate)) {
+                continue;
+            }
+            std::string type;
+            found_v2 = readSysfsLine(types + std::to_string(i), &type) && type == "RoCE v2";
+            if (ret != 0 || found_v2) {
+                *addr = candidate;
+                ret = 0;
+            }
+        }
+    } else {
+        // InfiniBand GIDs are not IP addresses; the CM resolves IPoIB ones
+        std::vector<std::string> netdevs = deviceNetdevs(device, port);
+        for (size_t i = 0; i < netdevs.size() && ret != 0; i++) {
+            ret = netdevAddress(netdevs[i], addr);
+        }
+    }
+    ibv_close_device(context);
+
+    if (ret) {
+        std::cerr << "No IPv4 address on " << device << " port " << port;
+        if (gid_index >= 0) {
+            std::cerr << " GID " << gid_index;
+        }
+        std::cerr << "\n";
+    }
+    return ret;
+}
+
+// Source address for a connection; 1 for an empty spec (no binding)
+static inline int resolveSource(const std::string& spec, struct sockaddr_in *addr) {
+    if (spec.empty()) {
+        return 1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    if (inet_pton(AF_INET, spec.c_str(), &addr->sin_addr) == 1) {
+        return 0;
+    }
+    if (netdevAddress(spec, &addr->sin_addr) == 0) {
+        return 0;
+    }
+
+    std::string device = spec;
+    int port = 1;
+    int gid_index = -1;
+    size_t colon = spec.find(':');
+    if (colon != std::string::npos) {
+        device = spec.substr(0, colon);
+        port = atoi(spec.c_str() + colon + 1);
+        size_t second = spec.find(':', colon + 1);
+        if (second != std::string::npos) {
+            gid_index = atoi(spec.c_str() + second + 1);
+        }
+    }
+    if (port < 1) {
+        std::cerr << "Invalid port in source " << spec << "\n";
+        return -1;
+    }
+    return deviceAddress(device, port, gid_index, &addr->sin_addr);
+}
+
+// NUMA node of an opened device, -1 if unknown
+static inline int deviceNumaNode(struct ibv_context *context) {
+    std::string line;
+    if (!context || !readSysfsLine(std::string(RDMA_SYSFS) + ibv_get_device_name(context->device) +
+                                   "/device/numa_node", &line)) {
+        return -1;
+    }
+    return atoi(line.c_str());
+}
+
+// CPUs local to a device, from a list like "0-15,32-47"; empty if unknown
+static inline std::vector<int> deviceLocalCpus(struct ibv_context *context) {
+    std::vector<int> cpus;
+    std::string line;
+    if (!context || !readSysfsLine(std::string(RDMA_SYSFS) + ibv_get_device_name(context->device) +
+                                   "/device/local_cpulist", &line)) {
+        return cpus;
+    }
+    const char *p = line.c_str();
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            cpus.push_back((int)cpu);
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return cpus;
+}
+
+// Pin the calling thread near a device: to its index'th local CPU, or with
+// index < 0 to all of them. Returns -1 if the device's CPUs are unknown.
+static inline int pinToDevice(struct ibv_context *context, int index = -1) {
+    std::vector<int> cpus = deviceLocalCpus(context);
+    if (cpus.empty()) {
+        return -1;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (index < 0) {
+        for (size_t i = 0; i < cpus.size(); i++) {
+            CPU_SET(cpus[i], &set);
+        }
+    } else {
+        CPU_SET(cpus[index % cpus.size()], &set);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        std::cerr << "Failed to pin thread near " << ibv_get_device_name(context->device) << "\n";
+        return -1;
+    }
+    return 0;
+}
+
+// One line per device port: state, link layer, NUMA node, interfaces and
+// IPv4 GIDs, to find a source to select
+static inline void printDevices(std::ostream& out) {
+    int count = 0;
+    struct ibv_device **list = ibv_get_device_list(&count);
+    if (!list || count == 0) {
+        out << "No RDMA devices\n";
+        if (list) ibv_free_device_list(list);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        struct ibv_context *context = ibv_open_device(list[i]);
+        struct ibv_device_attr attr;
+        if (!context || ibv_query_device(context, &attr)) {
+            if (context) ibv_close_device(context);
+            continue;
+        }
+        std::string name = ibv_get_device_name(list[i]);
+        for (int port = 1; port <= attr.phys_port_cnt; port++) {
+            struct ibv_port_attr port_attr;
+            if (ibv_query_port(context, port, &port_attr)) {
+                continue;
+            }
+            out << name << ":" << port << " " << ibv_port_state_str(port_attr.state)
+                << (port_attr.link_layer == IBV_LINK_LAYER_ETHERNET ? " Ethernet" : " InfiniBand")
+                << " numa " << deviceNumaNode(context);
+            std::vector<std::string> netdevs = deviceNetdevs(name, port);
+            for (size_t n = 0; n < netdevs.size(); n++) {
+                out << (n == 0 ? " netdev " : ",") << netdevs[n];
+            }
+            for (int g = 0; g < port_attr.gid_tbl_len; g++) {
+                union ibv_gid gid;
+                struct in_addr addr;
+                char text[INET_ADDRSTRLEN];
+                if (ibv_query_gid(context, port, g, &gid) == 0 && gidToIPv4(gid, &addr) &&
+                    inet_ntop(AF_INET, &addr, text, sizeof(text))) {
+                    out << " gid" << g << "=" << text;
+                }
+            }
+            out << "\n";
+        }
+        ibv_close_device(context);
+    }
+    ibv_free_device_list(list);
+}
+
+#endif
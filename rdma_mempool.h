@@ -0,0 +1,415 @@
+#ifndef RDMA_MEMPOOL_H
+#define RDMA_MEMPOOL_H
+
+#include <infiniband/verbs.h>
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Registration-aware memory for RDMA buffers.
+//
+// RegisteredPool maps large arenas (2 MB huge pages when the system has them),
+// registers every arena exactly once and carves it into slabs of size-classed
+// blocks, so handing out a registered buffer never calls ibv_reg_mr. Every
+// thread allocates from and frees to its own free lists without locking; only
+// batch refills and flushes touch the shared per-class depot.
+//
+// MRCache registers caller-owned buffers on first use and finds the covering
+// registration again on later accesses by interval lookup.
+
+static inline int registeredThreadIndex() {
+    static std::atomic<int> next_index(0);
+    static thread_local int index = next_index++;
+    return index;
+}
+
+class RegisteredPool {
+public:
+    static const size_t MIN_CLASS_SIZE = 64;
+    static const int NUM_CLASSES = 15;                  // 64 B .. 1 MB
+    static const size_t MAX_CLASS_SIZE = MIN_CLASS_SIZE << (NUM_CLASSES - 1);
+    static const size_t SLAB_SIZE = 2 << 20;            // one huge page
+    static const size_t DEFAULT_ARENA_SIZE = 32 << 20;
+    static const int MAX_ARENAS = 16;
+    static const int MAX_THREADS = 64;
+    static const int CACHE_BATCH = 32;
+
+    RegisteredPool(struct ibv_pd *pd, int access, size_t arena_size = DEFAULT_ARENA_SIZE)
+        : pd(pd), access(access), arena_count(0) {
+        this->arena_size = (arena_size + SLAB_SIZE - 1) / SLAB_SIZE * SLAB_SIZE;
+        memset(arenas, 0, sizeof(arenas));
+        memset(depot, 0, sizeof(depot));
+        memset(caches, 0, sizeof(caches));
+    }
+
+    ~RegisteredPool() {
+        for (int i = 0; i < arena_count; i++) {
+            if (arenas[i].mr) ibv_dereg_mr(arenas[i].mr);
+            munmap(arenas[i].base, arenas[i].size);
+            delete[] arenas[i].slab_class;
+        }
+    }
+
+    // Returns a block of at least size bytes covered by a registered MR, or
+    // nullptr when size exceeds MAX_CLASS_SIZE or no arena can be mapped
+    void *allocate(size_t size) {
+        int cls = sizeClass(size);
+        if (cls < 0) {
+            return nullptr;
+        }
+
+        ThreadCache *cache = threadCache();
+        if (!cache) {
+            std::lock_guard<std::mutex> guard(depot_lock);
+            return popDepot(cls);
+        }
+
+        if (!cache->head[cls] && refill(cache, cls)) {
+            return nullptr;
+        }
+        FreeBlock *block = cache->head[cls];
+        cache->head[cls] = block->next;
+        cache->count[cls]--;
+        return block;
+    }
+
+    void deallocate(void *ptr) {
+        if (!ptr) {
+            return;
+        }
+
+        int cls = blockClass(ptr);
+        if (cls < 0) {
+            std::cerr << "Freeing a buffer that does not belong to the pool\n";
+            return;
+        }
+
+        FreeBlock *block = (FreeBlock *)ptr;
+        ThreadCache *cache = threadCache();
+        if (!cache) {
+            std::lock_guard<std::mutex> guard(depot_lock);
+            block->next = depot[cls];
+            depot[cls] = block;
+            return;
+        }
+
+        block->next = cache->head[cls];
+        cache->head[cls] = block;
+        if (++cache->count[cls] > 2 * CACHE_BATCH) {
+            flush(cache, cls);
+        }
+    }
+
+    // MR of the arena holding [ptr, ptr + len), or nullptr if not pool memory
+    struct ibv_mr *findMR(const void *ptr, size_t len) const {
+        const Arena *arena = findArena(ptr);
+        if (!arena || len > arena->size - (size_t)((const char *)ptr - arena->base)) {
+            return nullptr;
+        }
+        return arena->mr;
+    }
+
+    size_t blockSize(const void *ptr) const {
+        int cls = blockClass(ptr);
+        return cls < 0 ? 0 : MIN_CLASS_SIZE << cls;
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    struct Arena {
+        char *base;
+        size_t size;
+        size_t next_slab;
+        bool huge;
+        struct ibv_mr *mr;
+        int8_t *slab_class;
+    };
+
+    // Only ever touched by the thread that owns the slot; padded to whole
+    // cache lines so neighbouring threads do not share one
+    struct ThreadCache {
+        FreeBlock *head[NUM_CLASSES];
+        int count[NUM_CLASSES];
+        char pad[64 - (NUM_CLASSES * (sizeof(FreeBlock *) + sizeof(int))) % 64];
+    };
+
+    struct ibv_pd *pd;
+    int access;
+    size_t arena_size;
+    Arena arenas[MAX_ARENAS];
+    std::atomic<int> arena_count;
+    std::mutex depot_lock;
+    FreeBlock *depot[NUM_CLASSES];
+    ThreadCache caches[MAX_THREADS];
+
+    static int sizeClass(size_t size) {
+        if (size > MAX_CLASS_SIZE) {
+            return -1;
+        }
+        int cls = 0;
+        while ((MIN_CLASS_SIZE << cls) < size) {
+            cls++;
+        }
+        return cls;
+    }
+
+    // Threads past MAX_THREADS fall back to the locked depot
+    ThreadCache *threadCache() {
+        int index = registeredThreadIndex();
+        return index < MAX_THREADS ? &caches[index] : nullptr;
+    }
+
+    const Arena *findArena(const void *ptr) const {
+        const char *p = (const char *)ptr;
+        int count = arena_count.load(std::memory_order_acquire);
+        for (int i = 0; i < count; i++) {
+            if (p >= arenas[i].base && p < arenas[i].base + arenas[i].size) {
+                return &arenas[i];
+            }
+        }
+        return nullptr;
+    }
+
+    int blockClass(const void *ptr) const {
+        const Arena *arena = findArena(ptr);
+        if (!arena) {
+            return -1;
+        }
+        return arena->slab_class[((const char *)ptr - arena->base) / SLAB_SIZE];
+    }
+
+    // Move a batch of blocks from the depot into the thread cache
+    int refill(ThreadCache *cache, int cls) {
+        std::lock_guard<std::mutex> guard(depot_lock);
+
+        for (int i = 0; i < CACHE_BATCH; i++) {
+            FreeBlock *block = (FreeBlock *)popDepot(cls);
+            if (!block) {
+                break;
+            }
+            block->next = cache->head[cls];
+            cache->head[cls] = block;
+            cache->count[cls]++;
+        }
+        return cache->head[cls] ? 0 : -1;
+    }
+
+    // Return a batch of blocks from the thread cache to the depot
+    void flush(ThreadCache *cache, int cls) {
+        std::lock_guard<std::mutex> guard(depot_lock);
+
+        for (int i = 0; i < CACHE_BATCH && cache->head[cls]; i++) {
+            FreeBlock *block = cache->head[cls];
+            cache->head[cls] = block->next;
+            cache->count[cls]--;
+            block->next = depot[cls];
+            depot[cls] = block;
+        }
+    }
+
+    // Caller holds depot_lock
+    void *popDepot(int cls) {
+        if (!depot[cls] && carveSlab(cls)) {
+            return nullptr;
+        }
+        FreeBlock *block = depot[cls];
+        depot[cls] = block->next;
+        return block;
+    }
+
+    // Caller holds depot_lock
+    int carveSlab(int cls) {
+        Arena *arena = nullptr;
+        int count = arena_count.load(std::memory_order_relaxed);
+        for (int i = 0; i < count; i++) {
+            if (arenas[i].next_slab < arenas[i].size) {
+                arena = &arenas[i];
+                break;
+            }
+        }
+        if (!arena) {
+            arena = mapArena();
+            if (!arena) {
+                return -1;
+            }
+        }
+
+        char *slab = arena->base + arena->next_slab;
+        arena->slab_class[arena->next_slab / SLAB_SIZE] = (int8_t)cls;
+        arena->next_slab += SLAB_SIZE;
+
+        size_t block_size = MIN_CLASS_SIZE << cls;
+        for (size_t off = SLAB_SIZE; off >= block_size; off -= block_size) {
+            FreeBlock *block = (FreeBlock *)(slab + off - block_size);
+            block->next = depot[cls];
+            depot[cls] = block;
+        }
+        return 0;
+    }
+
+    // Caller holds depot_lock
+    Arena *mapArena() {
+        int count = arena_count.load(std::memory_order_relaxed);
+        if (count >= MAX_ARENAS) {
+            std::cerr << "Registered pool exhausted\n";
+            return nullptr;
+        }
+
+        Arena *arena = &arenas[count];
+        arena->size = arena_size;
+        arena->huge = true;
+        arena->base = (char *)mmap(nullptr, arena_size, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (arena->base == MAP_FAILED) {
+            // No reserved huge pages; ask for transparent ones instead
+            arena->huge = false;
+            arena->base = (char *)mmap(nullptr, arena_size, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (arena->base == MAP_FAILED) {
+                std::cerr << "Failed to map pool arena\n";
+                return nullptr;
+            }
+            madvise(arena->base, arena_size, MADV_HUGEPAGE);
+        }
+
+        arena->mr = ibv_reg_mr(pd, arena->base, arena_size, access);
+        if (!arena->mr) {
+            std::cerr << "Failed to register pool arena\n";
+            munmap(arena->base, arena_size);
+            return nullptr;
+        }
+
+        arena->next_slab = 0;
+        arena->slab_class = new int8_t[arena_size / SLAB_SIZE];
+        memset(arena->slab_class, -1, arena_size / SLAB_SIZE);
+        arena_count.store(count + 1, std::memory_order_release);
+        return arena;
+    }
+};
+
+class MRCache {
+public:
+    static const size_t DEFAULT_MAX_ENTRIES = 1024;
+
+    // Evicting an entry deregisters it, so max_entries must exceed the number
+    // of distinct buffers that can be in flight at once
+    MRCache(struct ibv_pd *pd, int access, size_t max_entries = DEFAULT_MAX_ENTRIES)
+        : pd(pd), access(access), max_entries(max_entries), clock(0), hit_count(0),
+          miss_count(0) {}
+
+    ~MRCache() {
+        for (std::map<uintptr_t, Entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+            ibv_dereg_mr(it->second.mr);
+        }
+    }
+
+    // Registration covering [addr, addr + len), registering it on a miss
+    struct ibv_mr *lookup(const void *addr, size_t len) {
+        uintptr_t start = (uintptr_t)addr;
+        uintptr_t end = start + len;
+        std::lock_guard<std::mutex> guard(lock);
+
+        // Registrations may overlap, so look a few intervals back
+        std::map<uintptr_t, Entry>::iterator it = entries.upper_bound(start);
+        for (int i = 0; i < LOOKBACK && it != entries.begin(); i++) {
+            --it;
+            if (it->second.end >= end) {
+                it->second.last_use = ++clock;
+                hit_count++;
+                return it->second.mr;
+            }
+        }
+
+        miss_count++;
+        if (entries.size() >= max_entries) {
+            evictOldest();
+        }
+
+        // Register whole pages so neighbouring buffers share the entry
+        uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t reg_start = start & ~(page - 1);
+        uintptr_t reg_end = (end + page - 1) & ~(page - 1);
+        struct ibv_mr *mr = ibv_reg_mr(pd, (void *)reg_start, reg_end - reg_start, access);
+        if (!mr) {
+            std::cerr << "Failed to register user buffer\n";
+            return nullptr;
+        }
+
+        Entry entry;
+        entry.end = reg_end;
+        entry.mr = mr;
+        entry.last_use = ++clock;
+        std::map<uintptr_t, Entry>::iterator old = entries.find(reg_start);
+        if (old != entries.end()) {
+            ibv_dereg_mr(old->second.mr);
+            entries.erase(old);
+        }
+        entries[reg_start] = entry;
+        return mr;
+    }
+
+    // Drop every registration overlapping [addr, addr + len); call before
+    // unmapping or freeing a buffer that was used for RDMA
+    void invalidate(const void *addr, size_t len) {
+        uintptr_t start = (uintptr_t)addr;
+        uintptr_t end = start + len;
+        std::lock_guard<std::mutex> guard(lock);
+
+        std::map<uintptr_t, Entry>::iterator it = entries.begin();
+        while (it != entries.end() && it->first < end) {
+            if (it->second.end > start) {
+                ibv_dereg_mr(it->second.mr);
+                entries.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    uint64_t hits() const {
+        return hit_count;
+    }
+
+    uint64_t misses() const {
+        return miss_count;
+    }
+
+private:
+    static const int LOOKBACK = 8;
+
+    struct Entry {
+        uintptr_t end;
+        struct ibv_mr *mr;
+        uint64_t last_use;
+    };
+
+    struct ibv_pd *pd;
+    int access;
+    size_t max_entries;
+    std::mutex lock;
+    std::map<uintptr_t, Entry> entries;
+    uint64_t clock;
+    uint64_t hit_count;
+    uint64_t miss_count;
+
+    void evictOldest() {
+        std::map<uintptr_t, Entry>::iterator oldest = entries.begin();
+        for (std::map<uintptr_t, Entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+            if (it->second.last_use < oldest->second.last_use) {
+                oldest = it;
+            }
+        }
+        ibv_dereg_mr(oldest->second.mr);
+        entries.erase(oldest);
+    }
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef RDMA_MULTIRAIL_H
+#define RDMA_MULTIRAIL_H
+
+#include "rdma_client.h"
+
+// One-sided transfers striped over several connections, one per local
+// device or port ("rail"), so that a large transfer gets the bandwidth of
+// all of them.
+//
+// Each rail is an RDMAClient bound to its own source (see rdma_device.h),
+// optionally to its own server address, with its buffers on its device's
+// NUMA node. STRIPE_SIZE blocks of a transfer go round-robin over the rails
+// (block b = offset / STRIPE_SIZE on rail b % rails) and keep their offset
+// in the rail's window. Rails into one server device share its window, so
+// the window holds the whole range; rails into separate servers (one per
+// server device, see rdma_server --bind) each hold their blocks, and a
+// range written with write() reads back the same way with read(). Stripes
+// are posted to the rails in turn before any rail is waited for, so all
+// rails transfer at once from the calling thread. An RDMAMultiRail is
+// driven from one thread.
+class RDMAMultiRail {
+public:
+    static const size_t STRIPE_SIZE = 64 * 1024;
+
+    ~RDMAMultiRail() {
+        for (size_t i = 0; i < rails.size(); i++) {
+            delete rails[i];
+        }
+    }
+
+    // One rail per source; connect() opens them all, to server_ip unless
+    // the rail names its own server
+    void addRail(const std::string& source, const std::string& server_ip = "") {
+        RDMAClient *rail = new RDMAClient();
+        rail->setSource(source);
+        rail->setNumaPlacement(NUMA_MEMORY);
+        rails.push_back(rail);
+        servers.push_back(server_ip);
+    }
+
+    int connect(const std::string& server_ip, const std::string& port) {
+        if (rails.empty()) {
+            addRail("");
+        }
+        for (size_t i = 0; i < rails.size(); i++) {
+            const std::string& server = servers[i].empty() ? server_ip : servers[i];
+            if (rails[i]->initialize() || rails[i]->connectToServer(server, port)) {
+                std::cerr << "Failed to connect rail " << i << "\n";
+                return -1;
+            }
+            if (!rails[i]->remoteBuffer().rkey) {
+                std::cerr << "Server gave rail " << i << " no window\n";
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    size_t railCount() const {
+        return rails.size();
+    }
+
+    RDMAClient& rail(size_t index) {
+        return *rails[index];
+    }
+
+    // Bytes addressable by write() and read(): the smallest window
+    size_t capacity() const {
+        if (rails.empty()) {
+            return 0;
+        }
+        size_t window = SIZE_MAX;
+        for (size_t i = 0; i < rails.size(); i++) {
+            window = std::min(window, (size_t)rails[i]->remoteBuffer().length);
+        }
+        return window;
+    }
+
+    int write(uint64_t offset, const void *local_buf, size_t len) {
+        return transfer(true, offset, (char *)local_buf, len);
+    }
+
+    int read(uint64_t offset, void *local_buf, size_t len) {
+        return transfer(false, offset, (char *)local_buf, len);
+    }
+
+private:
+    std::vector<RDMAClient *> rails;
+    std::vector<std::string> servers;
+
+    int transfer(bool is_write, uint64_t offset, char *local, size_t len) {
+        if (rails.empty() || offset > capacity() || len > capacity() - offset) {
+            std::cerr << "Striped transfer out of range\n";
+            return -1;
+        }
+
+        size_t done = 0;
+        while (done < len) {
+            uint64_t pos = offset + done;
+            size_t chunk = std::min(len - done, (size_t)(STRIPE_SIZE - pos % STRIPE_SIZE));
+            RDMAClient *rail = rails[pos / STRIPE_SIZE % rails.size()];
+
+            int ret = is_write ? rail->postWrite(pos, local + done, chunk)
+                               : rail->postRead(pos, local + done, chunk);
+            if (ret) {
+                return ret;
+            }
+            done += chunk;
+        }
+
+        for (size_t i = 0; i < rails.size(); i++) {
+            int ret = rails[i]->flushSends();
+            if (ret) {
+                return ret;
+            }
+        }
+        return 0;
+    }
+};
+
+#endif
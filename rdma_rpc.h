@@ -0,0 +1,391 @@
+#ifndef RDMA_RPC_H
+#define RDMA_RPC_H
+
+#include <memory>
+#include <functional>
+#include <unordered_map>
+
+#include "rdma_client.h"
+#include "rdma_server.h"
+
+// Request/response calls over the RDMA client and server.
+//
+// A call is one message each way: an RpcHeader naming the method and the
+// request followed by the arguments, answered by an RpcHeader with the same
+// request id and a status followed by the result. Calls ride on the framed
+// SEND channel, so a small call costs exactly one SEND in each direction,
+// while arguments and results above the rendezvous threshold are pulled by
+// the receiver with one RDMA READ. Many calls may be outstanding on one
+// connection; replies are matched by request id and may complete in any
+// order.
+
+enum RpcStatus {
+    RPC_OK = 0,
+    RPC_NO_METHOD = 1,      // nothing registered under the method id
+    RPC_FAILED = 2          // the handler reported an error
+};
+
+struct RpcHeader {
+    uint32_t magic;
+    uint32_t request_id;
+    uint16_t method;
+    uint16_t status;
+};
+
+// Methods served by rdma_server --rpc
+enum RpcDemoMethod {
+    RPC_METHOD_ECHO = 1,        // returns its arguments
+    RPC_METHOD_CHECKSUM = 2     // returns the byte sum of its arguments as a uint64_t
+};
+
+static const uint32_t RPC_MAGIC = 0x52525043;     // "RRPC"
+
+static inline void packRpcHeader(uint32_t request_id, uint16_t method, uint16_t status, char *wire) {
+    RpcHeader header;
+    header.magic = htonl(RPC_MAGIC);
+    header.request_id = htonl(request_id);
+    header.method = htons(method);
+    header.status = htons(status);
+    memcpy(wire, &header, sizeof(header));
+}
+
+static inline int unpackRpcHeader(const char *data, size_t len, RpcHeader *header) {
+    if (len < sizeof(RpcHeader)) {
+        return -1;
+    }
+    memcpy(header, data, sizeof(*header));
+    header->magic = ntohl(header->magic);
+    header->request_id = ntohl(header->request_id);
+    header->method = ntohs(header->method);
+    header->status = ntohs(header->status);
+    return header->magic == RPC_MAGIC ? 0 : -1;
+}
+
+// Header plus payload in one buffer: messages up to STAGING_SIZE in a
+// buffer kept for the purpose, larger ones in a registered buffer from the
+// endpoint's pool so they are sent (or pulled) without registration
+template <typename Endpoint>
+class RpcStaging {
+public:
+    static const size_t STAGING_SIZE = 64 * 1024;
+
+    RpcStaging() : staging(STAGING_SIZE) {}
+
+    char *acquire(Endpoint& endpoint, size_t len) {
+        if (len <= STAGING_SIZE) {
+            return staging.data();
+        }
+        return (char *)endpoint.allocBuffer(len);
+    }
+
+    void release(Endpoint& endpoint, char *buf) {
+        if (buf != staging.data()) {
+            endpoint.freeBuffer(buf);
+        }
+    }
+
+private:
+    // Never resized, so a registration the MR cache made for it stays valid
+    std::vector<char> staging;
+};
+
+// Client side, driven from one thread like the RDMAClient it wraps. Replies
+// are only received while the caller is inside call(), poll() or wait().
+class RpcClient {
+public:
+    // status is an RpcStatus, or -1 if the connection failed; the result is
+    // only valid during the callback
+    typedef std::function<void(int status, const char *data, size_t len)> Callback;
+
+    // Result of a call issued with callAsync()
+    class Future {
+    public:
+        Future() {}
+
+        bool ready() const {
+            return state && state->done;
+        }
+
+        int status() const {
+            return state ? state->status : -1;
+        }
+
+        const std::string& result() const {
+            return state->result;
+        }
+
+    private:
+        friend class RpcClient;
+
+        struct State {
+            bool done;
+            int status;
+            std::string result;
+            State() : done(false), status(-1) {}
+        };
+        std::shared_ptr<State> state;
+    };
+
+    // Outstanding calls are capped below the client's receive ring, so the
+    // server always has credits for every reply and a full send queue never
+    // waits on replies nobody is reading
+    explicit RpcClient(RDMAClient& rdma_client)
+        : client(rdma_client), next_request(1),
+          max_outstanding(std::max(1, rdma_client.queueDepth() / 2)) {}
+
+    ~RpcClient() {
+        failAll();
+    }
+
+    void setMaxOutstanding(int calls) {
+        max_outstanding = std::max(1, std::min(calls, client.queueDepth() - 1));
+    }
+
+    size_t outstanding() const {
+        return pending.size();
+    }
+
+    // Issue a call; done runs from a later call(), poll() or wait(). Blocks
+    // for replies while max_outstanding calls are in flight.
+    int call(uint16_t method, const void *args, size_t len, const Callback& done) {
+        while ((int)pending.size() >= max_outstanding) {
+            if (receiveOne()) {
+                return -1;
+            }
+        }
+
+        uint32_t request_id = next_request++;
+        size_t total = sizeof(RpcHeader) + len;
+        char *buf = staging.acquire(client, total);
+        if (!buf) {
+            std::cerr << "No buffer for a " << len << " byte RPC request\n";
+            return -1;
+        }
+        packRpcHeader(request_id, method, RPC_OK, buf);
+        if (len) {
+            memcpy(buf + sizeof(RpcHeader), args, len);
+        }
+        int ret = client.sendData(buf, total);
+        staging.release(client, buf);
+        if (ret) {
+            return ret;
+        }
+        pending[request_id] = done;
+        return 0;
+    }
+
+    Future callAsync(uint16_t method, const void *args, size_t len) {
+        Future future;
+        future.state = std::make_shared<Future::State>();
+        std::shared_ptr<Future::State> state = future.state;
+        int ret = call(method, args, len, [state](int status, const char *data, size_t result_len) {
+            state->status = status;
+            state->result.assign(data ? data : "", result_len);
+            state->done = true;
+        });
+        if (ret) {
+            future.state->done = true;
+        }
+        return future;
+    }
+
+    // Call and wait; *result is filled when non-null
+    int callSync(uint16_t method, const void *args, size_t len, std::string *result) {
+        Future future = callAsync(method, args, len);
+        int ret = wait(future);
+        if (ret == 0 && result) {
+            *result = future.result();
+        }
+        return ret ? ret : future.status();
+    }
+
+    // Block until the call completed; its status is in the future
+    int wait(const Future& future) {
+        while (future.state && !future.state->done) {
+            if (receiveOne()) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // Block until every outstanding call completed
+    int waitAll() {
+        while (!pending.empty()) {
+            if (receiveOne()) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // Complete the calls whose replies have arrived, without blocking;
+    // returns how many completed, or -1
+    int poll() {
+        int completed = 0;
+        for (;;) {
+            int ret = client.pollReceive();
+            if (ret <= 0) {
+                return ret < 0 ? -1 : completed;
+            }
+            size_t before = pending.size();
+            if (receiveOne()) {
+                return -1;
+            }
+            completed += (int)(before - pending.size());
+        }
+    }
+
+private:
+    RDMAClient& client;
+    uint32_t next_request;
+    int max_outstanding;
+    std::unordered_map<uint32_t, Callback> pending;
+    RpcStaging<RDMAClient> staging;
+
+    // Receive one message and complete the call it answers. A broken
+    // connection fails every outstanding call.
+    int receiveOne() {
+        RDMAClient::MessageLease lease;
+        if (client.receiveLease(&lease)) {
+            failAll();
+            return -1;
+        }
+        if (lease.data) {
+            RpcHeader header;
+            if (unpackRpcHeader(lease.data, lease.len, &header)) {
+                LOG_WARN("Dropping a non-RPC message of %zu bytes", lease.len);
+            } else {
+                std::unordered_map<uint32_t, Callback>::iterator it = pending.find(header.request_id);
+                if (it == pending.end()) {
+                    LOG_WARN("Reply to unknown RPC request %u", header.request_id);
+                } else {
+                    Callback done;
+                    done.swap(it->second);
+                    pending.erase(it);
+                    done(header.status, lease.data + sizeof(header), lease.len - sizeof(header));
+                }
+            }
+        }
+        return client.releaseLease(&lease);
+    }
+
+    void failAll() {
+        std::unordered_map<uint32_t, Callback> failed;
+        failed.swap(pending);
+        for (std::unordered_map<uint32_t, Callback>::iterator it = failed.begin();
+             it != failed.end(); ++it) {
+            if (it->second) {
+                it->second(-1, nullptr, 0);
+            }
+        }
+    }
+};
+
+// Server side: handlers registered by method id run on the worker thread
+// that owns the calling connection, so calls of one connection run in order
+// while connections on different workers run in parallel.
+class RpcServer {
+public:
+    // One call in progress; handlers answer with reply() or fail() at most
+    // once, and a call they leave unanswered gets an empty RPC_OK reply
+    class Call {
+    public:
+        Call(RpcServer& rpc_server, RDMAServer& rdma_server, uint32_t qp, const RpcHeader& header)
+            : rpc(rpc_server), server(rdma_server), qp_num(qp), request_id(header.request_id),
+              method(header.method), replied(false) {}
+
+        int reply(const void *data, size_t len) {
+            return send(RPC_OK, data, len);
+        }
+
+        int fail(RpcStatus status) {
+            return send(status, nullptr, 0);
+        }
+
+        uint32_t connection() const {
+            return qp_num;
+        }
+
+        uint16_t methodId() const {
+            return method;
+        }
+
+    private:
+        friend class RpcServer;
+
+        RpcServer& rpc;
+        RDMAServer& server;
+        uint32_t qp_num;
+        uint32_t request_id;
+        uint16_t method;
+        bool replied;
+
+        int send(uint16_t status, const void *data, size_t len) {
+            if (replied) {
+                std::cerr << "RPC request " << request_id << " answered twice\n";
+                return -1;
+            }
+            replied = true;
+            return rpc.sendReply(server, qp_num, request_id, method, status, data, len);
+        }
+    };
+
+    typedef std::function<void(Call& call, const char *args, size_t len)> Handler;
+
+    // Register before the server starts; handlers are not locked
+    void registerMethod(uint16_t method, const Handler& handler) {
+        handlers[method] = handler;
+    }
+
+    // Message handler to start the RDMAServer with
+    RDMAServer::MessageHandler messageHandler() {
+        return [this](RDMAServer& server, uint32_t qp_num, const char *data, size_t len) {
+            dispatch(server, qp_num, data, len);
+        };
+    }
+
+private:
+    std::unordered_map<uint16_t, Handler> handlers;
+
+    void dispatch(RDMAServer& server, uint32_t qp_num, const char *data, size_t len) {
+        RpcHeader header;
+        if (unpackRpcHeader(data, len, &header)) {
+            LOG_WARN("Dropping a non-RPC message of %zu bytes from qp %u", len, qp_num);
+            return;
+        }
+
+        Call call(*this, server, qp_num, header);
+        std::unordered_map<uint16_t, Handler>::iterator it = handlers.find(header.method);
+        if (it == handlers.end()) {
+            call.fail(RPC_NO_METHOD);
+            return;
+        }
+        it->second(call, data + sizeof(header), len - sizeof(header));
+        if (!call.replied) {
+            call.reply(nullptr, 0);
+        }
+    }
+
+    int sendReply(RDMAServer& server, uint32_t qp_num, uint32_t request_id, uint16_t method,
+                  uint16_t status, const void *data, size_t len) {
+        // One staging buffer per worker thread
+        static thread_local RpcStaging<RDMAServer> staging;
+
+        size_t total = sizeof(RpcHeader) + len;
+        char *buf = staging.acquire(server, total);
+        if (!buf) {
+            std::cerr << "No buffer for a " << len << " byte RPC reply\n";
+            return -1;
+        }
+        packRpcHeader(request_id, method, status, buf);
+        if (len) {
+            memcpy(buf + sizeof(RpcHeader), data, len);
+        }
+        int ret = server.sendData(qp_num, buf, total);
+        staging.release(server, buf);
+        return ret;
+    }
+};
+
+#endif
@@ -1,276 +1,247 @@
-#include <rdma/rdma_cma.h>
-#include <rdma/rdma_verbs.h>
 #include <iostream>
 #include <string>
 #include <cstring>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-
-class RDMAServer {
-private:
-    struct rdma_cm_id *listen_id;
-    struct rdma_cm_id *conn_id;
-    struct rdma_event_channel *ec;
-    struct ibv_pd *pd;
-    struct ibv_comp_channel *comp_chan;
-    struct ibv_cq *cq;
-    struct ibv_mr *mr;
-    char *buffer;
-    static const size_t BUFFER_SIZE = 4096;
-    static const int MAX_WR = 16;
-
-public:
-    RDMAServer() : listen_id(nullptr), conn_id(nullptr), ec(nullptr), 
-                   pd(nullptr), comp_chan(nullptr), cq(nullptr), 
-                   mr(nullptr), buffer(nullptr) {
-        buffer = new char[BUFFER_SIZE];
-        memset(buffer, 0, BUFFER_SIZE);
-    }
-
-    ~RDMAServer() {
-        cleanup();
-        delete[] buffer;
-    }
-
-    int initialize(const std::string& port) {
-        struct sockaddr_in addr;
-        int ret;
-
-        ec = rdma_create_event_channel();
-        if (!ec) {
-            std::cerr << "Failed to create event channel\n";
-            return -1;
-        }
-
-        ret = rdma_create_id(ec, &listen_id, nullptr, RDMA_PS_TCP);
-        if (ret) {
-            std::cerr << "Failed to create listen ID\n";
-            return ret;
-        }
-
-        memset(&addr, 0, sizeof(addr));
-        addr.sin_family = AF_INET;
-        addr.sin_addr.s_addr = INADDR_ANY;
-        addr.sin_port = htons(std::stoi(port));
-
-        ret = rdma_bind_addr(listen_id, (struct sockaddr*)&addr);
-        if (ret) {
-            std::cerr << "Failed to bind address\n";
-            return ret;
-        }
-
-        ret = rdma_listen(listen_id, 1);
-        if (ret) {
-            std::cerr << "Failed to listen\n";
-            return ret;
-        }
-
-        std::cout << "RDMA server listening on port " << port << std::endl;
-        return 0;
-    }
-
-    int waitForConnection() {
-        struct rdma_cm_event *event;
-        int ret;
-
-        while (rdma_get_cm_event(ec, &event) == 0) {
-            switch (event->event) {
-                case RDMA_CM_EVENT_CONNECT_REQUEST:
-                    conn_id = event->id;
-                    ret = handleConnectRequest();
-                    if (ret) {
-                        rdma_ack_cm_event(event);
-                        return ret;
-                    }
-                    break;
-
-                case RDMA_CM_EVENT_ESTABLISHED:
-                    std::cout << "Connection established\n";
-                    rdma_ack_cm_event(event);
-                    return 0; // Exit event loop after connection established
-
-                case RDMA_CM_EVENT_DISCONNECTED:
-                    std::cout << "Client disconnected\n";
-                    rdma_ack_cm_event(event);
-                    return 0;
-
-                default:
-                    break;
-            }
-            rdma_ack_cm_event(event);
-        }
-        return 0;
+#include <unordered_map>
+#include <getopt.h>
+
+#include "rdma_server.h"
+#include "rdma_rpc.h"
+#include "rdma_ud.h"
+#include "benchmark.h"
+
+// UD mode: one UD QP serving every peer, echoing each datagram to its sender
+static int runUdServer(const std::string& source, const std::string& port) {
+    UDEndpoint endpoint;
+    endpoint.setHandler([](UDEndpoint& ep, uint32_t peer, const char *data, size_t len) {
+        ep.send(peer, data, len);
+    });
+    if (endpoint.open(source, port)) {
+        std::cerr << "Failed to open UD endpoint\n";
+        return 1;
     }
-
-    int sendMessage(const std::string& message) {
-        if (!conn_id || !mr) {
-            std::cerr << "Connection or memory region not ready\n";
-            return -1;
-        }
-
-        strncpy(buffer, message.c_str(), BUFFER_SIZE - 1);
-        buffer[BUFFER_SIZE - 1] = '\0';
-
-        struct ibv_sge sge;
-        struct ibv_send_wr send_wr, *bad_wr;
-
-        memset(&sge, 0, sizeof(sge));
-        sge.addr = (uintptr_t)buffer;
-        sge.length = strlen(buffer) + 1;
-        sge.lkey = mr->lkey;
-
-        memset(&send_wr, 0, sizeof(send_wr));
-        send_wr.wr_id = 1;
-        send_wr.sg_list = &sge;
-        send_wr.num_sge = 1;
-        send_wr.opcode = IBV_WR_SEND;
-        send_wr.send_flags = IBV_SEND_SIGNALED;
-
-        int ret = ibv_post_send(conn_id->qp, &send_wr, &bad_wr);
-        if (ret) {
-            std::cerr << "Failed to post send\n";
-            return ret;
-        }
-
-        std::cout << "Message sent: " << message << std::endl;
-        return 0;
+    std::cout << "Waiting for UD datagrams...\n";
+    while (endpoint.poll(1000) >= 0) {
     }
+    return 1;
+}
 
-    int receiveMessage() {
-        if (!conn_id || !cq) {
-            std::cerr << "Connection or completion queue not ready\n";
-            return -1;
-        }
+// Benchmark runs in progress on the calling worker, by qp_num
+static std::unordered_map<uint32_t, BenchSession>& benchSessions() {
+    static thread_local std::unordered_map<uint32_t, BenchSession> sessions;
+    return sessions;
+}
 
-        // Wait for completion of previously posted receive
-        struct ibv_wc wc;
-        do {
-            while (ibv_poll_cq(cq, 1, &wc) == 0) {
-                // Keep polling
-            }
-        } while (wc.wr_id != 2); // Wait for receive completion (wr_id = 2)
-
-        if (wc.status != IBV_WC_SUCCESS) {
-            std::cerr << "Work completion failed\n";
-            return -1;
+int main(int argc, char *argv[]) {
+    CompletionMode completion_mode = COMPLETION_ADAPTIVE;
+    int spin_us = 50;
+    int worker_count = 1;
+    AssignPolicy assign_policy = ASSIGN_ROUND_ROBIN;
+    int pin_cpu = -1;
+    size_t rendezvous = 64 * 1024;
+    int queue_depth = 16;
+    bool bench = false;
+    StatsFormat stats_format = STATS_TEXT;
+    int stats_interval = 0;
+    std::string bind_source;
+    bool numa = false;
+    bool rpc = false;
+    bool ud = false;
+    size_t atomic_slots = 0;
+
+    static const struct option long_options[] = {
+        {"cq-mode", required_argument, nullptr, 'm'},
+        {"spin-us", required_argument, nullptr, 's'},
+        {"workers", required_argument, nullptr, 'w'},
+        {"assign", required_argument, nullptr, 'a'},
+        {"pin-cpu", required_argument, nullptr, 'p'},
+        {"rendezvous", required_argument, nullptr, 'r'},
+        {"queue-depth", required_argument, nullptr, 'q'},
+        {"bench", no_argument, nullptr, 'b'},
+        {"stats", required_argument, nullptr, 'S'},
+        {"stats-interval", required_argument, nullptr, 'I'},
+        {"bind", required_argument, nullptr, 'B'},
+        {"numa", no_argument, nullptr, 'N'},
+        {"rpc", no_argument, nullptr, 'R'},
+        {"ud", no_argument, nullptr, 'U'},
+        {"atomics", required_argument, nullptr, 'A'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:s:w:a:p:r:q:bS:I:B:NRUA:", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'm':
+                if (parseCompletionMode(optarg, &completion_mode)) {
+                    std::cerr << "Unknown completion mode: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case 's':
+                spin_us = std::stoi(optarg);
+                break;
+            case 'w':
+                worker_count = std::stoi(optarg);
+                break;
+            case 'a':
+                if (parseAssignPolicy(optarg, &assign_policy)) {
+                    std::cerr << "Unknown assignment policy: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case 'p':
+                pin_cpu = std::stoi(optarg);
+                break;
+            case 'r':
+                rendezvous = std::stoul(optarg);
+                break;
+            case 'q':
+                queue_depth = std::stoi(optarg);
+                break;
+            case 'b':
+                bench = true;
+                break;
+            case 'S':
+                if (parseStatsFormat(optarg, &stats_format)) {
+                    std::cerr << "Unknown stats format: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case 'I':
+                stats_interval = std::stoi(optarg);
+                break;
+            case 'B':
+                bind_source = optarg;
+                break;
+            case 'N':
+                numa = true;
+                break;
+            case 'R':
+                rpc = true;
+                break;
+            case 'U':
+                ud = true;
+                break;
+            case 'A':
+                atomic_slots = std::stoul(optarg);
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [--cq-mode poll|event|adaptive] [--spin-us N] "
+                          << "[--workers N] [--assign rr|least] [--pin-cpu FIRST] "
+                          << "[--rendezvous BYTES] [--queue-depth N] [--bench] "
+                          << "[--stats text|json] [--stats-interval SECONDS] "
+                          << "[--bind SOURCE] [--numa] [--rpc] [--ud] [--atomics SLOTS] <port>\n";
+                return 1;
         }
-
-        std::cout << "Message received: " << buffer << std::endl;
-        return 0;
     }
 
-private:
-    int handleConnectRequest() {
-        int ret;
-
-        pd = ibv_alloc_pd(conn_id->verbs);
-        if (!pd) {
-            std::cerr << "Failed to allocate protection domain\n";
-            return -1;
-        }
-
-        comp_chan = ibv_create_comp_channel(conn_id->verbs);
-        if (!comp_chan) {
-            std::cerr << "Failed to create completion channel\n";
-            return -1;
-        }
-
-        cq = ibv_create_cq(conn_id->verbs, MAX_WR, nullptr, comp_chan, 0);
-        if (!cq) {
-            std::cerr << "Failed to create completion queue\n";
-            return -1;
-        }
-
-        mr = ibv_reg_mr(pd, buffer, BUFFER_SIZE, 
-                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ);
-        if (!mr) {
-            std::cerr << "Failed to register memory region\n";
-            return -1;
-        }
-
-        struct ibv_qp_init_attr qp_attr;
-        memset(&qp_attr, 0, sizeof(qp_attr));
-        qp_attr.send_cq = cq;
-        qp_attr.recv_cq = cq;
-        qp_attr.qp_type = IBV_QPT_RC;
-        qp_attr.cap.max_send_wr = MAX_WR;
-        qp_attr.cap.max_recv_wr = MAX_WR;
-        qp_attr.cap.max_send_sge = 1;
-        qp_attr.cap.max_recv_sge = 1;
-
-        ret = rdma_create_qp(conn_id, pd, &qp_attr);
-        if (ret) {
-            std::cerr << "Failed to create queue pair\n";
-            return ret;
-        }
-
-        ret = rdma_accept(conn_id, nullptr);
-        if (ret) {
-            std::cerr << "Failed to accept connection\n";
-            return ret;
-        }
-
-        // Post initial receive work request
-        struct ibv_sge sge;
-        struct ibv_recv_wr recv_wr, *bad_wr;
-
-        memset(&sge, 0, sizeof(sge));
-        sge.addr = (uintptr_t)buffer;
-        sge.length = BUFFER_SIZE;
-        sge.lkey = mr->lkey;
-
-        memset(&recv_wr, 0, sizeof(recv_wr));
-        recv_wr.wr_id = 2;
-        recv_wr.sg_list = &sge;
-        recv_wr.num_sge = 1;
-
-        ret = ibv_post_recv(conn_id->qp, &recv_wr, &bad_wr);
-        if (ret) {
-            std::cerr << "Failed to post initial receive\n";
-            return ret;
-        }
-
-        return 0;
+    if (argc - optind != 1) {
+        std::cerr << "Usage: " << argv[0] << " [--cq-mode poll|event|adaptive] [--spin-us N] "
+                  << "[--workers N] [--assign rr|least] [--pin-cpu FIRST] "
+                  << "[--rendezvous BYTES] [--queue-depth N] [--bench] "
+                  << "[--stats text|json] [--stats-interval SECONDS] "
+                  << "[--bind SOURCE] [--numa] [--rpc] [--ud] [--atomics SLOTS] <port>\n";
+        return 1;
     }
 
-    void cleanup() {
-        if (mr) ibv_dereg_mr(mr);
-        if (cq) ibv_destroy_cq(cq);
-        if (comp_chan) ibv_destroy_comp_channel(comp_chan);
-        if (pd) ibv_dealloc_pd(pd);
-        if (conn_id) rdma_destroy_id(conn_id);
-        if (listen_id) rdma_destroy_id(listen_id);
-        if (ec) rdma_destroy_event_channel(ec);
+    if (ud) {
+        return runUdServer(bind_source, argv[optind]);
     }
-};
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <port>\n";
+    // Started before the CM and worker threads so that SIGUSR1 reaches the
+    // reporter
+    StatsReporter reporter;
+    if (reporter.start(stats_interval, stats_format)) {
         return 1;
     }
 
     RDMAServer server;
+    server.setCompletionMode(completion_mode, spin_us);
+    server.setWorkers(worker_count, assign_policy, pin_cpu);
+    server.setRendezvousThreshold(rendezvous);
+    server.setQueueDepth(queue_depth);
+    server.setBindSource(bind_source);
+    server.setNumaPinning(numa);
+    server.setAtomicSlots(atomic_slots);
+
+    // Benchmarks keep the console quiet
+    if (bench) {
+        AsyncLogger::instance().setLevel(LOG_LEVEL_WARN);
+    }
     
-    int ret = server.initialize(argv[1]);
+    int ret = server.initialize(argv[optind]);
     if (ret) {
         std::cerr << "Failed to initialize server\n";
         return ret;
     }
 
-    ret = server.waitForConnection();
+    server.setWriteHandler([](RDMAServer& srv, uint32_t qp_num, uint32_t imm, size_t len) {
+        LOG_INFO("RDMA write from qp %u: %zu bytes, imm %u: %.*s", qp_num, len, imm,
+                 (int)strnlen(srv.rdmaBuffer(), len), srv.rdmaBuffer());
+    });
+
+    // Answer every client message on the worker that owns its connection
+    RDMAServer::MessageHandler handler = [](RDMAServer& srv, uint32_t qp_num, const char *data,
+                                            size_t len) {
+        LOG_INFO("Message from qp %u: %s", qp_num, previewPayload(data, len).c_str());
+        srv.sendMessage(qp_num, "Hello from RDMA server!");
+    };
+
+    // In benchmark mode the handler follows the client's runs instead; each
+    // worker keeps the sessions of its own connections while a run is in
+    // progress, and drops them when the run finishes or the client leaves,
+    // so a reused qp_num always starts with a new request
+    if (bench) {
+        handler = [](RDMAServer& srv, uint32_t qp_num, const char *data, size_t len) {
+            static const char ack = 0;
+            std::unordered_map<uint32_t, BenchSession>& sessions = benchSessions();
+
+            BenchSession& session = sessions[qp_num];
+            BenchReply reply = benchServerStep(&session, data, len);
+            if (session.remaining == 0) {
+                sessions.erase(qp_num);
+            }
+            switch (reply) {
+                case BENCH_REPLY_ECHO:
+                    srv.sendData(qp_num, data, len);
+                    break;
+                case BENCH_REPLY_ACK:
+                    srv.sendData(qp_num, &ack, sizeof(ack));
+                    break;
+                default:
+                    break;
+            }
+        };
+        server.setDisconnectHandler([](RDMAServer&, uint32_t qp_num) {
+            benchSessions().erase(qp_num);
+        });
+    }
+
+    // RPC mode serves the demo methods instead
+    RpcServer rpc_server;
+    if (rpc) {
+        rpc_server.registerMethod(RPC_METHOD_ECHO, [](RpcServer::Call& call, const char *args,
+                                                      size_t len) {
+            call.reply(args, len);
+        });
+        rpc_server.registerMethod(RPC_METHOD_CHECKSUM, [](RpcServer::Call& call, const char *args,
+                                                          size_t len) {
+            uint64_t sum = 0;
+            for (size_t i = 0; i < len; i++) {
+                sum += (unsigned char)args[i];
+            }
+            sum = htobe64(sum);
+            call.reply(&sum, sizeof(sum));
+        });
+        handler = rpc_server.messageHandler();
+    }
+
+    ret = server.start(handler);
     if (ret) {
-        std::cerr << "Connection handling failed\n";
+        std::cerr << "Failed to start server\n";
         return ret;
     }
 
-    // Post receive first, then wait for client message
-    std::cout << "Waiting for client message...\n";
-    server.receiveMessage();
-    
-    // Send response back to client
-    server.sendMessage("Hello from RDMA server!");
-
+    std::cout << "Waiting for client messages...\n";
+    server.wait();
     return 0;
 }
\ No newline at end of file
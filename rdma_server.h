@@ -0,0 +1,1544 @@
+#ifndef RDMA_SERVER_H
+#define RDMA_SERVER_H
+
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstddef>
+#include <vector>
+#include <unordered_map>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "rdma_common.h"
+#include "rdma_conn.h"
+#include "rdma_mempool.h"
+#include "rdma_device.h"
+#include "stats.h"
+#include "log.h"
+
+enum AssignPolicy {
+    ASSIGN_ROUND_ROBIN,
+    ASSIGN_LEAST_LOADED
+};
+
+static inline int parseAssignPolicy(const char *name, AssignPolicy *policy) {
+    if (strcmp(name, "rr") == 0) {
+        *policy = ASSIGN_ROUND_ROBIN;
+    } else if (strcmp(name, "least") == 0) {
+        *policy = ASSIGN_LEAST_LOADED;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+class RDMAServer;
+struct RDMAWorker;
+
+// Per-connection state. Receive buffers come from the server-wide SRQ, so a
+// connection only owns its send staging slots, send-queue credits, its share
+// of the SRQ (recv_granted receives promised to the client), its CreditBox
+// and the reassembly state of its incoming messages. After the connect
+// request has been handled it is only touched by its worker.
+struct RDMAConnection : public FramedChannel {
+    RDMAServer *server;
+    struct rdma_cm_id *id;
+    RDMAWorker *worker;
+    uint32_t qp_num;
+    RemoteBuffer remote;
+    int credit_index;
+    ConnectionStats *stats;
+
+    RDMAConnection() : server(nullptr), id(nullptr), worker(nullptr), qp_num(0),
+                       credit_index(-1), stats(nullptr) {
+        memset(&remote, 0, sizeof(remote));
+    }
+
+protected:
+    // Framing engine hooks, defined after RDMAServer
+    int progress(bool wait);
+    int repostReceives();
+    struct ibv_mr *registeredMR(const void *buf, size_t len);
+    struct ibv_mr *localMR(const void *buf, size_t len);
+    void releaseMR(const void *buf, size_t len);
+    void releaseRendezvous(const char *data, size_t len, void *owner);
+    void countCreditStall();
+};
+
+// Connection hand-over from the CM thread to a worker
+struct WorkerCommand {
+    bool add;
+    RDMAConnection *conn;
+};
+
+// A data-path thread. Each worker owns one CQ (plus a completion channel
+// unless it busy-polls) and every connection whose QP reports to that CQ.
+struct RDMAWorker {
+    int index;
+    std::thread thread;
+    struct ibv_comp_channel *comp_chan;
+    struct ibv_cq *cq;
+    CQNotifier cq_events;
+    int wake_fd;
+    std::mutex cmd_lock;
+    std::vector<WorkerCommand> commands;
+    std::atomic<bool> cmd_pending;
+    std::atomic<int> load;
+    std::unordered_map<uint32_t, RDMAConnection *> connections;
+    std::vector<uint32_t> recv_repost;
+    std::vector<uint32_t> repost_owners;
+    std::deque<struct ibv_wc> deferred_recvs;
+    std::vector<Segment> send_segments;
+    PollStats poll_stats;
+    ThreadStats *stats;
+};
+
+// Worker that owns the calling thread, used to route sends to their QP
+static thread_local RDMAWorker *current_worker = nullptr;
+
+class RDMAServer {
+public:
+    // Called on the owning worker thread for every received message. The
+    // data stays valid until the handler returns.
+    typedef std::function<void(RDMAServer& server, uint32_t qp_num,
+                               const char *data, size_t len)> MessageHandler;
+
+    // Called on the owning worker thread when a client's RDMA WRITE with
+    // immediate data has landed in rdmaBuffer()
+    typedef std::function<void(RDMAServer& server, uint32_t qp_num,
+                               uint32_t imm, size_t len)> WriteHandler;
+
+    // Called on the owning worker thread when a client's connection goes
+    // away, before its qp_num can be reused, so per-connection state kept by
+    // the handlers can be dropped
+    typedef std::function<void(RDMAServer& server, uint32_t qp_num)> DisconnectHandler;
+
+private:
+    friend struct RDMAConnection;
+
+    struct rdma_cm_id *listen_id;
+    struct rdma_event_channel *ec;
+
+    // Device-wide resources shared by every connection, created on the first
+    // connect request
+    struct ibv_context *verbs;
+    struct ibv_pd *pd;
+    struct ibv_srq *srq;
+    struct ibv_mr *mr;
+    char *buffer;
+    RegisteredPool *pool;
+    MRCache *mr_cache;
+    struct ibv_mr *rdma_mr;
+    char *rdma_buffer;
+    CreditBox *credit_boxes;
+    struct ibv_mr *credit_mr;
+    uint64_t *atomic_table;
+    struct ibv_mr *atomic_mr;
+    size_t atomic_slots;
+    std::mutex credit_lock;
+    std::vector<int> free_credit_boxes;
+    std::atomic<int> srq_credits_free;
+    uint8_t max_initiator_depth;
+    uint8_t max_responder_resources;
+
+    std::vector<RDMAWorker *> workers;
+    std::thread cm_thread;
+    int stop_fd;
+    std::atomic<bool> stopping;
+    std::atomic<int> connection_count;
+    MessageHandler handler;
+    WriteHandler write_handler;
+    DisconnectHandler disconnect_handler;
+    int worker_count;
+    AssignPolicy assign_policy;
+    int pin_cpu;
+    bool numa_pin;
+    std::string bind_source;
+    unsigned int next_worker;
+    int signal_interval;
+    CompletionMode completion_mode;
+    int spin_budget_us;
+    size_t rendezvous_threshold;
+    int queue_depth;
+    int max_cqe;
+    int worker_connection_cap;
+    static const size_t BUFFER_SIZE = FramedChannel::BUFFER_SIZE;
+    static const int MAX_CONNECTIONS = 256;
+
+    // The shared receive region is carved into SRQ_SLOTS buffers of
+    // BUFFER_SIZE that are kept posted on the SRQ; each connection gets
+    // queue_depth send staging slots (one per send queue entry).
+    static const int SRQ_SLOTS = 4096;
+    static const int SRQ_POST_CHUNK = 256;
+    static const int QUEUE_DEPTH = 16;
+    static const int MAX_QUEUE_DEPTH = 256;
+    static const int RECV_REPOST_BATCH = 16;
+    static const int SIGNAL_INTERVAL = 4;
+    static const uint32_t MAX_INLINE_DATA = 256;
+    static const int SPIN_BUDGET_US = 50;
+    static const size_t REGION_SIZE = BUFFER_SIZE * SRQ_SLOTS;
+    static const int CQ_POLL_BATCH = PollStats::MAX_BATCH;
+
+    // Message size from which the client pulls the payload with RDMA READ
+    // instead of receiving it in segments
+    static const size_t RENDEZVOUS_THRESHOLD = 64 * 1024;
+
+    // Receive credits promised to clients never add up to more than the
+    // SRQ slots, so every credited SEND finds a posted receive. Each of the
+    // MAX_CONNECTIONS connection slots is guaranteed CONNECTION_SHARE
+    // credits; the 3072 slots beyond all guarantees are headroom, handed
+    // out first come up to queue_depth per client.
+    static const int CONNECTION_SHARE = 4;
+    static const uint32_t MIN_CONNECTION_CREDITS = 2;
+
+    // Window shared by all clients for one-sided READ/WRITE; advertised to
+    // every client in the accept private data
+    static const size_t RDMA_REGION_SIZE = 1 << 20;
+    static const uint8_t MAX_RD_ATOMIC = 16;
+
+    // The atomic table length travels in a 32-bit field
+    static const size_t MAX_ATOMIC_SLOTS = (1 << 20) / sizeof(uint64_t);
+
+public:
+    RDMAServer() : listen_id(nullptr), ec(nullptr), verbs(nullptr),
+                   pd(nullptr), srq(nullptr), mr(nullptr), buffer(nullptr),
+                   pool(nullptr), mr_cache(nullptr),
+                   rdma_mr(nullptr), rdma_buffer(nullptr),
+                   credit_boxes(nullptr), credit_mr(nullptr),
+                   atomic_table(nullptr), atomic_mr(nullptr), atomic_slots(0),
+                   srq_credits_free(SRQ_SLOTS),
+                   max_initiator_depth(0), max_responder_resources(0),
+                   stop_fd(-1), stopping(false), connection_count(0),
+                   worker_count(1), assign_policy(ASSIGN_ROUND_ROBIN),
+                   pin_cpu(-1), numa_pin(false), next_worker(0),
+                   signal_interval(SIGNAL_INTERVAL),
+                   completion_mode(COMPLETION_ADAPTIVE),
+                   spin_budget_us(SPIN_BUDGET_US),
+                   rendezvous_threshold(RENDEZVOUS_THRESHOLD),
+                   queue_depth(QUEUE_DEPTH), max_cqe(0),
+                   worker_connection_cap(MAX_CONNECTIONS) {
+        buffer = new char[REGION_SIZE];
+        memset(buffer, 0, REGION_SIZE);
+        rdma_buffer = new char[RDMA_REGION_SIZE];
+        memset(rdma_buffer, 0, RDMA_REGION_SIZE);
+        credit_boxes = new CreditBox[MAX_CONNECTIONS]();
+        for (int i = MAX_CONNECTIONS - 1; i >= 0; i--) {
+            free_credit_boxes.push_back(i);
+        }
+    }
+
+    ~RDMAServer() {
+        cleanup();
+        delete[] buffer;
+        delete[] rdma_buffer;
+        delete[] credit_boxes;
+    }
+
+    int initialize(const std::string& port) {
+        struct sockaddr_in addr;
+        int ret;
+
+        ec = rdma_create_event_channel();
+        if (!ec) {
+            std::cerr << "Failed to create event channel\n";
+            return -1;
+        }
+
+        // The CM thread waits with poll() so that stop() can wake it
+        int flags = fcntl(ec->fd, F_GETFL);
+        if (flags < 0 || fcntl(ec->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            std::cerr << "Failed to make event channel non-blocking\n";
+            return -1;
+        }
+
+        stop_fd = eventfd(0, EFD_NONBLOCK);
+        if (stop_fd < 0) {
+            std::cerr << "Failed to create stop eventfd\n";
+            return -1;
+        }
+
+        ret = rdma_create_id(ec, &listen_id, nullptr, RDMA_PS_TCP);
+        if (ret) {
+            std::cerr << "Failed to create listen ID\n";
+            return ret;
+        }
+
+        // Binding to one device's address keeps the listener off the others
+        ret = resolveSource(bind_source, &addr);
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret > 0) {
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = INADDR_ANY;
+        }
+        addr.sin_port = htons(std::stoi(port));
+
+        ret = rdma_bind_addr(listen_id, (struct sockaddr*)&addr);
+        if (ret) {
+            std::cerr << "Failed to bind address\n";
+            return ret;
+        }
+
+        ret = rdma_listen(listen_id, MAX_CONNECTIONS);
+        if (ret) {
+            std::cerr << "Failed to listen\n";
+            return ret;
+        }
+
+        LOG_INFO("RDMA server listening on port %s", port.c_str());
+        return 0;
+    }
+
+    // Start the CM thread. Worker threads are started once the first connect
+    // request tells us which device to create their CQs on.
+    int start(const MessageHandler& message_handler) {
+        handler = message_handler;
+
+        for (int i = 0; i < worker_count; i++) {
+            RDMAWorker *worker = new RDMAWorker();
+            worker->index = i;
+            worker->comp_chan = nullptr;
+            worker->cq = nullptr;
+            worker->cmd_pending = false;
+            worker->load = 0;
+            worker->recv_repost.reserve(SRQ_SLOTS);
+            worker->repost_owners.reserve(SRQ_SLOTS);
+            memset(&worker->poll_stats, 0, sizeof(worker->poll_stats));
+            workers.push_back(worker);
+
+            worker->wake_fd = eventfd(0, EFD_NONBLOCK);
+            if (worker->wake_fd < 0) {
+                std::cerr << "Failed to create worker eventfd\n";
+                return -1;
+            }
+        }
+
+        cm_thread = std::thread(&RDMAServer::waitForConnection, this);
+        return 0;
+    }
+
+    // Block until the CM thread exits (after stop())
+    void wait() {
+        if (cm_thread.joinable()) {
+            cm_thread.join();
+        }
+    }
+
+    void stop() {
+        uint64_t one = 1;
+
+        stopping = true;
+        if (stop_fd >= 0 && write(stop_fd, &one, sizeof(one)) < 0) {
+            std::cerr << "Failed to wake CM thread\n";
+        }
+        for (size_t i = 0; i < workers.size(); i++) {
+            wakeWorker(workers[i]);
+        }
+
+        wait();
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (workers[i]->thread.joinable()) {
+                workers[i]->thread.join();
+            }
+        }
+    }
+
+    int sendMessage(uint32_t qp_num, const std::string& message) {
+        int ret = sendData(qp_num, message.data(), message.size());
+        if (ret) {
+            return ret;
+        }
+
+        LOG_DEBUG("Message sent: %s", previewPayload(message.data(), message.size()).c_str());
+        return 0;
+    }
+
+    // Send one binary message. Payloads larger than a receive slot are split
+    // into segments and payloads of rendezvous_threshold bytes or more are
+    // pulled by the client with a single RDMA READ, from a copy so that the
+    // worker does not wait for the client. The buffer may be reused as soon
+    // as the call returns. Like sendMessages, this must be called on the
+    // worker thread that owns the connection, i.e. from a handler.
+    int sendData(uint32_t qp_num, const void *data, size_t len) {
+        RDMAWorker *worker = ownerWorker(qp_num);
+        if (!worker) {
+            return -1;
+        }
+
+        RDMAConnection *conn = findConnection(worker, qp_num);
+        worker->send_segments.clear();
+        int ret = queueMessage(conn, (const char *)data, len);
+        return ret ? ret : conn->postSegments(worker->send_segments.data(),
+                                              worker->send_segments.size());
+    }
+
+    // Send a batch of messages; segments of consecutive non-rendezvous
+    // messages are posted together as chained work requests
+    int sendMessages(uint32_t qp_num, const std::vector<std::string>& messages) {
+        RDMAWorker *worker = ownerWorker(qp_num);
+        if (!worker) {
+            return -1;
+        }
+
+        RDMAConnection *conn = findConnection(worker, qp_num);
+        worker->send_segments.clear();
+        for (size_t i = 0; i < messages.size(); i++) {
+            int ret = queueMessage(conn, messages[i].data(), messages[i].size());
+            if (ret) {
+                return ret;
+            }
+        }
+        return conn->postSegments(worker->send_segments.data(), worker->send_segments.size());
+    }
+
+    // Registered buffer from the pool. Messages sent from it with sendData
+    // are gathered by the HCA without a staging copy once they span more
+    // than one segment. Returns nullptr until the first client connected,
+    // which is when the device and the pool are set up.
+    void *allocBuffer(size_t size) {
+        return pool ? pool->allocate(size) : nullptr;
+    }
+
+    void freeBuffer(void *ptr) {
+        if (pool) {
+            pool->deallocate(ptr);
+        }
+    }
+
+    // Must be called before start()
+    void setWriteHandler(const WriteHandler& handler_fn) {
+        write_handler = handler_fn;
+    }
+
+    // Must be called before start()
+    void setDisconnectHandler(const DisconnectHandler& handler_fn) {
+        disconnect_handler = handler_fn;
+    }
+
+    // Window that clients access with one-sided operations
+    char *rdmaBuffer() {
+        return rdma_buffer;
+    }
+
+    size_t rdmaBufferSize() const {
+        return RDMA_REGION_SIZE;
+    }
+
+    // Table of 64-bit words that clients update with atomic operations
+    // (see rdma_atomic.h); nullptr without setAtomicSlots() or before the
+    // first client connected. The HCA changes words behind the CPU's back,
+    // so read them with relaxed atomic loads and do not write them.
+    const uint64_t *atomicTable() const {
+        return atomic_table;
+    }
+
+    size_t atomicSlots() const {
+        return atomic_mr ? atomic_slots : 0;
+    }
+
+    size_t connectionCount() const {
+        return connection_count;
+    }
+
+    // Sum of the per-worker statistics; only meaningful once workers stopped
+    void printPollStats() const {
+        PollStats total;
+        memset(&total, 0, sizeof(total));
+        for (size_t w = 0; w < workers.size(); w++) {
+            const PollStats& stats = workers[w]->poll_stats;
+            total.polls += stats.polls;
+            total.empty_polls += stats.empty_polls;
+            total.completions += stats.completions;
+            total.errors += stats.errors;
+            total.credit_stalls += stats.credit_stalls;
+            total.max_batch = std::max(total.max_batch, stats.max_batch);
+            for (int i = 0; i <= PollStats::MAX_BATCH; i++) {
+                total.batch_hist[i] += stats.batch_hist[i];
+            }
+        }
+
+        std::cout << "CQ polls: " << total.polls
+                  << " (empty " << total.empty_polls << ")"
+                  << ", completions: " << total.completions
+                  << ", errors: " << total.errors
+                  << ", max batch: " << total.max_batch
+                  << ", credit stalls: " << total.credit_stalls << "\n";
+        for (int i = 1; i <= PollStats::MAX_BATCH; i++) {
+            if (total.batch_hist[i]) {
+                std::cout << "  batch " << i << ": " << total.batch_hist[i] << "\n";
+            }
+        }
+    }
+
+    void setCompletionMode(CompletionMode mode, int spin_us) {
+        completion_mode = mode;
+        spin_budget_us = std::max(0, spin_us);
+    }
+
+    void setSignalInterval(int interval) {
+        signal_interval = std::max(1, std::min(interval, queue_depth));
+    }
+
+    void setRendezvousThreshold(size_t bytes) {
+        rendezvous_threshold = std::max((size_t)1, bytes);
+    }
+
+    // Send queue entries and receive credits per connection; must be called
+    // before start()
+    void setQueueDepth(int depth) {
+        queue_depth = std::max((int)MIN_CONNECTION_CREDITS, std::min(depth, (int)MAX_QUEUE_DEPTH));
+        signal_interval = std::min(signal_interval, queue_depth);
+    }
+
+    // Must be called before start(). pin_first_cpu < 0 disables pinning;
+    // otherwise worker i is pinned to CPU (pin_first_cpu + i) modulo the
+    // number of CPUs.
+    void setWorkers(int count, AssignPolicy policy, int pin_first_cpu) {
+        worker_count = std::max(1, count);
+        assign_policy = policy;
+        pin_cpu = pin_first_cpu;
+    }
+
+    // Listen on one local address, interface or RDMA device (see
+    // rdma_device.h) instead of all of them. Must be called before
+    // initialize().
+    void setBindSource(const std::string& spec) {
+        bind_source = spec;
+    }
+
+    // Without explicit pinning, run the CM thread and the workers on CPUs
+    // local to the device, one worker per CPU, so the memory they allocate
+    // lands on its NUMA node. Must be called before start().
+    void setNumaPinning(bool enable) {
+        numa_pin = enable;
+    }
+
+    // Open a table of slots zeroed 64-bit words to remote atomics,
+    // advertised to every client next to the window. Counters and locks in
+    // it are then updated by clients without involving this process. Must
+    // be called before initialize().
+    void setAtomicSlots(size_t slots) {
+        atomic_slots = std::min(slots, (size_t)MAX_ATOMIC_SLOTS);
+    }
+
+private:
+    // CM event loop, run on its own thread so that connection setup never
+    // stalls the data path
+    void waitForConnection() {
+        while (!stopping) {
+            struct pollfd pfd[2];
+            pfd[0].fd = ec->fd;
+            pfd[0].events = POLLIN;
+            pfd[0].revents = 0;
+            pfd[1].fd = stop_fd;
+            pfd[1].events = POLLIN;
+            pfd[1].revents = 0;
+            if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+                std::cerr << "Failed to wait for CM events\n";
+                return;
+            }
+            if (pfd[1].revents) {
+                return;
+            }
+
+            if (processCMEvents()) {
+                return;
+            }
+        }
+    }
+
+    // Drain every pending CM event without blocking
+    int processCMEvents() {
+        struct rdma_cm_event *event;
+
+        while (rdma_get_cm_event(ec, &event) == 0) {
+            struct rdma_cm_id *id = event->id;
+            enum rdma_cm_event_type type = event->event;
+
+            // Private data is only valid until the event is acknowledged
+            struct rdma_conn_param request = event->param.conn;
+            ConnectionInfo peer;
+            bool has_peer = type == RDMA_CM_EVENT_CONNECT_REQUEST &&
+                            unpackConnectionInfo(request.private_data,
+                                                 request.private_data_len, &peer) == 0;
+            rdma_ack_cm_event(event);
+
+            switch (type) {
+                case RDMA_CM_EVENT_CONNECT_REQUEST:
+                    if (!has_peer) {
+                        std::cerr << "Connect request without connection info\n";
+                        rdma_reject(id, nullptr, 0);
+                        rdma_destroy_id(id);
+                    } else if (handleConnectRequest(id, request, peer)) {
+                        rdma_reject(id, nullptr, 0);
+                        rdma_destroy_id(id);
+                    }
+                    break;
+
+                case RDMA_CM_EVENT_ESTABLISHED: {
+                    RDMAConnection *conn = (RDMAConnection *)id->context;
+                    if (conn) {
+                        LOG_INFO("Connection established (qp %u, worker %d, %d active)",
+                                 conn->qp_num, conn->worker->index, connection_count.load());
+                    }
+                    break;
+                }
+
+                case RDMA_CM_EVENT_DISCONNECTED:
+                case RDMA_CM_EVENT_CONNECT_ERROR:
+                case RDMA_CM_EVENT_UNREACHABLE:
+                case RDMA_CM_EVENT_REJECTED: {
+                    RDMAConnection *conn = (RDMAConnection *)id->context;
+                    if (!conn) {
+                        break;
+                    }
+                    if (type == RDMA_CM_EVENT_DISCONNECTED) {
+                        LOG_INFO("Client disconnected (qp %u)", conn->qp_num);
+                    } else {
+                        std::cerr << "Connection failed (qp " << conn->qp_num << ")\n";
+                    }
+                    // The worker owns the connection now and tears it down
+                    id->context = nullptr;
+                    postCommand(conn->worker, false, conn);
+                    break;
+                }
+
+                default:
+                    break;
+            }
+        }
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            std::cerr << "Failed to get CM event\n";
+            return -1;
+        }
+        return 0;
+    }
+
+    // Allocated with the device, so that with NUMA pinning the table lands
+    // on the node of the HCA that executes the atomics
+    int setupAtomicTable(const struct ibv_device_attr& dev_attr) {
+        if (dev_attr.atomic_cap == IBV_ATOMIC_NONE) {
+            std::cerr << ibv_get_device_name(verbs->device)
+                      << " does not support atomic operations\n";
+            return -1;
+        }
+        if (dev_attr.atomic_cap != IBV_ATOMIC_GLOB) {
+            LOG_INFO("Atomics on %s are atomic only with respect to its own atomics",
+                     ibv_get_device_name(verbs->device));
+        }
+
+        atomic_table = new uint64_t[atomic_slots]();
+        atomic_mr = ibv_reg_mr(pd, atomic_table, atomic_slots * sizeof(uint64_t),
+                               IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+                               IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC);
+        if (!atomic_mr) {
+            std::cerr << "Failed to register atomic table\n";
+            return -1;
+        }
+        LOG_INFO("Atomic table: %zu slots", atomic_slots);
+        return 0;
+    }
+
+    // Create the PD, SRQ and receive region shared by all connections, give
+    // every worker its CQ and start the worker threads. verbs is only set
+    // once everything exists; a failure releases what was created, so the
+    // next connect request starts over.
+    int setupDevice(struct ibv_context *context) {
+        verbs = context;
+        int ret = createDeviceResources();
+        if (ret) {
+            releaseDevice();
+            return ret;
+        }
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i]->thread = std::thread(&RDMAServer::workerLoop, this, workers[i]);
+        }
+        return 0;
+    }
+
+    int createDeviceResources() {
+        if (numa_pin && pin_cpu < 0 && pinToDevice(verbs) == 0) {
+            LOG_INFO("Serving %s from NUMA node %d", ibv_get_device_name(verbs->device),
+                     deviceNumaNode(verbs));
+        }
+
+        pd = ibv_alloc_pd(verbs);
+        if (!pd) {
+            std::cerr << "Failed to allocate protection domain\n";
+            return -1;
+        }
+
+        mr = ibv_reg_mr(pd, buffer, REGION_SIZE, IBV_ACCESS_LOCAL_WRITE);
+        if (!mr) {
+            std::cerr << "Failed to register memory region\n";
+            return -1;
+        }
+
+        // Pool and cached buffers also hold the rendezvous copies clients
+        // pull messages from
+        pool = new RegisteredPool(pd, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+        mr_cache = new MRCache(pd, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+
+        rdma_mr = ibv_reg_mr(pd, rdma_buffer, RDMA_REGION_SIZE,
+                             IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ);
+        if (!rdma_mr) {
+            std::cerr << "Failed to register RDMA buffer\n";
+            return -1;
+        }
+
+        credit_mr = ibv_reg_mr(pd, credit_boxes, sizeof(CreditBox) * MAX_CONNECTIONS,
+                               IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+        if (!credit_mr) {
+            std::cerr << "Failed to register credit mailboxes\n";
+            return -1;
+        }
+
+        // Bounds for the READ credits negotiated with each client
+        struct ibv_device_attr dev_attr;
+        if (ibv_query_device(verbs, &dev_attr)) {
+            std::cerr << "Failed to query device\n";
+            return -1;
+        }
+        max_initiator_depth = std::min((int)MAX_RD_ATOMIC, dev_attr.max_qp_init_rd_atom);
+        max_responder_resources = std::min((int)MAX_RD_ATOMIC, dev_attr.max_qp_rd_atom);
+        max_cqe = dev_attr.max_cqe;
+
+        if (atomic_slots > 0) {
+            int ret = setupAtomicTable(dev_attr);
+            if (ret) {
+                return ret;
+            }
+        }
+
+        struct ibv_srq_init_attr srq_attr;
+        memset(&srq_attr, 0, sizeof(srq_attr));
+        srq_attr.attr.max_wr = SRQ_SLOTS;
+        srq_attr.attr.max_sge = 1;
+
+        srq = ibv_create_srq(pd, &srq_attr);
+        if (!srq) {
+            std::cerr << "Failed to create shared receive queue\n";
+            return -1;
+        }
+
+        // Fill the SRQ before the first accept so no client's first SEND
+        // can find it empty
+        int ret = postReceiveRing();
+        if (ret) {
+            std::cerr << "Failed to post initial receives\n";
+            return ret;
+        }
+
+        // A CQ overrun is fatal for every QP on it, so each worker's CQ holds
+        // a completion for every SRQ slot and every send queue entry of all
+        // the connections it could be given. Assignment does not keep the
+        // workers even, so that is all of them, unless the device has fewer
+        // CQEs; then the connections per worker are capped instead.
+        int cq_depth = std::min(SRQ_SLOTS + MAX_CONNECTIONS * queue_depth, max_cqe);
+        worker_connection_cap = (cq_depth - SRQ_SLOTS) / queue_depth;
+        if (worker_connection_cap < 1) {
+            std::cerr << "Completion queues of " << max_cqe << " entries are too small\n";
+            return -1;
+        }
+        if (worker_connection_cap < MAX_CONNECTIONS) {
+            LOG_WARN("The device's CQ size limits each worker to %d connections",
+                     worker_connection_cap);
+        }
+        for (size_t i = 0; i < workers.size(); i++) {
+            RDMAWorker *worker = workers[i];
+
+            if (completion_mode != COMPLETION_BUSY_POLL) {
+                worker->comp_chan = ibv_create_comp_channel(verbs);
+                if (!worker->comp_chan) {
+                    std::cerr << "Failed to create completion channel\n";
+                    return -1;
+                }
+
+                // Workers wait with poll() on the channel and their wake fd
+                int flags = fcntl(worker->comp_chan->fd, F_GETFL);
+                if (flags < 0 || fcntl(worker->comp_chan->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+                    std::cerr << "Failed to make completion channel non-blocking\n";
+                    return -1;
+                }
+            }
+
+            worker->cq = ibv_create_cq(verbs, cq_depth, nullptr, worker->comp_chan, 0);
+            if (!worker->cq) {
+                std::cerr << "Failed to create completion queue\n";
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    // Device resources shared by all connections; their connections must
+    // be gone and the workers stopped
+    void releaseDevice() {
+        for (size_t i = 0; i < workers.size(); i++) {
+            RDMAWorker *worker = workers[i];
+            worker->cq_events.release(worker->cq);
+            if (worker->cq) ibv_destroy_cq(worker->cq);
+            if (worker->comp_chan) ibv_destroy_comp_channel(worker->comp_chan);
+            worker->cq = nullptr;
+            worker->comp_chan = nullptr;
+        }
+
+        if (srq) ibv_destroy_srq(srq);
+        delete mr_cache;
+        delete pool;
+        if (atomic_mr) ibv_dereg_mr(atomic_mr);
+        if (credit_mr) ibv_dereg_mr(credit_mr);
+        if (rdma_mr) ibv_dereg_mr(rdma_mr);
+        if (mr) ibv_dereg_mr(mr);
+        if (pd) ibv_dealloc_pd(pd);
+        delete[] atomic_table;
+        srq = nullptr;
+        mr_cache = nullptr;
+        pool = nullptr;
+        atomic_mr = nullptr;
+        credit_mr = nullptr;
+        rdma_mr = nullptr;
+        mr = nullptr;
+        pd = nullptr;
+        atomic_table = nullptr;
+        verbs = nullptr;
+    }
+
+    // nullptr when every worker holds as many connections as its CQ can
+    // serve
+    RDMAWorker *pickWorker() {
+        if (assign_policy == ASSIGN_LEAST_LOADED) {
+            RDMAWorker *best = workers[0];
+            for (size_t i = 1; i < workers.size(); i++) {
+                if (workers[i]->load < best->load) {
+                    best = workers[i];
+                }
+            }
+            return best->load < worker_connection_cap ? best : nullptr;
+        }
+        for (size_t i = 0; i < workers.size(); i++) {
+            RDMAWorker *worker = workers[next_worker++ % workers.size()];
+            if (worker->load < worker_connection_cap) {
+                return worker;
+            }
+        }
+        return nullptr;
+    }
+
+    int handleConnectRequest(struct rdma_cm_id *id, const struct rdma_conn_param& request,
+                             const ConnectionInfo& peer) {
+        int ret;
+
+        if (!verbs) {
+            ret = setupDevice(id->verbs);
+            if (ret) {
+                return ret;
+            }
+        } else if (id->verbs != verbs) {
+            std::cerr << "Connect request on a second RDMA device is not supported\n";
+            return -1;
+        }
+
+        if (connection_count >= MAX_CONNECTIONS) {
+            std::cerr << "Connection limit reached\n";
+            return -1;
+        }
+        RDMAWorker *worker = pickWorker();
+        if (!worker) {
+            std::cerr << "Every worker has reached its connection limit\n";
+            return -1;
+        }
+
+        // Promise the client whatever the SRQ has left beyond the shares of
+        // the other free connection slots: at least its own share, and more
+        // while headroom remains. Only this thread takes credits, and
+        // workers return them before a slot is counted free, so every
+        // slot's share stays available.
+        int reserved = (MAX_CONNECTIONS - connection_count - 1) * CONNECTION_SHARE;
+        uint32_t grant = (uint32_t)std::min(queue_depth, srq_credits_free.load() - reserved);
+
+        RDMAConnection *conn = new RDMAConnection();
+        conn->server = this;
+        conn->id = id;
+        conn->worker = worker;
+        conn->queue_depth = queue_depth;
+        conn->signal_interval = signal_interval;
+        conn->rendezvous_threshold = rendezvous_threshold;
+        conn->remote = peer.window;
+        conn->credit_remote = peer.mailbox;
+        conn->peer_credits = peer.credits;
+        conn->recv_granted = grant;
+        conn->recv_posted = grant;
+        conn->recv_advertised = grant;
+        conn->post_times.resize(queue_depth);
+        srq_credits_free -= grant;
+
+        {
+            std::lock_guard<std::mutex> guard(credit_lock);
+            conn->credit_index = free_credit_boxes.back();
+            free_credit_boxes.pop_back();
+        }
+        conn->credit_box = &credit_boxes[conn->credit_index];
+        conn->credit_lkey = credit_mr->lkey;
+        memset(conn->credit_box, 0, sizeof(CreditBox));
+
+        // Send slots come from the pre-registered pool, so accepting a client
+        // does not pay for a memory registration
+        size_t send_region_size = BUFFER_SIZE * queue_depth;
+        conn->send_slots = (char *)pool->allocate(send_region_size);
+        if (!conn->send_slots) {
+            std::cerr << "Failed to allocate send region\n";
+            freeConnection(conn);
+            return -1;
+        }
+        conn->send_lkey = pool->findMR(conn->send_slots, send_region_size)->lkey;
+
+        struct ibv_qp_init_attr qp_attr;
+        memset(&qp_attr, 0, sizeof(qp_attr));
+        qp_attr.send_cq = conn->worker->cq;
+        qp_attr.recv_cq = conn->worker->cq;
+        qp_attr.srq = srq;
+        qp_attr.qp_type = IBV_QPT_RC;
+        qp_attr.cap.max_send_wr = queue_depth;
+        qp_attr.cap.max_send_sge = 2;
+        qp_attr.cap.max_inline_data = MAX_INLINE_DATA;
+
+        ret = createQueuePair(id, pd, &qp_attr);
+        if (ret) {
+            std::cerr << "Failed to create queue pair\n";
+            freeConnection(conn);
+            return ret;
+        }
+
+        conn->max_inline = qp_attr.cap.max_inline_data;
+        conn->qp = id->qp;
+        conn->qp_num = id->qp->qp_num;
+        conn->stats = StatsRegistry::instance().openConnection(conn->credit_index, conn->qp_num);
+        id->context = conn;
+
+        // Hand the connection over before accepting, so the worker already
+        // knows the QP when its first receive completes
+        conn->worker->load++;
+        connection_count++;
+        postCommand(conn->worker, true, conn);
+
+        // Advertise our window, mailbox and receive credits, and grant as
+        // many READ credits as the client asked for, within the device limits
+        ConnectionInfo local;
+        struct rdma_conn_param conn_param;
+
+        packConnectionInfo(rdma_mr, conn->credit_box, credit_mr->rkey,
+                           grant, atomic_mr, &local);
+        memset(&conn_param, 0, sizeof(conn_param));
+        conn_param.private_data = &local;
+        conn_param.private_data_len = sizeof(local);
+        conn_param.responder_resources = std::min(request.initiator_depth, max_responder_resources);
+        conn_param.initiator_depth = std::min(request.responder_resources, max_initiator_depth);
+        conn_param.rnr_retry_count = 7;
+
+        ret = rdma_accept(id, &conn_param);
+        if (ret) {
+            std::cerr << "Failed to accept connection\n";
+            id->context = nullptr;
+            postCommand(conn->worker, false, conn);
+        }
+
+        return 0;
+    }
+
+    void postCommand(RDMAWorker *worker, bool add, RDMAConnection *conn) {
+        WorkerCommand cmd;
+        cmd.add = add;
+        cmd.conn = conn;
+
+        {
+            std::lock_guard<std::mutex> guard(worker->cmd_lock);
+            worker->commands.push_back(cmd);
+        }
+        worker->cmd_pending.store(true, std::memory_order_release);
+        wakeWorker(worker);
+    }
+
+    void wakeWorker(RDMAWorker *worker) {
+        uint64_t one = 1;
+        if (worker->wake_fd >= 0 && write(worker->wake_fd, &one, sizeof(one)) < 0) {
+            std::cerr << "Failed to wake worker " << worker->index << "\n";
+        }
+    }
+
+    // Apply connection hand-overs on the worker thread
+    void processCommands(RDMAWorker *worker) {
+        std::vector<WorkerCommand> commands;
+
+        {
+            std::lock_guard<std::mutex> guard(worker->cmd_lock);
+            commands.swap(worker->commands);
+            worker->cmd_pending.store(false, std::memory_order_relaxed);
+        }
+
+        for (size_t i = 0; i < commands.size(); i++) {
+            RDMAConnection *conn = commands[i].conn;
+            if (commands[i].add) {
+                worker->connections[conn->qp_num] = conn;
+            } else {
+                // cleanup() drains the commands from its own thread once the
+                // workers have stopped serving
+                if (disconnect_handler && current_worker == worker) {
+                    disconnect_handler(*this, conn->qp_num);
+                }
+                destroyConnection(conn);
+            }
+        }
+    }
+
+    RDMAConnection *findConnection(RDMAWorker *worker, uint32_t qp_num) {
+        std::unordered_map<uint32_t, RDMAConnection *>::iterator it =
+            worker->connections.find(qp_num);
+        return it == worker->connections.end() ? nullptr : it->second;
+    }
+
+    void freeConnection(RDMAConnection *conn) {
+        if (conn->reassembly.capacity() > 0) {
+            mr_cache->invalidate(conn->reassembly.data(), conn->reassembly.capacity());
+        }
+        if (conn->stats) {
+            StatsRegistry::instance().closeConnection(conn->credit_index);
+        }
+        {
+            std::lock_guard<std::mutex> guard(credit_lock);
+            free_credit_boxes.push_back(conn->credit_index);
+        }
+        srq_credits_free += conn->recv_granted;
+        conn->dropRendezvous();
+        pool->deallocate(conn->send_slots);
+        delete conn;
+    }
+
+    void destroyConnection(RDMAConnection *conn) {
+        struct rdma_cm_id *id = conn->id;
+
+        conn->worker->connections.erase(conn->qp_num);
+        conn->worker->load--;
+        rdma_destroy_qp(id);
+        freeConnection(conn);
+        rdma_destroy_id(id);
+        connection_count--;
+    }
+
+    void pinThread(RDMAWorker *worker) {
+        if (pin_cpu < 0) {
+            if (numa_pin) {
+                pinToDevice(verbs, worker->index);
+            }
+            return;
+        }
+
+        unsigned int cpus = std::max(1u, std::thread::hardware_concurrency());
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET((pin_cpu + worker->index) % cpus, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+            std::cerr << "Failed to pin worker " << worker->index << "\n";
+        }
+    }
+
+    void workerLoop(RDMAWorker *worker) {
+        current_worker = worker;
+        worker->stats = threadStats();
+        pinThread(worker);
+
+        while (!stopping) {
+            if (worker->cmd_pending.load(std::memory_order_acquire)) {
+                processCommands(worker);
+            }
+
+            while (!worker->deferred_recvs.empty()) {
+                struct ibv_wc wc = worker->deferred_recvs.front();
+                worker->deferred_recvs.pop_front();
+                handleRecvCompletion(worker, wc);
+            }
+
+            if (pollCompletions(worker, false)) {
+                std::cerr << "Worker " << worker->index << " stopped\n";
+                return;
+            }
+
+            // Released slots are not held back while the worker is idle:
+            // their clients may be waiting for the credits
+            flushReceives(worker, false);
+        }
+    }
+
+    // Poll up to max completions, waiting according to completion_mode until
+    // at least one is available. Returns 0 without completions when the
+    // worker has been woken for a command or for shutdown.
+    int waitForCompletions(RDMAWorker *worker, struct ibv_wc *wc, int max) {
+        int n = pollCQ(worker, wc, max);
+        if (n != 0) {
+            return n;
+        }
+
+        if (completion_mode != COMPLETION_EVENT) {
+            std::chrono::steady_clock::time_point deadline =
+                std::chrono::steady_clock::now() + std::chrono::microseconds(spin_budget_us);
+            do {
+                n = pollCQ(worker, wc, max);
+                if (n != 0) {
+                    return n;
+                }
+                if (worker->cmd_pending.load(std::memory_order_relaxed) || stopping) {
+                    return 0;
+                }
+            } while (completion_mode == COMPLETION_BUSY_POLL ||
+                     std::chrono::steady_clock::now() < deadline);
+        }
+
+        for (;;) {
+            if (worker->cq_events.arm(worker->cq)) {
+                return -1;
+            }
+            n = pollCQ(worker, wc, max);
+            if (n != 0) {
+                return n;
+            }
+
+            struct pollfd pfd[2];
+            pfd[0].fd = worker->comp_chan->fd;
+            pfd[0].events = POLLIN;
+            pfd[0].revents = 0;
+            pfd[1].fd = worker->wake_fd;
+            pfd[1].events = POLLIN;
+            pfd[1].revents = 0;
+            if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+                std::cerr << "Failed to wait for completion events\n";
+                return -1;
+            }
+            if (pfd[1].revents) {
+                uint64_t count;
+                if (read(worker->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    std::cerr << "Failed to read worker eventfd\n";
+                }
+                return 0;
+            }
+            if (!pfd[0].revents) {
+                continue;
+            }
+
+            if (worker->cq_events.consume(worker->comp_chan, worker->cq)) {
+                if (errno == EAGAIN) {
+                    continue;
+                }
+                std::cerr << "Failed to get completion event\n";
+                return -1;
+            }
+
+            n = pollCQ(worker, wc, max);
+            if (n != 0) {
+                return n;
+            }
+        }
+    }
+
+    int pollCQ(RDMAWorker *worker, struct ibv_wc *wc, int max) {
+        int n = ibv_poll_cq(worker->cq, max, wc);
+        if (n < 0) {
+            std::cerr << "Failed to poll completion queue\n";
+            return n;
+        }
+
+        PollStats& stats = worker->poll_stats;
+        worker->stats->count(STAT_CQ_POLLS);
+        stats.polls++;
+        stats.batch_hist[n]++;
+        if (n == 0) {
+            worker->stats->count(STAT_EMPTY_POLLS);
+            stats.empty_polls++;
+        } else {
+            worker->stats->count(STAT_COMPLETIONS, n);
+            stats.completions += n;
+            stats.max_batch = std::max(stats.max_batch, n);
+        }
+        return n;
+    }
+
+    // Drain a batch of completions from the worker's CQ and route each one to
+    // the handler for its work request kind. Failed completions are reported
+    // and counted but only affect their own connection; -1 is returned for
+    // CQ-level failures. With defer_recvs set, receive completions are queued
+    // for the worker loop instead of being handled immediately. Without wait,
+    // returns at once if the CQ is empty.
+    int pollCompletions(RDMAWorker *worker, bool defer_recvs, bool wait = true) {
+        struct ibv_wc wc[CQ_POLL_BATCH];
+
+        int n = wait ? waitForCompletions(worker, wc, CQ_POLL_BATCH)
+                     : pollCQ(worker, wc, CQ_POLL_BATCH);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0 && worker->cmd_pending.load(std::memory_order_acquire)) {
+            processCommands(worker);
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                reportCompletionError(worker, wc[i]);
+            }
+
+            switch (wrIdKind(wc[i].wr_id)) {
+                case WR_KIND_SEND:
+                case WR_KIND_READ:
+                case WR_KIND_WRITE:
+                    handleSendCompletion(worker, wc[i]);
+                    break;
+                case WR_KIND_RECV:
+                    // Credits apply on arrival. DONE frames never reach the
+                    // handler and release their rendezvous copy at once.
+                    if (applyFrameCredits(worker, wc[i]) != FRAME_DONE && defer_recvs) {
+                        worker->deferred_recvs.push_back(wc[i]);
+                    } else {
+                        handleRecvCompletion(worker, wc[i]);
+                    }
+                    break;
+                default:
+                    std::cerr << "Completion with unknown wr_id " << wc[i].wr_id << "\n";
+                    break;
+            }
+        }
+        return 0;
+    }
+
+    void reportCompletionError(RDMAWorker *worker, const struct ibv_wc& wc) {
+        worker->stats->count(STAT_ERRORS);
+        if (wc.status == IBV_WC_RNR_RETRY_EXC_ERR) {
+            worker->stats->count(STAT_RNR_ERRORS);
+        }
+        worker->poll_stats.errors++;
+        std::cerr << "Work completion failed: " << wrKindName(wrIdKind(wc.wr_id))
+                  << " wr_id=" << wc.wr_id << " qp=" << wc.qp_num
+                  << " status=" << ibv_wc_status_str(wc.status)
+                  << " vendor_err=" << wc.vendor_err << "\n";
+    }
+
+    // Worker of the calling thread, if it owns the connection
+    RDMAWorker *ownerWorker(uint32_t qp_num) {
+        RDMAWorker *worker = current_worker;
+        if (!worker || !findConnection(worker, qp_num)) {
+            std::cerr << "Connection " << qp_num << " not owned by this thread\n";
+            return nullptr;
+        }
+        return worker;
+    }
+
+    // Poll on behalf of a caller blocked on one connection. Receives are
+    // deferred so the handler is never re-entered, and the connection is
+    // looked up again because its teardown may have been processed meanwhile.
+    RDMAConnection *waitOnConnection(RDMAWorker *worker, uint32_t qp_num, bool wait = true) {
+        if (pollCompletions(worker, true, wait) || stopping) {
+            return nullptr;
+        }
+
+        RDMAConnection *conn = findConnection(worker, qp_num);
+        if (!conn) {
+            std::cerr << "Connection " << qp_num << " closed while sending\n";
+        }
+        return conn;
+    }
+
+    // Registration covering memory that is already registered: the window or
+    // the pool
+    struct ibv_mr *findRegisteredMR(const void *buf, size_t len) {
+        const char *local = (const char *)buf;
+        if (local >= rdma_buffer && len <= RDMA_REGION_SIZE &&
+            local - rdma_buffer <= (ptrdiff_t)(RDMA_REGION_SIZE - len)) {
+            return rdma_mr;
+        }
+        return pool->findMR(buf, len);
+    }
+
+    // Append the frames of one message to the worker's send_segments
+    int queueMessage(RDMAConnection *conn, const char *data, size_t len) {
+        conn->stats->msgs_sent.add(1);
+        conn->stats->bytes_sent.add(len);
+        conn->worker->stats->count(STAT_MSGS_SENT);
+        conn->worker->stats->count(STAT_BYTES_SENT, len);
+        if (len < conn->rendezvous_threshold) {
+            return conn->queueFrames(&conn->worker->send_segments, data, len);
+        }
+
+        // The client pulls a rendezvous message whenever it gets to it, so
+        // the connection holds a copy of it until the DONE
+        char *copy = copyRendezvous(data, len);
+        if (!copy) {
+            std::cerr << "No memory for a rendezvous message of " << len << " bytes\n";
+            return -1;
+        }
+        return conn->queueFrames(&conn->worker->send_segments, copy, len, 0, copy);
+    }
+
+    // Pool memory up to its largest size class, beyond that a mapping of
+    // its own registered through the MR cache. Copies never share a page,
+    // so dropping the registration of one leaves the others readable.
+    char *copyRendezvous(const char *data, size_t len) {
+        char *copy = (char *)pool->allocate(len);
+        if (!copy) {
+            void *mapped = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mapped == MAP_FAILED) {
+                return nullptr;
+            }
+            copy = (char *)mapped;
+        }
+        memcpy(copy, data, len);
+        return copy;
+    }
+
+    void releaseRendezvousCopy(char *copy, size_t len) {
+        if (pool->findMR(copy, len)) {
+            pool->deallocate(copy);
+            return;
+        }
+        mr_cache->invalidate(copy, len);
+        munmap(copy, len);
+    }
+
+    // Send-queue completions return the credits of every WR they retire.
+    // Completions of connections that were already torn down are dropped.
+    void handleSendCompletion(RDMAWorker *worker, const struct ibv_wc& wc) {
+        RDMAConnection *conn = findConnection(worker, wc.qp_num);
+        if (conn) {
+            conn->retireSends(wc, worker->stats, statsNowNs());
+        }
+    }
+
+    // Apply the send credits carried by a received frame and return its
+    // frame type, or 0 for anything that is not a frame
+    int applyFrameCredits(RDMAWorker *worker, const struct ibv_wc& wc) {
+        MessageHeader header;
+        if (wc.status != IBV_WC_SUCCESS || wc.opcode != IBV_WC_RECV ||
+            unpackHeader(recvSlot(wrIdValue(wc.wr_id)), wc.byte_len, &header)) {
+            return 0;
+        }
+
+        RDMAConnection *conn = findConnection(worker, wc.qp_num);
+        return conn ? conn->applyFrameHeader(header) : header.type;
+    }
+
+    // Deliver a received message to the handler once it is complete, then
+    // hand its slot back to the SRQ. Slots are re-posted in batches to save
+    // doorbells, except after DONE frames, whose credit the client reserved
+    // and gets back at once.
+    void handleRecvCompletion(RDMAWorker *worker, const struct ibv_wc& wc) {
+        uint32_t slot = wrIdValue(wc.wr_id);
+        RDMAConnection *conn = findConnection(worker, wc.qp_num);
+        bool control = false;
+
+        // A failed receive belongs to a connection that is going away and
+        // was already reported by the dispatcher
+        if (wc.status == IBV_WC_SUCCESS && conn) {
+            if (wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+                // The payload went to rdma_buffer; the slot only carried the
+                // notification
+                if (write_handler) {
+                    write_handler(*this, wc.qp_num, ntohl(wc.imm_data), wc.byte_len);
+                }
+            } else {
+                MessageHeader header;
+                const char *frame = recvSlot(slot);
+                const char *data = nullptr;
+                size_t len = 0;
+
+                if (unpackHeader(frame, wc.byte_len, &header)) {
+                    std::cerr << "Malformed frame of " << wc.byte_len << " bytes (qp "
+                              << wc.qp_num << ")\n";
+                } else if (header.type == FRAME_DONE) {
+                    // Applied on arrival by applyFrameCredits
+                    control = true;
+                } else if (conn->consumeFrame(header, frame + sizeof(header),
+                                              wc.byte_len - sizeof(header), &data, &len) == 0 &&
+                           data) {
+                    RDMAConnection *conn = findConnection(worker, wc.qp_num);
+                    if (conn) {
+                        conn->stats->msgs_received.add(1);
+                        conn->stats->bytes_received.add(len);
+                    }
+                    worker->stats->count(STAT_MSGS_RECEIVED);
+                    worker->stats->count(STAT_BYTES_RECEIVED, len);
+                    LOG_DEBUG("Message received: %s", previewPayload(data, len).c_str());
+                    if (handler) {
+                        handler(*this, wc.qp_num, data, len);
+                    }
+                }
+            }
+        }
+
+        worker->recv_repost.push_back(slot);
+        worker->repost_owners.push_back(wc.qp_num);
+        if (control || worker->recv_repost.size() >= RECV_REPOST_BATCH) {
+            flushReceives(worker, control);
+        }
+    }
+
+    // Re-post the worker's released slots to the SRQ and credit each one to
+    // the connection whose frame it held
+    int flushReceives(RDMAWorker *worker, bool force) {
+        if (worker->recv_repost.empty()) {
+            return 0;
+        }
+
+        int ret = postReceives(worker->recv_repost.data(), worker->recv_repost.size());
+        if (ret) {
+            return ret;
+        }
+
+        for (size_t i = 0; i < worker->repost_owners.size(); i++) {
+            RDMAConnection *conn = findConnection(worker, worker->repost_owners[i]);
+            if (conn) {
+                conn->recv_posted++;
+            }
+        }
+        for (size_t i = 0; i < worker->repost_owners.size(); i++) {
+            RDMAConnection *conn = findConnection(worker, worker->repost_owners[i]);
+            if (conn && conn->returnCredits(force)) {
+                ret = -1;
+            }
+        }
+
+        worker->recv_repost.clear();
+        worker->repost_owners.clear();
+        return ret;
+    }
+
+    char *recvSlot(uint32_t slot) {
+        return buffer + BUFFER_SIZE * slot;
+    }
+
+    // Post the given receive slots to the SRQ as chained lists of up to
+    // SRQ_POST_CHUNK
+    int postReceives(const uint32_t *slots, size_t count) {
+        while (count > SRQ_POST_CHUNK) {
+            int ret = postReceives(slots, SRQ_POST_CHUNK);
+            if (ret) {
+                return ret;
+            }
+            slots += SRQ_POST_CHUNK;
+            count -= SRQ_POST_CHUNK;
+        }
+
+        struct ibv_sge sge[SRQ_POST_CHUNK];
+        struct ibv_recv_wr recv_wr[SRQ_POST_CHUNK], *bad_wr;
+
+        if (count == 0) {
+            return 0;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            memset(&sge[i], 0, sizeof(sge[i]));
+            sge[i].addr = (uintptr_t)recvSlot(slots[i]);
+            sge[i].length = BUFFER_SIZE;
+            sge[i].lkey = mr->lkey;
+
+            memset(&recv_wr[i], 0, sizeof(recv_wr[i]));
+            recv_wr[i].wr_id = makeWrId(WR_KIND_RECV, slots[i]);
+            recv_wr[i].sg_list = &sge[i];
+            recv_wr[i].num_sge = 1;
+            recv_wr[i].next = (i + 1 < count) ? &recv_wr[i + 1] : nullptr;
+        }
+
+        int ret = ibv_post_srq_recv(srq, recv_wr, &bad_wr);
+        if (ret) {
+            std::cerr << "Failed to post receive\n";
+            return ret;
+        }
+        return 0;
+    }
+
+    // Pre-post every receive slot so no peer ever hits an empty receive queue
+    int postReceiveRing() {
+        std::vector<uint32_t> slots(SRQ_SLOTS);
+        for (int i = 0; i < SRQ_SLOTS; i++) {
+            slots[i] = i;
+        }
+        return postReceives(slots.data(), slots.size());
+    }
+
+    void cleanup() {
+        stop();
+
+        for (size_t i = 0; i < workers.size(); i++) {
+            RDMAWorker *worker = workers[i];
+
+            // Connections handed over after the worker stopped polling
+            processCommands(worker);
+            while (!worker->connections.empty()) {
+                destroyConnection(worker->connections.begin()->second);
+            }
+        }
+        releaseDevice();
+
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (workers[i]->wake_fd >= 0) close(workers[i]->wake_fd);
+            delete workers[i];
+        }
+        workers.clear();
+
+        if (listen_id) rdma_destroy_id(listen_id);
+        if (ec) rdma_destroy_event_channel(ec);
+        if (stop_fd >= 0) close(stop_fd);
+    }
+};
+
+// Blocking calls of the framing engine poll the connection's worker CQ with
+// receives deferred. The connection may be torn down while it waits, which
+// waitOnConnection reports by no longer finding it.
+inline int RDMAConnection::progress(bool wait) {
+    return server->waitOnConnection(worker, qp_num, wait) == this ? 0 : -1;
+}
+
+inline int RDMAConnection::repostReceives() {
+    return server->flushReceives(worker, true);
+}
+
+inline struct ibv_mr *RDMAConnection::registeredMR(const void *buf, size_t len) {
+    return server->findRegisteredMR(buf, len);
+}
+
+inline struct ibv_mr *RDMAConnection::localMR(const void *buf, size_t len) {
+    struct ibv_mr *local_mr = server->findRegisteredMR(buf, len);
+    return local_mr ? local_mr : server->mr_cache->lookup(buf, len);
+}
+
+inline void RDMAConnection::releaseMR(const void *buf, size_t len) {
+    server->mr_cache->invalidate(buf, len);
+}
+
+inline void RDMAConnection::releaseRendezvous(const char *, size_t len, void *owner) {
+    server->releaseRendezvousCopy((char *)owner, len);
+}
+
+inline void RDMAConnection::countCreditStall() {
+    worker->poll_stats.credit_stalls++;
+    worker->stats->count(STAT_CREDIT_STALLS);
+}
+
+#endif
@@ -0,0 +1,158 @@
+#include <iostream>
+#include <string>
+
+#include "transport.h"
+#include "rdma_client.h"
+#include "rdma_server.h"
+
+// Transport backend over the RDMA client and server: SEND/RECV messages with
+// credit flow control, segmentation and READ rendezvous for large payloads
+class RdmaTransport : public Transport {
+private:
+    RDMAClient *client;
+    RDMAServer *server;
+
+public:
+    RdmaTransport() : client(nullptr), server(nullptr) {}
+
+    ~RdmaTransport() {
+        if (server) {
+            server->stop();
+        }
+        delete server;
+        delete client;
+    }
+
+    const char *name() const {
+        return "rdma";
+    }
+
+    int connect(const std::string& host, const std::string& port) {
+        if (client || server) {
+            std::cerr << "Transport already in use\n";
+            return -1;
+        }
+        client = new RDMAClient();
+        if (client->initialize() || client->connectToServer(host, port)) {
+            return -1;
+        }
+        return 0;
+    }
+
+    int listen(const std::string& port, const MessageHandler& handler) {
+        if (client || server) {
+            std::cerr << "Transport already in use\n";
+            return -1;
+        }
+        server = new RDMAServer();
+        if (server->initialize(port)) {
+            return -1;
+        }
+        return server->start([this, handler](RDMAServer&, uint32_t qp_num,
+                                             const char *data, size_t len) {
+            handler(*this, qp_num, data, len);
+        });
+    }
+
+    void wait() {
+        if (server) {
+            server->wait();
+        }
+    }
+
+    void stop() {
+        if (server) {
+            server->stop();
+        }
+    }
+
+    int send(uint32_t peer, const void *data, size_t len) {
+        if (client) {
+            return client->sendData(data, len);
+        }
+        if (server) {
+            return server->sendData(peer, data, len);
+        }
+        std::cerr << "Transport not connected\n";
+        return -1;
+    }
+
+    int recv(std::string *payload) {
+        if (!client) {
+            std::cerr << "recv is only available on connected transports\n";
+            return -1;
+        }
+        return client->receiveMessage(payload);
+    }
+
+    int flush() {
+        return client ? client->flushSends() : 0;
+    }
+
+    // Registered pool memory; on the server side only once a client has
+    // connected
+    void *allocBuffer(size_t size) {
+        if (client) {
+            return client->allocBuffer(size);
+        }
+        return server ? server->allocBuffer(size) : nullptr;
+    }
+
+    void freeBuffer(void *buf) {
+        if (client) {
+            client->freeBuffer(buf);
+        } else if (server) {
+            server->freeBuffer(buf);
+        }
+    }
+
+    // The server gathers multi-segment payloads and waits for their sends,
+    // so the buffer can go back to the pool as soon as sendData returns
+    int sendBuffer(uint32_t peer, void *buf, size_t len) {
+        if (client) {
+            return client->sendBuffer(buf, len);
+        }
+        if (server) {
+            int ret = server->sendData(peer, buf, len);
+            server->freeBuffer(buf);
+            return ret;
+        }
+        std::cerr << "Transport not connected\n";
+        return -1;
+    }
+
+    // Small messages stay in their receive slot, larger ones in the
+    // reassembly buffer; the latter lease must be released before the next
+    int recvLease(Lease *lease) {
+        if (!client) {
+            std::cerr << "recvLease is only available on connected transports\n";
+            return -1;
+        }
+        RDMAClient::MessageLease message;
+        int ret = client->receiveLease(&message);
+        if (ret) {
+            return ret;
+        }
+        lease->data = message.data;
+        lease->len = message.len;
+        lease->handle = message.slot;
+        return 0;
+    }
+
+    int releaseLease(Lease *lease) {
+        if (!client) {
+            return -1;
+        }
+        RDMAClient::MessageLease message;
+        message.data = lease->data;
+        message.len = lease->len;
+        message.slot = (uint32_t)lease->handle;
+        lease->data = nullptr;
+        lease->len = 0;
+        return client->releaseLease(&message);
+    }
+};
+
+Transport *createRdmaTransport() {
+    return new RdmaTransport();
+}
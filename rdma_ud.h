@@ -0,0 +1,912 @@
+#ifndef RDMA_UD_H
+#define RDMA_UD_H
+
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <functional>
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "rdma_common.h"
+#include "rdma_conn.h"
+#include "rdma_device.h"
+#include "stats.h"
+#include "log.h"
+
+// Unreliable Datagram messaging for large fan-out.
+//
+// An RC mesh needs one QP (and its NIC context) per peer. A UDEndpoint talks
+// to any number of peers through a single UD QP: each destination costs one
+// cached address handle, and every message carries its own addressing. Use
+// one endpoint per thread; an endpoint is not locked.
+//
+// Peers are found with the RDMA CM's SIDR exchange on RDMA_PS_UDP: resolve()
+// turns host:port into the remote QP number and an address handle, and an
+// open endpoint answers the resolutions of others. Peers that send first are
+// learned from their datagrams, whose GRH (global route header, which every
+// UD receive starts with) gives the route back.
+//
+// Received messages are handed to the handler from poll(); a handler may
+// send, including to the sender, whose peer id it is given. A reliable send
+// from a handler that waits for its window only reaps completions and
+// applies acknowledgements meanwhile; messages that arrive are delivered
+// after the handler has returned.
+//
+// Datagrams hold one MTU. Plain sends are fire-and-forget and are lost if
+// the receiver has no receive posted or the fabric drops them. Reliable
+// sends carry a per-peer sequence number and are retransmitted (go-back-N)
+// until acknowledged; they are delivered once and in order, and a peer that
+// stays silent for MAX_RETRIES retransmissions is marked failed. Every
+// datagram carries a cumulative acknowledgement of what its sender received
+// in order, so replies acknowledge for free; a peer that got no reply by
+// the end of the batch its messages arrived in gets one UD_ACK for all.
+
+enum UdMessageType {
+    UD_DATA = 1,
+    UD_ACK = 2
+};
+
+static const uint16_t UD_FLAG_RELIABLE = 1;
+static const uint32_t UD_MAGIC = 0x52554450;      // "RUDP"
+
+// Starts every datagram (network byte order). seq numbers reliable DATA of
+// one sender to one receiver from 1; ack is the highest sequence number
+// received in order.
+struct UdHeader {
+    uint32_t magic;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t seq;
+    uint32_t ack;
+};
+
+static inline void packUdHeader(UdMessageType type, uint16_t flags, uint32_t seq, uint32_t ack,
+                                char *wire) {
+    UdHeader header;
+    header.magic = htonl(UD_MAGIC);
+    header.type = htons((uint16_t)type);
+    header.flags = htons(flags);
+    header.seq = htonl(seq);
+    header.ack = htonl(ack);
+    memcpy(wire, &header, sizeof(header));
+}
+
+static inline int unpackUdHeader(const char *data, size_t len, UdHeader *header) {
+    if (len < sizeof(UdHeader)) {
+        return -1;
+    }
+    memcpy(header, data, sizeof(*header));
+    header->magic = ntohl(header->magic);
+    header->type = ntohs(header->type);
+    header->flags = ntohs(header->flags);
+    header->seq = ntohl(header->seq);
+    header->ack = ntohl(header->ack);
+    return header->magic == UD_MAGIC ? 0 : -1;
+}
+
+class UDEndpoint {
+public:
+    // peer identifies the sender for replies with send()
+    typedef std::function<void(UDEndpoint& endpoint, uint32_t peer,
+                               const char *data, size_t len)> MessageHandler;
+
+    static const uint32_t NO_PEER = UINT32_MAX;
+
+    UDEndpoint() : ec(nullptr), listen_id(nullptr), pd(nullptr), comp_chan(nullptr), cq(nullptr),
+                   qp(nullptr), send_mr(nullptr), recv_mr(nullptr), send_buffer(nullptr),
+                   recv_buffer(nullptr), port_num(0), mtu(0), max_inline(0), sends_posted(0),
+                   sends_completed(0), send_unsignaled(0),
+                   retransmit_us(RETRANSMIT_US), delivering(false) {}
+
+    ~UDEndpoint() {
+        for (std::map<struct rdma_cm_id *, Resolution>::iterator it = resolving.begin();
+             it != resolving.end(); ++it) {
+            rdma_destroy_id(it->first);
+        }
+        for (size_t i = 0; i < peers.size(); i++) {
+            if (peers[i].ah) ibv_destroy_ah(peers[i].ah);
+        }
+        if (qp) ibv_destroy_qp(qp);
+        if (recv_mr) ibv_dereg_mr(recv_mr);
+        if (send_mr) ibv_dereg_mr(send_mr);
+        cq_events.release(cq);
+        if (cq) ibv_destroy_cq(cq);
+        if (comp_chan) ibv_destroy_comp_channel(comp_chan);
+        if (pd) ibv_dealloc_pd(pd);
+        if (listen_id) rdma_destroy_id(listen_id);
+        if (ec) rdma_destroy_event_channel(ec);
+        delete[] send_buffer;
+        delete[] recv_buffer;
+    }
+
+    void setHandler(const MessageHandler& message_handler) {
+        handler = message_handler;
+    }
+
+    // Base retransmission timeout; it doubles with every retry
+    void setRetransmitTimeout(int us) {
+        retransmit_us = std::max(1, us);
+    }
+
+    // Bind to a local source (see rdma_device.h; empty for the first RDMA
+    // device) and UD port, create the QP and accept resolutions from peers.
+    // An empty port binds an ephemeral one.
+    int open(const std::string& source, const std::string& port) {
+        struct sockaddr_in addr;
+        int ret = resolveSource(source, &addr);
+        if (ret > 0) {
+            ret = firstDeviceAddress(&addr);
+        }
+        if (ret) {
+            return -1;
+        }
+        addr.sin_port = port.empty() ? 0 : htons(std::stoi(port));
+
+        ec = rdma_create_event_channel();
+        if (!ec) {
+            std::cerr << "Failed to create event channel\n";
+            return -1;
+        }
+        // CM events are serviced from poll()
+        int flags = fcntl(ec->fd, F_GETFL);
+        if (flags < 0 || fcntl(ec->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            std::cerr << "Failed to make event channel non-blocking\n";
+            return -1;
+        }
+
+        if (rdma_create_id(ec, &listen_id, nullptr, RDMA_PS_UDP)) {
+            std::cerr << "Failed to create UD connection ID\n";
+            return -1;
+        }
+        if (rdma_bind_addr(listen_id, (struct sockaddr *)&addr)) {
+            std::cerr << "Failed to bind UD address: " << strerror(errno) << "\n";
+            return -1;
+        }
+        if (!listen_id->verbs) {
+            std::cerr << "UD source is not on an RDMA device\n";
+            return -1;
+        }
+        local_addr = *(struct sockaddr_in *)&listen_id->route.addr.src_addr;
+        port_num = listen_id->port_num;
+
+        if (setupQueuePair()) {
+            return -1;
+        }
+        if (rdma_listen(listen_id, 128)) {
+            std::cerr << "Failed to listen for UD resolutions\n";
+            return -1;
+        }
+
+        char text[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &local_addr.sin_addr, text, sizeof(text));
+        LOG_INFO("UD endpoint %s:%u on %s port %u, QP %u, %zu byte datagrams", text,
+                 ntohs(local_addr.sin_port), ibv_get_device_name(listen_id->verbs->device),
+                 port_num, qp->qp_num, maxMessageSize());
+        return 0;
+    }
+
+    // Peer id of the endpoint at host:port, found with SIDR on first use and
+    // cached afterwards. Other traffic keeps being served while waiting.
+    int resolve(const std::string& host, const std::string& port, uint32_t *peer,
+                int timeout_ms = RESOLVE_TIMEOUT_MS) {
+        std::string key = host + ":" + port;
+        std::map<std::string, uint32_t>::iterator cached = resolved.find(key);
+        if (cached != resolved.end()) {
+            *peer = cached->second;
+            return 0;
+        }
+
+        struct sockaddr_in dst;
+        memset(&dst, 0, sizeof(dst));
+        dst.sin_family = AF_INET;
+        dst.sin_port = htons(std::stoi(port));
+        if (inet_pton(AF_INET, host.c_str(), &dst.sin_addr) != 1) {
+            std::cerr << "Invalid UD peer address " << host << "\n";
+            return -1;
+        }
+
+        struct rdma_cm_id *id;
+        if (rdma_create_id(ec, &id, nullptr, RDMA_PS_UDP)) {
+            std::cerr << "Failed to create UD resolution ID\n";
+            return -1;
+        }
+        // Resolve from our own device so the address handle is usable on it
+        struct sockaddr_in src = local_addr;
+        src.sin_port = 0;
+        if (rdma_resolve_addr(id, (struct sockaddr *)&src, (struct sockaddr *)&dst, 2000)) {
+            std::cerr << "Failed to resolve UD peer " << key << ": " << strerror(errno) << "\n";
+            rdma_destroy_id(id);
+            return -1;
+        }
+        Resolution& resolution = resolving[id];
+        resolution.key = key;
+        resolution.peer = NO_PEER;
+        resolution.failed = false;
+
+        uint64_t deadline = statsNowNs() + (uint64_t)timeout_ms * 1000000;
+        for (;;) {
+            std::map<struct rdma_cm_id *, Resolution>::iterator it = resolving.find(id);
+            if (it->second.peer != NO_PEER || it->second.failed) {
+                *peer = it->second.peer;
+                bool failed = it->second.failed;
+                resolving.erase(it);
+                rdma_destroy_id(id);
+                if (failed) {
+                    std::cerr << "Failed to resolve UD peer " << key << "\n";
+                    return -1;
+                }
+                resolved[key] = *peer;
+                return 0;
+            }
+            if (statsNowNs() > deadline) {
+                std::cerr << "Timed out resolving UD peer " << key << "\n";
+                resolving.erase(it);
+                rdma_destroy_id(id);
+                return -1;
+            }
+            if (poll(1) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    // Send one datagram of at most maxMessageSize() bytes. Reliable sends
+    // block while RELIABLE_WINDOW messages to the peer are unacknowledged.
+    int send(uint32_t peer, const void *data, size_t len, bool reliable = false) {
+        if (peer >= peers.size()) {
+            std::cerr << "Unknown UD peer " << peer << "\n";
+            return -1;
+        }
+        if (len > maxMessageSize()) {
+            std::cerr << "UD message of " << len << " bytes exceeds " << maxMessageSize() << "\n";
+            return -1;
+        }
+        if (!reliable) {
+            return postDatagram(peers[peer], UD_DATA, 0, 0, (const char *)data, len);
+        }
+
+        while (peers[peer].unacked.size() >= RELIABLE_WINDOW && !peers[peer].failed) {
+            if (poll(1) < 0) {
+                return -1;
+            }
+        }
+        Peer& p = peers[peer];
+        if (p.failed) {
+            return -1;
+        }
+        Unacked entry;
+        entry.seq = p.next_seq++;
+        entry.data.assign((const char *)data, len);
+        entry.sent_ns = statsNowNs();
+        entry.retries = 0;
+        p.unacked.push_back(entry);
+        retransmitting.insert(peer);
+        return postDatagram(p, UD_DATA, UD_FLAG_RELIABLE, entry.seq, entry.data.data(), len);
+    }
+
+    // Serve the endpoint: deliver received datagrams to the handler, answer
+    // acknowledgements and resolutions and retransmit what timed out. Waits
+    // up to timeout_ms for something to happen; returns the number of
+    // messages delivered, or -1.
+    int poll(int timeout_ms = 0) {
+        int delivered = progress();
+        if (delivered != 0 || timeout_ms <= 0) {
+            return delivered;
+        }
+
+        // Arm, re-check to close the race with arrivals, then sleep
+        if (cq_events.arm(cq)) {
+            return -1;
+        }
+        delivered = progress();
+        if (delivered != 0) {
+            return delivered;
+        }
+        if (!retransmitting.empty()) {
+            timeout_ms = std::min(timeout_ms, std::max(1, retransmit_us / 1000));
+        }
+        struct pollfd fds[2];
+        fds[0].fd = comp_chan->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = ec->fd;
+        fds[1].events = POLLIN;
+        fds[0].revents = fds[1].revents = 0;
+        if (::poll(fds, 2, timeout_ms) < 0 && errno != EINTR) {
+            std::cerr << "Failed to wait for UD events: " << strerror(errno) << "\n";
+            return -1;
+        }
+        if (fds[0].revents & POLLIN) {
+            cq_events.consume(comp_chan, cq);
+        }
+        return progress();
+    }
+
+    // Wait until every reliable message has been acknowledged (or its peer
+    // has failed)
+    int flush(int timeout_ms = RESOLVE_TIMEOUT_MS) {
+        uint64_t deadline = statsNowNs() + (uint64_t)timeout_ms * 1000000;
+        while (!retransmitting.empty()) {
+            if (statsNowNs() > deadline) {
+                std::cerr << "Timed out waiting for UD acknowledgements\n";
+                return -1;
+            }
+            if (poll(1) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    size_t maxMessageSize() const {
+        return mtu - sizeof(UdHeader);
+    }
+
+    size_t peerCount() const {
+        return peers.size();
+    }
+
+    bool peerFailed(uint32_t peer) const {
+        return peer < peers.size() && peers[peer].failed;
+    }
+
+private:
+    struct Unacked {
+        uint32_t seq;
+        std::string data;
+        uint64_t sent_ns;
+        int retries;
+    };
+
+    struct Peer {
+        struct ibv_ah *ah;
+        uint32_t qpn;
+        uint32_t qkey;
+        uint32_t next_seq;      // of our next reliable message to the peer
+        uint32_t expected;      // of the peer's next reliable message to us
+        std::deque<Unacked> unacked;
+        bool failed;
+        bool ack_due;           // received reliable messages not yet acknowledged
+    };
+
+    // SIDR exchange in flight for resolve()
+    struct Resolution {
+        std::string key;
+        uint32_t peer;
+        bool failed;
+    };
+
+    static const int SEND_SLOTS = 256;
+    static const int RECV_SLOTS = 1024;
+    static const int SIGNAL_INTERVAL = 16;
+    static const int RECV_REPOST_BATCH = 16;
+    static const int POLL_BATCH = PollStats::MAX_BATCH;
+    static const size_t GRH_SIZE = 40;
+    static const size_t RELIABLE_WINDOW = 64;
+    static const int RETRANSMIT_US = 2000;
+    static const int MAX_RETRIES = 10;
+    static const int RESOLVE_TIMEOUT_MS = 5000;
+    static const uint32_t MAX_INLINE_DATA = 256;
+
+    struct rdma_event_channel *ec;
+    struct rdma_cm_id *listen_id;
+    struct ibv_pd *pd;
+    struct ibv_comp_channel *comp_chan;
+    struct ibv_cq *cq;
+    struct ibv_qp *qp;
+    struct ibv_mr *send_mr;
+    struct ibv_mr *recv_mr;
+    char *send_buffer;
+    char *recv_buffer;
+    struct sockaddr_in local_addr;
+    uint8_t port_num;
+    size_t mtu;
+    uint32_t max_inline;
+    uint64_t sends_posted;
+    uint64_t sends_completed;
+    int send_unsignaled;
+    CQNotifier cq_events;
+    int retransmit_us;
+    bool delivering;                                // the handler is running
+    MessageHandler handler;
+
+    std::vector<Peer> peers;
+    std::map<std::string, uint32_t> peer_index;     // by remote GID or LID and QP
+    std::map<std::string, uint32_t> resolved;       // by host:port
+    std::map<struct rdma_cm_id *, Resolution> resolving;
+    std::set<uint32_t> retransmitting;              // peers with unacked messages
+    std::vector<uint32_t> acks_due;                 // peers with ack_due set
+    std::deque<struct ibv_wc> recv_pending;
+    std::vector<uint32_t> recv_repost;
+
+    static int firstDeviceAddress(struct sockaddr_in *addr) {
+        int count = 0;
+        struct ibv_device **list = ibv_get_device_list(&count);
+        if (!list || count == 0) {
+            std::cerr << "No RDMA devices\n";
+            if (list) ibv_free_device_list(list);
+            return -1;
+        }
+        std::string name = ibv_get_device_name(list[0]);
+        ibv_free_device_list(list);
+        memset(addr, 0, sizeof(*addr));
+        addr->sin_family = AF_INET;
+        return deviceAddress(name, 1, -1, &addr->sin_addr);
+    }
+
+    int setupQueuePair() {
+        struct ibv_context *verbs = listen_id->verbs;
+        struct ibv_port_attr port_attr;
+        if (ibv_query_port(verbs, port_num, &port_attr)) {
+            std::cerr << "Failed to query port " << (int)port_num << "\n";
+            return -1;
+        }
+        // enum ibv_mtu counts from IBV_MTU_256 = 1
+        mtu = (size_t)128 << port_attr.active_mtu;
+
+        pd = ibv_alloc_pd(verbs);
+        if (!pd) {
+            std::cerr << "Failed to allocate protection domain\n";
+            return -1;
+        }
+        comp_chan = ibv_create_comp_channel(verbs);
+        if (!comp_chan) {
+            std::cerr << "Failed to create completion channel\n";
+            return -1;
+        }
+        int flags = fcntl(comp_chan->fd, F_GETFL);
+        if (flags < 0 || fcntl(comp_chan->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            std::cerr << "Failed to make completion channel non-blocking\n";
+            return -1;
+        }
+        cq = ibv_create_cq(verbs, SEND_SLOTS + RECV_SLOTS, nullptr, comp_chan, 0);
+        if (!cq) {
+            std::cerr << "Failed to create completion queue\n";
+            return -1;
+        }
+
+        // Receive slots have room for the GRH in front of the datagram
+        send_buffer = new char[(size_t)SEND_SLOTS * mtu];
+        recv_buffer = new char[(size_t)RECV_SLOTS * (GRH_SIZE + mtu)];
+        send_mr = ibv_reg_mr(pd, send_buffer, (size_t)SEND_SLOTS * mtu, IBV_ACCESS_LOCAL_WRITE);
+        recv_mr = ibv_reg_mr(pd, recv_buffer, (size_t)RECV_SLOTS * (GRH_SIZE + mtu),
+                             IBV_ACCESS_LOCAL_WRITE);
+        if (!send_mr || !recv_mr) {
+            std::cerr << "Failed to register UD buffers\n";
+            return -1;
+        }
+
+        // rdma_create_qp takes a UD QP through to RTS with the CM's qkey
+        struct ibv_qp_init_attr qp_attr;
+        memset(&qp_attr, 0, sizeof(qp_attr));
+        qp_attr.send_cq = cq;
+        qp_attr.recv_cq = cq;
+        qp_attr.qp_type = IBV_QPT_UD;
+        qp_attr.cap.max_send_wr = SEND_SLOTS;
+        qp_attr.cap.max_recv_wr = RECV_SLOTS;
+        qp_attr.cap.max_send_sge = 1;
+        qp_attr.cap.max_recv_sge = 1;
+        qp_attr.cap.max_inline_data = MAX_INLINE_DATA;
+        if (createQueuePair(listen_id, pd, &qp_attr)) {
+            std::cerr << "Failed to create UD queue pair\n";
+            return -1;
+        }
+        qp = listen_id->qp;
+        max_inline = qp_attr.cap.max_inline_data;
+
+        recv_repost.reserve(RECV_SLOTS);
+        for (uint32_t slot = 0; slot < (uint32_t)RECV_SLOTS; slot++) {
+            recv_repost.push_back(slot);
+        }
+        return repostReceives();
+    }
+
+    // Hand every returned receive slot back to the QP in chained posts
+    int repostReceives() {
+        struct ibv_recv_wr wrs[RECV_REPOST_BATCH];
+        struct ibv_sge sges[RECV_REPOST_BATCH];
+        size_t next = 0;
+        while (next < recv_repost.size()) {
+            int count = (int)std::min(recv_repost.size() - next, (size_t)RECV_REPOST_BATCH);
+            for (int i = 0; i < count; i++) {
+                uint32_t slot = recv_repost[next + i];
+                sges[i].addr = (uintptr_t)(recv_buffer + (size_t)slot * (GRH_SIZE + mtu));
+                sges[i].length = (uint32_t)(GRH_SIZE + mtu);
+                sges[i].lkey = recv_mr->lkey;
+                memset(&wrs[i], 0, sizeof(wrs[i]));
+                wrs[i].wr_id = makeWrId(WR_KIND_RECV, slot);
+                wrs[i].sg_list = &sges[i];
+                wrs[i].num_sge = 1;
+                wrs[i].next = i + 1 < count ? &wrs[i + 1] : nullptr;
+            }
+            struct ibv_recv_wr *bad_wr;
+            if (ibv_post_recv(qp, wrs, &bad_wr)) {
+                std::cerr << "Failed to post UD receives\n";
+                return -1;
+            }
+            next += count;
+        }
+        recv_repost.clear();
+        return 0;
+    }
+
+    // Post one datagram from the next send slot. Sends complete in order, so
+    // a signaled send retires every slot up to its own.
+    int postDatagram(Peer& peer, UdMessageType type, uint16_t flags, uint32_t seq,
+                     const char *data, size_t len) {
+        while (sends_posted - sends_completed >= (uint64_t)SEND_SLOTS) {
+            if (pollCQ() < 0) {
+                return -1;
+            }
+        }
+
+        char *slot = send_buffer + (size_t)(sends_posted % SEND_SLOTS) * mtu;
+        packUdHeader(type, flags, seq, peer.expected - 1, slot);
+        peer.ack_due = false;
+        if (len) {
+            memcpy(slot + sizeof(UdHeader), data, len);
+        }
+
+        struct ibv_sge sge;
+        sge.addr = (uintptr_t)slot;
+        sge.length = (uint32_t)(sizeof(UdHeader) + len);
+        sge.lkey = send_mr->lkey;
+
+        struct ibv_send_wr wr, *bad_wr;
+        memset(&wr, 0, sizeof(wr));
+        sends_posted++;
+        wr.wr_id = makeWrId(WR_KIND_SEND, (uint32_t)sends_posted);
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_SEND;
+        if (++send_unsignaled >= SIGNAL_INTERVAL) {
+            wr.send_flags |= IBV_SEND_SIGNALED;
+            send_unsignaled = 0;
+        }
+        if (sge.length <= max_inline) {
+            wr.send_flags |= IBV_SEND_INLINE;
+        }
+        wr.wr.ud.ah = peer.ah;
+        wr.wr.ud.remote_qpn = peer.qpn;
+        wr.wr.ud.remote_qkey = peer.qkey;
+        if (ibv_post_send(qp, &wr, &bad_wr)) {
+            sends_posted--;
+            std::cerr << "Failed to post UD send\n";
+            return -1;
+        }
+
+        ThreadStats *stats = threadStats();
+        stats->count(STAT_MSGS_SENT);
+        stats->count(STAT_BYTES_SENT, len);
+        return 0;
+    }
+
+    // Retire send slots and queue receives, which progress() delivers; safe
+    // to call from within send() while a handler runs
+    int pollCQ() {
+        struct ibv_wc wc[POLL_BATCH];
+        int n = ibv_poll_cq(cq, POLL_BATCH, wc);
+        if (n < 0) {
+            std::cerr << "Failed to poll completion queue\n";
+            return -1;
+        }
+        ThreadStats *stats = threadStats();
+        stats->count(STAT_CQ_POLLS);
+        if (n == 0) {
+            stats->count(STAT_EMPTY_POLLS);
+        } else {
+            stats->count(STAT_COMPLETIONS, n);
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                stats->count(STAT_ERRORS);
+                std::cerr << "Work completion failed: " << wrKindName(wrIdKind(wc[i].wr_id))
+                          << " wr_id=" << wc[i].wr_id << " status="
+                          << ibv_wc_status_str(wc[i].status) << "\n";
+            }
+            if (wrIdKind(wc[i].wr_id) == WR_KIND_SEND) {
+                // Low 32 bits of the running count of posted sends
+                sends_completed += (uint32_t)(wrIdValue(wc[i].wr_id) - (uint32_t)sends_completed);
+            } else if (wc[i].status == IBV_WC_SUCCESS) {
+                recv_pending.push_back(wc[i]);
+            } else {
+                recv_repost.push_back(wrIdValue(wc[i].wr_id));
+            }
+        }
+        return n;
+    }
+
+    int progress() {
+        if (pollCQ() < 0 || serviceCM()) {
+            return -1;
+        }
+
+        int delivered = 0;
+        if (delivering) {
+            // Called from a send() within the handler: apply the peers'
+            // acknowledgements so its window opens, but leave messages for
+            // the outer call rather than re-entering the handler
+            applyPendingAcks();
+        } else {
+            delivering = true;
+            while (!recv_pending.empty() && delivered >= 0) {
+                struct ibv_wc wc = recv_pending.front();
+                recv_pending.pop_front();
+                uint32_t slot = wrIdValue(wc.wr_id);
+                int ret = handleDatagram(wc, recv_buffer + (size_t)slot * (GRH_SIZE + mtu));
+                recv_repost.push_back(slot);
+                delivered = ret < 0 ? -1 : delivered + ret;
+            }
+            delivering = false;
+            if (delivered < 0) {
+                return -1;
+            }
+        }
+        if (recv_repost.size() >= (size_t)RECV_REPOST_BATCH && repostReceives()) {
+            return -1;
+        }
+        if (!acks_due.empty() && sendAcks()) {
+            return -1;
+        }
+        if (!retransmitting.empty() && retransmit()) {
+            return -1;
+        }
+        return delivered;
+    }
+
+    // Header and sender of a received datagram, or NO_PEER if it is dropped
+    uint32_t parseDatagram(const struct ibv_wc& wc, const char *buf, UdHeader *header) {
+        if (wc.byte_len < GRH_SIZE ||
+            unpackUdHeader(buf + GRH_SIZE, wc.byte_len - GRH_SIZE, header)) {
+            LOG_WARN("Dropping a malformed UD datagram of %u bytes", wc.byte_len);
+            return NO_PEER;
+        }
+        return senderPeer(wc, (const struct ibv_grh *)buf);
+    }
+
+    // Apply the acknowledgement every queued datagram carries. Pure UD_ACKs
+    // are done with and their slots go back; messages stay queued, and
+    // applying their acknowledgement again on delivery changes nothing.
+    void applyPendingAcks() {
+        std::deque<struct ibv_wc> messages;
+        while (!recv_pending.empty()) {
+            struct ibv_wc wc = recv_pending.front();
+            recv_pending.pop_front();
+            uint32_t slot = wrIdValue(wc.wr_id);
+            UdHeader header;
+            uint32_t peer = parseDatagram(wc, recv_buffer + (size_t)slot * (GRH_SIZE + mtu),
+                                          &header);
+            if (peer != NO_PEER) {
+                acknowledge(peer, header.ack);
+            }
+            if (peer != NO_PEER && header.type == UD_DATA) {
+                messages.push_back(wc);
+            } else {
+                recv_repost.push_back(slot);
+            }
+        }
+        recv_pending.swap(messages);
+    }
+
+    // One cumulative UD_ACK to every peer whose reliable messages were not
+    // acknowledged by a datagram sent to it since they arrived
+    int sendAcks() {
+        for (size_t i = 0; i < acks_due.size(); i++) {
+            Peer& p = peers[acks_due[i]];
+            if (p.ack_due && postDatagram(p, UD_ACK, 0, 0, nullptr, 0)) {
+                return -1;
+            }
+        }
+        acks_due.clear();
+        return 0;
+    }
+
+    // 1 if a message went to the handler
+    int handleDatagram(const struct ibv_wc& wc, const char *buf) {
+        UdHeader header;
+        uint32_t peer = parseDatagram(wc, buf, &header);
+        if (peer == NO_PEER) {
+            return 0;
+        }
+        const char *data = buf + GRH_SIZE + sizeof(header);
+        size_t len = wc.byte_len - GRH_SIZE - sizeof(header);
+
+        // Every datagram carries the sender's acknowledgement
+        acknowledge(peer, header.ack);
+        if (header.type != UD_DATA) {
+            return 0;
+        }
+
+        ThreadStats *stats = threadStats();
+        if (header.flags & UD_FLAG_RELIABLE) {
+            // In order only: duplicates and messages past a gap are dropped,
+            // and either way the last in-order one is acknowledged, by the
+            // next datagram to the peer or by sendAcks()
+            Peer& p = peers[peer];
+            bool in_order = header.seq == p.expected;
+            if (in_order) {
+                p.expected++;
+            }
+            if (!p.ack_due) {
+                p.ack_due = true;
+                acks_due.push_back(peer);
+            }
+            if (!in_order) {
+                return 0;
+            }
+        }
+        stats->count(STAT_MSGS_RECEIVED);
+        stats->count(STAT_BYTES_RECEIVED, len);
+        if (handler) {
+            handler(*this, peer, data, len);
+        }
+        return 1;
+    }
+
+    void acknowledge(uint32_t peer, uint32_t ack) {
+        Peer& p = peers[peer];
+        while (!p.unacked.empty() && (int32_t)(ack - p.unacked.front().seq) >= 0) {
+            p.unacked.pop_front();
+        }
+        if (p.unacked.empty()) {
+            retransmitting.erase(peer);
+        }
+    }
+
+    // Go-back-N: once the oldest unacknowledged message of a peer times out,
+    // everything after it goes again, with the timeout doubling per retry
+    int retransmit() {
+        uint64_t now = statsNowNs();
+        std::set<uint32_t>::iterator it = retransmitting.begin();
+        while (it != retransmitting.end()) {
+            Peer& p = peers[*it];
+            Unacked& oldest = p.unacked.front();
+            uint64_t timeout_ns = (uint64_t)retransmit_us * 1000 << oldest.retries;
+            if (now - oldest.sent_ns < timeout_ns) {
+                ++it;
+                continue;
+            }
+            if (oldest.retries >= MAX_RETRIES) {
+                LOG_WARN("UD peer %u stopped acknowledging; dropping %zu messages", *it,
+                         p.unacked.size());
+                p.failed = true;
+                p.unacked.clear();
+                retransmitting.erase(it++);
+                continue;
+            }
+            for (size_t i = 0; i < p.unacked.size(); i++) {
+                Unacked& entry = p.unacked[i];
+                entry.retries++;
+                entry.sent_ns = now;
+                if (postDatagram(p, UD_DATA, UD_FLAG_RELIABLE, entry.seq, entry.data.data(),
+                                 entry.data.size())) {
+                    return -1;
+                }
+            }
+            ++it;
+        }
+        return 0;
+    }
+
+    // Peers are keyed by the remote QP and its GID (RoCE, routed) or LID, so
+    // a peer we resolved and one that wrote to us first are the same entry
+    static std::string peerKey(bool global, const uint8_t *gid, uint16_t lid, uint32_t qpn) {
+        std::string key(global ? (const char *)gid : "", global ? 16 : 0);
+        key.append((const char *)&lid, sizeof(lid));
+        key.append((const char *)&qpn, sizeof(qpn));
+        return key;
+    }
+
+    uint32_t addPeer(const std::string& key, struct ibv_ah *ah, uint32_t qpn, uint32_t qkey) {
+        Peer peer;
+        peer.ah = ah;
+        peer.qpn = qpn;
+        peer.qkey = qkey;
+        peer.next_seq = 1;
+        peer.expected = 1;
+        peer.failed = false;
+        peer.ack_due = false;
+        peers.push_back(peer);
+        uint32_t id = (uint32_t)(peers.size() - 1);
+        peer_index[key] = id;
+        return id;
+    }
+
+    // Peer of a received datagram; its address handle is built from the GRH
+    uint32_t senderPeer(const struct ibv_wc& wc, const struct ibv_grh *grh) {
+        bool global = (wc.wc_flags & IBV_WC_GRH) != 0;
+        std::string key = peerKey(global, grh->sgid.raw, global ? 0 : wc.slid, wc.src_qp);
+        std::map<std::string, uint32_t>::iterator it = peer_index.find(key);
+        if (it != peer_index.end()) {
+            return it->second;
+        }
+        struct ibv_ah *ah = ibv_create_ah_from_wc(pd, const_cast<struct ibv_wc *>(&wc),
+                                                  const_cast<struct ibv_grh *>(grh), port_num);
+        if (!ah) {
+            LOG_WARN("No address handle for UD sender QP %u", wc.src_qp);
+            return NO_PEER;
+        }
+        return addPeer(key, ah, wc.src_qp, RDMA_UDP_QKEY);
+    }
+
+    uint32_t resolvedPeer(const struct rdma_ud_param& ud) {
+        struct ibv_ah_attr ah_attr = ud.ah_attr;
+        std::string key = peerKey(ah_attr.is_global, ah_attr.grh.dgid.raw,
+                                  ah_attr.is_global ? 0 : ah_attr.dlid, ud.qp_num);
+        std::map<std::string, uint32_t>::iterator it = peer_index.find(key);
+        if (it != peer_index.end()) {
+            return it->second;
+        }
+        struct ibv_ah *ah = ibv_create_ah(pd, &ah_attr);
+        if (!ah) {
+            std::cerr << "Failed to create UD address handle\n";
+            return NO_PEER;
+        }
+        return addPeer(key, ah, ud.qp_num, ud.qkey);
+    }
+
+    // Drain the CM channel: answer peers resolving us with our QP and move
+    // our own resolutions along
+    int serviceCM() {
+        struct rdma_cm_event *event;
+        while (rdma_get_cm_event(ec, &event) == 0) {
+            struct rdma_cm_id *id = event->id;
+            if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST) {
+                struct rdma_conn_param param;
+                memset(&param, 0, sizeof(param));
+                param.qp_num = qp->qp_num;
+                if (rdma_accept(id, &param)) {
+                    LOG_WARN("Failed to answer a UD resolution");
+                }
+                rdma_ack_cm_event(event);
+                rdma_destroy_id(id);
+                continue;
+            }
+
+            std::map<struct rdma_cm_id *, Resolution>::iterator it = resolving.find(id);
+            if (it == resolving.end()) {
+                rdma_ack_cm_event(event);
+                continue;
+            }
+            Resolution& resolution = it->second;
+            switch (event->event) {
+                case RDMA_CM_EVENT_ADDR_RESOLVED:
+                    resolution.failed = rdma_resolve_route(id, 2000) != 0;
+                    break;
+                case RDMA_CM_EVENT_ROUTE_RESOLVED: {
+                    // SIDR request; the reply carries the peer's QP and qkey
+                    struct rdma_conn_param param;
+                    memset(&param, 0, sizeof(param));
+                    resolution.failed = rdma_connect(id, &param) != 0;
+                    break;
+                }
+                case RDMA_CM_EVENT_ESTABLISHED:
+                    resolution.peer = resolvedPeer(event->param.ud);
+                    resolution.failed = resolution.peer == NO_PEER;
+                    break;
+                default:
+                    LOG_WARN("UD resolution of %s failed: %s", resolution.key.c_str(),
+                             rdma_event_str(event->event));
+                    resolution.failed = true;
+                    break;
+            }
+            rdma_ack_cm_event(event);
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            std::cerr << "Failed to get CM event: " << strerror(errno) << "\n";
+            return -1;
+        }
+        return 0;
+    }
+};
+
+#endif
@@ -0,0 +1,489 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <csignal>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+// Always-on counters and latency histograms for the data path.
+//
+// Every thread records into its own ThreadStats without locks or atomic
+// read-modify-write instructions: each value has a single writer that stores
+// with relaxed ordering, and the dump thread only loads. Histograms are
+// HDR-style log-linear, so any recorded value is reported within about 3%.
+// Per-connection counters live in a fixed table indexed by a slot the owner
+// picks, so the dump can walk them without touching connection state.
+//
+// StatsReporter prints everything on SIGUSR1 and, optionally, periodically.
+
+enum StatCounterId {
+    STAT_BYTES_SENT,
+    STAT_BYTES_RECEIVED,
+    STAT_MSGS_SENT,
+    STAT_MSGS_RECEIVED,
+    STAT_COMPLETIONS,
+    STAT_ERRORS,
+    STAT_RNR_ERRORS,
+    STAT_CQ_POLLS,
+    STAT_EMPTY_POLLS,
+    STAT_CREDIT_STALLS,
+    STAT_COUNTER_COUNT
+};
+
+static inline const char *statCounterName(int id) {
+    static const char *const names[STAT_COUNTER_COUNT] = {
+        "bytes_sent", "bytes_received", "msgs_sent", "msgs_received",
+        "completions", "errors", "rnr_errors", "cq_polls", "empty_polls",
+        "credit_stalls"
+    };
+    return id >= 0 && id < STAT_COUNTER_COUNT ? names[id] : "unknown";
+}
+
+// Operations timed from ibv_post_send to their work completion
+enum StatLatencyId {
+    STAT_LAT_SEND,
+    STAT_LAT_READ,
+    STAT_LAT_WRITE,
+    STAT_LAT_ATOMIC,
+    STAT_LATENCY_COUNT
+};
+
+static inline const char *statLatencyName(int id) {
+    static const char *const names[STAT_LATENCY_COUNT] = {"send", "read", "write", "atomic"};
+    return id >= 0 && id < STAT_LATENCY_COUNT ? names[id] : "unknown";
+}
+
+static inline uint64_t statsNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Single-writer counter readable from any thread
+class StatCounter {
+public:
+    StatCounter() : value(0) {}
+
+    void add(uint64_t n) {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void set(uint64_t n) {
+        value.store(n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const {
+        return value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> value;
+};
+
+// Log-linear histogram of nanosecond values. Values below SUB_BUCKETS get a
+// bucket each; above that every power of two is split into SUB_BUCKETS
+// equal buckets. Values beyond 2^MAX_EXPONENT ns are clamped.
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKET_BITS = 5;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int MAX_EXPONENT = 40;     // about 18 minutes
+    static const int BUCKETS = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+
+    void record(uint64_t ns) {
+        counts[bucketOf(ns)].add(1);
+        total.add(1);
+        sum.add(ns);
+        if (ns > max.get()) {
+            max.set(ns);
+        }
+    }
+
+    static int bucketOf(uint64_t ns) {
+        if (ns < (uint64_t)SUB_BUCKETS) {
+            return (int)ns;
+        }
+        ns = std::min(ns, ((uint64_t)1 << (MAX_EXPONENT + 1)) - 1);
+        int shift = 63 - __builtin_clzll(ns) - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKETS + (int)((ns >> shift) - SUB_BUCKETS);
+    }
+
+    // Midpoint of the values that fall into a bucket
+    static uint64_t bucketValue(int bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        int shift = bucket / SUB_BUCKETS - 1;
+        uint64_t low = (uint64_t)(bucket % SUB_BUCKETS + SUB_BUCKETS) << shift;
+        return low + (((uint64_t)1 << shift) - 1) / 2;
+    }
+
+private:
+    friend class HistogramSnapshot;
+    StatCounter counts[BUCKETS];
+    StatCounter total;
+    StatCounter sum;
+    StatCounter max;
+};
+
+// Plain copy of one or more merged histograms, taken by the dump thread
+class HistogramSnapshot {
+public:
+    HistogramSnapshot() : counts(LatencyHistogram::BUCKETS, 0), total(0), sum(0), max(0) {}
+
+    void merge(const LatencyHistogram& histogram) {
+        for (int i = 0; i < LatencyHistogram::BUCKETS; i++) {
+            counts[i] += histogram.counts[i].get();
+        }
+        total += histogram.total.get();
+        sum += histogram.sum.get();
+        max = std::max(max, histogram.max.get());
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+
+    double meanUs() const {
+        return total ? sum / 1000.0 / total : 0;
+    }
+
+    double maxUs() const {
+        return max / 1000.0;
+    }
+
+    double percentileUs(double pct) const {
+        uint64_t seen = 0;
+        uint64_t rank = (uint64_t)(pct / 100.0 * total + 0.999999);
+        for (int i = 0; i < LatencyHistogram::BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank && seen > 0) {
+                return std::min(LatencyHistogram::bucketValue(i), max) / 1000.0;
+            }
+        }
+        return 0;
+    }
+
+private:
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+};
+
+struct ThreadStats {
+    StatCounter counters[STAT_COUNTER_COUNT];
+    LatencyHistogram latency[STAT_LATENCY_COUNT];
+
+    void count(StatCounterId id, uint64_t n = 1) {
+        counters[id].add(n);
+    }
+};
+
+// Traffic of one connection; written by the thread that owns it
+struct ConnectionStats {
+    std::atomic<bool> active;
+    std::atomic<uint32_t> qp_num;
+    StatCounter bytes_sent;
+    StatCounter bytes_received;
+    StatCounter msgs_sent;
+    StatCounter msgs_received;
+
+    ConnectionStats() : active(false), qp_num(0) {}
+};
+
+// Post timestamps of the signaled WRs still in flight on one send queue. A
+// send queue completes in order, so each completion matches the oldest.
+class PostTimes {
+public:
+    void resize(size_t capacity) {
+        times.assign(capacity, 0);
+        head = tail = 0;
+    }
+
+    void push(uint64_t ns) {
+        if (!times.empty() && tail - head < times.size()) {
+            times[tail++ % times.size()] = ns;
+        }
+    }
+
+    // 0 when nothing is in flight, e.g. for flushed unsignaled WRs
+    uint64_t pop() {
+        return head == tail ? 0 : times[head++ % times.size()];
+    }
+
+    PostTimes() : head(0), tail(0) {}
+
+private:
+    std::vector<uint64_t> times;
+    uint64_t head;
+    uint64_t tail;
+};
+
+enum StatsFormat {
+    STATS_TEXT,
+    STATS_JSON
+};
+
+static inline int parseStatsFormat(const char *name, StatsFormat *format) {
+    if (strcmp(name, "text") == 0) {
+        *format = STATS_TEXT;
+    } else if (strcmp(name, "json") == 0) {
+        *format = STATS_JSON;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+class StatsRegistry {
+public:
+    static const int MAX_THREADS = 64;
+    static const int MAX_CONNECTIONS = 256;
+
+    static StatsRegistry& instance() {
+        static StatsRegistry registry;
+        return registry;
+    }
+
+    // Stats of the calling thread, allocated on first use and kept after
+    // the thread exits. Threads past MAX_THREADS share the last slot and
+    // may lose updates.
+    ThreadStats *local() {
+        static thread_local ThreadStats *mine = nullptr;
+        if (!mine) {
+            int index = next_thread++;
+            if (index < MAX_THREADS) {
+                threads[index] = new ThreadStats();
+            } else {
+                index = MAX_THREADS - 1;
+                while (!threads[index].load()) {
+                    std::this_thread::yield();
+                }
+            }
+            mine = threads[index];
+        }
+        return mine;
+    }
+
+    // Slot must be below MAX_CONNECTIONS; counters start from zero
+    ConnectionStats *openConnection(int slot, uint32_t qp_num) {
+        ConnectionStats *conn = &connections[slot];
+        conn->bytes_sent.set(0);
+        conn->bytes_received.set(0);
+        conn->msgs_sent.set(0);
+        conn->msgs_received.set(0);
+        conn->qp_num = qp_num;
+        conn->active = true;
+        return conn;
+    }
+
+    void closeConnection(int slot) {
+        connections[slot].active = false;
+    }
+
+    void dump(std::ostream& out, StatsFormat format) {
+        uint64_t counters[STAT_COUNTER_COUNT] = {0};
+        HistogramSnapshot latency[STAT_LATENCY_COUNT];
+        for (int t = 0; t < MAX_THREADS; t++) {
+            const ThreadStats *stats = threads[t];
+            if (!stats) {
+                continue;
+            }
+            for (int i = 0; i < STAT_COUNTER_COUNT; i++) {
+                counters[i] += stats->counters[i].get();
+            }
+            for (int i = 0; i < STAT_LATENCY_COUNT; i++) {
+                latency[i].merge(stats->latency[i]);
+            }
+        }
+        double uptime = (statsNowNs() - start_ns) / 1e9;
+
+        if (format == STATS_JSON) {
+            dumpJson(out, uptime, counters, latency);
+        } else {
+            dumpText(out, uptime, counters, latency);
+        }
+        out.flush();
+    }
+
+private:
+    std::atomic<ThreadStats *> threads[MAX_THREADS];
+    ConnectionStats connections[MAX_CONNECTIONS];
+    std::atomic<int> next_thread;
+    uint64_t start_ns;
+
+    StatsRegistry() : next_thread(0), start_ns(statsNowNs()) {
+        for (int t = 0; t < MAX_THREADS; t++) {
+            threads[t] = nullptr;
+        }
+    }
+
+    void dumpText(std::ostream& out, double uptime, const uint64_t *counters,
+                  const HistogramSnapshot *latency) {
+        out << "--- stats at " << std::fixed << std::setprecision(1) << uptime << " s ---\n";
+        for (int i = 0; i < STAT_COUNTER_COUNT; i++) {
+            out << (i ? " " : "") << statCounterName(i) << "=" << counters[i];
+        }
+        out << "\n" << std::setprecision(2);
+        for (int i = 0; i < STAT_LATENCY_COUNT; i++) {
+            const HistogramSnapshot& h = latency[i];
+            out << statLatencyName(i) << ": count=" << h.count();
+            if (h.count()) {
+                out << " mean=" << h.meanUs() << "us p50=" << h.percentileUs(50)
+                    << "us p99=" << h.percentileUs(99) << "us p99.9=" << h.percentileUs(99.9)
+                    << "us max=" << h.maxUs() << "us";
+            }
+            out << "\n";
+        }
+        for (int c = 0; c < MAX_CONNECTIONS; c++) {
+            const ConnectionStats& conn = connections[c];
+            if (conn.active) {
+                out << "qp " << conn.qp_num << ": sent " << conn.msgs_sent.get() << " msgs/"
+                    << conn.bytes_sent.get() << " bytes, received " << conn.msgs_received.get()
+                    << " msgs/" << conn.bytes_received.get() << " bytes\n";
+            }
+        }
+    }
+
+    void dumpJson(std::ostream& out, double uptime, const uint64_t *counters,
+                  const HistogramSnapshot *latency) {
+        out << "{\"uptime_s\": " << std::fixed << std::setprecision(3) << uptime
+            << ", \"counters\": {";
+        for (int i = 0; i < STAT_COUNTER_COUNT; i++) {
+            out << (i ? ", " : "") << "\"" << statCounterName(i) << "\": " << counters[i];
+        }
+        out << "}, \"latency_us\": {";
+        for (int i = 0; i < STAT_LATENCY_COUNT; i++) {
+            const HistogramSnapshot& h = latency[i];
+            out << (i ? ", " : "") << "\"" << statLatencyName(i) << "\": {\"count\": " << h.count()
+                << ", \"mean\": " << h.meanUs() << ", \"p50\": " << h.percentileUs(50)
+                << ", \"p99\": " << h.percentileUs(99) << ", \"p999\": " << h.percentileUs(99.9)
+                << ", \"max\": " << h.maxUs() << "}";
+        }
+        out << "}, \"connections\": [";
+        bool first = true;
+        for (int c = 0; c < MAX_CONNECTIONS; c++) {
+            const ConnectionStats& conn = connections[c];
+            if (conn.active) {
+                out << (first ? "" : ", ") << "{\"qp\": " << conn.qp_num
+                    << ", \"msgs_sent\": " << conn.msgs_sent.get()
+                    << ", \"bytes_sent\": " << conn.bytes_sent.get()
+                    << ", \"msgs_received\": " << conn.msgs_received.get()
+                    << ", \"bytes_received\": " << conn.bytes_received.get() << "}";
+                first = false;
+            }
+        }
+        out << "]}\n";
+    }
+};
+
+static inline ThreadStats *threadStats() {
+    return StatsRegistry::instance().local();
+}
+
+// Dumps the registry on SIGUSR1 and every interval_s seconds (never when 0)
+// from a thread of its own. start() blocks SIGUSR1 in the calling thread, so
+// it must run before any other thread is created for the signal to reach
+// the reporter and not terminate the process.
+class StatsReporter {
+public:
+    StatsReporter() : signal_fd(-1), stop_fd(-1), interval_s(0), format(STATS_TEXT) {}
+
+    ~StatsReporter() {
+        stop();
+    }
+
+    int start(int interval_seconds, StatsFormat stats_format) {
+        interval_s = std::max(0, interval_seconds);
+        format = stats_format;
+
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGUSR1);
+        if (pthread_sigmask(SIG_BLOCK, &mask, nullptr)) {
+            std::cerr << "Failed to block SIGUSR1\n";
+            return -1;
+        }
+
+        signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        stop_fd = eventfd(0, EFD_NONBLOCK);
+        if (signal_fd < 0 || stop_fd < 0) {
+            std::cerr << "Failed to create stats reporter fds\n";
+            return -1;
+        }
+
+        thread = std::thread(&StatsReporter::run, this);
+        return 0;
+    }
+
+    void stop() {
+        uint64_t one = 1;
+        if (thread.joinable()) {
+            if (write(stop_fd, &one, sizeof(one)) < 0) {
+                std::cerr << "Failed to wake stats reporter\n";
+            }
+            thread.join();
+        }
+        if (signal_fd >= 0) close(signal_fd);
+        if (stop_fd >= 0) close(stop_fd);
+        signal_fd = stop_fd = -1;
+    }
+
+    // Dumps go to stderr so they never mix with benchmark results
+    void dump() {
+        StatsRegistry::instance().dump(std::cerr, format);
+    }
+
+private:
+    std::thread thread;
+    int signal_fd;
+    int stop_fd;
+    int interval_s;
+    StatsFormat format;
+
+    void run() {
+        for (;;) {
+            struct pollfd pfd[2];
+            pfd[0].fd = signal_fd;
+            pfd[0].events = POLLIN;
+            pfd[0].revents = 0;
+            pfd[1].fd = stop_fd;
+            pfd[1].events = POLLIN;
+            pfd[1].revents = 0;
+
+            // Either SIGUSR1 arrived or the interval expired
+            if (poll(pfd, 2, interval_s ? interval_s * 1000 : -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Stats reporter failed to wait\n";
+                return;
+            }
+            if (pfd[1].revents) {
+                return;
+            }
+            if (pfd[0].revents) {
+                struct signalfd_siginfo info;
+                while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                }
+            }
+            dump();
+        }
+    }
+};
+
+#endif
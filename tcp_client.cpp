@@ -1,118 +1,315 @@
 #include <iostream>
 #include <string>
 #include <cstring>
-#include <unistd.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <getopt.h>
 
-class TCPClient {
-private:
-    int sock_fd;
-    struct sockaddr_in server_addr;
-    static const size_t BUFFER_SIZE = 4096;
+#include "tcp_client.h"
+#include "benchmark.h"
 
-public:
-    TCPClient() : sock_fd(-1) {}
+// Rate runs coalesce up to window messages into one send() of at most this
+static const size_t BENCH_COALESCE_LIMIT = 1 << 20;
 
-    ~TCPClient() {
-        cleanup();
-    }
+// Payload, reply and coalesced-send buffers of a benchmark, allocated once
+// for the largest size so the io_uring engine can register them
+struct BenchBuffers {
+    std::vector<char> payload;
+    std::vector<char> reply;
+    std::vector<char> batch;
+};
 
-    int initialize() {
-        sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock_fd < 0) {
-            std::cerr << "Socket creation failed\n";
-            return -1;
-        }
-        return 0;
+// Announce a run of count messages to the server and drive it. Latency
+// samples and the elapsed time are only collected for measured runs.
+static int runBenchPass(TCPClient& client, BenchTest test, BenchBuffers& buffers, size_t size,
+                        int count, int window, LatencyRecorder *recorder, uint64_t *elapsed_ns) {
+    char request[sizeof(BenchRequest)];
+    packBenchRequest(test, size, count, window, request);
+    if (client.sendAll(request, sizeof(request))) {
+        return -1;
     }
 
-    int connectToServer(const std::string& server_ip, const std::string& port) {
-        memset(&server_addr, 0, sizeof(server_addr));
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(std::stoi(port));
+    const char *data = buffers.payload.data();
+    char *reply = buffers.reply.data();
+    uint64_t start = benchNowNs();
+    switch (test) {
+        case BENCH_LATENCY:
+            for (int i = 0; i < count; i++) {
+                uint64_t sent_at = benchNowNs();
+                if (client.sendStable(data, size) || client.recvAll(reply, size)) {
+                    return -1;
+                }
+                if (recorder) {
+                    recorder->record(benchNowNs() - sent_at);
+                }
+            }
+            break;
 
-        if (inet_pton(AF_INET, server_ip.c_str(), &server_addr.sin_addr) <= 0) {
-            std::cerr << "Invalid address or address not supported\n";
-            return -1;
-        }
+        case BENCH_BW:
+            for (int i = 0; i < count; i++) {
+                if (client.sendStable(data, size)) {
+                    return -1;
+                }
+            }
+            if (client.recvAll(reply, 1)) {
+                return -1;
+            }
+            break;
 
-        if (connect(sock_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-            std::cerr << "Connection failed\n";
-            return -1;
+        case BENCH_RATE: {
+            // The stream has no message boundaries, so a window of messages
+            // is one contiguous send
+            int per_send = (int)std::max((size_t)1, std::min((size_t)window,
+                                                             BENCH_COALESCE_LIMIT / size));
+            char *batch = buffers.batch.data();
+            for (int i = 0; i < per_send; i++) {
+                memcpy(batch + i * size, data, size);
+            }
+            for (int sent = 0; sent < count; sent += per_send) {
+                int n = std::min(per_send, count - sent);
+                if (client.sendStable(batch, n * size)) {
+                    return -1;
+                }
+            }
+            if (client.recvAll(reply, 1)) {
+                return -1;
+            }
+            break;
         }
 
-        std::cout << "Connected to TCP server at " << server_ip << ":" << port << std::endl;
-        return 0;
-    }
-
-    int sendMessage(const std::string& message) {
-        if (sock_fd < 0) {
-            std::cerr << "Not connected to server\n";
-            return -1;
+        case BENCH_BIBW: {
+            // A writer thread keeps up to window echoes outstanding while
+            // this thread reads them back
+            std::atomic<int> received(0);
+            std::atomic<bool> failed(false);
+            std::thread writer([&]() {
+                for (int sent = 0; sent < count && !failed; sent++) {
+                    while (sent - received.load() >= window && !failed) {
+                        std::this_thread::yield();
+                    }
+                    if (client.sendStable(data, size)) {
+                        failed = true;
+                    }
+                }
+            });
+            for (int i = 0; i < count && !failed; i++) {
+                if (client.recvAll(reply, size)) {
+                    failed = true;
+                }
+                received++;
+            }
+            writer.join();
+            if (failed) {
+                return -1;
+            }
+            break;
         }
 
-        ssize_t bytes_sent = send(sock_fd, message.c_str(), message.length(), 0);
-        if (bytes_sent < 0) {
-            std::cerr << "Failed to send message\n";
+        default:
             return -1;
-        }
+    }
 
-        std::cout << "Message sent: " << message << std::endl;
-        return 0;
+    // Zero-copy payloads may only change once the kernel is done with them
+    if (client.flush()) {
+        return -1;
     }
+    if (elapsed_ns) {
+        *elapsed_ns = benchNowNs() - start;
+    }
+    return 0;
+}
 
-    int receiveMessage() {
-        if (sock_fd < 0) {
-            std::cerr << "Not connected to server\n";
-            return -1;
+// Sweep the configured sizes: a warmup run followed by a measured run each
+static int runBenchmark(TCPClient& client, const BenchConfig& config) {
+    BenchReporter reporter("tcp", config);
+    std::vector<size_t> sizes = benchSizes(config);
+    LatencyRecorder recorder;
+
+    BenchBuffers buffers;
+    buffers.payload.assign(config.max_size, 'x');
+    buffers.reply.resize(config.max_size);
+    if (config.test == BENCH_RATE) {
+        buffers.batch.resize(std::max(BENCH_COALESCE_LIMIT, config.max_size));
+    }
+    struct iovec iov[3];
+    unsigned iov_count = 0;
+    std::vector<char> *registered[] = {&buffers.payload, &buffers.reply, &buffers.batch};
+    for (size_t i = 0; i < 3; i++) {
+        if (!registered[i]->empty()) {
+            iov[iov_count].iov_base = registered[i]->data();
+            iov[iov_count].iov_len = registered[i]->size();
+            iov_count++;
         }
+    }
+    if (client.registerBuffers(iov, iov_count)) {
+        return -1;
+    }
 
-        char buffer[BUFFER_SIZE];
-        memset(buffer, 0, BUFFER_SIZE);
+    for (size_t i = 0; i < sizes.size(); i++) {
+        size_t size = sizes[i];
 
-        ssize_t bytes_received = recv(sock_fd, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes_received > 0) {
-            buffer[bytes_received] = '\0';
-            std::cout << "Message received: " << buffer << std::endl;
-            return 0;
-        } else if (bytes_received == 0) {
-            std::cout << "Server disconnected\n";
-            return 1;
-        } else {
-            std::cerr << "Failed to receive message\n";
+        if (config.warmup > 0 &&
+            runBenchPass(client, config.test, buffers, size, config.warmup, config.window,
+                         nullptr, nullptr)) {
+            std::cerr << "Benchmark warmup failed at " << size << " bytes\n";
             return -1;
         }
-    }
 
-    int performHandshake() {
-        // Send initial message
-        int ret = sendMessage("Hello from TCP client!");
-        if (ret) {
-            return ret;
+        uint64_t elapsed_ns = 0;
+        recorder.reset(config.test == BENCH_LATENCY ? config.iters : 0);
+        if (runBenchPass(client, config.test, buffers, size, config.iters, config.window,
+                         config.test == BENCH_LATENCY ? &recorder : nullptr, &elapsed_ns)) {
+            std::cerr << "Benchmark failed at " << size << " bytes\n";
+            return -1;
         }
 
-        // Receive response
-        ret = receiveMessage();
-        return ret;
+        BenchResult result;
+        memset(&result, 0, sizeof(result));
+        result.test = config.test;
+        result.size = size;
+        result.iters = config.iters;
+        benchLatency(&result, recorder);
+        benchThroughput(&result, elapsed_ns);
+        reporter.add(result);
     }
 
-private:
-    void cleanup() {
-        if (sock_fd >= 0) {
-            close(sock_fd);
+    reporter.finish();
+    return 0;
+}
+
+static void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [--bench lat|bw|bibw|rate] [--min-size BYTES] "
+              << "[--max-size BYTES] [--iters N] [--warmup N] [--window N]\n"
+              << "       [--format human|csv|json] [--zerocopy BYTES] [--engine epoll|uring] [--sqpoll]\n"
+              << "       [--profile default|latency|throughput] [--pin-cpu CPU] "
+              << "[--busy-poll US] [--sock-buf BYTES] <server_ip> <port>\n";
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig bench;
+    size_t zerocopy_threshold = 0;
+    TcpTuning tuning;
+    int busy_poll_us = -1;
+    size_t sock_buf = 0;
+    TCPEngine engine = TCP_ENGINE_EPOLL;
+    bool sqpoll = false;
+
+    static const struct option long_options[] = {
+        {"bench", required_argument, nullptr, 'b'},
+        {"min-size", required_argument, nullptr, 'n'},
+        {"max-size", required_argument, nullptr, 'x'},
+        {"iters", required_argument, nullptr, 'i'},
+        {"warmup", required_argument, nullptr, 'W'},
+        {"window", required_argument, nullptr, 'w'},
+        {"format", required_argument, nullptr, 'f'},
+        {"zerocopy", required_argument, nullptr, 'z'},
+        {"profile", required_argument, nullptr, 'P'},
+        {"pin-cpu", required_argument, nullptr, 'p'},
+        {"busy-poll", required_argument, nullptr, 'B'},
+        {"sock-buf", required_argument, nullptr, 'S'},
+        {"engine", required_argument, nullptr, 'e'},
+        {"sqpoll", no_argument, nullptr, 's'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:n:x:i:W:w:f:z:P:p:B:S:e:s", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'b':
+                if (parseBenchTest(optarg, &bench.test)) {
+                    std::cerr << "Unknown benchmark: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case 'n':
+            case 'x':
+                if (parseSize(optarg, opt == 'n' ? &bench.min_size : &bench.max_size)) {
+                    std::cerr << "Invalid size: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case 'i':
+                bench.iters = std::max(1, std::stoi(optarg));
+                break;
+            case 'W':
+                bench.warmup = std::max(0, std::stoi(optarg));
+                break;
+            case 'w':
+                bench.window = std::max(1, std::stoi(optarg));
+                break;
+            case 'f':
+                if (parseBenchFormat(optarg, &bench.format)) {
+                    std::cerr << "Unknown output format: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case 'z':
+                if (parseSize(optarg, &zerocopy_threshold)) {
+                    std::cerr << "Invalid size: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case 'P':
+                if (parseTcpProfile(optarg, &tuning)) {
+                    std::cerr << "Unknown profile: " << optarg << " (default, latency or throughput)\n";
+                    return 1;
+                }
+                break;
+            case 'p':
+                tuning.first_cpu = std::stoi(optarg);
+                break;
+            case 'B':
+                busy_poll_us = std::max(0, std::stoi(optarg));
+                break;
+            case 'S':
+                if (parseSize(optarg, &sock_buf) || sock_buf > (1u << 30)) {
+                    std::cerr << "Invalid size: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case 'e':
+                if (parseTcpEngine(optarg, &engine)) {
+                    std::cerr << "Unknown engine: " << optarg << " (epoll or uring)\n";
+                    return 1;
+                }
+                break;
+            case 's':
+                sqpoll = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
         }
     }
-};
 
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " <server_ip> <port>\n";
+    if (argc - optind != 2) {
+        usage(argv[0]);
         return 1;
     }
 
+    // Explicit options override the profile, whatever their order
+    if (busy_poll_us >= 0) {
+        tuning.busy_poll_us = busy_poll_us;
+    }
+    if (sock_buf > 0) {
+        tuning.buffer_size = (int)sock_buf;
+    }
+    // Benchmark runs always disable Nagle, whatever the profile
+    if (bench.test != BENCH_NONE) {
+        tuning.nodelay = true;
+    }
+    bench.tuning = describeTcpTuning(tuning);
+    if (engine == TCP_ENGINE_URING) {
+        bench.tuning += sqpoll ? " io_uring+sqpoll" : " io_uring";
+    }
+
     TCPClient client;
+
+    // Benchmarks keep the console quiet
+    if (bench.test != BENCH_NONE) {
+        AsyncLogger::instance().setLevel(LOG_LEVEL_WARN);
+    }
     
     int ret = client.initialize();
     if (ret) {
@@ -120,12 +317,26 @@ int main(int argc, char *argv[]) {
         return ret;
     }
 
-    ret = client.connectToServer(argv[1], argv[2]);
+    ret = client.setTuning(tuning);
+    if (ret) {
+        std::cerr << "Failed to apply socket tuning\n";
+        return ret;
+    }
+
+    ret = client.connectToServer(argv[optind], argv[optind + 1]);
     if (ret) {
         std::cerr << "Failed to connect to server\n";
         return ret;
     }
 
+    // Benchmark runs need a server started with --bench
+    if (bench.test != BENCH_NONE) {
+        if (client.setZeroCopy(zerocopy_threshold) || client.setEngine(engine, sqpoll)) {
+            return 1;
+        }
+        return runBenchmark(client, bench) ? 1 : 0;
+    }
+
     // Perform message exchange
     ret = client.performHandshake();
     if (ret) {
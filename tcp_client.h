@@ -0,0 +1,465 @@
+#ifndef TCP_CLIENT_H
+#define TCP_CLIENT_H
+
+#include <iostream>
+#include <string>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "tcp_common.h"
+#include "uring.h"
+#include "log.h"
+
+class TCPClient {
+private:
+    int sock_fd;
+    struct sockaddr_in server_addr;
+    FrameReader reader;
+    bool quickack;
+
+    // MSG_ZEROCOPY state: sends of at least zerocopy_threshold bytes (0 for
+    // never) go out zero-copy. zerocopy_sent counts those send calls and
+    // zerocopy_completed the ones the kernel has released; owned buffers wait
+    // in loaned_buffers, tagged with the count after their send, until then.
+    size_t zerocopy_threshold;
+    uint32_t zerocopy_sent;
+    uint32_t zerocopy_completed;
+    bool zerocopy_copied;
+    std::deque<std::pair<uint32_t, void *> > loaned_buffers;
+
+    // io_uring engine for the raw stream calls: one ring per direction, so a
+    // writer thread and a reader thread never share one. Both have the
+    // socket as fixed file 0 and the buffers from registerBuffers() as
+    // fixed buffers, in the same order.
+    IoUring *send_ring;
+    IoUring *recv_ring;
+    std::vector<struct iovec> fixed_buffers;
+    bool sqpoll;
+    int spin_us;
+
+public:
+    // Under SQPOLL a wait spins this long on the completion queue before it
+    // sleeps in the kernel, unless there is only one CPU: spinning there
+    // only keeps the poller and the server from running
+    static const int URING_SPIN_US = 50;
+
+    TCPClient() : sock_fd(-1), quickack(false), zerocopy_threshold(0), zerocopy_sent(0), zerocopy_completed(0),
+                  zerocopy_copied(false), send_ring(nullptr), recv_ring(nullptr), sqpoll(false),
+                  spin_us(0) {}
+
+    ~TCPClient() {
+        cleanup();
+    }
+
+    int initialize() {
+        sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock_fd < 0) {
+            std::cerr << "Socket creation failed\n";
+            return -1;
+        }
+        reader.reset(sock_fd);
+        return 0;
+    }
+
+    int connectToServer(const std::string& server_ip, const std::string& port) {
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(std::stoi(port));
+
+        if (inet_pton(AF_INET, server_ip.c_str(), &server_addr.sin_addr) <= 0) {
+            std::cerr << "Invalid address or address not supported\n";
+            return -1;
+        }
+
+        if (connect(sock_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            std::cerr << "Connection failed\n";
+            return -1;
+        }
+
+        LOG_INFO("Connected to TCP server at %s:%s", server_ip.c_str(), port.c_str());
+        return 0;
+    }
+
+    // Call after connectToServer(). With TCP_ENGINE_URING the raw stream
+    // calls below go through io_uring, each operation submitted and waited
+    // for with one system call. Data in a buffer from registerBuffers() moves
+    // with WRITE_FIXED and READ_FIXED, anything else with SEND and RECV;
+    // neither is copied on the way. With use_sqpoll a kernel thread polls
+    // both rings, and a call that completes while the wait spins makes no
+    // system call at all. Framed messages keep using the socket directly.
+    int setEngine(TCPEngine engine, bool use_sqpoll = false) {
+        if (engine != TCP_ENGINE_URING) {
+            return 0;
+        }
+        sqpoll = use_sqpoll;
+        spin_us = std::thread::hardware_concurrency() > 1 ? URING_SPIN_US : 0;
+        send_ring = new IoUring();
+        recv_ring = new IoUring();
+        if (setupRing(send_ring, nullptr) || setupRing(recv_ring, send_ring)) {
+            std::cerr << "io_uring is not available, use --engine epoll\n";
+            releaseRings();
+            return -1;
+        }
+        return 0;
+    }
+
+    // Register the buffers the raw stream calls will use, in place of those
+    // registered before; they must stay allocated until replaced or the
+    // client is closed. Does nothing without the io_uring engine.
+    int registerBuffers(const struct iovec *iov, unsigned count) {
+        if (!send_ring) {
+            return 0;
+        }
+        fixed_buffers.assign(iov, iov + count);
+        if (send_ring->registerBuffers(iov, count) || recv_ring->registerBuffers(iov, count)) {
+            fixed_buffers.clear();
+            return -1;
+        }
+        return 0;
+    }
+
+    // Raw stream access for benchmark payloads, which are not framed
+    int sendAll(const void *data, size_t len) {
+        if (send_ring) {
+            return uringSend(data, len);
+        }
+        return ::sendAll(sock_fd, data, len);
+    }
+
+    // Like sendAll(), but sends of at least the zero-copy threshold go out
+    // with MSG_ZEROCOPY, so data must stay unchanged until flush(). The
+    // io_uring engine returns once the socket has taken the data instead.
+    int sendStable(const void *data, size_t len) {
+        if (send_ring || !useZeroCopy(len)) {
+            return sendAll(data, len);
+        }
+        struct iovec iov;
+        iov.iov_base = (void *)data;
+        iov.iov_len = len;
+        int ret = sendIov(sock_fd, &iov, 1, MSG_ZEROCOPY, &zerocopy_sent);
+        // Keep the error queue short
+        if (completeZeroCopy(false)) {
+            return -1;
+        }
+        return ret;
+    }
+
+    // 1 if the server disconnected first
+    int recvAll(void *data, size_t len) {
+        if (quickack) {
+            rearmQuickAck(sock_fd);
+        }
+        int ret = recv_ring ? uringRecv(data, len) : reader.read(data, len);
+        if (ret == 1) {
+            std::cerr << "Server disconnected\n";
+        }
+        return ret;
+    }
+
+    int setNoDelay(bool on) {
+        return ::setNoDelay(sock_fd, on);
+    }
+
+    // Call between initialize() and connectToServer(), so the buffer sizes
+    // take part in the window scale negotiation. Pins the calling thread.
+    int setTuning(const TcpTuning& tuning) {
+        if (applyTcpTuning(sock_fd, tuning) || pinTcpThread(tuning, 0)) {
+            return -1;
+        }
+        quickack = tuning.quickack;
+        return 0;
+    }
+
+    // Send messages of at least threshold bytes with MSG_ZEROCOPY; 0 turns
+    // it off. The pages are pinned instead of copied, which pays off from
+    // some tens of kilobytes up, but the sender has to learn from the error
+    // queue when it may touch the buffer again.
+    int setZeroCopy(size_t threshold) {
+        if (threshold && enableZeroCopy(sock_fd)) {
+            return -1;
+        }
+        zerocopy_threshold = threshold;
+        return 0;
+    }
+
+    // Wait until the kernel has released every zero-copy send
+    int flush() {
+        return completeZeroCopy(true);
+    }
+
+    int sendMessage(const std::string& message) {
+        if (sendData(message.data(), message.size())) {
+            return -1;
+        }
+        LOG_DEBUG("Message sent: %s", message.c_str());
+        return 0;
+    }
+
+    // Send one message of arbitrary bytes as a single frame. The caller may
+    // reuse data on return, so a zero-copy send waits for its notification.
+    int sendData(const void *data, size_t len) {
+        if (sock_fd < 0) {
+            std::cerr << "Not connected to server\n";
+            return -1;
+        }
+        if (!useZeroCopy(len)) {
+            return sendFrame(sock_fd, data, len);
+        }
+        int ret = sendFrame(sock_fd, data, len, MSG_ZEROCOPY, &zerocopy_sent);
+        if (completeZeroCopy(true)) {
+            return -1;
+        }
+        return ret;
+    }
+
+    // Buffers for sendBuffer(), with room for the frame header in front
+    void *allocBuffer(size_t size) {
+        return allocFrameBuffer(size);
+    }
+
+    void freeBuffer(void *buf) {
+        freeFrameBuffer(buf);
+    }
+
+    // Send a buffer from allocBuffer() as one frame and take it over. Header
+    // and payload leave as one contiguous send; a zero-copy buffer is freed
+    // once the kernel has released it rather than on return.
+    int sendBuffer(void *buf, size_t len) {
+        if (sock_fd < 0 || len > TCP_MAX_FRAME) {
+            std::cerr << (sock_fd < 0 ? "Not connected to server\n" : "Message exceeds the frame limit\n");
+            freeFrameBuffer(buf);
+            return -1;
+        }
+        char *frame = (char *)buf - TCP_FRAME_HEADER;
+        uint32_t wire_len = htonl((uint32_t)len);
+        memcpy(frame, &wire_len, sizeof(wire_len));
+
+        struct iovec iov;
+        iov.iov_base = frame;
+        iov.iov_len = TCP_FRAME_HEADER + len;
+        if (!useZeroCopy(len)) {
+            int ret = sendIov(sock_fd, &iov, 1);
+            freeFrameBuffer(buf);
+            return ret;
+        }
+        int ret = sendIov(sock_fd, &iov, 1, MSG_ZEROCOPY, &zerocopy_sent);
+        loaned_buffers.push_back(std::make_pair(zerocopy_sent, buf));
+        if (completeZeroCopy(false)) {
+            return -1;
+        }
+        return ret;
+    }
+
+    // Next message in place, valid until the next receive; 1 if the server
+    // disconnected
+    int receiveInPlace(const char **data, uint32_t *len) {
+        if (sock_fd < 0) {
+            std::cerr << "Not connected to server\n";
+            return -1;
+        }
+        if (quickack) {
+            rearmQuickAck(sock_fd);
+        }
+        int ret = reader.next(data, len);
+        if (ret == 1) {
+            LOG_INFO("Server disconnected");
+        }
+        return ret;
+    }
+
+    // Receive the next message; 1 if the server disconnected
+    int receiveMessage(std::string *payload = nullptr) {
+        const char *data;
+        uint32_t len;
+        int ret = receiveInPlace(&data, &len);
+        if (ret) {
+            return ret;
+        }
+        LOG_DEBUG("Message received: %.*s", (int)len, data);
+        if (payload) {
+            payload->assign(data, len);
+        }
+        return 0;
+    }
+
+    int performHandshake() {
+        // Send initial message
+        int ret = sendMessage("Hello from TCP client!");
+        if (ret) {
+            return ret;
+        }
+
+        // Receive response
+        std::string reply;
+        ret = receiveMessage(&reply);
+        if (ret == 0) {
+            LOG_INFO("Server replied: %s", reply.c_str());
+        }
+        return ret;
+    }
+
+private:
+    bool useZeroCopy(size_t len) const {
+        return zerocopy_threshold > 0 && len >= zerocopy_threshold;
+    }
+
+    // Read pending notifications, or with wait all outstanding ones, and free
+    // the loaned buffers they release
+    int completeZeroCopy(bool wait) {
+        while (zerocopy_completed != zerocopy_sent) {
+            bool copied = false;
+            int reaped = reapZeroCopy(sock_fd, &zerocopy_completed, wait, &copied);
+            if (reaped < 0) {
+                return -1;
+            }
+            if (copied && !zerocopy_copied) {
+                LOG_WARN("The kernel copies zero-copy sends on this path (e.g. loopback)");
+                zerocopy_copied = true;
+            }
+            if (!wait) {
+                break;
+            }
+        }
+        while (!loaned_buffers.empty() &&
+               (int32_t)(zerocopy_completed - loaned_buffers.front().first) >= 0) {
+            freeFrameBuffer(loaned_buffers.front().second);
+            loaned_buffers.pop_front();
+        }
+        return 0;
+    }
+
+    // With SQPOLL both rings share the send ring's poller thread
+    int setupRing(IoUring *ring, const IoUring *share_poller) {
+        return ring->init(4, 8, sqpoll, 1000, share_poller) || ring->registerFiles(1) ||
+               ring->updateFile(0, sock_fd) ? -1 : 0;
+    }
+
+    void releaseRings() {
+        delete send_ring;
+        delete recv_ring;
+        send_ring = recv_ring = nullptr;
+        fixed_buffers.clear();
+    }
+
+    // Index of the registered buffer holding [data, data + len), or -1
+    int fixedIndex(const void *data, size_t len) const {
+        const char *p = (const char *)data;
+        for (size_t i = 0; i < fixed_buffers.size(); i++) {
+            const char *base = (const char *)fixed_buffers[i].iov_base;
+            if (p >= base && p + len <= base + fixed_buffers[i].iov_len) {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+
+    // Read or write up to len bytes at data on the socket and wait for the
+    // result, the byte count or -errno. Without SQPOLL the submission and
+    // the wait share one io_uring_enter(). With it the poller picks the entry
+    // up, and the wait spins on the completion queue for spin_us before it
+    // sleeps with IORING_ENTER_GETEVENTS, so it neither burns a core nor
+    // starves the poller when the peer is slow.
+    int transfer(IoUring *ring, bool send, void *data, size_t len, int *res) {
+        struct io_uring_sqe *sqe = ring->getSqe();
+        if (!sqe) {
+            return -1;
+        }
+        int index = fixedIndex(data, len);
+        if (index >= 0) {
+            sqe->opcode = send ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->buf_index = (uint16_t)index;
+        } else {
+            sqe->opcode = send ? IORING_OP_SEND : IORING_OP_RECV;
+            sqe->msg_flags = send ? MSG_NOSIGNAL : 0;
+        }
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->addr = (uint64_t)(uintptr_t)data;
+        sqe->len = (uint32_t)std::min(len, (size_t)1 << 30);
+
+        struct io_uring_cqe *cqe;
+        if (sqpoll) {
+            if (ring->submit(false) < 0) {
+                return -1;
+            }
+            std::chrono::steady_clock::time_point deadline =
+                std::chrono::steady_clock::now() + std::chrono::microseconds(spin_us);
+            while (ring->peekCompletions(&cqe, 1) != 1 && std::chrono::steady_clock::now() < deadline) {
+            }
+        }
+        while (ring->peekCompletions(&cqe, 1) != 1) {
+            if (ring->submit(true) < 0) {
+                return -1;
+            }
+        }
+        *res = cqe->res;
+        ring->advance(1);
+        return 0;
+    }
+
+    // Like ::sendAll(): returns once the socket has taken every byte
+    int uringSend(const void *data, size_t len) {
+        const char *in = (const char *)data;
+        while (len > 0) {
+            int res;
+            if (transfer(send_ring, true, (void *)in, len, &res)) {
+                return -1;
+            }
+            if (res <= 0) {
+                std::cerr << "io_uring send failed: " << (res ? strerror(-res) : "connection closed") << "\n";
+                return -1;
+            }
+            in += res;
+            len -= res;
+        }
+        return 0;
+    }
+
+    // Exactly len bytes, so nothing is read ahead of the caller; 1 if the
+    // server disconnected first
+    int uringRecv(void *data, size_t len) {
+        char *out = (char *)data;
+        size_t buffered = reader.take(out, len);
+        out += buffered;
+        len -= buffered;
+        while (len > 0) {
+            int res;
+            if (transfer(recv_ring, false, out, len, &res)) {
+                return -1;
+            }
+            if (res == 0) {
+                return 1;
+            }
+            if (res < 0) {
+                std::cerr << "io_uring receive failed: " << strerror(-res) << "\n";
+                return -1;
+            }
+            out += res;
+            len -= res;
+        }
+        return 0;
+    }
+
+    void cleanup() {
+        // The rings hold their own reference to the socket
+        releaseRings();
+        if (sock_fd >= 0) {
+            close(sock_fd);
+        }
+        // The kernel holds its own references to pages still being sent
+        while (!loaned_buffers.empty()) {
+            freeFrameBuffer(loaned_buffers.front().second);
+            loaned_buffers.pop_front();
+        }
+    }
+};
+
+#endif
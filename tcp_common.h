@@ -0,0 +1,500 @@
+#ifndef TCP_COMMON_H
+#define TCP_COMMON_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <thread>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Socket helpers shared by the TCP client and server.
+//
+// Messages travel as frames: a 4-byte length in network byte order followed
+// by the payload, so a receiver gets back exactly the buffers that were sent
+// however the stream was segmented. Senders gather header and payload into
+// one sendmsg() and resume after short writes; receivers parse frames in
+// place from a large receive buffer. Benchmark payloads bypass the framing
+// and use sendAll/recvAll directly, since both sides know the message size.
+
+// Larger frames are treated as a corrupt stream
+static const uint32_t TCP_MAX_FRAME = 64 << 20;
+static const size_t TCP_FRAME_HEADER = sizeof(uint32_t);
+
+// Send exactly len bytes, continuing after short writes
+static inline int sendAll(int fd, const void *data, size_t len, int flags = 0) {
+    const char *next = (const char *)data;
+    while (len > 0) {
+        ssize_t bytes_sent = send(fd, next, len, flags | MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Failed to send message\n";
+            return -1;
+        }
+        next += bytes_sent;
+        len -= bytes_sent;
+    }
+    return 0;
+}
+
+// Receive exactly len bytes; 1 if the peer disconnected first
+static inline int recvAll(int fd, void *data, size_t len) {
+    char *next = (char *)data;
+    while (len > 0) {
+        ssize_t bytes_received = recv(fd, next, len, 0);
+        if (bytes_received == 0) {
+            return 1;
+        }
+        if (bytes_received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Failed to receive message\n";
+            return -1;
+        }
+        next += bytes_received;
+        len -= bytes_received;
+    }
+    return 0;
+}
+
+// Send every byte described by iov with as few sendmsg() calls as the socket
+// allows, stepping over short writes; iov is consumed in the process. calls
+// counts the sendmsg() calls that sent data with MSG_ZEROCOPY, which is how
+// the kernel numbers zero-copy notifications.
+static inline int sendIov(int fd, struct iovec *iov, int iovcnt, int flags = 0,
+                          uint32_t *calls = nullptr) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t bytes_sent = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                // Out of socket option memory for notifications; copy instead
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+            std::cerr << "Failed to send message\n";
+            return -1;
+        }
+        if (calls && (flags & MSG_ZEROCOPY)) {
+            (*calls)++;
+        }
+        size_t left = bytes_sent;
+        while (left > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (left > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
+}
+
+// Disable Nagle's algorithm, which would otherwise hold back small messages
+// until the peer's delayed ACK arrives
+static inline int setNoDelay(int fd, bool on) {
+    int flag = on ? 1 : 0;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag))) {
+        std::cerr << "Failed to set TCP_NODELAY\n";
+        return -1;
+    }
+    return 0;
+}
+
+// How sockets are driven: the server's workers wait on epoll readiness or on
+// io_uring completions for accept, receive and send; the client's raw stream
+// calls use blocking system calls or io_uring
+enum TCPEngine {
+    TCP_ENGINE_EPOLL,
+    TCP_ENGINE_URING
+};
+
+static inline int parseTcpEngine(const char *name, TCPEngine *engine) {
+    if (strcmp(name, "epoll") == 0) {
+        *engine = TCP_ENGINE_EPOLL;
+    } else if (strcmp(name, "uring") == 0) {
+        *engine = TCP_ENGINE_URING;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Socket tuning. The "latency" profile trades CPU for round-trip time: no
+// Nagle, ACKs sent at once instead of delayed, and busy polling of the
+// receive queue. The "throughput" profile leaves segmentation and ACKs to the
+// kernel but fixes large socket buffers, so the window never waits for
+// autotuning to grow. Thread pinning is separate, since client and server may
+// share a host.
+enum TcpProfile {
+    TCP_PROFILE_DEFAULT,
+    TCP_PROFILE_LATENCY,
+    TCP_PROFILE_THROUGHPUT
+};
+
+struct TcpTuning {
+    TcpProfile profile;
+    bool nodelay;
+    bool quickack;          // the kernel drops it, so it is re-armed per receive
+    int busy_poll_us;       // SO_BUSY_POLL; 0 leaves it off
+    int buffer_size;        // SO_SNDBUF and SO_RCVBUF; 0 keeps autotuning
+    int first_cpu;          // thread i runs on CPU first_cpu + i; -1 for no pinning
+
+    TcpTuning() : profile(TCP_PROFILE_DEFAULT), nodelay(false), quickack(false),
+                  busy_poll_us(0), buffer_size(0), first_cpu(-1) {}
+};
+
+static const int TCP_LATENCY_BUSY_POLL_US = 50;
+static const int TCP_THROUGHPUT_BUFFER = 4 << 20;
+
+// Resets the profile's options; set individual overrides afterwards
+static inline int parseTcpProfile(const char *name, TcpTuning *tuning) {
+    int first_cpu = tuning->first_cpu;
+    if (strcmp(name, "default") == 0) {
+        *tuning = TcpTuning();
+    } else if (strcmp(name, "latency") == 0) {
+        *tuning = TcpTuning();
+        tuning->profile = TCP_PROFILE_LATENCY;
+        tuning->nodelay = true;
+        tuning->quickack = true;
+        tuning->busy_poll_us = TCP_LATENCY_BUSY_POLL_US;
+    } else if (strcmp(name, "throughput") == 0) {
+        *tuning = TcpTuning();
+        tuning->profile = TCP_PROFILE_THROUGHPUT;
+        tuning->buffer_size = TCP_THROUGHPUT_BUFFER;
+    } else {
+        return -1;
+    }
+    tuning->first_cpu = first_cpu;
+    return 0;
+}
+
+// One line for logs and benchmark reports
+static inline std::string describeTcpTuning(const TcpTuning& tuning) {
+    static const char *const names[] = {"default", "latency", "throughput"};
+    std::string text = names[tuning.profile];
+    text += tuning.nodelay ? " nodelay" : "";
+    text += tuning.quickack ? " quickack" : "";
+    if (tuning.busy_poll_us > 0) {
+        text += " busy_poll=" + std::to_string(tuning.busy_poll_us) + "us";
+    }
+    if (tuning.buffer_size > 0) {
+        text += " sockbuf=" + std::to_string(tuning.buffer_size);
+    }
+    if (tuning.first_cpu >= 0) {
+        text += " cpu=" + std::to_string(tuning.first_cpu);
+    }
+    return text;
+}
+
+static inline int setSocketOption(int fd, int level, int name, int value, const char *label) {
+    if (setsockopt(fd, level, name, &value, sizeof(value))) {
+        std::cerr << "Failed to set " << label << ": " << strerror(errno) << "\n";
+        return -1;
+    }
+    return 0;
+}
+
+// Apply the per-socket options. Buffer sizes must be set before connect() or
+// listen() for the window scale to match them, and accepted sockets inherit
+// them from the listener. Raising SO_BUSY_POLL above net.core.busy_read needs
+// CAP_NET_ADMIN.
+static inline int applyTcpTuning(int fd, const TcpTuning& tuning) {
+    if (tuning.nodelay && setNoDelay(fd, true)) {
+        return -1;
+    }
+    if (tuning.quickack && setSocketOption(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK")) {
+        return -1;
+    }
+    if (tuning.busy_poll_us > 0 &&
+        setSocketOption(fd, SOL_SOCKET, SO_BUSY_POLL, tuning.busy_poll_us, "SO_BUSY_POLL")) {
+        return -1;
+    }
+    if (tuning.buffer_size > 0 &&
+        (setSocketOption(fd, SOL_SOCKET, SO_SNDBUF, tuning.buffer_size, "SO_SNDBUF") ||
+         setSocketOption(fd, SOL_SOCKET, SO_RCVBUF, tuning.buffer_size, "SO_RCVBUF"))) {
+        return -1;
+    }
+    return 0;
+}
+
+// TCP_QUICKACK only lasts until the kernel next decides to delay an ACK
+static inline void rearmQuickAck(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+}
+
+// CPU of thread index: first_cpu + index, wrapping around the online CPUs;
+// -1 without pinning
+static inline int tcpThreadCpu(const TcpTuning& tuning, int index) {
+    if (tuning.first_cpu < 0) {
+        return -1;
+    }
+    unsigned int cpus = std::max(1u, std::thread::hardware_concurrency());
+    return (int)((tuning.first_cpu + index) % cpus);
+}
+
+static inline int pinTcpThread(const TcpTuning& tuning, int index) {
+    int cpu = tcpThreadCpu(tuning, index);
+    if (cpu < 0) {
+        return 0;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        std::cerr << "Failed to pin thread to CPU " << cpu << "\n";
+        return -1;
+    }
+    return 0;
+}
+
+// Length and payload are gathered into one sendmsg(), so a small frame is
+// one segment and one system call
+static inline int sendFrame(int fd, const void *data, size_t len, int flags = 0,
+                            uint32_t *zerocopy_calls = nullptr) {
+    if (len > TCP_MAX_FRAME) {
+        std::cerr << "Message of " << len << " bytes exceeds the frame limit\n";
+        return -1;
+    }
+    uint32_t wire_len = htonl((uint32_t)len);
+    struct iovec iov[2];
+    iov[0].iov_base = &wire_len;
+    iov[0].iov_len = sizeof(wire_len);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    return sendIov(fd, iov, 2, flags, zerocopy_calls);
+}
+
+// Buffers with room for the frame header in front of the payload, so an
+// owned buffer goes out as one contiguous send; see TCPClient::sendBuffer()
+static inline void *allocFrameBuffer(size_t size) {
+    char *block = (char *)malloc(size + TCP_FRAME_HEADER);
+    return block ? block + TCP_FRAME_HEADER : nullptr;
+}
+
+static inline void freeFrameBuffer(void *buf) {
+    if (buf) {
+        free((char *)buf - TCP_FRAME_HEADER);
+    }
+}
+
+// Opt the socket in to MSG_ZEROCOPY (Linux 4.14 or later)
+static inline int enableZeroCopy(int fd) {
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))) {
+        std::cerr << "Failed to enable SO_ZEROCOPY: " << strerror(errno) << "\n";
+        return -1;
+    }
+    return 0;
+}
+
+// Read zero-copy notifications from the socket's error queue. Each covers a
+// range of send calls; *completed becomes one past the newest call the kernel
+// has released the pages of. copied is set when the kernel fell back to
+// copying, as it does on loopback. With wait, blocks until at least one
+// notification arrives. Returns the number read.
+static inline int reapZeroCopy(int fd, uint32_t *completed, bool wait, bool *copied) {
+    int reaped = 0;
+    for (;;) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "Failed to read zero-copy notifications: " << strerror(errno) << "\n";
+                return -1;
+            }
+            if (!wait || reaped > 0) {
+                return reaped;
+            }
+
+            // The error queue signals POLLERR; so does a socket error, which
+            // would otherwise keep this loop spinning
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = 0;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                std::cerr << "poll failed: " << strerror(errno) << "\n";
+                return -1;
+            }
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 && error) {
+                std::cerr << "Socket failed while waiting for zero-copy sends: " << strerror(error) << "\n";
+                return -1;
+            }
+            continue;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0) {
+                continue;
+            }
+            // ee_info..ee_data is the range of calls completed, inclusive
+            if ((int32_t)(err.ee_data + 1 - *completed) > 0) {
+                *completed = err.ee_data + 1;
+            }
+            if (copied && (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)) {
+                *copied = true;
+            }
+            reaped++;
+        }
+    }
+}
+
+// Batched, in-place frame parsing for blocking sockets. Each recv() pulls in
+// whatever the socket has buffered, up to a large window, and frames are
+// handed out straight from that buffer; a run of small frames thus costs one
+// system call instead of two per frame. Unparsed bytes move to the front
+// only when a frame would run past the end.
+class FrameReader {
+public:
+    static const size_t READ_SIZE = 256 * 1024;
+
+    FrameReader() : fd(-1), head(0), tail(0), consumed(0) {}
+
+    void reset(int socket_fd) {
+        fd = socket_fd;
+        head = tail = consumed = 0;
+        if (buf.empty()) {
+            buf.resize(READ_SIZE);
+        }
+    }
+
+    // Next frame, in place: data stays valid until the next call. 1 if the
+    // peer disconnected between frames.
+    int next(const char **data, uint32_t *len) {
+        head += consumed;
+        consumed = 0;
+
+        int ret = fill(TCP_FRAME_HEADER);
+        if (ret) {
+            return ret;
+        }
+        uint32_t wire_len;
+        memcpy(&wire_len, buf.data() + head, sizeof(wire_len));
+        uint32_t frame_len = ntohl(wire_len);
+        if (frame_len > TCP_MAX_FRAME) {
+            std::cerr << "Frame of " << frame_len << " bytes exceeds the limit\n";
+            return -1;
+        }
+        if (fill(TCP_FRAME_HEADER + frame_len)) {
+            return -1;
+        }
+        *data = buf.data() + head + TCP_FRAME_HEADER;
+        *len = frame_len;
+        consumed = TCP_FRAME_HEADER + frame_len;
+        return 0;
+    }
+
+    // Unframed bytes, buffered ones first; 1 if the peer disconnected first
+    int read(void *data, size_t len) {
+        size_t buffered = take(data, len);
+        if (buffered == len) {
+            return 0;
+        }
+        return recvAll(fd, (char *)data + buffered, len - buffered);
+    }
+
+    // Up to len bytes already read past the last frame, for callers that
+    // read the rest of the stream themselves
+    size_t take(void *data, size_t len) {
+        head += consumed;
+        consumed = 0;
+
+        size_t buffered = std::min(len, tail - head);
+        memcpy(data, buf.data() + head, buffered);
+        head += buffered;
+        if (head == tail) {
+            head = tail = 0;
+        }
+        return buffered;
+    }
+
+private:
+    int fd;
+    std::vector<char> buf;
+    size_t head;
+    size_t tail;
+    size_t consumed;    // bytes of the frame last handed out
+
+    // Buffer at least need bytes from head on; 1 if the peer disconnected
+    // before sending any of them
+    int fill(size_t need) {
+        if (head == tail) {
+            head = tail = 0;
+        }
+        if (buf.size() - head < need) {
+            memmove(buf.data(), buf.data() + head, tail - head);
+            tail -= head;
+            head = 0;
+            if (buf.size() < need) {
+                buf.resize(need + READ_SIZE);
+            }
+        }
+        while (tail - head < need) {
+            ssize_t n = recv(fd, buf.data() + tail, buf.size() - tail, 0);
+            if (n == 0) {
+                if (tail == head) {
+                    return 1;
+                }
+                std::cerr << "Connection closed in the middle of a frame\n";
+                return -1;
+            }
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Failed to receive message\n";
+                return -1;
+            }
+            tail += n;
+        }
+        return 0;
+    }
+};
+
+#endif
@@ -1,151 +1,113 @@
 #include <iostream>
 #include <string>
-#include <cstring>
-#include <unistd.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <thread>
-#include <vector>
+#include <cstdlib>
+#include <getopt.h>
 
-class TCPServer {
-private:
-    int server_fd;
-    struct sockaddr_in address;
-    static const size_t BUFFER_SIZE = 4096;
-    static const int MAX_CLIENTS = 10;
+#include "tcp_server.h"
 
-public:
-    TCPServer() : server_fd(-1) {}
+static void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [--bench] [--workers N] [--engine epoll|uring] [--sqpoll]\n"
+              << "       [--profile default|latency|throughput] [--pin-cpu FIRST] "
+              << "[--busy-poll US] [--sock-buf BYTES] <port>\n";
+}
 
-    ~TCPServer() {
-        cleanup();
-    }
-
-    int initialize(const std::string& port) {
-        server_fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_fd == 0) {
-            std::cerr << "Socket creation failed\n";
-            return -1;
-        }
-
-        int opt = 1;
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-            std::cerr << "Setsockopt failed\n";
-            return -1;
-        }
-
-        address.sin_family = AF_INET;
-        address.sin_addr.s_addr = INADDR_ANY;
-        address.sin_port = htons(std::stoi(port));
-
-        if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
-            std::cerr << "Bind failed\n";
-            return -1;
-        }
-
-        if (listen(server_fd, MAX_CLIENTS) < 0) {
-            std::cerr << "Listen failed\n";
-            return -1;
-        }
-
-        std::cout << "TCP server listening on port " << port << std::endl;
-        return 0;
-    }
-
-    int waitForConnection() {
-        struct sockaddr_in client_addr;
-        socklen_t addrlen = sizeof(client_addr);
-        
-        int client_socket = accept(server_fd, (struct sockaddr*)&client_addr, &addrlen);
-        if (client_socket < 0) {
-            std::cerr << "Accept failed\n";
-            return -1;
-        }
-
-        std::cout << "Client connected from " << inet_ntoa(client_addr.sin_addr) << std::endl;
-        
-        handleClient(client_socket);
-        close(client_socket);
-        return 0;
-    }
-
-    void handleClient(int client_socket) {
-        char buffer[BUFFER_SIZE];
-        
-        // Receive message from client
-        memset(buffer, 0, BUFFER_SIZE);
-        ssize_t bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes_received > 0) {
-            buffer[bytes_received] = '\0';
-            std::cout << "Message received: " << buffer << std::endl;
-            
-            // Send response back to client
-            std::string response = "Hello from TCP server!";
-            send(client_socket, response.c_str(), response.length(), 0);
-            std::cout << "Response sent: " << response << std::endl;
-        } else {
-            std::cerr << "Failed to receive message\n";
+int main(int argc, char *argv[]) {
+    bool bench = false;
+    int workers = 1;
+    TCPEngine engine = TCP_ENGINE_EPOLL;
+    bool sqpoll = false;
+    TcpTuning tuning;
+    int busy_poll_us = -1;
+    size_t sock_buf = 0;
+
+    static const struct option long_options[] = {
+        {"bench", no_argument, nullptr, 'b'},
+        {"workers", required_argument, nullptr, 'w'},
+        {"engine", required_argument, nullptr, 'e'},
+        {"sqpoll", no_argument, nullptr, 's'},
+        {"profile", required_argument, nullptr, 'P'},
+        {"pin-cpu", required_argument, nullptr, 'p'},
+        {"busy-poll", required_argument, nullptr, 'B'},
+        {"sock-buf", required_argument, nullptr, 'S'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "bw:e:sP:p:B:S:", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'b':
+                bench = true;
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                if (workers < 1) {
+                    std::cerr << "Invalid worker count: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case 'e':
+                if (parseTcpEngine(optarg, &engine)) {
+                    std::cerr << "Unknown engine: " << optarg << " (epoll or uring)\n";
+                    return 1;
+                }
+                break;
+            case 's':
+                sqpoll = true;
+                break;
+            case 'P':
+                if (parseTcpProfile(optarg, &tuning)) {
+                    std::cerr << "Unknown profile: " << optarg << " (default, latency or throughput)\n";
+                    return 1;
+                }
+                break;
+            case 'p':
+                tuning.first_cpu = std::stoi(optarg);
+                break;
+            case 'B':
+                busy_poll_us = std::max(0, std::stoi(optarg));
+                break;
+            case 'S':
+                if (parseSize(optarg, &sock_buf) || sock_buf > (1u << 30)) {
+                    std::cerr << "Invalid size: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
         }
     }
 
-    int sendMessage(int client_socket, const std::string& message) {
-        ssize_t bytes_sent = send(client_socket, message.c_str(), message.length(), 0);
-        if (bytes_sent < 0) {
-            std::cerr << "Failed to send message\n";
-            return -1;
-        }
-        std::cout << "Message sent: " << message << std::endl;
-        return 0;
+    if (argc - optind != 1) {
+        usage(argv[0]);
+        return 1;
     }
 
-    int receiveMessage(int client_socket) {
-        char buffer[BUFFER_SIZE];
-        memset(buffer, 0, BUFFER_SIZE);
-        
-        ssize_t bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes_received > 0) {
-            buffer[bytes_received] = '\0';
-            std::cout << "Message received: " << buffer << std::endl;
-            return 0;
-        } else if (bytes_received == 0) {
-            std::cout << "Client disconnected\n";
-            return 1;
-        } else {
-            std::cerr << "Failed to receive message\n";
-            return -1;
-        }
+    // Explicit options override the profile, whatever their order
+    if (busy_poll_us >= 0) {
+        tuning.busy_poll_us = busy_poll_us;
     }
-
-private:
-    void cleanup() {
-        if (server_fd >= 0) {
-            close(server_fd);
-        }
-    }
-};
-
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <port>\n";
-        return 1;
+    if (sock_buf > 0) {
+        tuning.buffer_size = (int)sock_buf;
     }
 
     TCPServer server;
+    server.setWorkers(workers);
+    server.setBenchMode(bench);
+    server.setEngine(engine, sqpoll);
+    server.setTuning(tuning);
+    server.setMessageHandler([](TCPServer& srv, int client_socket, const char *data, size_t len) {
+        LOG_INFO("Message received: %.*s", (int)len, data);
+        srv.sendMessage(client_socket, "Hello from TCP server!");
+    });
     
-    int ret = server.initialize(argv[1]);
+    int ret = server.initialize(argv[optind]);
     if (ret) {
         std::cerr << "Failed to initialize server\n";
         return ret;
     }
 
-    while (true) {
-        ret = server.waitForConnection();
-        if (ret) {
-            std::cerr << "Connection handling failed\n";
-            break;
-        }
-    }
-
+    server.start();
+    server.wait();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,967 @@
+#ifndef TCP_SERVER_H
+#define TCP_SERVER_H
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "tcp_common.h"
+#include "uring.h"
+#include "benchmark.h"
+#include "log.h"
+
+// Per-connection state. Bytes are read into `in` until EAGAIN and parsed from
+// in_head; replies are appended to `out` and written when the batch of input
+// has been handled, or when the socket becomes writable again.
+struct TCPConnection {
+    int fd;
+    std::vector<char> in;
+    size_t in_head;
+    size_t in_tail;
+    std::string out;
+    size_t out_head;
+    bool read_paused;
+
+    // Benchmark run in progress: messages left to echo, or bytes left to
+    // drain before the ack of a one-way run
+    BenchRequest bench;
+    uint64_t bench_remaining;
+
+    // io_uring engine: the output being sent while `out` collects more,
+    // the registered file slot (-1 for none) and the operations the kernel
+    // still holds, which keep the connection alive after it is closed
+    std::string sending;
+    size_t sending_head;
+    int file_index;
+    int ops_inflight;
+    bool recv_armed;
+    bool send_inflight;
+    bool closing;
+};
+
+// An event loop thread. Each worker has its own SO_REUSEPORT listener, so the
+// kernel spreads new connections over the workers, and its own epoll
+// instance watching that listener, a wake-up eventfd and its connections.
+// With the io_uring engine a ring takes the place of the epoll instance.
+struct TCPWorker {
+    int index;
+    std::thread thread;
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;
+    IoUring *ring;
+    uint64_t wake_value;
+    std::unordered_map<int, TCPConnection *> connections;
+    std::vector<int> pending_output;
+};
+
+// Worker that owns the calling thread, used to route sends to their socket
+static thread_local TCPWorker *current_tcp_worker = nullptr;
+
+class TCPServer {
+public:
+    // Called for every message a client sends, on the worker thread that owns
+    // the connection
+    typedef std::function<void(TCPServer&, int client_socket, const char *data, size_t len)>
+        MessageHandler;
+
+private:
+    std::vector<TCPWorker *> workers;
+    int worker_count;
+    bool bench_mode;
+    TCPEngine engine;
+    bool sqpoll;
+    TcpTuning tuning;
+    std::atomic<bool> stopping;
+    MessageHandler handler;
+
+    static const int EPOLL_BATCH = 64;
+    static const size_t READ_CHUNK = 256 * 1024;
+    // Reading stops while this much output is queued for a slow reader
+    static const size_t OUT_HIGH_WATER = 4 << 20;
+
+    // io_uring engine. Sockets below URING_FILES get a registered file slot;
+    // receives pick one of URING_BUFFERS kernel-provided buffers.
+    static const unsigned URING_ENTRIES = 256;
+    static const unsigned URING_CQ_ENTRIES = 4096;
+    static const unsigned URING_BATCH = 64;
+    static const unsigned URING_FILES = 4096;
+    static const unsigned URING_BUFFERS = 256;
+    static const unsigned URING_BUFFER_SIZE = 64 * 1024;
+
+    // Operation kinds, kept in the low bits of a completion's user_data
+    // next to the connection pointer
+    enum UringOp {
+        URING_ACCEPT = 1,
+        URING_WAKE = 2,
+        URING_RECV = 3,
+        URING_SEND = 4,
+        URING_CANCEL = 5
+    };
+    static const uint64_t URING_OP_MASK = 7;
+
+public:
+    TCPServer() : worker_count(1), bench_mode(false), engine(TCP_ENGINE_EPOLL), sqpoll(false),
+                  stopping(false) {}
+
+    ~TCPServer() {
+        stop();
+        cleanup();
+    }
+
+    // Must be called before initialize()
+    void setWorkers(int count) {
+        worker_count = std::max(1, count);
+    }
+
+    // Answer benchmark runs instead of dispatching messages
+    void setBenchMode(bool on) {
+        bench_mode = on;
+    }
+
+    // Must be called before initialize(). SQPOLL gives every io_uring worker
+    // a kernel thread that picks up submissions without system calls.
+    void setEngine(TCPEngine server_engine, bool use_sqpoll = false) {
+        engine = server_engine;
+        sqpoll = use_sqpoll;
+    }
+
+    // Must be called before initialize(). With pinning, worker i runs on
+    // CPU first_cpu + i and its listener asks for the connections whose
+    // packets that CPU receives (SO_INCOMING_CPU).
+    void setTuning(const TcpTuning& socket_tuning) {
+        tuning = socket_tuning;
+    }
+
+    void setMessageHandler(const MessageHandler& message_handler) {
+        handler = message_handler;
+    }
+
+    // Open one non-blocking listener and epoll instance (or ring) per worker
+    int initialize(const std::string& port) {
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(std::stoi(port));
+
+        for (int i = 0; i < worker_count; i++) {
+            TCPWorker *worker = new TCPWorker();
+            worker->index = i;
+            worker->listen_fd = -1;
+            worker->epoll_fd = -1;
+            worker->wake_fd = -1;
+            worker->ring = nullptr;
+            worker->wake_value = 0;
+            workers.push_back(worker);
+
+            worker->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (worker->listen_fd < 0) {
+                std::cerr << "Socket creation failed\n";
+                return -1;
+            }
+
+            int opt = 1;
+            if (setsockopt(worker->listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+                setsockopt(worker->listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+                std::cerr << "Setsockopt failed\n";
+                return -1;
+            }
+
+            // Accepted sockets inherit the buffer sizes and busy polling
+            if (applyTcpTuning(worker->listen_fd, tuning)) {
+                return -1;
+            }
+            int cpu = tcpThreadCpu(tuning, i);
+            if (cpu >= 0 && setSocketOption(worker->listen_fd, SOL_SOCKET, SO_INCOMING_CPU, cpu,
+                                            "SO_INCOMING_CPU")) {
+                return -1;
+            }
+
+            if (bind(worker->listen_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+                std::cerr << "Bind failed\n";
+                return -1;
+            }
+
+            if (listen(worker->listen_fd, SOMAXCONN) < 0) {
+                std::cerr << "Listen failed\n";
+                return -1;
+            }
+
+            if (engine == TCP_ENGINE_URING) {
+                if (setupRing(worker)) {
+                    return -1;
+                }
+                continue;
+            }
+
+            worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (worker->epoll_fd < 0 || worker->wake_fd < 0) {
+                std::cerr << "Failed to create epoll instance\n";
+                return -1;
+            }
+            if (watch(worker, worker->listen_fd, EPOLLIN | EPOLLET) ||
+                watch(worker, worker->wake_fd, EPOLLIN)) {
+                return -1;
+            }
+        }
+
+        LOG_INFO("TCP server listening on port %s (%d workers, %s%s)", port.c_str(), worker_count,
+                 engine == TCP_ENGINE_URING ? "io_uring" : "epoll",
+                 engine == TCP_ENGINE_URING && sqpoll ? " with SQPOLL" : "");
+        LOG_INFO("Socket tuning: %s", describeTcpTuning(tuning).c_str());
+        return 0;
+    }
+
+    int start() {
+        for (size_t i = 0; i < workers.size(); i++) {
+            TCPWorker *worker = workers[i];
+            worker->thread = std::thread(&TCPServer::workerLoop, this, worker);
+        }
+        return 0;
+    }
+
+    void wait() {
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (workers[i]->thread.joinable()) {
+                workers[i]->thread.join();
+            }
+        }
+    }
+
+    void stop() {
+        uint64_t one = 1;
+
+        stopping = true;
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (workers[i]->wake_fd >= 0 && write(workers[i]->wake_fd, &one, sizeof(one)) < 0) {
+                std::cerr << "Failed to wake worker " << i << "\n";
+            }
+        }
+        wait();
+    }
+
+    int sendMessage(int client_socket, const std::string& message) {
+        if (sendData(client_socket, message.data(), message.size())) {
+            return -1;
+        }
+        LOG_DEBUG("Message sent: %s", message.c_str());
+        return 0;
+    }
+
+    // Queue one message as a frame. Only the worker that owns the connection,
+    // i.e. the message handler, may send on it; the frame leaves with the
+    // rest of the replies to the current batch of input.
+    int sendData(int client_socket, const void *data, size_t len) {
+        TCPConnection *conn = ownedConnection(client_socket);
+        if (!conn) {
+            return -1;
+        }
+        if (len > TCP_MAX_FRAME) {
+            std::cerr << "Message of " << len << " bytes exceeds the frame limit\n";
+            return -1;
+        }
+        if (conn->out_head == conn->out.size()) {
+            current_tcp_worker->pending_output.push_back(client_socket);
+        }
+        uint32_t wire_len = htonl((uint32_t)len);
+        conn->out.append((const char *)&wire_len, sizeof(wire_len));
+        conn->out.append((const char *)data, len);
+        return 0;
+    }
+
+private:
+    int watch(TCPWorker *worker, int fd, uint32_t events) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = events;
+        event.data.fd = fd;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+            std::cerr << "Failed to add socket to epoll: " << strerror(errno) << "\n";
+            return -1;
+        }
+        return 0;
+    }
+
+    TCPConnection *ownedConnection(int client_socket) {
+        TCPWorker *worker = current_tcp_worker;
+        if (!worker) {
+            std::cerr << "Sends must come from the message handler\n";
+            return nullptr;
+        }
+        std::unordered_map<int, TCPConnection *>::iterator it = worker->connections.find(client_socket);
+        if (it == worker->connections.end() || it->second->closing) {
+            std::cerr << "Unknown connection " << client_socket << "\n";
+            return nullptr;
+        }
+        return it->second;
+    }
+
+    void workerLoop(TCPWorker *worker) {
+        pinTcpThread(tuning, worker->index);
+        if (worker->ring) {
+            uringLoop(worker);
+        } else {
+            epollLoop(worker);
+        }
+    }
+
+    void epollLoop(TCPWorker *worker) {
+        struct epoll_event events[EPOLL_BATCH];
+
+        current_tcp_worker = worker;
+        while (!stopping) {
+            int n = epoll_wait(worker->epoll_fd, events, EPOLL_BATCH, -1);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "epoll_wait failed: " << strerror(errno) << "\n";
+                break;
+            }
+
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == worker->wake_fd) {
+                    continue;
+                }
+                if (fd == worker->listen_fd) {
+                    acceptConnections(worker);
+                    continue;
+                }
+
+                std::unordered_map<int, TCPConnection *>::iterator it = worker->connections.find(fd);
+                if (it == worker->connections.end()) {
+                    continue;
+                }
+                TCPConnection *conn = it->second;
+                bool open = true;
+                if (events[i].events & EPOLLOUT) {
+                    open = writeOutput(conn);
+                    if (open && conn->read_paused && queuedOutput(conn) < OUT_HIGH_WATER) {
+                        conn->read_paused = false;
+                        open = readInput(conn);
+                    }
+                }
+                if (open && !conn->read_paused &&
+                    (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                    open = readInput(conn);
+                }
+                if (!open) {
+                    closeConnection(worker, conn);
+                }
+            }
+
+            // Replies the handler queued on other connections of this worker
+            for (size_t i = 0; i < worker->pending_output.size(); i++) {
+                std::unordered_map<int, TCPConnection *>::iterator it =
+                    worker->connections.find(worker->pending_output[i]);
+                if (it != worker->connections.end() && !writeOutput(it->second)) {
+                    closeConnection(worker, it->second);
+                }
+            }
+            worker->pending_output.clear();
+        }
+
+        for (std::unordered_map<int, TCPConnection *>::iterator it = worker->connections.begin();
+             it != worker->connections.end(); ++it) {
+            close(it->first);
+            delete it->second;
+        }
+        worker->connections.clear();
+        current_tcp_worker = nullptr;
+    }
+
+    // Edge-triggered: accept until the backlog is empty
+    void acceptConnections(TCPWorker *worker) {
+        for (;;) {
+            struct sockaddr_in client_addr;
+            socklen_t addrlen = sizeof(client_addr);
+            int fd = accept4(worker->listen_fd, (struct sockaddr*)&client_addr, &addrlen,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    std::cerr << "Accept failed: " << strerror(errno) << "\n";
+                }
+                return;
+            }
+
+            // Echoes and acks must leave immediately, not wait for Nagle
+            if ((bench_mode && setNoDelay(fd, true)) || applyTcpTuning(fd, tuning)) {
+                close(fd);
+                continue;
+            }
+
+            TCPConnection *conn = newConnection(fd);
+            if (watch(worker, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)) {
+                close(fd);
+                delete conn;
+                continue;
+            }
+            worker->connections[fd] = conn;
+            LOG_INFO("Client connected from %s (worker %d)", inet_ntoa(client_addr.sin_addr),
+                     worker->index);
+        }
+    }
+
+    TCPConnection *newConnection(int fd) {
+        TCPConnection *conn = new TCPConnection();
+        conn->fd = fd;
+        conn->in.resize(READ_CHUNK);
+        conn->in_head = 0;
+        conn->in_tail = 0;
+        conn->out_head = 0;
+        conn->read_paused = false;
+        memset(&conn->bench, 0, sizeof(conn->bench));
+        conn->bench_remaining = 0;
+        conn->sending_head = 0;
+        conn->file_index = -1;
+        conn->ops_inflight = 0;
+        conn->recv_armed = false;
+        conn->send_inflight = false;
+        conn->closing = false;
+        return conn;
+    }
+
+    void closeConnection(TCPWorker *worker, TCPConnection *conn) {
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+        worker->connections.erase(conn->fd);
+        close(conn->fd);
+        delete conn;
+        LOG_INFO("Client disconnected");
+    }
+
+    int setupRing(TCPWorker *worker) {
+        worker->wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (worker->wake_fd < 0) {
+            std::cerr << "Failed to create eventfd\n";
+            return -1;
+        }
+        worker->ring = new IoUring();
+        if (worker->ring->init(URING_ENTRIES, URING_CQ_ENTRIES, sqpoll) ||
+            worker->ring->registerFiles(URING_FILES) ||
+            worker->ring->provideBuffers(0, URING_BUFFERS, URING_BUFFER_SIZE)) {
+            std::cerr << "io_uring is not available, use --engine epoll\n";
+            return -1;
+        }
+        return 0;
+    }
+
+    // Completion-driven loop. Accepts and receives are multishot, so each is
+    // armed once and keeps producing completions; everything the handlers
+    // queue while a batch of completions is processed is submitted together
+    // with the wait for the next batch.
+    void uringLoop(TCPWorker *worker) {
+        IoUring *ring = worker->ring;
+        struct io_uring_cqe *batch[URING_BATCH];
+
+        current_tcp_worker = worker;
+        armAccept(worker);
+        armWake(worker);
+        while (!stopping) {
+            if (ring->submit(true) < 0) {
+                break;
+            }
+
+            unsigned n;
+            while ((n = ring->peekCompletions(batch, URING_BATCH)) > 0) {
+                for (unsigned i = 0; i < n; i++) {
+                    handleCompletion(worker, batch[i]->user_data, batch[i]->res, batch[i]->flags);
+                }
+                ring->advance(n);
+            }
+
+            // Replies the handler queued on other connections of this worker
+            for (size_t i = 0; i < worker->pending_output.size(); i++) {
+                std::unordered_map<int, TCPConnection *>::iterator it =
+                    worker->connections.find(worker->pending_output[i]);
+                if (it != worker->connections.end()) {
+                    startSend(worker, it->second);
+                }
+            }
+            worker->pending_output.clear();
+        }
+
+        // Tearing the ring down cancels whatever is still in flight, so the
+        // connections can only go once it is gone
+        std::unordered_map<int, TCPConnection *>::iterator it;
+        for (it = worker->connections.begin(); it != worker->connections.end(); ++it) {
+            shutdown(it->first, SHUT_RDWR);
+        }
+        delete worker->ring;
+        worker->ring = nullptr;
+        for (it = worker->connections.begin(); it != worker->connections.end(); ++it) {
+            close(it->first);
+            delete it->second;
+        }
+        worker->connections.clear();
+        current_tcp_worker = nullptr;
+    }
+
+    static uint64_t uringTag(const void *ptr, UringOp op) {
+        return (uint64_t)(uintptr_t)ptr | op;
+    }
+
+    void handleCompletion(TCPWorker *worker, uint64_t user_data, int res, unsigned flags) {
+        TCPConnection *conn = (TCPConnection *)(uintptr_t)(user_data & ~URING_OP_MASK);
+
+        switch (user_data & URING_OP_MASK) {
+            case URING_ACCEPT:
+                if (res >= 0) {
+                    addConnection(worker, res);
+                } else if (!stopping) {
+                    std::cerr << "Accept failed: " << strerror(-res) << "\n";
+                }
+                if (!(flags & IORING_CQE_F_MORE) && !stopping) {
+                    armAccept(worker);
+                }
+                break;
+            case URING_RECV:
+                handleRecv(worker, conn, res, flags);
+                break;
+            case URING_SEND:
+                handleSend(worker, conn, res);
+                break;
+            default:
+                // Wake-ups only need to end the wait; cancels and failed
+                // buffer recycles (user_data 0) report nothing
+                if (user_data == 0 && res < 0) {
+                    std::cerr << "Failed to recycle a receive buffer: " << strerror(-res) << "\n";
+                }
+                break;
+        }
+    }
+
+    // Socket operations go through the registered file slot when there is one
+    void setTarget(struct io_uring_sqe *sqe, const TCPConnection *conn) {
+        if (conn->file_index >= 0) {
+            sqe->fd = conn->file_index;
+            sqe->flags |= IOSQE_FIXED_FILE;
+        } else {
+            sqe->fd = conn->fd;
+        }
+    }
+
+    void armAccept(TCPWorker *worker) {
+        struct io_uring_sqe *sqe = worker->ring->getSqe();
+        if (!sqe) {
+            return;
+        }
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = worker->listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = uringTag(nullptr, URING_ACCEPT);
+    }
+
+    void armWake(TCPWorker *worker) {
+        struct io_uring_sqe *sqe = worker->ring->getSqe();
+        if (!sqe) {
+            return;
+        }
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = worker->wake_fd;
+        sqe->addr = (uintptr_t)&worker->wake_value;
+        sqe->len = sizeof(worker->wake_value);
+        sqe->user_data = uringTag(nullptr, URING_WAKE);
+    }
+
+    void addConnection(TCPWorker *worker, int fd) {
+        // Echoes and acks must leave immediately, not wait for Nagle
+        if ((bench_mode && setNoDelay(fd, true)) || applyTcpTuning(fd, tuning)) {
+            close(fd);
+            return;
+        }
+
+        TCPConnection *conn = newConnection(fd);
+        if ((unsigned)fd < URING_FILES && worker->ring->updateFile(fd, fd) == 0) {
+            conn->file_index = fd;
+        }
+        worker->connections[fd] = conn;
+        armRecv(worker, conn);
+
+        struct sockaddr_in client_addr;
+        socklen_t addrlen = sizeof(client_addr);
+        memset(&client_addr, 0, sizeof(client_addr));
+        getpeername(fd, (struct sockaddr*)&client_addr, &addrlen);
+        LOG_INFO("Client connected from %s (worker %d)", inet_ntoa(client_addr.sin_addr),
+                 worker->index);
+    }
+
+    void armRecv(TCPWorker *worker, TCPConnection *conn) {
+        struct io_uring_sqe *sqe = worker->ring->getSqe();
+        if (!sqe) {
+            return;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        setTarget(sqe, conn);
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = worker->ring->bufferGroup();
+        sqe->user_data = uringTag(conn, URING_RECV);
+        conn->recv_armed = true;
+        conn->ops_inflight++;
+    }
+
+    void cancelRecv(TCPWorker *worker, TCPConnection *conn) {
+        struct io_uring_sqe *sqe = worker->ring->getSqe();
+        if (!sqe) {
+            return;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = uringTag(conn, URING_RECV);
+        sqe->user_data = uringTag(nullptr, URING_CANCEL);
+    }
+
+    void handleRecv(TCPWorker *worker, TCPConnection *conn, int res, unsigned flags) {
+        if (!(flags & IORING_CQE_F_MORE)) {
+            conn->recv_armed = false;
+            conn->ops_inflight--;
+        }
+
+        if (res > 0) {
+            uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+            if (!conn->closing) {
+                appendInput(conn, worker->ring->buffer(bid), res);
+                if (tuning.quickack) {
+                    rearmQuickAck(conn->fd);
+                }
+            }
+            worker->ring->recycleBuffer(bid);
+
+            if (!conn->closing) {
+                if (!(bench_mode ? consumeBench(conn) : consumeFrames(conn))) {
+                    closeRingConnection(worker, conn);
+                } else {
+                    startSend(worker, conn);
+                    if (queuedOutput(conn) >= OUT_HIGH_WATER && !conn->read_paused) {
+                        // Resumed once the client has read enough of its replies
+                        conn->read_paused = true;
+                        if (conn->recv_armed) {
+                            cancelRecv(worker, conn);
+                        }
+                    }
+                }
+            }
+        } else if (res == 0) {
+            closeRingConnection(worker, conn);
+        } else if (res != -ENOBUFS && res != -ECANCELED) {
+            // ENOBUFS: every provided buffer was in use; re-armed below
+            if (!conn->closing) {
+                std::cerr << "Failed to receive message: " << strerror(-res) << "\n";
+            }
+            closeRingConnection(worker, conn);
+        }
+
+        if (conn->closing) {
+            releaseConnection(worker, conn);
+        } else if (!conn->recv_armed && !conn->read_paused) {
+            armRecv(worker, conn);
+        }
+    }
+
+    void appendInput(TCPConnection *conn, const char *data, size_t len) {
+        if (conn->in.size() - conn->in_tail < len) {
+            compactInput(conn);
+            if (conn->in.size() - conn->in_tail < len) {
+                conn->in.resize(conn->in_tail + len + READ_CHUNK);
+            }
+        }
+        memcpy(conn->in.data() + conn->in_tail, data, len);
+        conn->in_tail += len;
+    }
+
+    // One send in flight per connection. Its buffer must stay put until the
+    // completion, so queued output is swapped into `sending` and `out` keeps
+    // collecting replies meanwhile.
+    void startSend(TCPWorker *worker, TCPConnection *conn) {
+        if (conn->closing || conn->send_inflight || conn->out.empty()) {
+            return;
+        }
+        conn->sending.swap(conn->out);
+        conn->out.clear();
+        conn->sending_head = 0;
+        submitSend(worker, conn);
+    }
+
+    void submitSend(TCPWorker *worker, TCPConnection *conn) {
+        struct io_uring_sqe *sqe = worker->ring->getSqe();
+        if (!sqe) {
+            return;
+        }
+        sqe->opcode = IORING_OP_SEND;
+        setTarget(sqe, conn);
+        sqe->addr = (uintptr_t)(conn->sending.data() + conn->sending_head);
+        sqe->len = (uint32_t)std::min(conn->sending.size() - conn->sending_head, (size_t)1 << 30);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = uringTag(conn, URING_SEND);
+        conn->send_inflight = true;
+        conn->ops_inflight++;
+    }
+
+    void handleSend(TCPWorker *worker, TCPConnection *conn, int res) {
+        conn->send_inflight = false;
+        conn->ops_inflight--;
+
+        if (!conn->closing) {
+            if (res < 0) {
+                std::cerr << "Failed to send message: " << strerror(-res) << "\n";
+                closeRingConnection(worker, conn);
+            } else {
+                conn->sending_head += res;
+                if (conn->sending_head < conn->sending.size()) {
+                    submitSend(worker, conn);
+                } else {
+                    conn->sending.clear();
+                    conn->sending_head = 0;
+                    startSend(worker, conn);
+                }
+
+                if (conn->read_paused && queuedOutput(conn) < OUT_HIGH_WATER) {
+                    conn->read_paused = false;
+                    if (!conn->recv_armed) {
+                        armRecv(worker, conn);
+                    }
+                }
+            }
+        }
+
+        if (conn->closing) {
+            releaseConnection(worker, conn);
+        }
+    }
+
+    // The connection stays registered until the kernel has returned every
+    // operation on it; shutdown() makes a send that is stuck on a full
+    // socket fail instead of waiting for the peer
+    void closeRingConnection(TCPWorker *worker, TCPConnection *conn) {
+        if (conn->closing) {
+            return;
+        }
+        conn->closing = true;
+        if (conn->recv_armed) {
+            cancelRecv(worker, conn);
+        }
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+
+    void releaseConnection(TCPWorker *worker, TCPConnection *conn) {
+        if (conn->ops_inflight > 0) {
+            return;
+        }
+        if (conn->file_index >= 0) {
+            worker->ring->updateFile(conn->file_index, -1);
+        }
+        worker->connections.erase(conn->fd);
+        close(conn->fd);
+        delete conn;
+        LOG_INFO("Client disconnected");
+    }
+
+    // Edge-triggered: read until EAGAIN, handling every complete message in
+    // between, then write the replies. false once the connection is done.
+    bool readInput(TCPConnection *conn) {
+        for (;;) {
+            if (queuedOutput(conn) >= OUT_HIGH_WATER) {
+                if (!writeOutput(conn)) {
+                    return false;
+                }
+                if (queuedOutput(conn) >= OUT_HIGH_WATER) {
+                    // Resumed on EPOLLOUT once the client has caught up
+                    conn->read_paused = true;
+                    return true;
+                }
+            }
+
+            if (conn->in.size() - conn->in_tail < READ_CHUNK / 4) {
+                compactInput(conn);
+            }
+            ssize_t n = recv(conn->fd, conn->in.data() + conn->in_tail,
+                             conn->in.size() - conn->in_tail, 0);
+            if (n == 0) {
+                return false;
+            }
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return writeOutput(conn);
+                }
+                std::cerr << "Failed to receive message: " << strerror(errno) << "\n";
+                return false;
+            }
+            conn->in_tail += n;
+            if (tuning.quickack) {
+                rearmQuickAck(conn->fd);
+            }
+
+            if (!(bench_mode ? consumeBench(conn) : consumeFrames(conn))) {
+                return false;
+            }
+        }
+    }
+
+    // Move unparsed bytes to the front, growing the buffer for a frame that
+    // does not fit
+    void compactInput(TCPConnection *conn) {
+        size_t pending = conn->in_tail - conn->in_head;
+        if (conn->in_head > 0) {
+            memmove(conn->in.data(), conn->in.data() + conn->in_head, pending);
+            conn->in_head = 0;
+            conn->in_tail = pending;
+        }
+        if (conn->in.size() - conn->in_tail < READ_CHUNK / 4) {
+            conn->in.resize(conn->in.size() * 2);
+        }
+    }
+
+    bool consumeFrames(TCPConnection *conn) {
+        while (conn->in_tail - conn->in_head >= sizeof(uint32_t)) {
+            uint32_t wire_len;
+            memcpy(&wire_len, conn->in.data() + conn->in_head, sizeof(wire_len));
+            uint32_t len = ntohl(wire_len);
+            if (len > TCP_MAX_FRAME) {
+                std::cerr << "Frame of " << len << " bytes exceeds the limit\n";
+                return false;
+            }
+            if (conn->in_tail - conn->in_head < sizeof(wire_len) + len) {
+                // Make room for the rest of a large frame
+                if (conn->in.size() < sizeof(wire_len) + len + READ_CHUNK / 4) {
+                    compactInput(conn);
+                    conn->in.resize(std::max(conn->in.size(), sizeof(wire_len) + len + READ_CHUNK));
+                }
+                break;
+            }
+
+            const char *data = conn->in.data() + conn->in_head + sizeof(wire_len);
+            conn->in_head += sizeof(wire_len) + len;
+            LOG_DEBUG("Message received: %.*s", (int)std::min(len, (uint32_t)64), data);
+            if (handler) {
+                handler(*this, conn->fd, data, len);
+            }
+        }
+        if (conn->in_head == conn->in_tail) {
+            conn->in_head = conn->in_tail = 0;
+        }
+        return true;
+    }
+
+    // Follow the client's benchmark runs. Echoed runs are answered message by
+    // message; one-way runs are drained and acked with one byte, since the
+    // stream keeps no message boundaries anyway.
+    bool consumeBench(TCPConnection *conn) {
+        static const char ack = 0;
+
+        for (;;) {
+            size_t available = conn->in_tail - conn->in_head;
+            const char *data = conn->in.data() + conn->in_head;
+
+            if (conn->bench_remaining == 0) {
+                if (available < sizeof(BenchRequest)) {
+                    break;
+                }
+                if (unpackBenchRequest(data, sizeof(BenchRequest), &conn->bench)) {
+                    std::cerr << "Malformed benchmark request\n";
+                    return false;
+                }
+                conn->in_head += sizeof(BenchRequest);
+                if (conn->bench.test == BENCH_LATENCY || conn->bench.test == BENCH_BIBW) {
+                    conn->bench_remaining = conn->bench.count;
+                } else {
+                    conn->bench_remaining = (uint64_t)conn->bench.size * conn->bench.count;
+                    if (conn->bench_remaining == 0) {
+                        conn->out.append(&ack, sizeof(ack));
+                    }
+                }
+                continue;
+            }
+
+            if (conn->bench.test == BENCH_LATENCY || conn->bench.test == BENCH_BIBW) {
+                if (available < conn->bench.size) {
+                    if (conn->in.size() < conn->bench.size + READ_CHUNK / 4) {
+                        compactInput(conn);
+                        conn->in.resize(std::max(conn->in.size(), (size_t)conn->bench.size + READ_CHUNK));
+                    }
+                    break;
+                }
+                conn->out.append(data, conn->bench.size);
+                conn->in_head += conn->bench.size;
+                conn->bench_remaining--;
+                continue;
+            }
+
+            if (available == 0) {
+                break;
+            }
+            size_t drained = (size_t)std::min((uint64_t)available, conn->bench_remaining);
+            conn->in_head += drained;
+            conn->bench_remaining -= drained;
+            if (conn->bench_remaining == 0) {
+                conn->out.append(&ack, sizeof(ack));
+            }
+        }
+        if (conn->in_head == conn->in_tail) {
+            conn->in_head = conn->in_tail = 0;
+        }
+        return true;
+    }
+
+    size_t queuedOutput(const TCPConnection *conn) const {
+        return conn->out.size() - conn->out_head + conn->sending.size() - conn->sending_head;
+    }
+
+    // Write queued output until done or EAGAIN; EPOLLOUT resumes it
+    bool writeOutput(TCPConnection *conn) {
+        while (conn->out_head < conn->out.size()) {
+            ssize_t n = send(conn->fd, conn->out.data() + conn->out_head,
+                             conn->out.size() - conn->out_head, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return true;
+                }
+                std::cerr << "Failed to send message: " << strerror(errno) << "\n";
+                return false;
+            }
+            conn->out_head += n;
+        }
+        conn->out.clear();
+        conn->out_head = 0;
+        return true;
+    }
+
+    void cleanup() {
+        for (size_t i = 0; i < workers.size(); i++) {
+            TCPWorker *worker = workers[i];
+            if (worker->listen_fd >= 0) close(worker->listen_fd);
+            if (worker->epoll_fd >= 0) close(worker->epoll_fd);
+            delete worker->ring;
+            if (worker->wake_fd >= 0) close(worker->wake_fd);
+            delete worker;
+        }
+        workers.clear();
+    }
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include <iostream>
+#include <string>
+#include <cstdlib>
+
+#include "transport.h"
+#include "tcp_client.h"
+#include "tcp_server.h"
+
+// Transport backend over TCP sockets with length-prefixed frames. The server
+// side runs the epoll event loop on one worker thread; its handler may only
+// send to the peer whose message it is handling.
+class TcpTransport : public Transport {
+private:
+    TCPClient *client;
+    TCPServer *server;
+
+public:
+    TcpTransport() : client(nullptr), server(nullptr) {}
+
+    ~TcpTransport() {
+        stop();
+        delete server;
+        delete client;
+    }
+
+    const char *name() const {
+        return "tcp";
+    }
+
+    int connect(const std::string& host, const std::string& port) {
+        if (client || server) {
+            std::cerr << "Transport already in use\n";
+            return -1;
+        }
+        client = new TCPClient();
+        if (client->initialize() || client->connectToServer(host, port)) {
+            return -1;
+        }
+        return client->setNoDelay(true);
+    }
+
+    int listen(const std::string& port, const MessageHandler& handler) {
+        if (client || server) {
+            std::cerr << "Transport already in use\n";
+            return -1;
+        }
+        server = new TCPServer();
+        if (server->initialize(port)) {
+            return -1;
+        }
+        server->setMessageHandler([this, handler](TCPServer&, int client_socket,
+                                                  const char *data, size_t len) {
+            handler(*this, (uint32_t)client_socket, data, len);
+        });
+        return server->start();
+    }
+
+    void wait() {
+        if (server) {
+            server->wait();
+        }
+    }
+
+    void stop() {
+        if (server) {
+            server->stop();
+        }
+    }
+
+    int send(uint32_t peer, const void *data, size_t len) {
+        if (client) {
+            return client->sendData(data, len);
+        }
+        if (server) {
+            return server->sendData((int)peer, data, len);
+        }
+        std::cerr << "Transport not connected\n";
+        return -1;
+    }
+
+    int recv(std::string *payload) {
+        if (!client) {
+            std::cerr << "recv is only available on connected transports\n";
+            return -1;
+        }
+        return client->receiveMessage(payload);
+    }
+
+    // Copied sends complete once they are in the socket buffer; zero-copy
+    // sends once the kernel has released their pages
+    int flush() {
+        return client ? client->flush() : 0;
+    }
+
+    // Heap memory with room for the frame header, so a client sends header
+    // and payload in one piece
+    void *allocBuffer(size_t size) {
+        return allocFrameBuffer(size);
+    }
+
+    void freeBuffer(void *buf) {
+        freeFrameBuffer(buf);
+    }
+
+    int sendBuffer(uint32_t peer, void *buf, size_t len) {
+        if (client) {
+            return client->sendBuffer(buf, len);
+        }
+        int ret = send(peer, buf, len);
+        freeFrameBuffer(buf);
+        return ret;
+    }
+
+    // Every lease owns the string its frame was read into, so any number of
+    // them may be held
+    int recvLease(Lease *lease) {
+        std::string *payload = new std::string();
+        int ret = recv(payload);
+        if (ret) {
+            delete payload;
+            return ret;
+        }
+        lease->data = payload->data();
+        lease->len = payload->size();
+        lease->handle = (uintptr_t)payload;
+        return 0;
+    }
+
+    int releaseLease(Lease *lease) {
+        delete (std::string *)lease->handle;
+        lease->data = nullptr;
+        lease->len = 0;
+        lease->handle = 0;
+        return 0;
+    }
+};
+
+Transport *createTcpTransport() {
+    return new TcpTransport();
+}
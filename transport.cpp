@@ -0,0 +1,15 @@
+#include <iostream>
+#include <string>
+
+#include "transport.h"
+
+Transport *createTransport(const std::string& kind) {
+    if (kind == "rdma") {
+        return createRdmaTransport();
+    }
+    if (kind == "tcp") {
+        return createTcpTransport();
+    }
+    std::cerr << "Unknown transport: " << kind << "\n";
+    return nullptr;
+}
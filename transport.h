@@ -0,0 +1,79 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <string>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+// Message transport with interchangeable backends, built into libtransport.
+//
+// A Transport is either a client, after connect(), or a server, after
+// listen(). Clients exchange messages with one server through send() and a
+// blocking recv(). Servers deliver every message from every connection to a
+// handler on the backend's own threads and answer through send() with the
+// peer id the handler was given. Message boundaries are kept by every
+// backend; a message sent as one buffer arrives as one buffer.
+class Transport {
+public:
+    // peer identifies the connection the message arrived on
+    typedef std::function<void(Transport& transport, uint32_t peer,
+                               const char *data, size_t len)> MessageHandler;
+
+    virtual ~Transport() {}
+
+    virtual const char *name() const = 0;
+
+    virtual int connect(const std::string& host, const std::string& port) = 0;
+    virtual int listen(const std::string& port, const MessageHandler& handler) = 0;
+
+    // Server side: block until stop() is called from another thread
+    virtual void wait() = 0;
+    virtual void stop() = 0;
+
+    // peer is ignored on the client side
+    virtual int send(uint32_t peer, const void *data, size_t len) = 0;
+
+    int send(const void *data, size_t len) {
+        return send(0, data, len);
+    }
+
+    // Client side: the next message from the server; 1 if it disconnected
+    virtual int recv(std::string *payload) = 0;
+
+    // Wait until every message sent so far has left the local buffers
+    virtual int flush() = 0;
+
+    // Zero-copy API. allocBuffer() hands out memory the backend can send
+    // from without a staging copy; sendBuffer() takes such a buffer over and
+    // frees it once it has been sent, so the caller must not touch it again.
+    // recvLease() hands out the next message in the backend's own receive
+    // memory, valid until releaseLease(); see the backends for how long a
+    // lease may be held.
+    struct Lease {
+        const char *data;
+        size_t len;
+        uintptr_t handle;   // backend bookkeeping
+    };
+
+    virtual void *allocBuffer(size_t size) = 0;
+    virtual void freeBuffer(void *buf) = 0;
+    virtual int sendBuffer(uint32_t peer, void *buf, size_t len) = 0;
+
+    int sendBuffer(void *buf, size_t len) {
+        return sendBuffer(0, buf, len);
+    }
+
+    // Client side; 1 if the server disconnected
+    virtual int recvLease(Lease *lease) = 0;
+    virtual int releaseLease(Lease *lease) = 0;
+};
+
+// "rdma" or "tcp"; nullptr for an unknown name. The caller deletes the
+// transport, which closes its connections.
+Transport *createTransport(const std::string& kind);
+
+Transport *createRdmaTransport();
+Transport *createTcpTransport();
+
+#endif
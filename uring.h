@@ -0,0 +1,352 @@
+#ifndef URING_H
+#define URING_H
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring driver on the raw system calls, so the TCP server and
+// client need no liburing. It covers what they use: one submission/completion
+// ring pair, optional SQPOLL, a sparse registered file table, one group of
+// provided buffers for multishot receives and a set of caller buffers
+// registered for READ_FIXED and WRITE_FIXED.
+//
+// Submission queue entries are only published by submit(), so everything a
+// caller prepares between two submits goes to the kernel in one batch.
+
+static inline int uringSetup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int uringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static inline int uringRegister(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+class IoUring {
+public:
+    IoUring() : ring_fd(-1), sqpoll(false), sq_ring(nullptr), cq_ring(nullptr), sq_ring_size(0),
+                cq_ring_size(0), sqes(nullptr), sqes_size(0), sqe_head(0), sqe_tail(0),
+                buf_memory(nullptr), buf_count(0), buf_size(0), buf_group(0),
+                fixed_count(0) {}
+
+    ~IoUring() {
+        if (buf_memory) munmap(buf_memory, (size_t)buf_count * buf_size);
+        if (sqes) munmap(sqes, sqes_size);
+        if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+        if (sq_ring) munmap(sq_ring, sq_ring_size);
+        if (ring_fd >= 0) close(ring_fd);
+    }
+
+    // SQPOLL moves submission to a kernel thread that polls the ring for
+    // sq_idle_ms before it goes to sleep. A ring set up with share_poller
+    // is polled by that ring's thread instead of a thread of its own.
+    int init(unsigned entries, unsigned cq_entries, bool use_sqpoll, unsigned sq_idle_ms = 1000,
+             const IoUring *share_poller = nullptr) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = cq_entries;
+        if (use_sqpoll) {
+            params.flags |= IORING_SETUP_SQPOLL;
+            params.sq_thread_idle = sq_idle_ms;
+            if (share_poller) {
+                params.flags |= IORING_SETUP_ATTACH_WQ;
+                params.wq_fd = (uint32_t)share_poller->ring_fd;
+            }
+        }
+
+        ring_fd = uringSetup(entries, &params);
+        if (ring_fd < 0) {
+            std::cerr << "io_uring_setup failed: " << strerror(errno) << "\n";
+            return -1;
+        }
+        sqpoll = use_sqpoll;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+
+        sq_ring = mapRing(sq_ring_size, IORING_OFF_SQ_RING);
+        if (!sq_ring) {
+            return -1;
+        }
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ring = sq_ring;
+        } else {
+            cq_ring = mapRing(cq_ring_size, IORING_OFF_CQ_RING);
+            if (!cq_ring) {
+                return -1;
+            }
+        }
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe *)mapRing(sqes_size, IORING_OFF_SQES);
+        if (!sqes) {
+            return -1;
+        }
+
+        char *sq = (char *)sq_ring;
+        sq_head = (unsigned *)(sq + params.sq_off.head);
+        sq_tail = (unsigned *)(sq + params.sq_off.tail);
+        sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+        sq_entries = *(unsigned *)(sq + params.sq_off.ring_entries);
+        sq_flags = (unsigned *)(sq + params.sq_off.flags);
+        sq_array = (unsigned *)(sq + params.sq_off.array);
+
+        char *cq = (char *)cq_ring;
+        cq_head = (unsigned *)(cq + params.cq_off.head);
+        cq_tail = (unsigned *)(cq + params.cq_off.tail);
+        cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+        return 0;
+    }
+
+    // Next free entry, zeroed; a full queue is submitted first
+    struct io_uring_sqe *getSqe() {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (sqe_tail - head >= sq_entries) {
+            if (submit() < 0) {
+                return nullptr;
+            }
+            head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            if (sqe_tail - head >= sq_entries) {
+                std::cerr << "io_uring submission queue full\n";
+                return nullptr;
+            }
+        }
+        struct io_uring_sqe *sqe = &sqes[sqe_tail & sq_mask];
+        sqe_tail++;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // Publish prepared entries and, with wait, block for one completion
+    int submit(bool wait = false) {
+        for (; sqe_head != sqe_tail; sqe_head++) {
+            sq_array[sqe_head & sq_mask] = sqe_head & sq_mask;
+        }
+        __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+
+        // Everything published that the kernel has not consumed yet,
+        // including entries left over from a submit that hit EAGAIN
+        unsigned to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+        unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+        if (sqpoll) {
+            // The poller consumes the ring by itself unless it went to sleep
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+                flags |= IORING_ENTER_SQ_WAKEUP;
+            }
+            to_submit = 0;
+            if (!flags) {
+                return 0;
+            }
+        } else if (!to_submit && !wait) {
+            return 0;
+        }
+
+        for (;;) {
+            int ret = uringEnter(ring_fd, to_submit, wait ? 1 : 0, flags);
+            if (ret >= 0) {
+                return ret;
+            }
+            if (errno == EINTR) {
+                if (!wait) {
+                    return 0;
+                }
+                continue;
+            }
+            if (errno == EAGAIN || errno == EBUSY) {
+                // Completions have to be reaped before more can be submitted
+                return 0;
+            }
+            std::cerr << "io_uring_enter failed: " << strerror(errno) << "\n";
+            return -1;
+        }
+    }
+
+    // Completions available right now, oldest first; release them with
+    // advance() once handled
+    unsigned peekCompletions(struct io_uring_cqe **batch, unsigned max) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        unsigned n = 0;
+        while (head + n != tail && n < max) {
+            batch[n] = &cqes[(head + n) & cq_mask];
+            n++;
+        }
+        return n;
+    }
+
+    void advance(unsigned n) {
+        __atomic_store_n(cq_head, *cq_head + n, __ATOMIC_RELEASE);
+    }
+
+    // Sparse table of count registered files, filled by updateFile()
+    int registerFiles(unsigned count) {
+        std::vector<int> fds(count, -1);
+        if (uringRegister(ring_fd, IORING_REGISTER_FILES, fds.data(), count) < 0) {
+            std::cerr << "Failed to register io_uring files: " << strerror(errno) << "\n";
+            return -1;
+        }
+        return 0;
+    }
+
+    // fd -1 clears the slot
+    int updateFile(unsigned index, int fd) {
+        struct io_uring_files_update update;
+        memset(&update, 0, sizeof(update));
+        update.offset = index;
+        update.fds = (uintptr_t)&fd;
+        if (uringRegister(ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 0) {
+            std::cerr << "Failed to update io_uring file " << index << ": " << strerror(errno) << "\n";
+            return -1;
+        }
+        return 0;
+    }
+
+    // Provide count buffers of size bytes to the kernel as buffer group
+    // group; receives that select a buffer take one and recycleBuffer() gives
+    // it back. Buffers go in with IORING_OP_PROVIDE_BUFFERS, whose completions
+    // are skipped on success, so they cost one entry in the next submission.
+    int provideBuffers(uint16_t group, unsigned count, unsigned size) {
+        buf_memory = (char *)mmap(nullptr, (size_t)count * size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf_memory == MAP_FAILED) {
+            buf_memory = nullptr;
+            std::cerr << "Failed to allocate receive buffers\n";
+            return -1;
+        }
+        buf_count = count;
+        buf_size = size;
+        buf_group = group;
+
+        struct io_uring_sqe *sqe = getSqe();
+        if (!sqe) {
+            return -1;
+        }
+        prepProvide(sqe, buf_memory, count, 0);
+        // This one completes, so a refused group shows up right here
+        sqe->flags &= ~IOSQE_CQE_SKIP_SUCCESS;
+        if (submit(true) < 0) {
+            return -1;
+        }
+        struct io_uring_cqe *cqe;
+        if (peekCompletions(&cqe, 1) != 1) {
+            std::cerr << "No completion for the receive buffers\n";
+            return -1;
+        }
+        int res = cqe->res;
+        advance(1);
+        if (res < 0) {
+            std::cerr << "Failed to provide receive buffers: " << strerror(-res) << "\n";
+            return -1;
+        }
+        return 0;
+    }
+
+    char *buffer(uint16_t bid) {
+        return buf_memory + (size_t)bid * buf_size;
+    }
+
+    int recycleBuffer(uint16_t bid) {
+        struct io_uring_sqe *sqe = getSqe();
+        if (!sqe) {
+            return -1;
+        }
+        prepProvide(sqe, buffer(bid), 1, bid);
+        return 0;
+    }
+
+    uint16_t bufferGroup() const {
+        return buf_group;
+    }
+
+    // Register the caller's buffers as fixed buffers 0 to count - 1, in
+    // place of any registered before. The kernel pins their pages once, so
+    // READ_FIXED and WRITE_FIXED on them skip the per-call page lookup.
+    // Buffers must stay allocated while registered; pinned pages count
+    // against RLIMIT_MEMLOCK on kernels before 5.12.
+    int registerBuffers(const struct iovec *iov, unsigned count) {
+        if (fixed_count > 0) {
+            uringRegister(ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+            fixed_count = 0;
+        }
+        if (count == 0) {
+            return 0;
+        }
+        if (uringRegister(ring_fd, IORING_REGISTER_BUFFERS, iov, count) < 0) {
+            std::cerr << "Failed to register io_uring buffers: " << strerror(errno) << "\n";
+            return -1;
+        }
+        fixed_count = count;
+        return 0;
+    }
+
+private:
+    int ring_fd;
+    bool sqpoll;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned sqe_head;
+    unsigned sqe_tail;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_flags;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    char *buf_memory;
+    unsigned buf_count;
+    unsigned buf_size;
+    uint16_t buf_group;
+
+    unsigned fixed_count;
+
+    // Completions of these carry user_data 0
+    void prepProvide(struct io_uring_sqe *sqe, char *addr, unsigned count, uint16_t first_bid) {
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->fd = (int)count;
+        sqe->addr = (uintptr_t)addr;
+        sqe->len = buf_size;
+        sqe->buf_group = buf_group;
+        sqe->off = first_bid;
+    }
+
+    void *mapRing(size_t size, uint64_t offset) {
+        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring_fd, offset);
+        if (ptr == MAP_FAILED) {
+            std::cerr << "Failed to map io_uring: " << strerror(errno) << "\n";
+            return nullptr;
+        }
+        return ptr;
+    }
+};
+
+#endif